@@ -870,6 +870,12 @@ static QemuOptsList bdrv_runtime_opts = {
             .type = QEMU_OPT_BOOL,
             .help = "Ignore flush requests",
         },
+        {
+            .name = BDRV_OPT_COR_PREFETCH,
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum number of bytes to copy ahead of sequential "
+                    "reads with copy-on-read (0 = disabled)",
+        },
         { /* end of list */ }
     },
 };
@@ -953,6 +959,7 @@ static int bdrv_open_common(BlockDriverState *bs, BdrvChild *file,
             goto fail_opts;
         }
     }
+    bs->cor_prefetch_max = qemu_opt_get_size(opts, BDRV_OPT_COR_PREFETCH, 0);
 
     if (filename != NULL) {
         pstrcpy(bs->filename, sizeof(bs->filename), filename);
@@ -2166,6 +2173,10 @@ static void bdrv_close(BlockDriverState *bs)
         g_free(bs->opaque);
         bs->opaque = NULL;
         bs->copy_on_read = 0;
+        bs->cor_prefetch_max = 0;
+        bs->cor_prefetch_next = 0;
+        bs->cor_prefetch_seq = 0;
+        bs->cor_prefetch_end = 0;
         bs->backing_file[0] = '\0';
         bs->backing_format[0] = '\0';
         bs->total_sectors = 0;
@@ -2369,6 +2380,27 @@ int bdrv_check(BlockDriverState *bs, BdrvCheckResult *res, BdrvCheckMode fix)
     return bs->drv->bdrv_check(bs, res, fix);
 }
 
+/*
+ * Like bdrv_check(), but lets the driver spread the work over up to
+ * num_workers workers and report its progress.  Drivers without support for
+ * this fall back to the plain (serial, silent) check.
+ */
+int bdrv_check_parallel(BlockDriverState *bs, BdrvCheckResult *res,
+                        BdrvCheckMode fix, int num_workers,
+                        BlockDriverCheckStatusCB *status_cb, void *cb_opaque)
+{
+    if (bs->drv == NULL) {
+        return -ENOMEDIUM;
+    }
+    if (bs->drv->bdrv_check_parallel == NULL) {
+        return bdrv_check(bs, res, fix);
+    }
+
+    memset(res, 0, sizeof(*res));
+    return bs->drv->bdrv_check_parallel(bs, res, fix, num_workers,
+                                        status_cb, cb_opaque);
+}
+
 #define COMMIT_BUF_SECTORS 2048
 
 /* commit COW file into the raw image */
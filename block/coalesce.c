@@ -0,0 +1,403 @@
+/*
+ * Request coalescing filter
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/*
+ * The coalesce driver sits on top of another node and merges adjacent reads
+ * resp. writes into a single request to that node.  This helps backends with
+ * a high per-request cost (NFS, iSCSI, ssh, ...) for all users of the node:
+ * emulated devices that submit small requests, NBD exports and block jobs.
+ *
+ * A request that arrives while nothing is in flight is passed on immediately,
+ * so an idle backend doesn't see any added latency.  Otherwise the request
+ * waits up to the configured window for adjacent requests to join it, then
+ * the whole batch is submitted at once.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "qapi/error.h"
+#include "qemu/coroutine.h"
+#include "qemu/queue.h"
+#include "qemu/timer.h"
+#include "block/block_int.h"
+#include "trace.h"
+
+#define COALESCE_OPT_WINDOW     "window"
+#define COALESCE_OPT_MAX_SIZE   "max-size"
+
+#define COALESCE_DEFAULT_WINDOW     100         /* microseconds */
+#define COALESCE_DEFAULT_MAX_SIZE   (1 << 20)   /* bytes */
+
+typedef struct CoalesceReq {
+    int64_t sector_num;
+    int nb_sectors;
+    QEMUIOVector *qiov;
+    int ret;
+    QTAILQ_ENTRY(CoalesceReq) next;
+} CoalesceReq;
+
+typedef struct CoalesceBatch {
+    bool is_write;
+    int64_t sector_num;
+    int nb_sectors;
+    int niov;
+    int nb_reqs;
+    QTAILQ_HEAD(, CoalesceReq) reqs;    /* sorted by sector_num */
+    CoQueue waiters;                    /* all requests but the first */
+    Coroutine *leader;                  /* the first request */
+    QEMUTimer *timer;                   /* wakes the leader */
+    bool joinable;                      /* on BDRVCoalesceState.pending */
+    QLIST_ENTRY(CoalesceBatch) next;
+} CoalesceBatch;
+
+typedef struct BDRVCoalesceState {
+    int64_t window_ns;
+    int max_sectors;
+
+    /* Requests submitted to bs->file that haven't completed yet */
+    unsigned int in_flight;
+
+    /* Batches that can still be joined */
+    QLIST_HEAD(, CoalesceBatch) pending;
+} BDRVCoalesceState;
+
+static QemuOptsList runtime_opts = {
+    .name = "coalesce",
+    .head = QTAILQ_HEAD_INITIALIZER(runtime_opts.head),
+    .desc = {
+        {
+            .name = COALESCE_OPT_WINDOW,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Time in microseconds that requests wait for adjacent "
+                    "requests to merge with",
+        },
+        {
+            .name = COALESCE_OPT_MAX_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum size in bytes of a merged request",
+        },
+        { /* end of list */ }
+    },
+};
+
+static int coalesce_open(BlockDriverState *bs, QDict *options, int flags,
+                         Error **errp)
+{
+    BDRVCoalesceState *s = bs->opaque;
+    QemuOpts *opts;
+    Error *local_err = NULL;
+    uint64_t window, max_size;
+    int ret;
+
+    opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
+    qemu_opts_absorb_qdict(opts, options, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    window = qemu_opt_get_number(opts, COALESCE_OPT_WINDOW,
+                                 COALESCE_DEFAULT_WINDOW);
+    if (window > INT64_MAX / SCALE_US) {
+        error_setg(errp, "Coalescing window too big");
+        ret = -EINVAL;
+        goto out;
+    }
+    s->window_ns = window * SCALE_US;
+
+    max_size = qemu_opt_get_size(opts, COALESCE_OPT_MAX_SIZE,
+                                 COALESCE_DEFAULT_MAX_SIZE);
+    if (max_size < BDRV_SECTOR_SIZE ||
+        max_size > (uint64_t)BDRV_REQUEST_MAX_SECTORS << BDRV_SECTOR_BITS) {
+        error_setg(errp, "Invalid maximum size for merged requests");
+        ret = -EINVAL;
+        goto out;
+    }
+    s->max_sectors = max_size >> BDRV_SECTOR_BITS;
+
+    QLIST_INIT(&s->pending);
+
+    bs->file = bdrv_open_child(NULL, options, "image", bs, &child_file, false,
+                               &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    ret = 0;
+out:
+    qemu_opts_del(opts);
+    return ret;
+}
+
+static void coalesce_close(BlockDriverState *bs)
+{
+    BDRVCoalesceState *s = bs->opaque;
+
+    assert(QLIST_EMPTY(&s->pending));
+}
+
+static int coalesce_reopen_prepare(BDRVReopenState *reopen_state,
+                                   BlockReopenQueue *queue, Error **errp)
+{
+    return 0;
+}
+
+static int64_t coalesce_getlength(BlockDriverState *bs)
+{
+    return bdrv_getlength(bs->file->bs);
+}
+
+/* Maximum size of a merged request, taking the limits of bs->file into
+ * account */
+static int coalesce_max_sectors(BlockDriverState *bs)
+{
+    BDRVCoalesceState *s = bs->opaque;
+    int max = bs->file->bs->bl.max_transfer_length;
+
+    return max ? MIN(max, s->max_sectors) : s->max_sectors;
+}
+
+/* Returns a pending batch that @req can be merged into, or NULL */
+static CoalesceBatch *coalesce_find_batch(BlockDriverState *bs,
+                                          CoalesceReq *req, bool is_write)
+{
+    BDRVCoalesceState *s = bs->opaque;
+    CoalesceBatch *batch;
+
+    QLIST_FOREACH(batch, &s->pending, next) {
+        if (batch->is_write != is_write ||
+            batch->nb_sectors + req->nb_sectors > coalesce_max_sectors(bs) ||
+            batch->niov + req->qiov->niov > IOV_MAX) {
+            continue;
+        }
+        if (req->sector_num == batch->sector_num + batch->nb_sectors ||
+            req->sector_num + req->nb_sectors == batch->sector_num) {
+            return batch;
+        }
+    }
+
+    return NULL;
+}
+
+static void coalesce_batch_timer_cb(void *opaque)
+{
+    CoalesceBatch *batch = opaque;
+
+    qemu_coroutine_enter(batch->leader, NULL);
+}
+
+/* Stops further requests from joining @batch */
+static void coalesce_close_batch(CoalesceBatch *batch)
+{
+    if (batch->joinable) {
+        QLIST_REMOVE(batch, next);
+        batch->joinable = false;
+    }
+}
+
+static void coalesce_add_req(CoalesceBatch *batch, CoalesceReq *req)
+{
+    if (QTAILQ_EMPTY(&batch->reqs)) {
+        batch->sector_num = req->sector_num;
+        QTAILQ_INSERT_TAIL(&batch->reqs, req, next);
+    } else if (req->sector_num < batch->sector_num) {
+        batch->sector_num = req->sector_num;
+        QTAILQ_INSERT_HEAD(&batch->reqs, req, next);
+    } else {
+        QTAILQ_INSERT_TAIL(&batch->reqs, req, next);
+    }
+
+    batch->nb_sectors += req->nb_sectors;
+    batch->niov += req->qiov->niov;
+    batch->nb_reqs++;
+}
+
+static int coroutine_fn coalesce_do_submit(BlockDriverState *bs,
+                                           int64_t sector_num, int nb_sectors,
+                                           QEMUIOVector *qiov, bool is_write)
+{
+    BDRVCoalesceState *s = bs->opaque;
+    int ret;
+
+    s->in_flight++;
+    if (is_write) {
+        ret = bdrv_co_writev(bs->file->bs, sector_num, nb_sectors, qiov);
+    } else {
+        ret = bdrv_co_readv(bs->file->bs, sector_num, nb_sectors, qiov);
+    }
+    s->in_flight--;
+
+    return ret;
+}
+
+static void coroutine_fn coalesce_submit_batch(BlockDriverState *bs,
+                                               CoalesceBatch *batch)
+{
+    CoalesceReq *req;
+    QEMUIOVector qiov;
+    int ret;
+
+    trace_coalesce_submit(bs, batch->is_write, batch->sector_num,
+                          batch->nb_sectors, batch->nb_reqs);
+
+    req = QTAILQ_FIRST(&batch->reqs);
+    if (batch->nb_reqs == 1) {
+        req->ret = coalesce_do_submit(bs, req->sector_num, req->nb_sectors,
+                                      req->qiov, batch->is_write);
+        return;
+    }
+
+    qemu_iovec_init(&qiov, batch->niov);
+    QTAILQ_FOREACH(req, &batch->reqs, next) {
+        qemu_iovec_concat(&qiov, req->qiov, 0, req->qiov->size);
+    }
+
+    ret = coalesce_do_submit(bs, batch->sector_num, batch->nb_sectors, &qiov,
+                             batch->is_write);
+
+    QTAILQ_FOREACH(req, &batch->reqs, next) {
+        req->ret = ret;
+    }
+    qemu_iovec_destroy(&qiov);
+}
+
+static int coroutine_fn coalesce_co_rw(BlockDriverState *bs,
+                                       int64_t sector_num, int nb_sectors,
+                                       QEMUIOVector *qiov, bool is_write)
+{
+    BDRVCoalesceState *s = bs->opaque;
+    CoalesceBatch *batch;
+    CoalesceReq req = {
+        .sector_num = sector_num,
+        .nb_sectors = nb_sectors,
+        .qiov       = qiov,
+    };
+
+    if (s->in_flight == 0 || s->window_ns == 0 ||
+        nb_sectors >= coalesce_max_sectors(bs)) {
+        return coalesce_do_submit(bs, sector_num, nb_sectors, qiov, is_write);
+    }
+
+    batch = coalesce_find_batch(bs, &req, is_write);
+    if (batch) {
+        /* The first request of the batch submits it and sets req.ret */
+        coalesce_add_req(batch, &req);
+
+        /* Nothing else fits in, so don't wait for the rest of the window.
+         * The timer only fires once we are on the queue below. */
+        if (batch->nb_sectors >= coalesce_max_sectors(bs) ||
+            batch->niov >= IOV_MAX) {
+            coalesce_close_batch(batch);
+            timer_mod(batch->timer, qemu_clock_get_ns(QEMU_CLOCK_REALTIME));
+        }
+        qemu_co_queue_wait(&batch->waiters);
+        return req.ret;
+    }
+
+    /* Start a new batch and give adjacent requests some time to join */
+    batch = g_new0(CoalesceBatch, 1);
+    batch->is_write = is_write;
+    QTAILQ_INIT(&batch->reqs);
+    qemu_co_queue_init(&batch->waiters);
+    coalesce_add_req(batch, &req);
+    batch->leader = qemu_coroutine_self();
+    batch->timer = aio_timer_new(bdrv_get_aio_context(bs), QEMU_CLOCK_REALTIME,
+                                 SCALE_NS, coalesce_batch_timer_cb, batch);
+    batch->joinable = true;
+    QLIST_INSERT_HEAD(&s->pending, batch, next);
+
+    timer_mod(batch->timer,
+              qemu_clock_get_ns(QEMU_CLOCK_REALTIME) + s->window_ns);
+    qemu_coroutine_yield();
+    timer_del(batch->timer);
+    timer_free(batch->timer);
+
+    coalesce_close_batch(batch);
+    coalesce_submit_batch(bs, batch);
+
+    /* The waiters only run after we have yielded or terminated, and don't
+     * touch the batch any more */
+    qemu_co_queue_restart_all(&batch->waiters);
+    g_free(batch);
+
+    return req.ret;
+}
+
+static int coroutine_fn coalesce_co_readv(BlockDriverState *bs,
+                                          int64_t sector_num, int nb_sectors,
+                                          QEMUIOVector *qiov)
+{
+    return coalesce_co_rw(bs, sector_num, nb_sectors, qiov, false);
+}
+
+static int coroutine_fn coalesce_co_writev(BlockDriverState *bs,
+                                           int64_t sector_num, int nb_sectors,
+                                           QEMUIOVector *qiov)
+{
+    return coalesce_co_rw(bs, sector_num, nb_sectors, qiov, true);
+}
+
+static int coroutine_fn coalesce_co_write_zeroes(BlockDriverState *bs,
+                                                 int64_t sector_num,
+                                                 int nb_sectors,
+                                                 BdrvRequestFlags flags)
+{
+    return bdrv_co_write_zeroes(bs->file->bs, sector_num, nb_sectors, flags);
+}
+
+static int coroutine_fn coalesce_co_discard(BlockDriverState *bs,
+                                            int64_t sector_num, int nb_sectors)
+{
+    return bdrv_co_discard(bs->file->bs, sector_num, nb_sectors);
+}
+
+static int64_t coroutine_fn
+coalesce_co_get_block_status(BlockDriverState *bs, int64_t sector_num,
+                             int nb_sectors, int *pnum,
+                             BlockDriverState **file)
+{
+    *pnum = nb_sectors;
+    *file = bs->file->bs;
+    return BDRV_BLOCK_RAW | BDRV_BLOCK_OFFSET_VALID | BDRV_BLOCK_DATA |
+           (sector_num << BDRV_SECTOR_BITS);
+}
+
+static bool coalesce_recurse_is_first_non_filter(BlockDriverState *bs,
+                                                 BlockDriverState *candidate)
+{
+    return bdrv_recurse_is_first_non_filter(bs->file->bs, candidate);
+}
+
+static BlockDriver bdrv_coalesce = {
+    .format_name            = "coalesce",
+    .protocol_name          = "coalesce",
+    .instance_size          = sizeof(BDRVCoalesceState),
+
+    .bdrv_file_open         = coalesce_open,
+    .bdrv_close             = coalesce_close,
+    .bdrv_reopen_prepare    = coalesce_reopen_prepare,
+    .bdrv_getlength         = coalesce_getlength,
+
+    .bdrv_co_readv          = coalesce_co_readv,
+    .bdrv_co_writev         = coalesce_co_writev,
+    .bdrv_co_write_zeroes   = coalesce_co_write_zeroes,
+    .bdrv_co_discard        = coalesce_co_discard,
+    .bdrv_co_get_block_status = coalesce_co_get_block_status,
+
+    .is_filter                        = true,
+    .bdrv_recurse_is_first_non_filter = coalesce_recurse_is_first_non_filter,
+};
+
+static void bdrv_coalesce_init(void)
+{
+    bdrv_register(&bdrv_coalesce);
+}
+
+block_init(bdrv_coalesce_init);
@@ -225,6 +225,9 @@ bool bdrv_requests_pending(BlockDriverState *bs)
     if (!QLIST_EMPTY(&bs->tracked_requests)) {
         return true;
     }
+    if (bs->cor_prefetch_co) {
+        return true;
+    }
     if (!qemu_co_queue_empty(&bs->throttled_reqs[0])) {
         return true;
     }
@@ -245,6 +248,9 @@ static void bdrv_drain_recurse(BlockDriverState *bs)
 {
     BdrvChild *child;
 
+    /* Stop prefetching, the next sequential guest read restarts it */
+    bs->cor_prefetch_cancel = true;
+
     if (bs->drv && bs->drv->bdrv_drain) {
         bs->drv->bdrv_drain(bs);
     }
@@ -964,6 +970,147 @@ out:
     return ret;
 }
 
+/* Number of sequential reads in a row before prefetching starts */
+#define COR_PREFETCH_MIN_SEQ    2
+
+/* Maximum size of a single prefetch request */
+#define COR_PREFETCH_CHUNK      (1 << 20)
+
+typedef struct BdrvCorPrefetch {
+    BlockDriverState *bs;
+    int64_t offset;
+    int64_t end;
+} BdrvCorPrefetch;
+
+/*
+ * Copies [@offset, @offset + @bytes) from the backing chain into the image,
+ * like a guest read with copy-on-read would do, and throws away the data.
+ * The request is extended to the alignment that the image requires.
+ */
+static int coroutine_fn bdrv_co_cor_prefetch_chunk(BlockDriverState *bs,
+                                                   int64_t offset,
+                                                   unsigned int bytes)
+{
+    uint64_t align = MAX(BDRV_SECTOR_SIZE, bs->request_alignment);
+    BdrvTrackedRequest req;
+    QEMUIOVector qiov;
+    struct iovec iov;
+    int ret;
+
+    bytes = QEMU_ALIGN_UP(offset + bytes, align) -
+            QEMU_ALIGN_DOWN(offset, align);
+    offset = QEMU_ALIGN_DOWN(offset, align);
+
+    iov.iov_len = bytes;
+    iov.iov_base = qemu_try_blockalign(bs, bytes);
+    if (iov.iov_base == NULL) {
+        return -ENOMEM;
+    }
+    qemu_iovec_init_external(&qiov, &iov, 1);
+
+    tracked_request_begin(&req, bs, offset, bytes, BDRV_TRACKED_READ);
+    ret = bdrv_aligned_preadv(bs, &req, offset, bytes, align, &qiov,
+                              BDRV_REQ_COPY_ON_READ);
+    tracked_request_end(&req);
+
+    qemu_vfree(iov.iov_base);
+    return ret;
+}
+
+static void coroutine_fn bdrv_cor_prefetch_entry(void *opaque)
+{
+    BdrvCorPrefetch *p = opaque;
+    BlockDriverState *bs = p->bs;
+    int64_t offset = QEMU_ALIGN_DOWN(p->offset,
+                                     MAX(bdrv_get_cluster_size(bs),
+                                         bs->request_alignment));
+    int ret = 0;
+
+    trace_bdrv_cor_prefetch(bs, p->offset, p->end - p->offset);
+
+    while (offset < p->end && !bs->cor_prefetch_cancel) {
+        int64_t bytes = MIN(p->end - offset, COR_PREFETCH_CHUNK);
+        int pnum;
+
+        ret = bdrv_is_allocated(bs, offset >> BDRV_SECTOR_BITS,
+                                DIV_ROUND_UP(bytes, BDRV_SECTOR_SIZE), &pnum);
+        if (ret < 0 || pnum == 0) {
+            break;
+        }
+        bytes = MIN(bytes, (int64_t)pnum << BDRV_SECTOR_BITS);
+
+        if (!ret) {
+            ret = bdrv_co_cor_prefetch_chunk(bs, offset, bytes);
+            if (ret < 0) {
+                break;
+            }
+        }
+        offset += bytes;
+    }
+
+    if (ret < 0 || offset < p->end) {
+        /* Let the next sequential read start over from where we stopped */
+        bs->cor_prefetch_end = MIN(bs->cor_prefetch_end, offset);
+    }
+
+    bs->cor_prefetch_co = NULL;
+    g_free(p);
+}
+
+/*
+ * Called after each guest read with copy-on-read.  When the guest reads
+ * sequentially, the data ahead of it is copied from the backing chain into
+ * the image in the background, so that the following reads are served from
+ * the image.  Like readahead, the prefetch window grows as long as the guest
+ * keeps reading sequentially, up to bs->cor_prefetch_max bytes.
+ */
+static void bdrv_cor_prefetch_update(BlockDriverState *bs, int64_t offset,
+                                     unsigned int bytes)
+{
+    int64_t end = offset + bytes;
+    int64_t start, stop;
+    uint64_t window;
+    BdrvCorPrefetch *p;
+
+    if (offset == bs->cor_prefetch_next) {
+        bs->cor_prefetch_seq++;
+    } else {
+        bs->cor_prefetch_seq = 0;
+        bs->cor_prefetch_end = 0;
+    }
+    bs->cor_prefetch_next = end;
+
+    if (bs->cor_prefetch_seq < COR_PREFETCH_MIN_SEQ || bs->cor_prefetch_co ||
+        !bs->backing) {
+        return;
+    }
+
+    window = MIN(bs->cor_prefetch_max,
+                 (uint64_t)bytes << MIN(bs->cor_prefetch_seq, 16));
+
+    /* Wait until half of the previous window has been consumed */
+    if (bs->cor_prefetch_end > end + window / 2) {
+        return;
+    }
+
+    start = MAX(end, bs->cor_prefetch_end);
+    stop = MIN(end + window, bdrv_nb_sectors(bs) << BDRV_SECTOR_BITS);
+    if (start >= stop) {
+        return;
+    }
+
+    p = g_new(BdrvCorPrefetch, 1);
+    *p = (BdrvCorPrefetch) {
+        .bs     = bs,
+        .offset = start,
+        .end    = stop,
+    };
+    bs->cor_prefetch_end = stop;
+    bs->cor_prefetch_cancel = false;
+    bs->cor_prefetch_co = qemu_coroutine_create(bdrv_cor_prefetch_entry);
+    qemu_coroutine_enter(bs->cor_prefetch_co, p);
+}
+
 /*
  * Handle a read request in coroutine context
  */
@@ -980,6 +1127,7 @@ int coroutine_fn bdrv_co_do_preadv(BlockDriverState *bs,
     uint8_t *tail_buf = NULL;
     QEMUIOVector local_qiov;
     bool use_local_qiov = false;
+    bool prefetch = false;
     int ret;
 
     if (!drv) {
@@ -994,6 +1142,7 @@ int coroutine_fn bdrv_co_do_preadv(BlockDriverState *bs,
     /* Don't do copy-on-read if we read data before write operation */
     if (bs->copy_on_read && !(flags & BDRV_REQ_NO_SERIALISING)) {
         flags |= BDRV_REQ_COPY_ON_READ;
+        prefetch = bs->cor_prefetch_max > 0;
     }
 
     /* throttling disk I/O */
@@ -1038,6 +1187,10 @@ int coroutine_fn bdrv_co_do_preadv(BlockDriverState *bs,
         qemu_vfree(tail_buf);
     }
 
+    if (prefetch && ret >= 0) {
+        bdrv_cor_prefetch_update(bs, offset, bytes);
+    }
+
     return ret;
 }
 
@@ -1744,6 +1897,24 @@ int bdrv_is_allocated_above(BlockDriverState *top,
     return 0;
 }
 
+typedef struct CompressedWriteCo {
+    BlockDriverState *bs;
+    int64_t sector_num;
+    int nb_sectors;
+    QEMUIOVector *qiov;
+    int ret;
+} CompressedWriteCo;
+
+static void coroutine_fn bdrv_write_compressed_co_entry(void *opaque)
+{
+    CompressedWriteCo *cwco = opaque;
+    BlockDriverState *bs = cwco->bs;
+
+    cwco->ret = bs->drv->bdrv_co_write_compressed(bs, cwco->sector_num,
+                                                  cwco->nb_sectors,
+                                                  cwco->qiov);
+}
+
 int bdrv_write_compressed(BlockDriverState *bs, int64_t sector_num,
                           const uint8_t *buf, int nb_sectors)
 {
@@ -1753,7 +1924,7 @@ int bdrv_write_compressed(BlockDriverState *bs, int64_t sector_num,
     if (!drv) {
         return -ENOMEDIUM;
     }
-    if (!drv->bdrv_write_compressed) {
+    if (!drv->bdrv_write_compressed && !drv->bdrv_co_write_compressed) {
         return -ENOTSUP;
     }
     ret = bdrv_check_request(bs, sector_num, nb_sectors);
@@ -1763,6 +1934,39 @@ int bdrv_write_compressed(BlockDriverState *bs, int64_t sector_num,
 
     assert(QLIST_EMPTY(&bs->dirty_bitmaps));
 
+    if (drv->bdrv_co_write_compressed) {
+        QEMUIOVector qiov;
+        struct iovec iov = {
+            .iov_base = (uint8_t *)buf,
+            .iov_len = nb_sectors * BDRV_SECTOR_SIZE,
+        };
+        CompressedWriteCo cwco = {
+            .bs = bs,
+            .sector_num = sector_num,
+            .nb_sectors = nb_sectors,
+            .qiov = &qiov,
+            .ret = NOT_DONE,
+        };
+
+        qemu_iovec_init_external(&qiov, &iov, 1);
+
+        /* Drivers may offload the compression to worker threads, so callers
+         * in coroutine context can keep several writes in flight */
+        if (qemu_in_coroutine()) {
+            bdrv_write_compressed_co_entry(&cwco);
+        } else {
+            AioContext *aio_context = bdrv_get_aio_context(bs);
+            Coroutine *co;
+
+            co = qemu_coroutine_create(bdrv_write_compressed_co_entry);
+            qemu_coroutine_enter(co, &cwco);
+            while (cwco.ret == NOT_DONE) {
+                aio_poll(aio_context, true);
+            }
+        }
+        return cwco.ret;
+    }
+
     return drv->bdrv_write_compressed(bs, sector_num, buf, nb_sectors);
 }
 
@@ -2792,6 +2996,30 @@ void bdrv_flush_io_queue(BlockDriverState *bs)
     bdrv_start_throttled_reqs(bs);
 }
 
+void bdrv_register_buf(BlockDriverState *bs, void *host, size_t size)
+{
+    BdrvChild *child;
+
+    if (bs->drv && bs->drv->bdrv_register_buf) {
+        bs->drv->bdrv_register_buf(bs, host, size);
+    }
+    QLIST_FOREACH(child, &bs->children, next) {
+        bdrv_register_buf(child->bs, host, size);
+    }
+}
+
+void bdrv_unregister_buf(BlockDriverState *bs, void *host, size_t size)
+{
+    BdrvChild *child;
+
+    if (bs->drv && bs->drv->bdrv_unregister_buf) {
+        bs->drv->bdrv_unregister_buf(bs, host, size);
+    }
+    QLIST_FOREACH(child, &bs->children, next) {
+        bdrv_unregister_buf(child->bs, host, size);
+    }
+}
+
 void bdrv_drained_begin(BlockDriverState *bs)
 {
     if (!bs->quiesce_counter++) {
@@ -0,0 +1,521 @@
+/*
+ * Linux io_uring support.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "block/aio.h"
+#include "qemu/queue.h"
+#include "block/raw-aio.h"
+#include "qemu/event_notifier.h"
+#include "trace.h"
+
+#include <liburing.h>
+
+/*
+ * Ring size (per-device).  Submissions are throttled so that no more than
+ * this many requests are in flight, which guarantees that the completion
+ * ring (twice as large) can never overflow.
+ */
+#define MAX_ENTRIES 128
+
+/*
+ * The kernel refuses to register buffers larger than 1 GiB, and the number
+ * of registered buffers is limited by UIO_MAXIOV.
+ */
+#define MAX_BUF_SIZE   (1ULL << 30)
+#define MAX_BUFS       1024
+
+typedef struct LuringAIOCB {
+    BlockAIOCB common;
+    LuringState *s;
+    QEMUIOVector *qiov;
+    int fd;
+    int type;
+    off_t offset;
+    size_t nbytes;
+    ssize_t ret;
+
+    /* index into the registered buffer table, or -1 for readv/writev */
+    int buf_index;
+
+    /* bytes already read when a short read had to be resubmitted */
+    size_t total_read;
+    QEMUIOVector resubmit_qiov;
+
+    QSIMPLEQ_ENTRY(LuringAIOCB) next;
+} LuringAIOCB;
+
+typedef struct LuringQueue {
+    int plugged;
+    unsigned int in_queue;
+    unsigned int in_flight;
+    bool blocked;
+    QSIMPLEQ_HEAD(, LuringAIOCB) submit_queue;
+} LuringQueue;
+
+struct LuringState {
+    struct io_uring ring;
+    EventNotifier e;
+
+    /* io queue for submit at batch */
+    LuringQueue io_q;
+
+    /* I/O completion processing */
+    QEMUBH *completion_bh;
+
+    /*
+     * Fixed buffers, sorted by address.  bufs_dirty is set when the array
+     * does not match what is registered with the kernel; the table is only
+     * updated while no request is in flight.
+     */
+    GArray *bufs;
+    bool bufs_registered;
+    bool bufs_dirty;
+    bool bufs_failed;
+};
+
+static void ioq_submit(LuringState *s);
+
+/*
+ * Find the registered buffer that contains [base, base + len).
+ * Returns its index, or -1 if there is none.
+ */
+static int luring_find_buf(LuringState *s, void *base, size_t len)
+{
+    uintptr_t start = (uintptr_t)base;
+    int lo = 0, hi;
+
+    if (!s->bufs_registered || s->bufs_dirty) {
+        return -1;
+    }
+
+    hi = s->bufs->len;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        struct iovec *iov = &g_array_index(s->bufs, struct iovec, mid);
+        uintptr_t iov_start = (uintptr_t)iov->iov_base;
+
+        if (start < iov_start) {
+            hi = mid;
+        } else if (start >= iov_start + iov->iov_len) {
+            lo = mid + 1;
+        } else {
+            return start + len <= iov_start + iov->iov_len ? mid : -1;
+        }
+    }
+    return -1;
+}
+
+static bool luring_idle(LuringState *s)
+{
+    return s->io_q.in_flight == 0 && QSIMPLEQ_EMPTY(&s->io_q.submit_queue);
+}
+
+/*
+ * Bring the kernel's buffer table in sync with s->bufs.  Must be called
+ * with nothing in flight or queued, because requests that were created with
+ * the old table refer to it by index.
+ */
+static void luring_update_bufs(LuringState *s)
+{
+    int ret;
+
+    assert(luring_idle(s));
+
+    if (s->bufs_registered) {
+        io_uring_unregister_buffers(&s->ring);
+        s->bufs_registered = false;
+    }
+    s->bufs_dirty = false;
+
+    if (s->bufs->len == 0 || s->bufs_failed) {
+        return;
+    }
+
+    ret = io_uring_register_buffers(&s->ring,
+                                    (struct iovec *)s->bufs->data,
+                                    s->bufs->len);
+    if (ret < 0) {
+        /* Typically RLIMIT_MEMLOCK; keep using readv/writev */
+        trace_luring_register_buffers_failed(s, ret);
+        s->bufs_failed = true;
+        return;
+    }
+    s->bufs_registered = true;
+}
+
+void luring_register_buf(LuringState *s, void *host, size_t size)
+{
+    uint8_t *p = host;
+
+    while (size > 0 && s->bufs->len < MAX_BUFS) {
+        struct iovec iov = {
+            .iov_base = p,
+            .iov_len  = MIN(size, MAX_BUF_SIZE),
+        };
+        unsigned int i;
+
+        for (i = 0; i < s->bufs->len; i++) {
+            if (g_array_index(s->bufs, struct iovec, i).iov_base >
+                iov.iov_base) {
+                break;
+            }
+        }
+        g_array_insert_val(s->bufs, i, iov);
+
+        p += iov.iov_len;
+        size -= iov.iov_len;
+    }
+
+    s->bufs_dirty = true;
+    if (luring_idle(s)) {
+        luring_update_bufs(s);
+    }
+}
+
+void luring_unregister_buf(LuringState *s, void *host, size_t size)
+{
+    uint8_t *start = host;
+    unsigned int i = 0;
+
+    while (i < s->bufs->len) {
+        uint8_t *base = g_array_index(s->bufs, struct iovec, i).iov_base;
+
+        if (base >= start && base < start + size) {
+            g_array_remove_index(s->bufs, i);
+        } else {
+            i++;
+        }
+    }
+
+    s->bufs_dirty = true;
+    if (luring_idle(s)) {
+        luring_update_bufs(s);
+    }
+}
+
+static void luring_prep_sqe(struct io_uring_sqe *sqe, LuringAIOCB *acb)
+{
+    QEMUIOVector *qiov = acb->qiov;
+    off_t offset = acb->offset;
+
+    if (acb->total_read) {
+        qiov = &acb->resubmit_qiov;
+        offset += acb->total_read;
+    }
+
+    switch (acb->type) {
+    case QEMU_AIO_WRITE:
+        if (acb->buf_index >= 0) {
+            io_uring_prep_write_fixed(sqe, acb->fd, qiov->iov[0].iov_base,
+                                      qiov->iov[0].iov_len, offset,
+                                      acb->buf_index);
+        } else {
+            io_uring_prep_writev(sqe, acb->fd, qiov->iov, qiov->niov, offset);
+        }
+        break;
+    case QEMU_AIO_READ:
+        if (acb->buf_index >= 0) {
+            io_uring_prep_read_fixed(sqe, acb->fd, qiov->iov[0].iov_base,
+                                     qiov->iov[0].iov_len, offset,
+                                     acb->buf_index);
+        } else {
+            io_uring_prep_readv(sqe, acb->fd, qiov->iov, qiov->niov, offset);
+        }
+        break;
+    case QEMU_AIO_FLUSH:
+        io_uring_prep_fsync(sqe, acb->fd, IORING_FSYNC_DATASYNC);
+        break;
+    default:
+        abort();
+    }
+    io_uring_sqe_set_data(sqe, acb);
+}
+
+/*
+ * Completes an AIO request (calls the callback and frees the ACB).
+ */
+static void luring_process_completion(LuringState *s, LuringAIOCB *acb)
+{
+    ssize_t ret = acb->ret;
+
+    if (ret >= 0 && acb->type != QEMU_AIO_FLUSH) {
+        ret += acb->total_read;
+        if (ret == acb->nbytes) {
+            ret = 0;
+        } else if (acb->type == QEMU_AIO_READ && acb->ret > 0) {
+            /*
+             * Short reads happen on buffered I/O; read the rest before
+             * deciding that the file ended.
+             */
+            acb->total_read = ret;
+            acb->buf_index = -1;
+            qemu_iovec_reset(&acb->resubmit_qiov);
+            qemu_iovec_concat(&acb->resubmit_qiov, acb->qiov, ret,
+                              acb->nbytes - ret);
+            QSIMPLEQ_INSERT_HEAD(&s->io_q.submit_queue, acb, next);
+            s->io_q.in_queue++;
+            return;
+        } else if (acb->type == QEMU_AIO_READ) {
+            /* A read returning 0 means EOF, pad with zeros. */
+            qemu_iovec_memset(acb->qiov, ret, 0, acb->qiov->size - ret);
+            ret = 0;
+        } else {
+            ret = -EINVAL;
+        }
+    }
+
+    trace_luring_process_completion(s, acb, ret);
+    acb->common.cb(acb->common.opaque, ret);
+
+    qemu_iovec_destroy(&acb->resubmit_qiov);
+    qemu_aio_unref(acb);
+}
+
+/* The completion BH reaps completed requests straight from the completion
+ * ring, which is shared with the kernel, and invokes their callbacks.
+ *
+ * Like the linux-aio code, it supports nested event loops: the BH reschedules
+ * itself before running any callback, so a callback that invokes aio_poll()
+ * will see the remaining completions.  Each entry is consumed before its
+ * callback runs, so no completion is processed twice.
+ */
+static void luring_completion_bh(void *opaque)
+{
+    LuringState *s = opaque;
+    struct io_uring_cqe *cqe;
+
+    qemu_bh_schedule(s->completion_bh);
+
+    while (io_uring_peek_cqe(&s->ring, &cqe) == 0) {
+        LuringAIOCB *acb = io_uring_cqe_get_data(cqe);
+
+        acb->ret = cqe->res;
+        io_uring_cqe_seen(&s->ring, cqe);
+        s->io_q.in_flight--;
+        s->io_q.blocked = false;
+
+        luring_process_completion(s, acb);
+    }
+
+    qemu_bh_cancel(s->completion_bh);
+
+    /*
+     * Queued requests looked up their buf_index in the current table too,
+     * so wait until they have been submitted and completed as well.
+     */
+    if (s->bufs_dirty && luring_idle(s)) {
+        luring_update_bufs(s);
+    }
+
+    if (!s->io_q.plugged && (!QSIMPLEQ_EMPTY(&s->io_q.submit_queue) ||
+                             io_uring_sq_ready(&s->ring))) {
+        ioq_submit(s);
+    }
+}
+
+static void luring_completion_cb(EventNotifier *e)
+{
+    LuringState *s = container_of(e, LuringState, e);
+
+    if (event_notifier_test_and_clear(&s->e)) {
+        qemu_bh_schedule(s->completion_bh);
+    }
+}
+
+/* Busy-polling callback: completions are visible in the shared ring */
+static bool luring_poll_cb(void *opaque)
+{
+    EventNotifier *e = opaque;
+    LuringState *s = container_of(e, LuringState, e);
+
+    if (!io_uring_cq_ready(&s->ring)) {
+        return false;
+    }
+
+    luring_completion_bh(s);
+    return true;
+}
+
+static const AIOCBInfo luring_aiocb_info = {
+    .aiocb_size         = sizeof(LuringAIOCB),
+};
+
+static void ioq_init(LuringQueue *io_q)
+{
+    QSIMPLEQ_INIT(&io_q->submit_queue);
+    io_q->plugged = 0;
+    io_q->in_queue = 0;
+    io_q->in_flight = 0;
+    io_q->blocked = false;
+}
+
+/*
+ * Move queued requests into the submission ring, up to the number of free
+ * slots, and hand them to the kernel with a single io_uring_enter().
+ */
+static void ioq_submit(LuringState *s)
+{
+    LuringAIOCB *acb;
+    int ret;
+
+    while (s->io_q.in_flight < MAX_ENTRIES &&
+           !QSIMPLEQ_EMPTY(&s->io_q.submit_queue)) {
+        struct io_uring_sqe *sqe = io_uring_get_sqe(&s->ring);
+
+        if (!sqe) {
+            break;
+        }
+        acb = QSIMPLEQ_FIRST(&s->io_q.submit_queue);
+        QSIMPLEQ_REMOVE_HEAD(&s->io_q.submit_queue, next);
+        s->io_q.in_queue--;
+        s->io_q.in_flight++;
+        luring_prep_sqe(sqe, acb);
+    }
+
+    /* Entries left in the ring by a failed io_uring_enter() go out too */
+    do {
+        ret = io_uring_submit(&s->ring);
+    } while (ret == -EINTR);
+
+    if (ret == -EAGAIN || ret == -EBUSY) {
+        /* Retried when the next completion frees kernel resources */
+        s->io_q.blocked = true;
+        ret = 0;
+    } else if (ret < 0) {
+        abort();
+    } else {
+        s->io_q.blocked = (s->io_q.in_queue > 0);
+    }
+    trace_luring_submit(s, ret, s->io_q.in_queue, s->io_q.in_flight);
+
+    /*
+     * Fast devices may already have completed something; process it without
+     * waiting for the eventfd round trip.
+     */
+    if (io_uring_cq_ready(&s->ring)) {
+        qemu_bh_schedule(s->completion_bh);
+    }
+}
+
+void luring_io_plug(BlockDriverState *bs, LuringState *s)
+{
+    s->io_q.plugged++;
+}
+
+void luring_io_unplug(BlockDriverState *bs, LuringState *s, bool unplug)
+{
+    assert(s->io_q.plugged > 0 || !unplug);
+
+    if (unplug && --s->io_q.plugged > 0) {
+        return;
+    }
+
+    if (!s->io_q.blocked && !QSIMPLEQ_EMPTY(&s->io_q.submit_queue)) {
+        ioq_submit(s);
+    }
+}
+
+BlockAIOCB *luring_submit(BlockDriverState *bs, LuringState *s, int fd,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockCompletionFunc *cb, void *opaque, int type)
+{
+    LuringAIOCB *acb;
+
+    switch (type) {
+    case QEMU_AIO_WRITE:
+    case QEMU_AIO_READ:
+    case QEMU_AIO_FLUSH:
+        break;
+    default:
+        fprintf(stderr, "%s: invalid AIO request type 0x%x.\n",
+                        __func__, type);
+        return NULL;
+    }
+
+    acb = qemu_aio_get(&luring_aiocb_info, bs, cb, opaque);
+    acb->s = s;
+    acb->fd = fd;
+    acb->type = type;
+    acb->qiov = qiov;
+    acb->offset = sector_num * BDRV_SECTOR_SIZE;
+    acb->nbytes = nb_sectors * BDRV_SECTOR_SIZE;
+    acb->ret = -EINPROGRESS;
+    acb->total_read = 0;
+    acb->buf_index = -1;
+    qemu_iovec_init(&acb->resubmit_qiov, qiov ? qiov->niov : 1);
+
+    if (qiov && qiov->niov == 1) {
+        acb->buf_index = luring_find_buf(s, qiov->iov[0].iov_base,
+                                         qiov->iov[0].iov_len);
+    }
+
+    QSIMPLEQ_INSERT_TAIL(&s->io_q.submit_queue, acb, next);
+    s->io_q.in_queue++;
+    if (!s->io_q.blocked &&
+        (!s->io_q.plugged || s->io_q.in_queue >= MAX_ENTRIES)) {
+        ioq_submit(s);
+    }
+    return &acb->common;
+}
+
+void luring_detach_aio_context(LuringState *s, AioContext *old_context)
+{
+    aio_set_event_notifier(old_context, &s->e, false, NULL);
+    qemu_bh_delete(s->completion_bh);
+}
+
+void luring_attach_aio_context(LuringState *s, AioContext *new_context)
+{
+    s->completion_bh = aio_bh_new(new_context, luring_completion_bh, s);
+    aio_set_event_notifier(new_context, &s->e, false,
+                           luring_completion_cb);
+    aio_set_event_notifier_poll(new_context, &s->e, luring_poll_cb);
+}
+
+LuringState *luring_init(void)
+{
+    LuringState *s;
+    int ret;
+
+    s = g_new0(LuringState, 1);
+    if (event_notifier_init(&s->e, false) < 0) {
+        goto out_free_state;
+    }
+
+    ret = io_uring_queue_init(MAX_ENTRIES, &s->ring, 0);
+    if (ret < 0) {
+        errno = -ret;
+        goto out_close_efd;
+    }
+
+    ret = io_uring_register_eventfd(&s->ring, event_notifier_get_fd(&s->e));
+    if (ret < 0) {
+        errno = -ret;
+        goto out_exit_ring;
+    }
+
+    ioq_init(&s->io_q);
+    s->bufs = g_array_new(false, false, sizeof(struct iovec));
+
+    return s;
+
+out_exit_ring:
+    io_uring_queue_exit(&s->ring);
+out_close_efd:
+    event_notifier_cleanup(&s->e);
+out_free_state:
+    g_free(s);
+    return NULL;
+}
+
+void luring_cleanup(LuringState *s)
+{
+    event_notifier_cleanup(&s->e);
+    io_uring_queue_exit(&s->ring);
+    g_array_free(s->bufs, true);
+    g_free(s);
+}
@@ -535,6 +535,14 @@ BlockStatsList *qmp_query_blockstats(bool has_query_nodes,
     return head;
 }
 
+#ifndef CONFIG_POSIX
+/* The read-cache driver is only built on POSIX hosts, see block/read-cache.c */
+ReadCacheInfoList *qmp_query_read_cache(Error **errp)
+{
+    return NULL;
+}
+#endif
+
 #define NB_SUFFIXES 4
 
 static char *get_human_readable_size(char *buf, int buf_size, int64_t size)
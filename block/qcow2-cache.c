@@ -39,43 +39,113 @@ typedef struct Qcow2CachedTable {
     uint64_t lru_counter;
     int      ref;
     bool     dirty;
+    bool     loading;   /* being read from disk with s->lock dropped */
+    int      hash_next; /* next entry in the same hash bucket, or -1 */
+    QTAILQ_ENTRY(Qcow2CachedTable) lru_entry; /* only linked while ref == 0 */
 } Qcow2CachedTable;
 
 struct Qcow2Cache {
     Qcow2CachedTable       *entries;
     struct Qcow2Cache      *depends;
     int                     size;
+    int                     table_size;
     bool                    depends_on_flush;
     void                   *table_array;
     uint64_t                lru_counter;
     uint64_t                cache_clean_lru_counter;
+
+    /* Maps table offsets to entry indices; the bucket count is a power of 2 */
+    int                    *buckets;
+    int                     bucket_bits;
+
+    /* Unreferenced entries, least recently used first.  Unused entries are
+     * kept at the head so that they are recycled before any cached table. */
+    QTAILQ_HEAD(, Qcow2CachedTable) lru_list;
+
+    /* Requests waiting for a table that is being loaded without s->lock */
+    CoQueue                 loading_queue;
+    int                     nb_loading;
 };
 
 static inline void *qcow2_cache_get_table_addr(BlockDriverState *bs,
                     Qcow2Cache *c, int table)
 {
-    BDRVQcow2State *s = bs->opaque;
-    return (uint8_t *) c->table_array + (size_t) table * s->cluster_size;
+    return (uint8_t *) c->table_array + (size_t) table * c->table_size;
 }
 
 static inline int qcow2_cache_get_table_idx(BlockDriverState *bs,
                   Qcow2Cache *c, void *table)
 {
-    BDRVQcow2State *s = bs->opaque;
     ptrdiff_t table_offset = (uint8_t *) table - (uint8_t *) c->table_array;
-    int idx = table_offset / s->cluster_size;
-    assert(idx >= 0 && idx < c->size && table_offset % s->cluster_size == 0);
+    int idx = table_offset / c->table_size;
+    assert(idx >= 0 && idx < c->size && table_offset % c->table_size == 0);
     return idx;
 }
 
+static inline int qcow2_cache_entry_idx(Qcow2Cache *c, Qcow2CachedTable *t)
+{
+    return t - c->entries;
+}
+
+static inline unsigned qcow2_cache_hash(Qcow2Cache *c, uint64_t offset)
+{
+    /* Fibonacci hashing of the table number; the top bits are the best mixed */
+    uint64_t h = (offset / c->table_size) * 0x9e3779b97f4a7c15ULL;
+    return c->bucket_bits ? h >> (64 - c->bucket_bits) : 0;
+}
+
+static void qcow2_cache_hash_insert(Qcow2Cache *c, int i)
+{
+    unsigned b = qcow2_cache_hash(c, c->entries[i].offset);
+
+    c->entries[i].hash_next = c->buckets[b];
+    c->buckets[b] = i;
+}
+
+static void qcow2_cache_hash_remove(Qcow2Cache *c, int i)
+{
+    int *link = &c->buckets[qcow2_cache_hash(c, c->entries[i].offset)];
+
+    while (*link != i) {
+        assert(*link != -1);
+        link = &c->entries[*link].hash_next;
+    }
+    *link = c->entries[i].hash_next;
+    c->entries[i].hash_next = -1;
+}
+
+static int qcow2_cache_hash_lookup(Qcow2Cache *c, uint64_t offset)
+{
+    int i = c->buckets[qcow2_cache_hash(c, offset)];
+
+    while (i != -1 && c->entries[i].offset != offset) {
+        i = c->entries[i].hash_next;
+    }
+    return i;
+}
+
+/* Forget the table cached in entry @i and make it the next one to be reused */
+static void qcow2_cache_entry_discard(Qcow2Cache *c, int i)
+{
+    Qcow2CachedTable *t = &c->entries[i];
+
+    assert(t->ref == 0);
+    if (t->offset) {
+        qcow2_cache_hash_remove(c, i);
+        t->offset = 0;
+    }
+    t->lru_counter = 0;
+    QTAILQ_REMOVE(&c->lru_list, t, lru_entry);
+    QTAILQ_INSERT_HEAD(&c->lru_list, t, lru_entry);
+}
+
 static void qcow2_cache_table_release(BlockDriverState *bs, Qcow2Cache *c,
                                       int i, int num_tables)
 {
 #if QEMU_MADV_DONTNEED != QEMU_MADV_INVALID
-    BDRVQcow2State *s = bs->opaque;
     void *t = qcow2_cache_get_table_addr(bs, c, i);
     int align = getpagesize();
-    size_t mem_size = (size_t) s->cluster_size * num_tables;
+    size_t mem_size = (size_t) c->table_size * num_tables;
     size_t offset = QEMU_ALIGN_UP((uintptr_t) t, align) - (uintptr_t) t;
     size_t length = QEMU_ALIGN_DOWN(mem_size - offset, align);
     if (length > 0) {
@@ -87,7 +157,7 @@ static void qcow2_cache_table_release(BlockDriverState *bs, Qcow2Cache *c,
 static inline bool can_clean_entry(Qcow2Cache *c, int i)
 {
     Qcow2CachedTable *t = &c->entries[i];
-    return t->ref == 0 && !t->dirty && t->offset != 0 &&
+    return t->ref == 0 && !t->dirty && !t->loading && t->offset != 0 &&
         t->lru_counter <= c->cache_clean_lru_counter;
 }
 
@@ -104,8 +174,7 @@ void qcow2_cache_clean_unused(BlockDriverState *bs, Qcow2Cache *c)
 
         /* And count how many we can clean in a row */
         while (i < c->size && can_clean_entry(c, i)) {
-            c->entries[i].offset = 0;
-            c->entries[i].lru_counter = 0;
+            qcow2_cache_entry_discard(c, i);
             i++;
             to_clean++;
         }
@@ -118,22 +187,43 @@ void qcow2_cache_clean_unused(BlockDriverState *bs, Qcow2Cache *c)
     c->cache_clean_lru_counter = c->lru_counter;
 }
 
-Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables)
+Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
+                               int table_size)
 {
-    BDRVQcow2State *s = bs->opaque;
     Qcow2Cache *c;
+    int i;
+
+    assert(is_power_of_2(table_size));
 
     c = g_new0(Qcow2Cache, 1);
     c->size = num_tables;
+    c->table_size = table_size;
     c->entries = g_try_new0(Qcow2CachedTable, num_tables);
     c->table_array = qemu_try_blockalign(bs->file->bs,
-                                         (size_t) num_tables * s->cluster_size);
+                                         (size_t) num_tables * table_size);
 
-    if (!c->entries || !c->table_array) {
+    /* Aim for a load factor of at most 1/2 */
+    while (c->bucket_bits < 30 && (1 << c->bucket_bits) < 2 * num_tables) {
+        c->bucket_bits++;
+    }
+    c->buckets = g_try_new(int, 1 << c->bucket_bits);
+
+    if (!c->entries || !c->table_array || !c->buckets) {
         qemu_vfree(c->table_array);
         g_free(c->entries);
+        g_free(c->buckets);
         g_free(c);
-        c = NULL;
+        return NULL;
+    }
+
+    for (i = 0; i < (1 << c->bucket_bits); i++) {
+        c->buckets[i] = -1;
+    }
+    QTAILQ_INIT(&c->lru_list);
+    qemu_co_queue_init(&c->loading_queue);
+    for (i = 0; i < num_tables; i++) {
+        c->entries[i].hash_next = -1;
+        QTAILQ_INSERT_TAIL(&c->lru_list, &c->entries[i], lru_entry);
     }
 
     return c;
@@ -143,12 +233,14 @@ int qcow2_cache_destroy(BlockDriverState *bs, Qcow2Cache *c)
 {
     int i;
 
+    assert(c->nb_loading == 0);
     for (i = 0; i < c->size; i++) {
         assert(c->entries[i].ref == 0);
     }
 
     qemu_vfree(c->table_array);
     g_free(c->entries);
+    g_free(c->buckets);
     g_free(c);
 
     return 0;
@@ -196,13 +288,13 @@ static int qcow2_cache_entry_flush(BlockDriverState *bs, Qcow2Cache *c, int i)
 
     if (c == s->refcount_block_cache) {
         ret = qcow2_pre_write_overlap_check(bs, QCOW2_OL_REFCOUNT_BLOCK,
-                c->entries[i].offset, s->cluster_size);
+                c->entries[i].offset, c->table_size);
     } else if (c == s->l2_table_cache) {
         ret = qcow2_pre_write_overlap_check(bs, QCOW2_OL_ACTIVE_L2,
-                c->entries[i].offset, s->cluster_size);
+                c->entries[i].offset, c->table_size);
     } else {
         ret = qcow2_pre_write_overlap_check(bs, 0,
-                c->entries[i].offset, s->cluster_size);
+                c->entries[i].offset, c->table_size);
     }
 
     if (ret < 0) {
@@ -216,7 +308,7 @@ static int qcow2_cache_entry_flush(BlockDriverState *bs, Qcow2Cache *c, int i)
     }
 
     ret = bdrv_pwrite(bs->file->bs, c->entries[i].offset,
-                      qcow2_cache_get_table_addr(bs, c, i), s->cluster_size);
+                      qcow2_cache_get_table_addr(bs, c, i), c->table_size);
     if (ret < 0) {
         return ret;
     }
@@ -280,6 +372,42 @@ void qcow2_cache_depends_on_flush(Qcow2Cache *c)
     c->depends_on_flush = true;
 }
 
+int qcow2_cache_size(Qcow2Cache *c)
+{
+    return c->size;
+}
+
+int qcow2_cache_table_size(Qcow2Cache *c)
+{
+    return c->table_size;
+}
+
+/*
+ * Stores the offsets of up to max cached tables in offsets, least recently
+ * used first, and returns their number.  Tables that are currently in use
+ * count as most recently used.
+ */
+int qcow2_cache_get_offsets(Qcow2Cache *c, uint64_t *offsets, int max)
+{
+    Qcow2CachedTable *t;
+    int i, n = 0;
+
+    QTAILQ_FOREACH(t, &c->lru_list, lru_entry) {
+        if (n < max && t->offset && !t->loading) {
+            offsets[n++] = t->offset;
+        }
+    }
+
+    for (i = 0; i < c->size && n < max; i++) {
+        t = &c->entries[i];
+        if (t->ref > 0 && t->offset && !t->loading) {
+            offsets[n++] = t->offset;
+        }
+    }
+
+    return n;
+}
+
 int qcow2_cache_empty(BlockDriverState *bs, Qcow2Cache *c)
 {
     int ret, i;
@@ -289,10 +417,10 @@ int qcow2_cache_empty(BlockDriverState *bs, Qcow2Cache *c)
         return ret;
     }
 
+    assert(c->nb_loading == 0);
     for (i = 0; i < c->size; i++) {
         assert(c->entries[i].ref == 0);
-        c->entries[i].offset = 0;
-        c->entries[i].lru_counter = 0;
+        qcow2_cache_entry_discard(c, i);
     }
 
     qcow2_cache_table_release(bs, c, 0, c->size);
@@ -303,42 +431,47 @@ int qcow2_cache_empty(BlockDriverState *bs, Qcow2Cache *c)
 }
 
 static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
-    uint64_t offset, void **table, bool read_from_disk)
+    uint64_t offset, void **table, bool read_from_disk, bool unlock)
 {
     BDRVQcow2State *s = bs->opaque;
+    Qcow2CachedTable *t;
     int i;
     int ret;
-    int lookup_index;
-    uint64_t min_lru_counter = UINT64_MAX;
-    int min_lru_index = -1;
 
     trace_qcow2_cache_get(qemu_coroutine_self(), c == s->l2_table_cache,
                           offset, read_from_disk);
 
+    assert(offset != 0 && offset % c->table_size == 0);
+
+retry:
     /* Check if the table is already cached */
-    i = lookup_index = (offset / s->cluster_size * 4) % c->size;
-    do {
-        const Qcow2CachedTable *t = &c->entries[i];
-        if (t->offset == offset) {
-            goto found;
-        }
-        if (t->ref == 0 && t->lru_counter < min_lru_counter) {
-            min_lru_counter = t->lru_counter;
-            min_lru_index = i;
+    i = qcow2_cache_hash_lookup(c, offset);
+    if (i != -1) {
+        t = &c->entries[i];
+        if (t->loading) {
+            /* Somebody else is reading it; s->lock stays held while we wait,
+             * which is fine because the reader doesn't need it to finish */
+            qemu_co_queue_wait(&c->loading_queue);
+            goto retry;
         }
-        if (++i == c->size) {
-            i = 0;
+        if (t->ref == 0) {
+            QTAILQ_REMOVE(&c->lru_list, t, lru_entry);
         }
-    } while (i != lookup_index);
+        goto found;
+    }
 
-    if (min_lru_index == -1) {
-        /* This can't happen in current synchronous code, but leave the check
-         * here as a reminder for whoever starts using AIO with the cache */
+    /* Cache miss: write back the least recently used table and replace it */
+    t = QTAILQ_FIRST(&c->lru_list);
+    if (t == NULL) {
+        if (c->nb_loading > 0) {
+            /* All free entries are being filled by other requests */
+            qemu_co_queue_wait(&c->loading_queue);
+            goto retry;
+        }
+        /* Every entry is referenced; callers never hold that many tables */
         abort();
     }
-
-    /* Cache miss: write a table back and replace it */
-    i = min_lru_index;
+    i = qcow2_cache_entry_idx(c, t);
     trace_qcow2_cache_get_replace_entry(qemu_coroutine_self(),
                                         c == s->l2_table_cache, i);
 
@@ -349,25 +482,54 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
 
     trace_qcow2_cache_get_read(qemu_coroutine_self(),
                                c == s->l2_table_cache, i);
-    c->entries[i].offset = 0;
+    if (t->offset) {
+        qcow2_cache_hash_remove(c, i);
+        t->offset = 0;
+    }
+    QTAILQ_REMOVE(&c->lru_list, t, lru_entry);
+
+    /* Publish the entry before reading so that concurrent lookups for the
+     * same table wait for this read instead of issuing their own */
+    t->offset = offset;
+    qcow2_cache_hash_insert(c, i);
+
     if (read_from_disk) {
         if (c == s->l2_table_cache) {
             BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
         }
 
+        unlock = unlock && qemu_in_coroutine();
+        if (unlock) {
+            t->loading = true;
+            c->nb_loading++;
+            qemu_co_mutex_unlock(&s->lock);
+        }
+
         ret = bdrv_pread(bs->file->bs, offset,
                          qcow2_cache_get_table_addr(bs, c, i),
-                         s->cluster_size);
+                         c->table_size);
+        if (ret < 0) {
+            qcow2_cache_hash_remove(c, i);
+            t->offset = 0;
+            t->lru_counter = 0;
+            QTAILQ_INSERT_HEAD(&c->lru_list, t, lru_entry);
+        }
+
+        if (unlock) {
+            t->loading = false;
+            c->nb_loading--;
+            qemu_co_queue_restart_all(&c->loading_queue);
+            qemu_co_mutex_lock(&s->lock);
+        }
+
         if (ret < 0) {
             return ret;
         }
     }
 
-    c->entries[i].offset = offset;
-
     /* And return the right table */
 found:
-    c->entries[i].ref++;
+    t->ref++;
     *table = qcow2_cache_get_table_addr(bs, c, i);
 
     trace_qcow2_cache_get_done(qemu_coroutine_self(),
@@ -379,13 +541,25 @@ found:
 int qcow2_cache_get(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     void **table)
 {
-    return qcow2_cache_do_get(bs, c, offset, table, true);
+    return qcow2_cache_do_get(bs, c, offset, table, true, false);
+}
+
+/*
+ * Like qcow2_cache_get(), but on a cache miss s->lock is dropped while the
+ * table is read from disk, so that other requests aren't stalled by the
+ * metadata read.  s->lock must be held by the caller, and anything derived
+ * from metadata before the call must be revalidated afterwards.
+ */
+int qcow2_cache_get_unlocked(BlockDriverState *bs, Qcow2Cache *c,
+    uint64_t offset, void **table)
+{
+    return qcow2_cache_do_get(bs, c, offset, table, true, true);
 }
 
 int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     void **table)
 {
-    return qcow2_cache_do_get(bs, c, offset, table, false);
+    return qcow2_cache_do_get(bs, c, offset, table, false, false);
 }
 
 void qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table)
@@ -397,6 +571,7 @@ void qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table)
 
     if (c->entries[i].ref == 0) {
         c->entries[i].lru_counter = ++c->lru_counter;
+        QTAILQ_INSERT_TAIL(&c->lru_list, &c->entries[i], lru_entry);
     }
 
     assert(c->entries[i].ref >= 0);
@@ -23,7 +23,6 @@
  */
 
 #include "qemu/osdep.h"
-#include <zlib.h>
 
 #include "qapi/error.h"
 #include "qemu-common.h"
@@ -142,24 +141,62 @@ int qcow2_grow_l1_table(BlockDriverState *bs, uint64_t min_size,
 /*
  * l2_load
  *
- * Loads a L2 table into memory. If the table is in the cache, the cache
- * is used; otherwise the L2 table is loaded from the image file.
+ * Loads the slice of the L2 table at l2_offset that contains the entry for
+ * the guest offset 'offset' into memory. If the slice is in the cache, the
+ * cache is used; otherwise it is loaded from the image file.
  *
- * Returns a pointer to the L2 table on success, or NULL if the read from
- * the image file failed.
+ * Returns 0 and a pointer to the L2 slice on success, or a negative errno
+ * value if the read from the image file failed.
  */
 
-static int l2_load(BlockDriverState *bs, uint64_t l2_offset,
-    uint64_t **l2_table)
+static int l2_load(BlockDriverState *bs, uint64_t offset,
+                   uint64_t l2_offset, uint64_t **l2_slice)
 {
     BDRVQcow2State *s = bs->opaque;
     int ret;
 
-    ret = qcow2_cache_get(bs, s->l2_table_cache, l2_offset, (void**) l2_table);
+    l2_offset = l2_slice_offset(s, l2_offset, offset_to_l2_index(s, offset));
+    ret = qcow2_cache_get(bs, s->l2_table_cache, l2_offset, (void**) l2_slice);
 
     return ret;
 }
 
+/*
+ * qcow2_l2_prefetch
+ *
+ * Reads the L2 slice for 'offset' into the cache with s->lock dropped, if the
+ * L2 table is allocated and not shared. qcow2_alloc_cluster_offset() keeps
+ * the lock throughout, so calling this first lets other requests proceed
+ * during the metadata read instead of waiting for it. Errors are left for
+ * the actual lookup to report.
+ *
+ * Must be called with s->lock held. Because the lock is dropped, callers
+ * must not carry anything they computed under the lock across the call.
+ */
+void coroutine_fn qcow2_l2_prefetch(BlockDriverState *bs, uint64_t offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t l1_index, l2_offset;
+    uint64_t *l2_slice;
+
+    l1_index = offset >> (s->l2_bits + s->cluster_bits);
+    if (l1_index >= s->l1_size ||
+        !(s->l1_table[l1_index] & QCOW_OFLAG_COPIED)) {
+        return;
+    }
+
+    l2_offset = s->l1_table[l1_index] & L1E_OFFSET_MASK;
+    if (!l2_offset || offset_into_cluster(s, l2_offset)) {
+        return;
+    }
+
+    l2_offset = l2_slice_offset(s, l2_offset, offset_to_l2_index(s, offset));
+    if (qcow2_cache_get_unlocked(bs, s->l2_table_cache, l2_offset,
+                                 (void **) &l2_slice) == 0) {
+        qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_slice);
+    }
+}
+
 /*
  * Writes one sector of the L1 table to the disk (can't update single entries
  * and we really don't want bdrv_pread to perform a read-modify-write)
@@ -204,14 +241,18 @@ int qcow2_write_l1_entry(BlockDriverState *bs, int l1_index)
  * table) copy the contents of the old L2 table into the newly allocated one.
  * Otherwise the new table is initialized with zeros.
  *
+ * The new table is written out one slice at a time through the L2 cache;
+ * callers have to load the slice they need with l2_load() afterwards.
  */
 
-static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
+static int l2_allocate(BlockDriverState *bs, int l1_index)
 {
     BDRVQcow2State *s = bs->opaque;
     uint64_t old_l2_offset;
     uint64_t *l2_table = NULL;
     int64_t l2_offset;
+    int slice, n_slices = s->l2_size / s->l2_slice_size;
+    size_t slice_size2 = s->l2_slice_size * sizeof(uint64_t);
     int ret;
 
     old_l2_offset = s->l1_table[l1_index];
@@ -231,41 +272,44 @@ static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
         goto fail;
     }
 
-    /* allocate a new entry in the l2 cache */
-
     trace_qcow2_l2_allocate_get_empty(bs, l1_index);
-    ret = qcow2_cache_get_empty(bs, s->l2_table_cache, l2_offset, (void**) table);
-    if (ret < 0) {
-        goto fail;
-    }
-
-    l2_table = *table;
-
-    if ((old_l2_offset & L1E_OFFSET_MASK) == 0) {
-        /* if there was no old l2 table, clear the new table */
-        memset(l2_table, 0, s->l2_size * sizeof(uint64_t));
-    } else {
-        uint64_t* old_table;
-
-        /* if there was an old l2 table, read it from the disk */
-        BLKDBG_EVENT(bs->file, BLKDBG_L2_ALLOC_COW_READ);
-        ret = qcow2_cache_get(bs, s->l2_table_cache,
-            old_l2_offset & L1E_OFFSET_MASK,
-            (void**) &old_table);
+    for (slice = 0; slice < n_slices; slice++) {
+        /* allocate a new entry in the l2 cache */
+        ret = qcow2_cache_get_empty(bs, s->l2_table_cache,
+                                    l2_offset + slice * slice_size2,
+                                    (void**) &l2_table);
         if (ret < 0) {
             goto fail;
         }
 
-        memcpy(l2_table, old_table, s->cluster_size);
+        if ((old_l2_offset & L1E_OFFSET_MASK) == 0) {
+            /* if there was no old l2 table, clear the new table */
+            memset(l2_table, 0, slice_size2);
+        } else {
+            uint64_t* old_table;
 
-        qcow2_cache_put(bs, s->l2_table_cache, (void **) &old_table);
+            /* if there was an old l2 table, read it from the disk */
+            BLKDBG_EVENT(bs->file, BLKDBG_L2_ALLOC_COW_READ);
+            ret = qcow2_cache_get(bs, s->l2_table_cache,
+                (old_l2_offset & L1E_OFFSET_MASK) + slice * slice_size2,
+                (void**) &old_table);
+            if (ret < 0) {
+                goto fail;
+            }
+
+            memcpy(l2_table, old_table, slice_size2);
+
+            qcow2_cache_put(bs, s->l2_table_cache, (void **) &old_table);
+        }
+
+        qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache, l2_table);
+        qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
     }
 
     /* write the l2 table to the file */
     BLKDBG_EVENT(bs->file, BLKDBG_L2_ALLOC_WRITE);
 
     trace_qcow2_l2_allocate_write_l2(bs, l1_index);
-    qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache, l2_table);
     ret = qcow2_cache_flush(bs, s->l2_table_cache);
     if (ret < 0) {
         goto fail;
@@ -279,14 +323,13 @@ static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
         goto fail;
     }
 
-    *table = l2_table;
     trace_qcow2_l2_allocate_done(bs, l1_index, 0);
     return 0;
 
 fail:
     trace_qcow2_l2_allocate_done(bs, l1_index, ret);
     if (l2_table != NULL) {
-        qcow2_cache_put(bs, s->l2_table_cache, (void**) table);
+        qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
     }
     s->l1_table[l1_index] = old_l2_offset;
     if (l2_offset > 0) {
@@ -389,10 +432,15 @@ int qcow2_encrypt_sectors(BDRVQcow2State *s, int64_t sector_num,
     return 0;
 }
 
+/*
+ * Copies sectors [n_start, n_end) of the cluster at guest sector start_sect
+ * to the host cluster at cluster_offset.  If is_zero is true, the source is
+ * known to read as zeroes and isn't read.
+ */
 static int coroutine_fn copy_sectors(BlockDriverState *bs,
                                      uint64_t start_sect,
                                      uint64_t cluster_offset,
-                                     int n_start, int n_end)
+                                     int n_start, int n_end, bool is_zero)
 {
     BDRVQcow2State *s = bs->opaque;
     QEMUIOVector qiov;
@@ -404,6 +452,20 @@ static int coroutine_fn copy_sectors(BlockDriverState *bs,
         return 0;
     }
 
+    if (is_zero && !bs->encrypted) {
+        /* Nothing to read or encrypt, and no buffer to write */
+        ret = qcow2_pre_write_overlap_check(bs, 0,
+                cluster_offset + n_start * BDRV_SECTOR_SIZE,
+                n * BDRV_SECTOR_SIZE);
+        if (ret < 0) {
+            return ret;
+        }
+
+        BLKDBG_EVENT(bs->file, BLKDBG_COW_WRITE);
+        return bdrv_co_write_zeroes(bs->file->bs,
+                                    (cluster_offset >> 9) + n_start, n, 0);
+    }
+
     iov.iov_len = n * BDRV_SECTOR_SIZE;
     iov.iov_base = qemu_try_blockalign(bs, iov.iov_len);
     if (iov.iov_base == NULL) {
@@ -412,20 +474,26 @@ static int coroutine_fn copy_sectors(BlockDriverState *bs,
 
     qemu_iovec_init_external(&qiov, &iov, 1);
 
-    BLKDBG_EVENT(bs->file, BLKDBG_COW_READ);
+    if (is_zero) {
+        /* Encrypted zeroes still have to be written as data */
+        memset(iov.iov_base, 0, iov.iov_len);
+    } else {
+        BLKDBG_EVENT(bs->file, BLKDBG_COW_READ);
 
-    if (!bs->drv) {
-        ret = -ENOMEDIUM;
-        goto out;
-    }
+        if (!bs->drv) {
+            ret = -ENOMEDIUM;
+            goto out;
+        }
 
-    /* Call .bdrv_co_readv() directly instead of using the public block-layer
-     * interface.  This avoids double I/O throttling and request tracking,
-     * which can lead to deadlock when block layer copy-on-read is enabled.
-     */
-    ret = bs->drv->bdrv_co_readv(bs, start_sect + n_start, n, &qiov);
-    if (ret < 0) {
-        goto out;
+        /* Call .bdrv_co_readv() directly instead of using the public
+         * block-layer interface.  This avoids double I/O throttling and
+         * request tracking, which can lead to deadlock when block layer
+         * copy-on-read is enabled.
+         */
+        ret = bs->drv->bdrv_co_readv(bs, start_sect + n_start, n, &qiov);
+        if (ret < 0) {
+            goto out;
+        }
     }
 
     if (bs->encrypted) {
@@ -482,19 +550,20 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
     uint64_t l1_index, l2_offset, *l2_table;
     int l1_bits, c;
     unsigned int index_in_cluster, nb_clusters;
-    uint64_t nb_available, nb_needed;
+    uint64_t nb_available, nb_needed, slice_bytes;
     int ret;
 
     index_in_cluster = (offset >> 9) & (s->cluster_sectors - 1);
     nb_needed = *num + index_in_cluster;
 
     l1_bits = s->l2_bits + s->cluster_bits;
+    slice_bytes = (uint64_t)s->l2_slice_size << s->cluster_bits;
 
     /* compute how many bytes there are between the offset and
-     * the end of the l1 entry
+     * the end of the L2 slice (which never crosses an l1 entry)
      */
 
-    nb_available = (1ULL << l1_bits) - (offset & ((1ULL << l1_bits) - 1));
+    nb_available = slice_bytes - (offset & (slice_bytes - 1));
 
     /* compute the number of available sectors */
 
@@ -505,6 +574,7 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
     }
     assert(nb_needed <= INT_MAX);
 
+again:
     *cluster_offset = 0;
 
     /* seek to the l2 offset in the l1 table */
@@ -528,16 +598,27 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
         return -EIO;
     }
 
-    /* load the l2 table in memory */
+    /* load the l2 slice in memory; s->lock is dropped if it must be read
+     * from disk, so that other requests can go on in the meantime */
 
-    ret = l2_load(bs, l2_offset, &l2_table);
+    ret = qcow2_cache_get_unlocked(bs, s->l2_table_cache,
+            l2_slice_offset(s, l2_offset, offset_to_l2_index(s, offset)),
+            (void **) &l2_table);
     if (ret < 0) {
         return ret;
     }
 
+    /* The L1 entry may have changed while the lock was dropped, e.g. if the
+     * L2 table was copied on write; start over in that case */
+    if (l1_index >= s->l1_size ||
+        (s->l1_table[l1_index] & L1E_OFFSET_MASK) != l2_offset) {
+        qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
+        goto again;
+    }
+
     /* find the cluster offset for the given disk offset */
 
-    l2_index = (offset >> s->cluster_bits) & (s->l2_size - 1);
+    l2_index = offset_to_l2_slice_index(s, offset);
     *cluster_offset = be64_to_cpu(l2_table[l2_index]);
 
     /* nb_needed <= INT_MAX, thus nb_clusters <= INT_MAX, too */
@@ -607,10 +688,10 @@ fail:
  * get_cluster_table
  *
  * for a given disk offset, load (and allocate if needed)
- * the l2 table.
+ * the slice of the l2 table that covers it.
  *
- * the l2 table offset in the qcow2 file and the cluster index
- * in the l2 table are given to the caller.
+ * the l2 slice and the index of the cluster within that slice
+ * are given to the caller.
  *
  * Returns 0 on success, -errno in failure case
  */
@@ -645,15 +726,9 @@ static int get_cluster_table(BlockDriverState *bs, uint64_t offset,
 
     /* seek the l2 table of the given l2 offset */
 
-    if (s->l1_table[l1_index] & QCOW_OFLAG_COPIED) {
-        /* load the l2 table in memory */
-        ret = l2_load(bs, l2_offset, &l2_table);
-        if (ret < 0) {
-            return ret;
-        }
-    } else {
+    if (!(s->l1_table[l1_index] & QCOW_OFLAG_COPIED)) {
         /* First allocate a new L2 table (and do COW if needed) */
-        ret = l2_allocate(bs, l1_index, &l2_table);
+        ret = l2_allocate(bs, l1_index);
         if (ret < 0) {
             return ret;
         }
@@ -663,11 +738,21 @@ static int get_cluster_table(BlockDriverState *bs, uint64_t offset,
             qcow2_free_clusters(bs, l2_offset, s->l2_size * sizeof(uint64_t),
                                 QCOW2_DISCARD_OTHER);
         }
+
+        /* Get the offset of the newly-allocated l2 table */
+        l2_offset = s->l1_table[l1_index] & L1E_OFFSET_MASK;
+        assert(offset_into_cluster(s, l2_offset) == 0);
+    }
+
+    /* load the l2 slice in memory */
+    ret = l2_load(bs, offset, l2_offset, &l2_table);
+    if (ret < 0) {
+        return ret;
     }
 
     /* find the cluster offset for the given disk offset */
 
-    l2_index = (offset >> s->cluster_bits) & (s->l2_size - 1);
+    l2_index = offset_to_l2_slice_index(s, offset);
 
     *new_l2_table = l2_table;
     *new_l2_index = l2_index;
@@ -747,7 +832,8 @@ static int perform_cow(BlockDriverState *bs, QCowL2Meta *m, Qcow2COWRegion *r)
     qemu_co_mutex_unlock(&s->lock);
     ret = copy_sectors(bs, m->offset / BDRV_SECTOR_SIZE, m->alloc_offset,
                        r->offset / BDRV_SECTOR_SIZE,
-                       r->offset / BDRV_SECTOR_SIZE + r->nb_sectors);
+                       r->offset / BDRV_SECTOR_SIZE + r->nb_sectors,
+                       r->is_zero);
     qemu_co_mutex_lock(&s->lock);
 
     if (ret < 0) {
@@ -764,6 +850,184 @@ static int perform_cow(BlockDriverState *bs, QCowL2Meta *m, Qcow2COWRegion *r)
     return 0;
 }
 
+/*
+ * Returns true if the COW regions of m can be written together with the guest
+ * data, which starts at guest_offset and is bytes long, in a single request.
+ * This is the case if m is the only allocation of the request and both
+ * regions are directly adjacent to the guest data.
+ */
+bool qcow2_can_merge_cow(BlockDriverState *bs, QCowL2Meta *m,
+                         uint64_t guest_offset, uint64_t bytes)
+{
+    uint64_t data_start, data_end;
+
+    if (m == NULL || m->next != NULL || bs->encrypted) {
+        return false;
+    }
+
+    if (m->cow_start.nb_sectors == 0 && m->cow_end.nb_sectors == 0) {
+        return false;
+    }
+
+    /* The request may start in clusters that were already allocated */
+    if (guest_offset < m->offset) {
+        return false;
+    }
+
+    data_start = guest_offset - m->offset;
+    data_end = data_start + bytes;
+
+    return m->cow_start.offset +
+           m->cow_start.nb_sectors * BDRV_SECTOR_SIZE == data_start &&
+           m->cow_end.offset == data_end;
+}
+
+static int coroutine_fn read_cow_region(BlockDriverState *bs, QCowL2Meta *m,
+                                        Qcow2COWRegion *r, void *buf)
+{
+    QEMUIOVector qiov;
+    struct iovec iov = {
+        .iov_base   = buf,
+        .iov_len    = r->nb_sectors * BDRV_SECTOR_SIZE,
+    };
+
+    if (r->is_zero) {
+        memset(buf, 0, iov.iov_len);
+        return 0;
+    }
+
+    if (!bs->drv) {
+        return -ENOMEDIUM;
+    }
+
+    qemu_iovec_init_external(&qiov, &iov, 1);
+
+    /* Bypass the block layer like copy_sectors() does */
+    BLKDBG_EVENT(bs->file, BLKDBG_COW_READ);
+    return bs->drv->bdrv_co_readv(bs,
+                                  (m->offset + r->offset) >> BDRV_SECTOR_BITS,
+                                  r->nb_sectors, &qiov);
+}
+
+/*
+ * Writes the guest data in m->data_qiov and the COW regions around it into the
+ * newly allocated clusters of m with a single vectored request.
+ *
+ * Called with s->lock held; the lock is dropped during I/O.
+ */
+static int coroutine_fn perform_merged_cow(BlockDriverState *bs,
+                                           QCowL2Meta *m)
+{
+    BDRVQcow2State *s = bs->opaque;
+    QEMUIOVector *qiov = m->data_qiov;
+    Qcow2COWRegion *start = &m->cow_start;
+    Qcow2COWRegion *end = &m->cow_end;
+    size_t start_bytes = start->nb_sectors * BDRV_SECTOR_SIZE;
+    size_t end_bytes = end->nb_sectors * BDRV_SECTOR_SIZE;
+    uint8_t *start_buf = NULL, *end_buf = NULL;
+    QEMUIOVector hd_qiov;
+    int64_t offset;
+    int ret;
+
+    offset = m->alloc_offset + start->offset;
+    ret = qcow2_pre_write_overlap_check(bs, 0, offset,
+                                        start_bytes + qiov->size + end_bytes);
+    if (ret < 0) {
+        return ret;
+    }
+
+    qemu_iovec_init(&hd_qiov, qiov->niov + 2);
+    qemu_co_mutex_unlock(&s->lock);
+
+    if (start_bytes) {
+        start_buf = qemu_try_blockalign(bs, start_bytes);
+        if (start_buf == NULL) {
+            ret = -ENOMEM;
+            goto out;
+        }
+        ret = read_cow_region(bs, m, start, start_buf);
+        if (ret < 0) {
+            goto out;
+        }
+        qemu_iovec_add(&hd_qiov, start_buf, start_bytes);
+    }
+
+    qemu_iovec_concat(&hd_qiov, qiov, 0, qiov->size);
+
+    if (end_bytes) {
+        end_buf = qemu_try_blockalign(bs, end_bytes);
+        if (end_buf == NULL) {
+            ret = -ENOMEM;
+            goto out;
+        }
+        ret = read_cow_region(bs, m, end, end_buf);
+        if (ret < 0) {
+            goto out;
+        }
+        qemu_iovec_add(&hd_qiov, end_buf, end_bytes);
+    }
+
+    BLKDBG_EVENT(bs->file, BLKDBG_WRITE_AIO);
+    trace_qcow2_writev_data(qemu_coroutine_self(), offset >> BDRV_SECTOR_BITS);
+    ret = bdrv_co_writev(bs->file->bs, offset >> BDRV_SECTOR_BITS,
+                         hd_qiov.size >> BDRV_SECTOR_BITS, &hd_qiov);
+
+out:
+    qemu_co_mutex_lock(&s->lock);
+    qemu_iovec_destroy(&hd_qiov);
+    qemu_vfree(start_buf);
+    qemu_vfree(end_buf);
+
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* See perform_cow() */
+    qcow2_cache_depends_on_flush(s->l2_table_cache);
+
+    return 0;
+}
+
+/*
+ * If the clusters allocated for m extend the image file, preallocate the
+ * following s->prealloc_size bytes as well, so that sequential writes grow
+ * the file in large extents instead of cluster by cluster.
+ *
+ * Only clusters that are free are preallocated; they remain free and are
+ * picked up by later allocations. s->lock is held throughout so that none of
+ * them can be allocated (and written to) while they are being zeroed.
+ *
+ * This is best effort, errors are ignored.
+ */
+void coroutine_fn qcow2_prealloc_ahead(BlockDriverState *bs, QCowL2Meta *m)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int64_t file_length, start, end, offset;
+    uint64_t refcount;
+    int ret;
+
+    file_length = bdrv_getlength(bs->file->bs);
+    start = m->alloc_offset + ((int64_t)m->nb_clusters << s->cluster_bits);
+    if (file_length < 0 || start <= file_length) {
+        return;
+    }
+
+    end = start + s->prealloc_size;
+    for (offset = start; offset < end; offset += s->cluster_size) {
+        ret = qcow2_get_refcount(bs, offset >> s->cluster_bits, &refcount);
+        if (ret < 0 || refcount != 0) {
+            break;
+        }
+    }
+
+    if (offset > start) {
+        trace_qcow2_prealloc_ahead(qemu_coroutine_self(), start,
+                                   offset - start);
+        bdrv_co_write_zeroes(bs->file->bs, start >> BDRV_SECTOR_BITS,
+                             (offset - start) >> BDRV_SECTOR_BITS, 0);
+    }
+}
+
 int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
 {
     BDRVQcow2State *s = bs->opaque;
@@ -781,14 +1045,21 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
     }
 
     /* copy content of unmodified sectors */
-    ret = perform_cow(bs, m, &m->cow_start);
-    if (ret < 0) {
-        goto err;
-    }
+    if (m->data_qiov) {
+        ret = perform_merged_cow(bs, m);
+        if (ret < 0) {
+            goto err;
+        }
+    } else {
+        ret = perform_cow(bs, m, &m->cow_start);
+        if (ret < 0) {
+            goto err;
+        }
 
-    ret = perform_cow(bs, m, &m->cow_end);
-    if (ret < 0) {
-        goto err;
+        ret = perform_cow(bs, m, &m->cow_end);
+        if (ret < 0) {
+            goto err;
+        }
     }
 
     /* Update L2 table. */
@@ -806,7 +1077,7 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
     }
     qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache, l2_table);
 
-    assert(l2_index + m->nb_clusters <= s->l2_size);
+    assert(l2_index + m->nb_clusters <= s->l2_slice_size);
     for (i = 0; i < m->nb_clusters; i++) {
         /* if two concurrent writes happen to the same unallocated cluster
 	 * each write allocates separate cluster and writes data concurrently.
@@ -982,14 +1253,14 @@ static int handle_copied(BlockDriverState *bs, uint64_t guest_offset,
                                 == offset_into_cluster(s, *host_offset));
 
     /*
-     * Calculate the number of clusters to look for. We stop at L2 table
+     * Calculate the number of clusters to look for. We stop at L2 slice
      * boundaries to keep things simple.
      */
     nb_clusters =
         size_to_clusters(s, offset_into_cluster(s, guest_offset) + *bytes);
 
-    l2_index = offset_to_l2_index(s, guest_offset);
-    nb_clusters = MIN(nb_clusters, s->l2_size - l2_index);
+    l2_index = offset_to_l2_slice_index(s, guest_offset);
+    nb_clusters = MIN(nb_clusters, s->l2_slice_size - l2_index);
     assert(nb_clusters <= INT_MAX);
 
     /* Find L2 entry for the first involved cluster */
@@ -1100,6 +1371,22 @@ static int do_alloc_cluster_offset(BlockDriverState *bs, uint64_t guest_offset,
     }
 }
 
+/*
+ * Returns true if a cluster with the given L2 entry is known to read as
+ * zeroes, so that copy on write from it doesn't need to read anything.
+ */
+static bool cow_source_is_zero(BlockDriverState *bs, uint64_t l2_entry)
+{
+    switch (qcow2_get_cluster_type(l2_entry)) {
+    case QCOW2_CLUSTER_ZERO:
+        return true;
+    case QCOW2_CLUSTER_UNALLOCATED:
+        return !bs->backing;
+    default:
+        return false;
+    }
+}
+
 /*
  * Allocates new clusters for an area that either is yet unallocated or needs a
  * copy on write. If *host_offset is non-zero, clusters are only allocated if
@@ -1127,7 +1414,8 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
     int l2_index;
     uint64_t *l2_table;
     uint64_t entry;
-    uint64_t nb_clusters;
+    uint64_t nb_clusters, cow_clusters;
+    bool start_is_zero, end_is_zero;
     int ret;
 
     uint64_t alloc_cluster_offset;
@@ -1137,14 +1425,14 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
     assert(*bytes > 0);
 
     /*
-     * Calculate the number of clusters to look for. We stop at L2 table
+     * Calculate the number of clusters to look for. We stop at L2 slice
      * boundaries to keep things simple.
      */
     nb_clusters =
         size_to_clusters(s, offset_into_cluster(s, guest_offset) + *bytes);
 
-    l2_index = offset_to_l2_index(s, guest_offset);
-    nb_clusters = MIN(nb_clusters, s->l2_size - l2_index);
+    l2_index = offset_to_l2_slice_index(s, guest_offset);
+    nb_clusters = MIN(nb_clusters, s->l2_slice_size - l2_index);
     assert(nb_clusters <= INT_MAX);
 
     /* Find L2 entry for the first involved cluster */
@@ -1167,6 +1455,11 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
      * wrong with our code. */
     assert(nb_clusters > 0);
 
+    cow_clusters = nb_clusters;
+    start_is_zero = cow_source_is_zero(bs, entry);
+    end_is_zero = cow_source_is_zero(bs, be64_to_cpu(
+                      l2_table[l2_index + nb_clusters - 1]));
+
     qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
 
     /* Allocate, if necessary at a given offset in the image file */
@@ -1231,10 +1524,13 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
         .cow_start = {
             .offset     = 0,
             .nb_sectors = alloc_n_start,
+            .is_zero    = start_is_zero,
         },
         .cow_end = {
             .offset     = nb_sectors * BDRV_SECTOR_SIZE,
             .nb_sectors = avail_sectors - nb_sectors,
+            /* The allocation may have been shortened */
+            .is_zero    = end_is_zero && nb_clusters == cow_clusters,
         },
     };
     qemu_co_queue_init(&(*m)->dependent_requests);
@@ -1381,57 +1677,75 @@ again:
     return 0;
 }
 
-static int decompress_buffer(uint8_t *out_buf, int out_buf_size,
-                             const uint8_t *buf, int buf_size)
-{
-    z_stream strm1, *strm = &strm1;
-    int ret, out_len;
-
-    memset(strm, 0, sizeof(*strm));
-
-    strm->next_in = (uint8_t *)buf;
-    strm->avail_in = buf_size;
-    strm->next_out = out_buf;
-    strm->avail_out = out_buf_size;
-
-    ret = inflateInit2(strm, -12);
-    if (ret != Z_OK)
-        return -1;
-    ret = inflate(strm, Z_FINISH);
-    out_len = strm->next_out - out_buf;
-    if ((ret != Z_STREAM_END && ret != Z_BUF_ERROR) ||
-        out_len != out_buf_size) {
-        inflateEnd(strm);
-        return -1;
-    }
-    inflateEnd(strm);
-    return 0;
-}
-
-int qcow2_decompress_cluster(BlockDriverState *bs, uint64_t cluster_offset)
+/*
+ * Reads the compressed cluster described by the L2 entry cluster_offset,
+ * decompresses it and copies bytes bytes starting at offset_in_cluster into
+ * qiov. The decompressed cluster is kept in s->cluster_cache.
+ *
+ * Must be called with s->lock held. The lock is dropped while the cluster is
+ * read and decompressed (in a worker thread), using private buffers, so that
+ * several compressed clusters can be processed in parallel.
+ */
+int coroutine_fn qcow2_decompress_cluster(BlockDriverState *bs,
+                                          uint64_t cluster_offset,
+                                          int offset_in_cluster,
+                                          QEMUIOVector *qiov, size_t bytes)
 {
     BDRVQcow2State *s = bs->opaque;
     int ret, csize, nb_csectors, sector_offset;
-    uint64_t coffset;
+    uint64_t coffset, cache_gen;
+    uint8_t *buf, *out_buf;
 
     coffset = cluster_offset & s->cluster_offset_mask;
-    if (s->cluster_cache_offset != coffset) {
-        nb_csectors = ((cluster_offset >> s->csize_shift) & s->csize_mask) + 1;
-        sector_offset = coffset & 511;
-        csize = nb_csectors * 512 - sector_offset;
-        BLKDBG_EVENT(bs->file, BLKDBG_READ_COMPRESSED);
-        ret = bdrv_read(bs->file->bs, coffset >> 9, s->cluster_data,
-                        nb_csectors);
-        if (ret < 0) {
-            return ret;
-        }
-        if (decompress_buffer(s->cluster_cache, s->cluster_size,
-                              s->cluster_data + sector_offset, csize) < 0) {
-            return -EIO;
-        }
+    if (s->cluster_cache_offset == coffset) {
+        qemu_iovec_from_buf(qiov, 0, s->cluster_cache + offset_in_cluster,
+                            bytes);
+        return 0;
+    }
+
+    nb_csectors = ((cluster_offset >> s->csize_shift) & s->csize_mask) + 1;
+    sector_offset = coffset & 511;
+    csize = nb_csectors * 512 - sector_offset;
+
+    buf = qemu_try_blockalign(bs->file->bs, nb_csectors * 512);
+    out_buf = g_try_malloc(s->cluster_size);
+    if (buf == NULL || out_buf == NULL) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    cache_gen = s->cluster_cache_gen;
+    qemu_co_mutex_unlock(&s->lock);
+
+    BLKDBG_EVENT(bs->file, BLKDBG_READ_COMPRESSED);
+    ret = bdrv_read(bs->file->bs, coffset >> 9, buf, nb_csectors);
+    if (ret >= 0) {
+        ret = qcow2_co_decompress(bs, out_buf, s->cluster_size,
+                                  buf + sector_offset, csize);
+    }
+
+    qemu_co_mutex_lock(&s->lock);
+
+    if (ret < 0) {
+        goto out;
+    }
+
+    qemu_iovec_from_buf(qiov, 0, out_buf + offset_in_cluster, bytes);
+
+    /* A write while the lock was dropped may have put new data at coffset,
+     * so only publish the result if there was none */
+    if (s->cluster_cache_gen == cache_gen) {
+        g_free(s->cluster_cache);
+        s->cluster_cache = out_buf;
         s->cluster_cache_offset = coffset;
+        out_buf = NULL;
     }
-    return 0;
+    ret = 0;
+
+out:
+    qemu_vfree(buf);
+    g_free(out_buf);
+    return ret;
 }
 
 /*
@@ -1454,8 +1768,8 @@ static int discard_single_l2(BlockDriverState *bs, uint64_t offset,
         return ret;
     }
 
-    /* Limit nb_clusters to one L2 table */
-    nb_clusters = MIN(nb_clusters, s->l2_size - l2_index);
+    /* Limit nb_clusters to one L2 slice */
+    nb_clusters = MIN(nb_clusters, s->l2_slice_size - l2_index);
     assert(nb_clusters <= INT_MAX);
 
     for (i = 0; i < nb_clusters; i++) {
@@ -1574,8 +1888,8 @@ static int zero_single_l2(BlockDriverState *bs, uint64_t offset,
         return ret;
     }
 
-    /* Limit nb_clusters to one L2 table */
-    nb_clusters = MIN(nb_clusters, s->l2_size - l2_index);
+    /* Limit nb_clusters to one L2 slice */
+    nb_clusters = MIN(nb_clusters, s->l2_slice_size - l2_index);
     assert(nb_clusters <= INT_MAX);
 
     for (i = 0; i < nb_clusters; i++) {
@@ -1649,13 +1963,15 @@ static int expand_zero_clusters_in_l1(BlockDriverState *bs, uint64_t *l1_table,
     BDRVQcow2State *s = bs->opaque;
     bool is_active_l1 = (l1_table == s->l1_table);
     uint64_t *l2_table = NULL;
+    int n_slices = s->l2_size / s->l2_slice_size;
+    int slice_size2 = s->l2_slice_size * sizeof(uint64_t);
     int ret;
-    int i, j;
+    int i, j, slice;
 
     if (!is_active_l1) {
         /* inactive L2 tables require a buffer to be stored in when loading
          * them from disk */
-        l2_table = qemu_try_blockalign(bs->file->bs, s->cluster_size);
+        l2_table = qemu_try_blockalign(bs->file->bs, slice_size2);
         if (l2_table == NULL) {
             return -ENOMEM;
         }
@@ -1663,7 +1979,6 @@ static int expand_zero_clusters_in_l1(BlockDriverState *bs, uint64_t *l1_table,
 
     for (i = 0; i < l1_size; i++) {
         uint64_t l2_offset = l1_table[i] & L1E_OFFSET_MASK;
-        bool l2_dirty = false;
         uint64_t l2_refcount;
 
         if (!l2_offset) {
@@ -1683,124 +1998,137 @@ static int expand_zero_clusters_in_l1(BlockDriverState *bs, uint64_t *l1_table,
             goto fail;
         }
 
-        if (is_active_l1) {
-            /* get active L2 tables from cache */
-            ret = qcow2_cache_get(bs, s->l2_table_cache, l2_offset,
-                    (void **)&l2_table);
-        } else {
-            /* load inactive L2 tables from disk */
-            ret = bdrv_read(bs->file->bs, l2_offset / BDRV_SECTOR_SIZE,
-                            (void *)l2_table, s->cluster_sectors);
-        }
-        if (ret < 0) {
-            goto fail;
-        }
-
         ret = qcow2_get_refcount(bs, l2_offset >> s->cluster_bits,
                                  &l2_refcount);
         if (ret < 0) {
             goto fail;
         }
 
-        for (j = 0; j < s->l2_size; j++) {
-            uint64_t l2_entry = be64_to_cpu(l2_table[j]);
-            int64_t offset = l2_entry & L2E_OFFSET_MASK;
-            int cluster_type = qcow2_get_cluster_type(l2_entry);
-            bool preallocated = offset != 0;
+        for (slice = 0; slice < n_slices; slice++) {
+            bool l2_dirty = false;
 
-            if (cluster_type != QCOW2_CLUSTER_ZERO) {
-                continue;
+            if (is_active_l1) {
+                /* get active L2 tables from cache */
+                ret = qcow2_cache_get(bs, s->l2_table_cache,
+                                      l2_offset + slice * slice_size2,
+                                      (void **)&l2_table);
+            } else {
+                /* load inactive L2 tables from disk */
+                ret = bdrv_read(bs->file->bs,
+                                (l2_offset + slice * slice_size2)
+                                / BDRV_SECTOR_SIZE,
+                                (void *)l2_table,
+                                slice_size2 / BDRV_SECTOR_SIZE);
+            }
+            if (ret < 0) {
+                goto fail;
             }
 
-            if (!preallocated) {
-                if (!bs->backing) {
-                    /* not backed; therefore we can simply deallocate the
-                     * cluster */
-                    l2_table[j] = 0;
-                    l2_dirty = true;
+            for (j = 0; j < s->l2_slice_size; j++) {
+                uint64_t l2_entry = be64_to_cpu(l2_table[j]);
+                int64_t offset = l2_entry & L2E_OFFSET_MASK;
+                int cluster_type = qcow2_get_cluster_type(l2_entry);
+                bool preallocated = offset != 0;
+
+                if (cluster_type != QCOW2_CLUSTER_ZERO) {
                     continue;
                 }
 
-                offset = qcow2_alloc_clusters(bs, s->cluster_size);
-                if (offset < 0) {
-                    ret = offset;
-                    goto fail;
-                }
+                if (!preallocated) {
+                    if (!bs->backing) {
+                        /* not backed; therefore we can simply deallocate the
+                         * cluster */
+                        l2_table[j] = 0;
+                        l2_dirty = true;
+                        continue;
+                    }
 
-                if (l2_refcount > 1) {
-                    /* For shared L2 tables, set the refcount accordingly (it is
-                     * already 1 and needs to be l2_refcount) */
-                    ret = qcow2_update_cluster_refcount(bs,
-                            offset >> s->cluster_bits,
-                            refcount_diff(1, l2_refcount), false,
-                            QCOW2_DISCARD_OTHER);
-                    if (ret < 0) {
-                        qcow2_free_clusters(bs, offset, s->cluster_size,
-                                            QCOW2_DISCARD_OTHER);
+                    offset = qcow2_alloc_clusters(bs, s->cluster_size);
+                    if (offset < 0) {
+                        ret = offset;
                         goto fail;
                     }
+
+                    if (l2_refcount > 1) {
+                        /* For shared L2 tables, set the refcount accordingly
+                         * (it is already 1 and needs to be l2_refcount) */
+                        ret = qcow2_update_cluster_refcount(bs,
+                                offset >> s->cluster_bits,
+                                refcount_diff(1, l2_refcount), false,
+                                QCOW2_DISCARD_OTHER);
+                        if (ret < 0) {
+                            qcow2_free_clusters(bs, offset, s->cluster_size,
+                                                QCOW2_DISCARD_OTHER);
+                            goto fail;
+                        }
+                    }
                 }
-            }
 
-            if (offset_into_cluster(s, offset)) {
-                qcow2_signal_corruption(bs, true, -1, -1, "Data cluster offset "
-                                        "%#" PRIx64 " unaligned (L2 offset: %#"
-                                        PRIx64 ", L2 index: %#x)", offset,
-                                        l2_offset, j);
-                if (!preallocated) {
-                    qcow2_free_clusters(bs, offset, s->cluster_size,
-                                        QCOW2_DISCARD_ALWAYS);
+                if (offset_into_cluster(s, offset)) {
+                    qcow2_signal_corruption(bs, true, -1, -1,
+                            "Data cluster offset %#" PRIx64 " unaligned "
+                            "(L2 offset: %#" PRIx64 ", L2 index: %#x)",
+                            offset, l2_offset, slice * s->l2_slice_size + j);
+                    if (!preallocated) {
+                        qcow2_free_clusters(bs, offset, s->cluster_size,
+                                            QCOW2_DISCARD_ALWAYS);
+                    }
+                    ret = -EIO;
+                    goto fail;
                 }
-                ret = -EIO;
-                goto fail;
-            }
 
-            ret = qcow2_pre_write_overlap_check(bs, 0, offset, s->cluster_size);
-            if (ret < 0) {
-                if (!preallocated) {
-                    qcow2_free_clusters(bs, offset, s->cluster_size,
-                                        QCOW2_DISCARD_ALWAYS);
+                ret = qcow2_pre_write_overlap_check(bs, 0, offset,
+                                                    s->cluster_size);
+                if (ret < 0) {
+                    if (!preallocated) {
+                        qcow2_free_clusters(bs, offset, s->cluster_size,
+                                            QCOW2_DISCARD_ALWAYS);
+                    }
+                    goto fail;
                 }
-                goto fail;
-            }
 
-            ret = bdrv_write_zeroes(bs->file->bs, offset / BDRV_SECTOR_SIZE,
-                                    s->cluster_sectors, 0);
-            if (ret < 0) {
-                if (!preallocated) {
-                    qcow2_free_clusters(bs, offset, s->cluster_size,
-                                        QCOW2_DISCARD_ALWAYS);
+                ret = bdrv_write_zeroes(bs->file->bs, offset / BDRV_SECTOR_SIZE,
+                                        s->cluster_sectors, 0);
+                if (ret < 0) {
+                    if (!preallocated) {
+                        qcow2_free_clusters(bs, offset, s->cluster_size,
+                                            QCOW2_DISCARD_ALWAYS);
+                    }
+                    goto fail;
                 }
-                goto fail;
-            }
 
-            if (l2_refcount == 1) {
-                l2_table[j] = cpu_to_be64(offset | QCOW_OFLAG_COPIED);
-            } else {
-                l2_table[j] = cpu_to_be64(offset);
+                if (l2_refcount == 1) {
+                    l2_table[j] = cpu_to_be64(offset | QCOW_OFLAG_COPIED);
+                } else {
+                    l2_table[j] = cpu_to_be64(offset);
+                }
+                l2_dirty = true;
             }
-            l2_dirty = true;
-        }
 
-        if (is_active_l1) {
-            if (l2_dirty) {
-                qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache, l2_table);
-                qcow2_cache_depends_on_flush(s->l2_table_cache);
-            }
-            qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
-        } else {
-            if (l2_dirty) {
-                ret = qcow2_pre_write_overlap_check(bs,
-                        QCOW2_OL_INACTIVE_L2 | QCOW2_OL_ACTIVE_L2, l2_offset,
-                        s->cluster_size);
-                if (ret < 0) {
-                    goto fail;
+            if (is_active_l1) {
+                if (l2_dirty) {
+                    qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache,
+                                                 l2_table);
+                    qcow2_cache_depends_on_flush(s->l2_table_cache);
                 }
+                qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
+            } else {
+                if (l2_dirty) {
+                    ret = qcow2_pre_write_overlap_check(bs,
+                            QCOW2_OL_INACTIVE_L2 | QCOW2_OL_ACTIVE_L2,
+                            l2_offset + slice * slice_size2, slice_size2);
+                    if (ret < 0) {
+                        goto fail;
+                    }
 
-                ret = bdrv_write(bs->file->bs, l2_offset / BDRV_SECTOR_SIZE,
-                                 (void *)l2_table, s->cluster_sectors);
-                if (ret < 0) {
-                    goto fail;
+                    ret = bdrv_write(bs->file->bs,
+                                     (l2_offset + slice * slice_size2)
+                                     / BDRV_SECTOR_SIZE,
+                                     (void *)l2_table,
+                                     slice_size2 / BDRV_SECTOR_SIZE);
+                    if (ret < 0) {
+                        goto fail;
+                    }
                 }
             }
         }
@@ -1861,6 +2189,7 @@ int qcow2_expand_zero_clusters(BlockDriverState *bs,
      * necessary to empty the L2 table cache, since it may contain tables which
      * are now going to be modified directly on disk, bypassing the cache.
      * qcow2_cache_empty() does both for us. */
+    qcow2_warmup_stop(bs);
     ret = qcow2_cache_empty(bs, s->l2_table_cache);
     if (ret < 0) {
         goto fail;
@@ -0,0 +1,381 @@
+/*
+ * Free cluster index for the QCOW2 format
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/*
+ * When the free-extent-index option is set, cluster allocation doesn't scan
+ * the refcount blocks linearly from free_cluster_index, but looks up a run of
+ * free clusters in an in-memory index of free extents.
+ *
+ * The index covers the clusters below scan_end.  It is built lazily, one
+ * refcount block at a time, whenever no extent in it is large enough for an
+ * allocation; after that it is kept up to date by update_refcount() on every
+ * transition of a refcount from or to zero.  Refcount changes above scan_end
+ * are ignored, they are picked up when the refcount block is scanned.
+ *
+ * Extents are kept in a balanced tree sorted by their start, which is used to
+ * find the extent containing a given cluster and the neighbours to merge
+ * with, and in a list per size class (the log2 of their length), which is used
+ * to find a run of a given size.  Both lookups are logarithmic.
+ *
+ * Unlike the linear scan, allocations prefer the smallest extent that fits
+ * over the one at the lowest offset, so that holes left by discards are
+ * filled up and large runs are kept for large writes.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "qemu/host-utils.h"
+#include "qemu/queue.h"
+#include "block/block_int.h"
+#include "block/qcow2.h"
+#include "trace.h"
+
+/* Extents are classified by the log2 of their length */
+#define FREE_INDEX_CLASSES 64
+
+/* Number of extents in the smallest possible class that are checked before
+ * the search moves on to the larger classes, whose extents all fit */
+#define FREE_INDEX_MAX_PROBES 8
+
+typedef struct Qcow2FreeExtent {
+    int64_t start;
+    int64_t length;
+    int size_class;
+    QTAILQ_ENTRY(Qcow2FreeExtent) next;
+} Qcow2FreeExtent;
+
+struct Qcow2FreeIndex {
+    /* All extents, sorted by start; the extents are the keys */
+    GTree *extents;
+    QTAILQ_HEAD(, Qcow2FreeExtent) classes[FREE_INDEX_CLASSES];
+
+    /* Clusters below this index have been scanned into the index */
+    int64_t scan_end;
+};
+
+static int size_class(int64_t length)
+{
+    assert(length > 0);
+    return 63 - clz64(length);
+}
+
+static gint extent_cmp(gconstpointer a, gconstpointer b, gpointer opaque)
+{
+    const Qcow2FreeExtent *ea = a, *eb = b;
+
+    return ea->start < eb->start ? -1 : ea->start > eb->start;
+}
+
+static gint extent_search(gconstpointer key, gconstpointer user_data)
+{
+    const Qcow2FreeExtent *e = key;
+    int64_t cluster_index = *(const int64_t *)user_data;
+
+    if (cluster_index < e->start) {
+        return -1;
+    } else if (cluster_index >= e->start + e->length) {
+        return 1;
+    }
+    return 0;
+}
+
+/* Returns the extent that contains @cluster_index, or NULL */
+static Qcow2FreeExtent *extent_lookup(Qcow2FreeIndex *fi,
+                                      int64_t cluster_index)
+{
+    if (cluster_index < 0) {
+        return NULL;
+    }
+    return g_tree_search(fi->extents, extent_search, &cluster_index);
+}
+
+static void extent_insert(Qcow2FreeIndex *fi, int64_t start, int64_t length)
+{
+    Qcow2FreeExtent *e = g_new(Qcow2FreeExtent, 1);
+
+    *e = (Qcow2FreeExtent) {
+        .start      = start,
+        .length     = length,
+        .size_class = size_class(length),
+    };
+    g_tree_insert(fi->extents, e, e);
+    QTAILQ_INSERT_TAIL(&fi->classes[e->size_class], e, next);
+}
+
+static void extent_remove(Qcow2FreeIndex *fi, Qcow2FreeExtent *e)
+{
+    QTAILQ_REMOVE(&fi->classes[e->size_class], e, next);
+    g_tree_remove(fi->extents, e);
+    g_free(e);
+}
+
+/*
+ * Changes the range of an extent in place.  This is fine for the tree as long
+ * as the new range only overlaps the old one and free space next to it, so
+ * that the order of the extents stays the same.
+ */
+static void extent_resize(Qcow2FreeIndex *fi, Qcow2FreeExtent *e,
+                          int64_t start, int64_t length)
+{
+    int new_class = size_class(length);
+
+    e->start = start;
+    e->length = length;
+    if (new_class != e->size_class) {
+        QTAILQ_REMOVE(&fi->classes[e->size_class], e, next);
+        e->size_class = new_class;
+        QTAILQ_INSERT_TAIL(&fi->classes[e->size_class], e, next);
+    }
+}
+
+/* Adds a free range that is not in the index yet, merging with neighbours */
+static void free_index_add(Qcow2FreeIndex *fi, int64_t start, int64_t length)
+{
+    Qcow2FreeExtent *prev = extent_lookup(fi, start - 1);
+    Qcow2FreeExtent *next = extent_lookup(fi, start + length);
+
+    if (prev && next) {
+        int64_t end = next->start + next->length;
+        extent_remove(fi, next);
+        extent_resize(fi, prev, prev->start, end - prev->start);
+    } else if (prev) {
+        extent_resize(fi, prev, prev->start, prev->length + length);
+    } else if (next) {
+        extent_resize(fi, next, start, next->length + length);
+    } else {
+        extent_insert(fi, start, length);
+    }
+}
+
+static gboolean extent_free(gpointer key, gpointer value, gpointer opaque)
+{
+    g_free(key);
+    return FALSE;
+}
+
+static void free_index_clear(Qcow2FreeIndex *fi)
+{
+    int i;
+
+    g_tree_foreach(fi->extents, extent_free, NULL);
+    g_tree_destroy(fi->extents);
+    fi->extents = g_tree_new_full(extent_cmp, NULL, NULL, NULL);
+
+    for (i = 0; i < FREE_INDEX_CLASSES; i++) {
+        QTAILQ_INIT(&fi->classes[i]);
+    }
+    fi->scan_end = 0;
+}
+
+/* Enables the index.  It starts out empty and is filled on demand. */
+void qcow2_free_index_init(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (s->free_index) {
+        return;
+    }
+
+    s->free_index = g_new0(Qcow2FreeIndex, 1);
+    s->free_index->extents = g_tree_new_full(extent_cmp, NULL, NULL, NULL);
+    free_index_clear(s->free_index);
+}
+
+void qcow2_free_index_destroy(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2FreeIndex *fi = s->free_index;
+
+    if (!fi) {
+        return;
+    }
+
+    g_tree_foreach(fi->extents, extent_free, NULL);
+    g_tree_destroy(fi->extents);
+    g_free(fi);
+    s->free_index = NULL;
+}
+
+/*
+ * Drops everything that is known about free clusters.  Must be called when
+ * the refcount structures are changed without going through update_refcount().
+ */
+void qcow2_free_index_reset(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (s->free_index) {
+        free_index_clear(s->free_index);
+    }
+}
+
+/* Called when the refcount of @cluster_index has dropped to zero */
+void qcow2_free_index_mark_free(BlockDriverState *bs, int64_t cluster_index)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2FreeIndex *fi = s->free_index;
+
+    if (!fi || cluster_index >= fi->scan_end ||
+        extent_lookup(fi, cluster_index)) {
+        return;
+    }
+
+    free_index_add(fi, cluster_index, 1);
+}
+
+/* Called when the refcount of @cluster_index has become non-zero */
+void qcow2_free_index_mark_used(BlockDriverState *bs, int64_t cluster_index)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2FreeIndex *fi = s->free_index;
+    Qcow2FreeExtent *e;
+    int64_t end;
+
+    if (!fi || cluster_index >= fi->scan_end) {
+        return;
+    }
+
+    e = extent_lookup(fi, cluster_index);
+    if (!e) {
+        return;
+    }
+
+    end = e->start + e->length;
+    if (e->length == 1) {
+        extent_remove(fi, e);
+    } else if (cluster_index == e->start) {
+        /* The common case, allocations are taken from the start */
+        extent_resize(fi, e, e->start + 1, e->length - 1);
+    } else if (cluster_index == end - 1) {
+        extent_resize(fi, e, e->start, e->length - 1);
+    } else {
+        extent_resize(fi, e, e->start, cluster_index - e->start);
+        extent_insert(fi, cluster_index + 1, end - cluster_index - 1);
+    }
+}
+
+/* Returns an extent of at least @nb_clusters clusters, or NULL */
+static Qcow2FreeExtent *free_index_best_fit(Qcow2FreeIndex *fi,
+                                            int64_t nb_clusters)
+{
+    int c = size_class(nb_clusters);
+    Qcow2FreeExtent *e;
+    int probes = 0;
+
+    QTAILQ_FOREACH(e, &fi->classes[c], next) {
+        if (e->length >= nb_clusters) {
+            return e;
+        }
+        if (++probes >= FREE_INDEX_MAX_PROBES) {
+            break;
+        }
+    }
+
+    for (c++; c < FREE_INDEX_CLASSES; c++) {
+        e = QTAILQ_FIRST(&fi->classes[c]);
+        if (e) {
+            return e;
+        }
+    }
+
+    return NULL;
+}
+
+/* Adds the free clusters described by the next refcount block to the index */
+static int free_index_scan_block(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2FreeIndex *fi = s->free_index;
+    uint64_t refcount_table_index = fi->scan_end >> s->refcount_block_bits;
+    uint64_t refcount_block_offset;
+    void *refcount_block;
+    int64_t i, run_start = -1;
+    int ret;
+
+    assert(refcount_table_index < s->refcount_table_size);
+    refcount_block_offset =
+        s->refcount_table[refcount_table_index] & REFT_OFFSET_MASK;
+
+    if (!refcount_block_offset) {
+        free_index_add(fi, fi->scan_end, s->refcount_block_size);
+        goto done;
+    }
+
+    if (offset_into_cluster(s, refcount_block_offset)) {
+        qcow2_signal_corruption(bs, true, -1, -1, "Refblock offset %#" PRIx64
+                                " unaligned (reftable index: %#" PRIx64 ")",
+                                refcount_block_offset, refcount_table_index);
+        return -EIO;
+    }
+
+    ret = qcow2_cache_get(bs, s->refcount_block_cache, refcount_block_offset,
+                          &refcount_block);
+    if (ret < 0) {
+        return ret;
+    }
+
+    for (i = 0; i < s->refcount_block_size; i++) {
+        if (s->get_refcount(refcount_block, i) == 0) {
+            if (run_start < 0) {
+                run_start = i;
+            }
+        } else if (run_start >= 0) {
+            free_index_add(fi, fi->scan_end + run_start, i - run_start);
+            run_start = -1;
+        }
+    }
+    if (run_start >= 0) {
+        free_index_add(fi, fi->scan_end + run_start, i - run_start);
+    }
+
+    qcow2_cache_put(bs, s->refcount_block_cache, &refcount_block);
+
+done:
+    fi->scan_end += s->refcount_block_size;
+    trace_qcow2_free_index_scan(bs, refcount_table_index,
+                                g_tree_nnodes(fi->extents));
+    return 0;
+}
+
+/*
+ * Finds @nb_clusters contiguous free clusters, scanning more refcount blocks
+ * into the index as needed.  The clusters are not marked as used, this only
+ * happens when their refcount is increased.
+ *
+ * Returns the index of the first cluster on success, -errno on error.
+ */
+int64_t qcow2_free_index_find(BlockDriverState *bs, int64_t nb_clusters)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2FreeIndex *fi = s->free_index;
+    Qcow2FreeExtent *e;
+    int ret;
+
+    assert(fi && nb_clusters > 0);
+
+    for (;;) {
+        e = free_index_best_fit(fi, nb_clusters);
+        if (e) {
+            return e->start;
+        }
+
+        if (fi->scan_end >= ((int64_t)s->refcount_table_size
+                             << s->refcount_block_bits)) {
+            break;
+        }
+
+        ret = free_index_scan_block(bs);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    /* Everything that has refcounts is scanned and too fragmented; append to
+     * the image, starting with the free clusters at its end */
+    e = extent_lookup(fi, fi->scan_end - 1);
+    return e ? e->start : fi->scan_end;
+}
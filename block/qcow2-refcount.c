@@ -27,6 +27,7 @@
 #include "qemu-common.h"
 #include "block/block_int.h"
 #include "block/qcow2.h"
+#include "block/thread-pool.h"
 #include "qemu/range.h"
 
 static int64_t alloc_clusters_noref(BlockDriverState *bs, uint64_t size);
@@ -120,6 +121,7 @@ void qcow2_refcount_close(BlockDriverState *bs)
 {
     BDRVQcow2State *s = bs->opaque;
     g_free(s->refcount_table);
+    qcow2_free_index_destroy(bs);
 }
 
 
@@ -396,6 +398,7 @@ static int alloc_refcount_block(BlockDriverState *bs,
         int block_index = (new_block >> s->cluster_bits) &
             (s->refcount_block_size - 1);
         s->set_refcount(*refcount_block, block_index, 1);
+        qcow2_free_index_mark_used(bs, new_block >> s->cluster_bits);
     } else {
         /* Described somewhere else. This can recurse at most twice before we
          * arrive at a block that describes itself. */
@@ -756,6 +759,12 @@ static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
         }
         s->set_refcount(refcount_block, block_index, refcount);
 
+        if (refcount == 0) {
+            qcow2_free_index_mark_free(bs, cluster_index);
+        } else if (!decrease && refcount == addend) {
+            qcow2_free_index_mark_used(bs, cluster_index);
+        }
+
         if (refcount == 0 && s->discard_passthrough[type]) {
             update_refcount_discard(bs, cluster_offset, s->cluster_size);
         }
@@ -831,6 +840,18 @@ static int64_t alloc_clusters_noref(BlockDriverState *bs, uint64_t size)
     }
 
     nb_clusters = size_to_clusters(s, size);
+
+    if (s->free_index) {
+        int64_t cluster_index = qcow2_free_index_find(bs, nb_clusters);
+        if (cluster_index < 0) {
+            return cluster_index;
+        }
+        if (cluster_index + nb_clusters - 1 > (INT64_MAX >> s->cluster_bits)) {
+            return -EFBIG;
+        }
+        return cluster_index << s->cluster_bits;
+    }
+
 retry:
     for(i = 0; i < nb_clusters; i++) {
         uint64_t next_cluster_index = s->free_cluster_index++;
@@ -1052,7 +1073,9 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
     uint64_t *l1_table, *l2_table, l2_offset, offset, l1_size2, refcount;
     bool l1_allocated = false;
     int64_t old_offset, old_l2_offset;
-    int i, j, l1_modified = 0, nb_csectors;
+    int i, j, slice, l1_modified = 0, nb_csectors;
+    int n_slices = s->l2_size / s->l2_slice_size;
+    int slice_size2 = s->l2_slice_size * sizeof(uint64_t);
     int ret;
 
     assert(addend >= -1 && addend <= 1);
@@ -1101,93 +1124,98 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
                 goto fail;
             }
 
-            ret = qcow2_cache_get(bs, s->l2_table_cache, l2_offset,
-                (void**) &l2_table);
-            if (ret < 0) {
-                goto fail;
-            }
+            for (slice = 0; slice < n_slices; slice++) {
+                ret = qcow2_cache_get(bs, s->l2_table_cache,
+                    l2_offset + slice * slice_size2, (void**) &l2_table);
+                if (ret < 0) {
+                    goto fail;
+                }
 
-            for(j = 0; j < s->l2_size; j++) {
-                uint64_t cluster_index;
-
-                offset = be64_to_cpu(l2_table[j]);
-                old_offset = offset;
-                offset &= ~QCOW_OFLAG_COPIED;
-
-                switch (qcow2_get_cluster_type(offset)) {
-                    case QCOW2_CLUSTER_COMPRESSED:
-                        nb_csectors = ((offset >> s->csize_shift) &
-                                       s->csize_mask) + 1;
-                        if (addend != 0) {
-                            ret = update_refcount(bs,
-                                (offset & s->cluster_offset_mask) & ~511,
-                                nb_csectors * 512, abs(addend), addend < 0,
-                                QCOW2_DISCARD_SNAPSHOT);
-                            if (ret < 0) {
+                for (j = 0; j < s->l2_slice_size; j++) {
+                    uint64_t cluster_index;
+
+                    offset = be64_to_cpu(l2_table[j]);
+                    old_offset = offset;
+                    offset &= ~QCOW_OFLAG_COPIED;
+
+                    switch (qcow2_get_cluster_type(offset)) {
+                        case QCOW2_CLUSTER_COMPRESSED:
+                            nb_csectors = ((offset >> s->csize_shift) &
+                                           s->csize_mask) + 1;
+                            if (addend != 0) {
+                                ret = update_refcount(bs,
+                                    (offset & s->cluster_offset_mask) & ~511,
+                                    nb_csectors * 512, abs(addend), addend < 0,
+                                    QCOW2_DISCARD_SNAPSHOT);
+                                if (ret < 0) {
+                                    goto fail;
+                                }
+                            }
+                            /* compressed clusters are never modified */
+                            refcount = 2;
+                            break;
+
+                        case QCOW2_CLUSTER_NORMAL:
+                        case QCOW2_CLUSTER_ZERO:
+                            if (offset_into_cluster(s,
+                                                    offset & L2E_OFFSET_MASK)) {
+                                qcow2_signal_corruption(bs, true, -1, -1,
+                                        "Data cluster offset %#llx unaligned "
+                                        "(L2 offset: %#" PRIx64
+                                        ", L2 index: %#x)",
+                                        offset & L2E_OFFSET_MASK, l2_offset,
+                                        slice * s->l2_slice_size + j);
+                                ret = -EIO;
                                 goto fail;
                             }
-                        }
-                        /* compressed clusters are never modified */
-                        refcount = 2;
-                        break;
-
-                    case QCOW2_CLUSTER_NORMAL:
-                    case QCOW2_CLUSTER_ZERO:
-                        if (offset_into_cluster(s, offset & L2E_OFFSET_MASK)) {
-                            qcow2_signal_corruption(bs, true, -1, -1, "Data "
-                                                    "cluster offset %#llx "
-                                                    "unaligned (L2 offset: %#"
-                                                    PRIx64 ", L2 index: %#x)",
-                                                    offset & L2E_OFFSET_MASK,
-                                                    l2_offset, j);
-                            ret = -EIO;
-                            goto fail;
-                        }
 
-                        cluster_index = (offset & L2E_OFFSET_MASK) >> s->cluster_bits;
-                        if (!cluster_index) {
-                            /* unallocated */
-                            refcount = 0;
-                            break;
-                        }
-                        if (addend != 0) {
-                            ret = qcow2_update_cluster_refcount(bs,
-                                    cluster_index, abs(addend), addend < 0,
-                                    QCOW2_DISCARD_SNAPSHOT);
+                            cluster_index = (offset & L2E_OFFSET_MASK)
+                                            >> s->cluster_bits;
+                            if (!cluster_index) {
+                                /* unallocated */
+                                refcount = 0;
+                                break;
+                            }
+                            if (addend != 0) {
+                                ret = qcow2_update_cluster_refcount(bs,
+                                        cluster_index, abs(addend), addend < 0,
+                                        QCOW2_DISCARD_SNAPSHOT);
+                                if (ret < 0) {
+                                    goto fail;
+                                }
+                            }
+
+                            ret = qcow2_get_refcount(bs, cluster_index,
+                                                     &refcount);
                             if (ret < 0) {
                                 goto fail;
                             }
-                        }
-
-                        ret = qcow2_get_refcount(bs, cluster_index, &refcount);
-                        if (ret < 0) {
-                            goto fail;
-                        }
-                        break;
+                            break;
 
-                    case QCOW2_CLUSTER_UNALLOCATED:
-                        refcount = 0;
-                        break;
+                        case QCOW2_CLUSTER_UNALLOCATED:
+                            refcount = 0;
+                            break;
 
-                    default:
-                        abort();
-                }
+                        default:
+                            abort();
+                    }
 
-                if (refcount == 1) {
-                    offset |= QCOW_OFLAG_COPIED;
-                }
-                if (offset != old_offset) {
-                    if (addend > 0) {
-                        qcow2_cache_set_dependency(bs, s->l2_table_cache,
-                            s->refcount_block_cache);
+                    if (refcount == 1) {
+                        offset |= QCOW_OFLAG_COPIED;
+                    }
+                    if (offset != old_offset) {
+                        if (addend > 0) {
+                            qcow2_cache_set_dependency(bs, s->l2_table_cache,
+                                s->refcount_block_cache);
+                        }
+                        l2_table[j] = cpu_to_be64(offset);
+                        qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache,
+                                                     l2_table);
                     }
-                    l2_table[j] = cpu_to_be64(offset);
-                    qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache,
-                                                 l2_table);
                 }
-            }
 
-            qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
+                qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
+            }
 
             if (addend != 0) {
                 ret = qcow2_update_cluster_refcount(bs, l2_offset >>
@@ -1308,6 +1336,15 @@ static int realloc_refcount_array(BDRVQcow2State *s, void **array,
     return 0;
 }
 
+static void report_refcount_overflow(uint64_t cluster_offset)
+{
+    fprintf(stderr, "ERROR: overflow cluster offset=0x%" PRIx64
+            "\n", cluster_offset);
+    fprintf(stderr, "Use qemu-img amend to increase the refcount entry "
+            "width or qemu-img convert to create a clean copy if the "
+            "image cannot be opened for writing\n");
+}
+
 /*
  * Increases the refcount for a range of clusters in a given refcount table.
  * This is used to construct a temporary refcount table out of L1 and L2 tables
@@ -1345,11 +1382,7 @@ static int inc_refcounts(BlockDriverState *bs,
 
         refcount = s->get_refcount(*refcount_table, k);
         if (refcount == s->refcount_max) {
-            fprintf(stderr, "ERROR: overflow cluster offset=0x%" PRIx64
-                    "\n", cluster_offset);
-            fprintf(stderr, "Use qemu-img amend to increase the refcount entry "
-                    "width or qemu-img convert to create a clean copy if the "
-                    "image cannot be opened for writing\n");
+            report_refcount_overflow(cluster_offset);
             res->corruptions++;
             continue;
         }
@@ -1366,34 +1399,24 @@ enum {
 
 /*
  * Increases the refcount in the given refcount table for the all clusters
- * referenced in the L2 table. While doing so, performs some checks on L2
- * entries.
+ * referenced by the entries of an L2 table that has already been read from
+ * disk. While doing so, performs some checks on L2 entries.
  *
- * Returns the number of errors found by the checks or -errno if an internal
- * error occurred.
+ * This only accesses immutable fields of BDRVQcow2State, so it may be called
+ * from worker threads as long as each of them uses its own refcount table.
+ *
+ * Returns 0 on success and -errno if an internal error occurred.
  */
-static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
-                              void **refcount_table,
-                              int64_t *refcount_table_size, int64_t l2_offset,
-                              int flags)
+static int check_l2_entries(BlockDriverState *bs, BdrvCheckResult *res,
+                            void **refcount_table,
+                            int64_t *refcount_table_size,
+                            const uint64_t *l2_table, int flags)
 {
     BDRVQcow2State *s = bs->opaque;
-    uint64_t *l2_table, l2_entry;
+    uint64_t l2_entry;
     uint64_t next_contiguous_offset = 0;
-    int i, l2_size, nb_csectors, ret;
-
-    /* Read L2 table from disk */
-    l2_size = s->l2_size * sizeof(uint64_t);
-    l2_table = g_malloc(l2_size);
-
-    ret = bdrv_pread(bs->file->bs, l2_offset, l2_table, l2_size);
-    if (ret < 0) {
-        fprintf(stderr, "ERROR: I/O error in check_refcounts_l2\n");
-        res->check_errors++;
-        goto fail;
-    }
+    int i, nb_csectors, ret;
 
-    /* Do the actual checks */
     for(i = 0; i < s->l2_size; i++) {
         l2_entry = be64_to_cpu(l2_table[i]);
 
@@ -1415,7 +1438,7 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
             ret = inc_refcounts(bs, res, refcount_table, refcount_table_size,
                                 l2_entry & ~511, nb_csectors * 512);
             if (ret < 0) {
-                goto fail;
+                return ret;
             }
 
             if (flags & CHECK_FRAG_INFO) {
@@ -1454,7 +1477,7 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
             ret = inc_refcounts(bs, res, refcount_table, refcount_table_size,
                                 offset, s->cluster_size);
             if (ret < 0) {
-                goto fail;
+                return ret;
             }
 
             /* Correct offsets are cluster aligned */
@@ -1474,19 +1497,284 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
         }
     }
 
-    g_free(l2_table);
     return 0;
+}
+
+/*
+ * Increases the refcount in the given refcount table for the all clusters
+ * referenced in the L2 table. While doing so, performs some checks on L2
+ * entries.
+ *
+ * Returns the number of errors found by the checks or -errno if an internal
+ * error occurred.
+ */
+static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
+                              void **refcount_table,
+                              int64_t *refcount_table_size, int64_t l2_offset,
+                              int flags)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t *l2_table;
+    int l2_size, ret;
+
+    /* Read L2 table from disk */
+    l2_size = s->l2_size * sizeof(uint64_t);
+    l2_table = g_malloc(l2_size);
+
+    ret = bdrv_pread(bs->file->bs, l2_offset, l2_table, l2_size);
+    if (ret < 0) {
+        fprintf(stderr, "ERROR: I/O error in check_refcounts_l2\n");
+        res->check_errors++;
+        goto fail;
+    }
+
+    /* Do the actual checks */
+    ret = check_l2_entries(bs, res, refcount_table, refcount_table_size,
+                           l2_table, flags);
 
 fail:
     g_free(l2_table);
     return ret;
 }
 
+typedef struct Qcow2CheckL2 {
+    int64_t l2_offset;
+    int flags;
+} Qcow2CheckL2;
+
+/*
+ * State of a (possibly parallel) refcount check.  In parallel mode, the L1
+ * walk only queues the L2 tables it finds; they are then read concurrently by
+ * num_workers coroutines, whose entries are checked in the thread pool.
+ */
+typedef struct Qcow2CheckState {
+    BlockDriverState *bs;
+    int num_workers;
+    BlockDriverCheckStatusCB *status_cb;
+    void *cb_opaque;
+
+    /* L2 tables queued by check_refcounts_l1() */
+    Qcow2CheckL2 *l2_tables;
+    int64_t nb_l2_tables;
+    int64_t l2_tables_alloc;
+
+    int64_t next_l2_table;
+    int64_t done_l2_tables;
+    int nb_running;
+    int ret;
+} Qcow2CheckState;
+
+typedef struct Qcow2CheckWorker {
+    Qcow2CheckState *state;
+
+    /* Partial results, merged when all workers are done */
+    BdrvCheckResult res;
+    void *refcount_table;
+    int64_t refcount_table_size;
+
+    uint64_t *l2_table;
+    int flags;
+} Qcow2CheckWorker;
+
+static void check_queue_l2(Qcow2CheckState *state, int64_t l2_offset,
+                           int flags)
+{
+    if (state->nb_l2_tables == state->l2_tables_alloc) {
+        state->l2_tables_alloc = MAX(64, state->l2_tables_alloc * 2);
+        state->l2_tables = g_renew(Qcow2CheckL2, state->l2_tables,
+                                   state->l2_tables_alloc);
+    }
+
+    state->l2_tables[state->nb_l2_tables++] = (Qcow2CheckL2) {
+        .l2_offset = l2_offset,
+        .flags     = flags,
+    };
+}
+
+static int check_l2_entries_pool_func(void *opaque)
+{
+    Qcow2CheckWorker *w = opaque;
+
+    return check_l2_entries(w->state->bs, &w->res, &w->refcount_table,
+                            &w->refcount_table_size, w->l2_table, w->flags);
+}
+
+static void coroutine_fn check_refcounts_l2_entry(void *opaque)
+{
+    Qcow2CheckWorker *w = opaque;
+    Qcow2CheckState *state = w->state;
+    BlockDriverState *bs = state->bs;
+    BDRVQcow2State *s = bs->opaque;
+    ThreadPool *pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    Qcow2CheckL2 *t;
+    int ret;
+
+    while (state->ret == 0 && state->next_l2_table < state->nb_l2_tables) {
+        t = &state->l2_tables[state->next_l2_table++];
+
+        ret = bdrv_pread(bs->file->bs, t->l2_offset, w->l2_table,
+                         s->l2_size * sizeof(uint64_t));
+        if (ret < 0) {
+            fprintf(stderr, "ERROR: I/O error in check_refcounts_l2\n");
+            w->res.check_errors++;
+            state->ret = ret;
+            break;
+        }
+
+        w->flags = t->flags;
+        ret = thread_pool_submit_co(pool, check_l2_entries_pool_func, w);
+        if (ret < 0) {
+            state->ret = ret;
+            break;
+        }
+
+        state->done_l2_tables++;
+        if (state->status_cb) {
+            state->status_cb(bs, state->done_l2_tables, state->nb_l2_tables,
+                             state->cb_opaque);
+        }
+    }
+
+    state->nb_running--;
+}
+
+/*
+ * Adds the refcounts from a worker's partial refcount table to the given
+ * refcount table.  Overflows are accounted for like in inc_refcounts(), so
+ * the result is the same as if all L2 tables had been checked serially.
+ */
+static int merge_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
+                           void **refcount_table,
+                           int64_t *refcount_table_size,
+                           void *partial_table, int64_t partial_size)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t refcount, total;
+    int64_t k;
+    int ret;
+
+    if (partial_size > *refcount_table_size) {
+        ret = realloc_refcount_array(s, refcount_table, refcount_table_size,
+                                     partial_size);
+        if (ret < 0) {
+            res->check_errors++;
+            return ret;
+        }
+    }
+
+    for (k = 0; k < partial_size; k++) {
+        refcount = s->get_refcount(partial_table, k);
+        if (!refcount) {
+            continue;
+        }
+
+        total = s->get_refcount(*refcount_table, k);
+        if (refcount > s->refcount_max - total) {
+            report_refcount_overflow(k << s->cluster_bits);
+            res->corruptions += refcount - (s->refcount_max - total);
+            refcount = s->refcount_max - total;
+        }
+        s->set_refcount(*refcount_table, k, total + refcount);
+    }
+
+    return 0;
+}
+
+/*
+ * Checks all L2 tables queued in state, using up to state->num_workers
+ * concurrent workers, and adds their refcounts to the given refcount table.
+ *
+ * Returns 0 on success and -errno if an internal error occurred.
+ */
+static int check_refcounts_l2_parallel(BlockDriverState *bs,
+                                       BdrvCheckResult *res,
+                                       void **refcount_table,
+                                       int64_t *refcount_table_size,
+                                       Qcow2CheckState *state)
+{
+    BDRVQcow2State *s = bs->opaque;
+    AioContext *ctx = bdrv_get_aio_context(bs);
+    Qcow2CheckWorker *workers;
+    Coroutine *co;
+    int i, num_workers, ret;
+
+    if (state->nb_l2_tables == 0) {
+        return 0;
+    }
+
+    num_workers = MIN(state->num_workers, state->nb_l2_tables);
+    workers = g_new0(Qcow2CheckWorker, num_workers);
+
+    state->next_l2_table = 0;
+    state->done_l2_tables = 0;
+    state->ret = 0;
+
+    for (i = 0; i < num_workers; i++) {
+        Qcow2CheckWorker *w = &workers[i];
+
+        w->state = state;
+        w->l2_table = qemu_blockalign(bs->file->bs,
+                                      s->l2_size * sizeof(uint64_t));
+
+        /* Size the partial table up front, inc_refcounts() would grow it one
+         * cluster at a time */
+        ret = realloc_refcount_array(s, &w->refcount_table,
+                                     &w->refcount_table_size,
+                                     *refcount_table_size);
+        if (ret < 0) {
+            res->check_errors++;
+            state->ret = ret;
+        }
+    }
+
+    if (state->status_cb) {
+        state->status_cb(bs, 0, state->nb_l2_tables, state->cb_opaque);
+    }
+
+    if (state->ret == 0) {
+        state->nb_running = num_workers;
+        for (i = 0; i < num_workers; i++) {
+            co = qemu_coroutine_create(check_refcounts_l2_entry);
+            qemu_coroutine_enter(co, &workers[i]);
+        }
+        while (state->nb_running > 0) {
+            aio_poll(ctx, true);
+        }
+    }
+
+    ret = state->ret;
+    for (i = 0; i < num_workers; i++) {
+        Qcow2CheckWorker *w = &workers[i];
+
+        res->corruptions += w->res.corruptions;
+        res->leaks += w->res.leaks;
+        res->check_errors += w->res.check_errors;
+        res->bfi.allocated_clusters += w->res.bfi.allocated_clusters;
+        res->bfi.fragmented_clusters += w->res.bfi.fragmented_clusters;
+        res->bfi.compressed_clusters += w->res.bfi.compressed_clusters;
+
+        if (ret == 0) {
+            ret = merge_refcounts(bs, res, refcount_table,
+                                  refcount_table_size, w->refcount_table,
+                                  w->refcount_table_size);
+        }
+
+        g_free(w->refcount_table);
+        qemu_vfree(w->l2_table);
+    }
+    g_free(workers);
+
+    return ret;
+}
+
 /*
  * Increases the refcount for the L1 table, its L2 tables and all referenced
  * clusters in the given refcount table. While doing so, performs some checks
  * on L1 and L2 entries.
  *
+ * If queue is non-NULL, the L2 tables are not checked right away, but queued
+ * for check_refcounts_l2_parallel().
+ *
  * Returns the number of errors found by the checks or -errno if an internal
  * error occurred.
  */
@@ -1495,7 +1783,7 @@ static int check_refcounts_l1(BlockDriverState *bs,
                               void **refcount_table,
                               int64_t *refcount_table_size,
                               int64_t l1_table_offset, int l1_size,
-                              int flags)
+                              int flags, Qcow2CheckState *queue)
 {
     BDRVQcow2State *s = bs->opaque;
     uint64_t *l1_table = NULL, l2_offset, l1_size2;
@@ -1548,6 +1836,10 @@ static int check_refcounts_l1(BlockDriverState *bs,
             }
 
             /* Process and check L2 entries */
+            if (queue) {
+                check_queue_l2(queue, l2_offset, flags);
+                continue;
+            }
             ret = check_refcounts_l2(bs, res, refcount_table,
                                      refcount_table_size, l2_offset, flags);
             if (ret < 0) {
@@ -1795,13 +2087,21 @@ resize_fail:
  */
 static int calculate_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
                                BdrvCheckMode fix, bool *rebuild,
-                               void **refcount_table, int64_t *nb_clusters)
+                               void **refcount_table, int64_t *nb_clusters,
+                               Qcow2CheckState *state)
 {
     BDRVQcow2State *s = bs->opaque;
+    Qcow2CheckState *queue = NULL;
     int64_t i;
     QCowSnapshot *sn;
     int ret;
 
+    /* The workers are run from a nested event loop */
+    if (state->num_workers > 1 && !qemu_in_coroutine()) {
+        queue = state;
+        queue->nb_l2_tables = 0;
+    }
+
     if (!*refcount_table) {
         int64_t old_size = 0;
         ret = realloc_refcount_array(s, refcount_table,
@@ -1821,16 +2121,32 @@ static int calculate_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
 
     /* current L1 table */
     ret = check_refcounts_l1(bs, res, refcount_table, nb_clusters,
-                             s->l1_table_offset, s->l1_size, CHECK_FRAG_INFO);
+                             s->l1_table_offset, s->l1_size, CHECK_FRAG_INFO,
+                             queue);
     if (ret < 0) {
         return ret;
     }
+    if (!queue && state->status_cb) {
+        state->status_cb(bs, 1, s->nb_snapshots + 1, state->cb_opaque);
+    }
 
     /* snapshots */
     for (i = 0; i < s->nb_snapshots; i++) {
         sn = s->snapshots + i;
         ret = check_refcounts_l1(bs, res, refcount_table, nb_clusters,
-                                 sn->l1_table_offset, sn->l1_size, 0);
+                                 sn->l1_table_offset, sn->l1_size, 0, queue);
+        if (ret < 0) {
+            return ret;
+        }
+        if (!queue && state->status_cb) {
+            state->status_cb(bs, i + 2, s->nb_snapshots + 1,
+                             state->cb_opaque);
+        }
+    }
+
+    if (queue) {
+        ret = check_refcounts_l2_parallel(bs, res, refcount_table,
+                                          nb_clusters, queue);
         if (ret < 0) {
             return ret;
         }
@@ -2178,6 +2494,7 @@ write_refblocks:
     s->refcount_table = on_disk_reftable;
     s->refcount_table_offset = reftable_offset;
     s->refcount_table_size = reftable_size;
+    qcow2_free_index_reset(bs);
 
     return 0;
 
@@ -2189,17 +2506,30 @@ fail:
 /*
  * Checks an image for refcount consistency.
  *
+ * If num_workers is greater than 1, the L2 tables are read and checked
+ * concurrently by that many workers, each of which keeps its own partial
+ * in-memory refcount table.  status_cb (if not NULL) is called as the check
+ * makes progress.
+ *
  * Returns 0 if no errors are found, the number of errors in case the image is
  * detected as corrupted, and -errno when an internal error occurred.
  */
-int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
-                          BdrvCheckMode fix)
+int qcow2_check_refcounts_parallel(BlockDriverState *bs, BdrvCheckResult *res,
+                                   BdrvCheckMode fix, int num_workers,
+                                   BlockDriverCheckStatusCB *status_cb,
+                                   void *cb_opaque)
 {
     BDRVQcow2State *s = bs->opaque;
     BdrvCheckResult pre_compare_res;
     int64_t size, highest_cluster, nb_clusters;
     void *refcount_table = NULL;
     bool rebuild = false;
+    Qcow2CheckState state = {
+        .bs          = bs,
+        .num_workers = num_workers,
+        .status_cb   = status_cb,
+        .cb_opaque   = cb_opaque,
+    };
     int ret;
 
     size = bdrv_getlength(bs->file->bs);
@@ -2218,7 +2548,7 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
         size_to_clusters(s, bs->total_sectors * BDRV_SECTOR_SIZE);
 
     ret = calculate_refcounts(bs, res, fix, &rebuild, &refcount_table,
-                              &nb_clusters);
+                              &nb_clusters, &state);
     if (ret < 0) {
         goto fail;
     }
@@ -2249,7 +2579,7 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
         rebuild = false;
         memset(refcount_table, 0, refcount_array_byte_size(s, nb_clusters));
         ret = calculate_refcounts(bs, res, 0, &rebuild, &refcount_table,
-                                  &nb_clusters);
+                                  &nb_clusters, &state);
         if (ret < 0) {
             goto fail;
         }
@@ -2308,10 +2638,17 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
 
 fail:
     g_free(refcount_table);
+    g_free(state.l2_tables);
 
     return ret;
 }
 
+int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
+                          BdrvCheckMode fix)
+{
+    return qcow2_check_refcounts_parallel(bs, res, fix, 1, NULL, NULL);
+}
+
 #define overlaps_with(ofs, sz) \
     ranges_overlap(offset, size, ofs, sz)
 
@@ -2888,6 +3225,7 @@ int qcow2_change_refcount_order(BlockDriverState *bs, int refcount_order,
 
     s->get_refcount = new_get_refcount;
     s->set_refcount = new_set_refcount;
+    qcow2_free_index_reset(bs);
 
     /* For cleaning up all old refblocks and the old reftable below the "done"
      * label */
@@ -0,0 +1,305 @@
+/*
+ * Metadata cache warmup for the QCOW2 format
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/*
+ * When the cache-warmup-file option is set, the tables in the L2 and refcount
+ * block caches are recorded in that file when the image is closed or
+ * inactivated (e.g. at the end of migration), and read back into the caches
+ * in the background when the image is opened or activated again.
+ *
+ * Tables are recorded by their position in the L1 table resp. the refcount
+ * table rather than by their host offset, and are only loaded if that entry
+ * is still in use.  A stale or foreign warmup file therefore only costs some
+ * useless reads, and the file can be shared by all hosts that use the image.
+ *
+ * File format (all fields big endian):
+ *
+ *   uint64_t magic             QCOW2_WARMUP_MAGIC
+ *   uint32_t version           QCOW2_WARMUP_VERSION
+ *   uint32_t nb_entries
+ *   Qcow2WarmupEntry entries[nb_entries]   least recently used first
+ */
+
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "qemu/error-report.h"
+#include "block/block_int.h"
+#include "block/qcow2.h"
+#include "trace.h"
+
+#define QCOW2_WARMUP_MAGIC   0x5143573257524d55ULL /* "QCW2WRMU" */
+#define QCOW2_WARMUP_VERSION 1
+
+enum {
+    QCOW2_WARMUP_L2         = 0,
+    QCOW2_WARMUP_REFBLOCK   = 1,
+};
+
+typedef struct QEMU_PACKED Qcow2WarmupHeader {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t nb_entries;
+} Qcow2WarmupHeader;
+
+typedef struct QEMU_PACKED Qcow2WarmupEntry {
+    uint32_t type;
+    /* Index into the L1 table or the refcount table */
+    uint32_t index;
+    /* Offset of the cached part inside the L2 table or refcount block */
+    uint32_t offset;
+} Qcow2WarmupEntry;
+
+/*
+ * Maps the host offset of each table referenced by the given table of offsets
+ * to its index in there.
+ */
+static GHashTable *warmup_build_index(const uint64_t *table, int size,
+                                      uint64_t mask)
+{
+    GHashTable *lookup = g_hash_table_new_full(g_int64_hash, g_int64_equal,
+                                               g_free, NULL);
+    int i;
+
+    for (i = 0; i < size; i++) {
+        uint64_t *offset;
+
+        if (!(table[i] & mask)) {
+            continue;
+        }
+        offset = g_new(uint64_t, 1);
+        *offset = table[i] & mask;
+        g_hash_table_insert(lookup, offset, GINT_TO_POINTER(i + 1));
+    }
+
+    return lookup;
+}
+
+static int warmup_add_entries(BDRVQcow2State *s, Qcow2Cache *c, uint32_t type,
+                              GHashTable *lookup, Qcow2WarmupEntry *entries,
+                              int nb_entries)
+{
+    uint64_t *offsets;
+    int i, n, count = 0;
+
+    offsets = g_new(uint64_t, qcow2_cache_size(c));
+    n = qcow2_cache_get_offsets(c, offsets, qcow2_cache_size(c));
+
+    for (i = 0; i < n; i++) {
+        uint64_t table = start_of_cluster(s, offsets[i]);
+        int idx = GPOINTER_TO_INT(g_hash_table_lookup(lookup, &table));
+
+        if (idx == 0) {
+            continue;
+        }
+
+        entries[nb_entries + count++] = (Qcow2WarmupEntry) {
+            .type   = cpu_to_be32(type),
+            .index  = cpu_to_be32(idx - 1),
+            .offset = cpu_to_be32(offsets[i] - table),
+        };
+    }
+
+    g_free(offsets);
+    return count;
+}
+
+/*
+ * Records the tables in the metadata caches in the warmup file.  Errors are
+ * reported, but otherwise ignored: the warmup file is only an optimisation.
+ */
+void qcow2_warmup_save(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2WarmupHeader *header;
+    Qcow2WarmupEntry *entries;
+    GHashTable *lookup;
+    GError *gerr = NULL;
+    size_t len;
+    int n = 0;
+
+    if (!s->warmup_file || !s->l1_table) {
+        return;
+    }
+
+    len = sizeof(*header) +
+          sizeof(*entries) * (qcow2_cache_size(s->l2_table_cache) +
+                              qcow2_cache_size(s->refcount_block_cache));
+    header = g_malloc0(len);
+    entries = (Qcow2WarmupEntry *)(header + 1);
+
+    /* Refcount blocks first, they are needed as soon as the guest writes */
+    lookup = warmup_build_index(s->refcount_table, s->refcount_table_size,
+                                REFT_OFFSET_MASK);
+    n += warmup_add_entries(s, s->refcount_block_cache, QCOW2_WARMUP_REFBLOCK,
+                            lookup, entries, n);
+    g_hash_table_destroy(lookup);
+
+    lookup = warmup_build_index(s->l1_table, s->l1_size, L1E_OFFSET_MASK);
+    n += warmup_add_entries(s, s->l2_table_cache, QCOW2_WARMUP_L2,
+                            lookup, entries, n);
+    g_hash_table_destroy(lookup);
+
+    header->magic = cpu_to_be64(QCOW2_WARMUP_MAGIC);
+    header->version = cpu_to_be32(QCOW2_WARMUP_VERSION);
+    header->nb_entries = cpu_to_be32(n);
+
+    trace_qcow2_warmup_save(bs, n);
+
+    len = sizeof(*header) + n * sizeof(*entries);
+    if (!g_file_set_contents(s->warmup_file, (char *)header, len, &gerr)) {
+        error_report("Could not write qcow2 cache warmup file: %s",
+                     gerr->message);
+        g_error_free(gerr);
+    }
+
+    g_free(header);
+}
+
+/*
+ * Returns the host offset of the table described by e if it is still in use
+ * by the image, or 0 otherwise.
+ */
+static uint64_t warmup_entry_offset(BDRVQcow2State *s, Qcow2WarmupEntry *e,
+                                    Qcow2Cache **c)
+{
+    uint32_t index = be32_to_cpu(e->index);
+    uint32_t offset = be32_to_cpu(e->offset);
+    uint64_t table;
+
+    switch (be32_to_cpu(e->type)) {
+    case QCOW2_WARMUP_L2:
+        if (index >= s->l1_size) {
+            return 0;
+        }
+        table = s->l1_table[index] & L1E_OFFSET_MASK;
+        *c = s->l2_table_cache;
+        break;
+    case QCOW2_WARMUP_REFBLOCK:
+        if (index >= s->refcount_table_size) {
+            return 0;
+        }
+        table = s->refcount_table[index] & REFT_OFFSET_MASK;
+        *c = s->refcount_block_cache;
+        break;
+    default:
+        return 0;
+    }
+
+    if (!table || offset_into_cluster(s, table) ||
+        offset >= s->cluster_size ||
+        offset % qcow2_cache_table_size(*c)) {
+        return 0;
+    }
+
+    return table + offset;
+}
+
+static void coroutine_fn qcow2_warmup_co_entry(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2WarmupEntry *e;
+    Qcow2Cache *c;
+    uint64_t offset;
+    void *table;
+    int i, loaded = 0;
+
+    qemu_co_mutex_lock(&s->lock);
+    for (i = 0; i < s->warmup_nb_entries && !s->warmup_cancel; i++) {
+        e = &s->warmup_entries[i];
+
+        /* Revalidated after every load: the L1 and refcount tables may have
+         * changed while s->lock was dropped */
+        offset = warmup_entry_offset(s, e, &c);
+        if (!offset) {
+            continue;
+        }
+
+        if (qcow2_cache_get_unlocked(bs, c, offset, &table) == 0) {
+            qcow2_cache_put(bs, c, &table);
+            loaded++;
+        }
+    }
+    qemu_co_mutex_unlock(&s->lock);
+
+    trace_qcow2_warmup_done(bs, loaded, s->warmup_cancel);
+
+    g_free(s->warmup_entries);
+    s->warmup_entries = NULL;
+    s->warmup_nb_entries = 0;
+    s->warmup_co = NULL;
+}
+
+/*
+ * Starts loading the tables recorded in the warmup file into the metadata
+ * caches.  This happens in the background, requests are served meanwhile.
+ */
+void qcow2_warmup_start(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2WarmupHeader *header;
+    GError *gerr = NULL;
+    gchar *buf;
+    gsize len;
+    uint32_t n;
+
+    if (!s->warmup_file || s->warmup_co) {
+        return;
+    }
+
+    if (!g_file_get_contents(s->warmup_file, &buf, &len, &gerr)) {
+        /* A missing file is fine, it is written on close */
+        g_error_free(gerr);
+        return;
+    }
+
+    header = (Qcow2WarmupHeader *)buf;
+    if (len < sizeof(*header) ||
+        be64_to_cpu(header->magic) != QCOW2_WARMUP_MAGIC ||
+        be32_to_cpu(header->version) != QCOW2_WARMUP_VERSION) {
+        error_report("Ignoring invalid qcow2 cache warmup file '%s'",
+                     s->warmup_file);
+        g_free(buf);
+        return;
+    }
+
+    n = be32_to_cpu(header->nb_entries);
+    n = MIN(n, (len - sizeof(*header)) / sizeof(Qcow2WarmupEntry));
+
+    trace_qcow2_warmup_start(bs, n);
+    if (n == 0) {
+        g_free(buf);
+        return;
+    }
+
+    s->warmup_entries = g_memdup(header + 1, n * sizeof(Qcow2WarmupEntry));
+    s->warmup_nb_entries = n;
+    s->warmup_cancel = false;
+    g_free(buf);
+
+    s->warmup_co = qemu_coroutine_create(qcow2_warmup_co_entry);
+    qemu_coroutine_enter(s->warmup_co, bs);
+}
+
+/*
+ * Cancels the background warmup and waits until it has stopped.  Must be
+ * called before the metadata caches are emptied or replaced, and outside of
+ * coroutine context.
+ */
+void qcow2_warmup_stop(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (!s->warmup_co) {
+        return;
+    }
+
+    s->warmup_cancel = true;
+    while (s->warmup_co) {
+        aio_poll(bdrv_get_aio_context(bs), true);
+    }
+}
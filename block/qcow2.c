@@ -25,7 +25,6 @@
 #include "block/block_int.h"
 #include "sysemu/block-backend.h"
 #include "qemu/module.h"
-#include <zlib.h>
 #include "block/qcow2.h"
 #include "qemu/error-report.h"
 #include "qapi/qmp/qerror.h"
@@ -318,10 +317,13 @@ int qcow2_mark_consistent(BlockDriverState *bs)
     return 0;
 }
 
-static int qcow2_check(BlockDriverState *bs, BdrvCheckResult *result,
-                       BdrvCheckMode fix)
+static int qcow2_check_parallel(BlockDriverState *bs, BdrvCheckResult *result,
+                                BdrvCheckMode fix, int num_workers,
+                                BlockDriverCheckStatusCB *status_cb,
+                                void *cb_opaque)
 {
-    int ret = qcow2_check_refcounts(bs, result, fix);
+    int ret = qcow2_check_refcounts_parallel(bs, result, fix, num_workers,
+                                             status_cb, cb_opaque);
     if (ret < 0) {
         return ret;
     }
@@ -336,6 +338,12 @@ static int qcow2_check(BlockDriverState *bs, BdrvCheckResult *result,
     return ret;
 }
 
+static int qcow2_check(BlockDriverState *bs, BdrvCheckResult *result,
+                       BdrvCheckMode fix)
+{
+    return qcow2_check_parallel(bs, result, fix, 1, NULL, NULL);
+}
+
 static int validate_table_offset(BlockDriverState *bs, uint64_t offset,
                                  uint64_t entries, size_t entry_len)
 {
@@ -455,11 +463,34 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_SIZE,
             .help = "Maximum refcount block cache size",
         },
+        {
+            .name = QCOW2_OPT_L2_CACHE_ENTRY_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Size of each entry in the L2 cache",
+        },
         {
             .name = QCOW2_OPT_CACHE_CLEAN_INTERVAL,
             .type = QEMU_OPT_NUMBER,
             .help = "Clean unused cache entries after this time (in seconds)",
         },
+        {
+            .name = QCOW2_OPT_CACHE_WARMUP_FILE,
+            .type = QEMU_OPT_STRING,
+            .help = "File to record the cached metadata tables in on close, "
+                    "and to load them from on open",
+        },
+        {
+            .name = QCOW2_OPT_PREALLOC_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Preallocate this many bytes in the image file ahead of "
+                    "allocating writes",
+        },
+        {
+            .name = QCOW2_OPT_FREE_EXTENT_INDEX,
+            .type = QEMU_OPT_BOOL,
+            .help = "Find free clusters in an in-memory index of free extents "
+                    "instead of scanning the refcount blocks",
+        },
         { /* end of list */ }
     },
 };
@@ -509,6 +540,7 @@ static void cache_clean_timer_del(BlockDriverState *bs)
 
 static void qcow2_detach_aio_context(BlockDriverState *bs)
 {
+    qcow2_warmup_stop(bs);
     cache_clean_timer_del(bs);
 }
 
@@ -580,10 +612,14 @@ static void read_cache_sizes(BlockDriverState *bs, QemuOpts *opts,
 typedef struct Qcow2ReopenState {
     Qcow2Cache *l2_table_cache;
     Qcow2Cache *refcount_block_cache;
+    int l2_slice_size; /* Number of entries in a slice of the L2 table */
     bool use_lazy_refcounts;
     int overlap_check;
     bool discard_passthrough[QCOW2_DISCARD_MAX];
     uint64_t cache_clean_interval;
+    uint64_t prealloc_size;
+    char *warmup_file;
+    bool use_free_index;
 } Qcow2ReopenState;
 
 static int qcow2_update_options_prepare(BlockDriverState *bs,
@@ -595,7 +631,7 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
     QemuOpts *opts = NULL;
     const char *opt_overlap_check, *opt_overlap_check_template;
     int overlap_check_template = 0;
-    uint64_t l2_cache_size, refcount_cache_size;
+    uint64_t l2_cache_size, l2_cache_entry_size, refcount_cache_size;
     int i;
     Error *local_err = NULL;
     int ret;
@@ -617,7 +653,23 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
         goto fail;
     }
 
-    l2_cache_size /= s->cluster_size;
+    /* L2 tables are cached in slices of this size; smaller slices mean less
+     * I/O per cache miss and less memory wasted on the unused parts of large
+     * L2 tables */
+    l2_cache_entry_size = qemu_opt_get_size(opts, QCOW2_OPT_L2_CACHE_ENTRY_SIZE,
+                                            s->cluster_size);
+    if (l2_cache_entry_size < (1 << MIN_CLUSTER_BITS) ||
+        l2_cache_entry_size > s->cluster_size ||
+        !is_power_of_2(l2_cache_entry_size)) {
+        error_setg(errp, "L2 cache entry size must be a power of two "
+                   "between %d and the cluster size (%d)",
+                   1 << MIN_CLUSTER_BITS, s->cluster_size);
+        ret = -EINVAL;
+        goto fail;
+    }
+    r->l2_slice_size = l2_cache_entry_size / sizeof(uint64_t);
+
+    l2_cache_size /= l2_cache_entry_size;
     if (l2_cache_size < MIN_L2_CACHE_SIZE) {
         l2_cache_size = MIN_L2_CACHE_SIZE;
     }
@@ -638,6 +690,7 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
     }
 
     /* alloc new L2 table/refcount block cache, flush old one */
+    qcow2_warmup_stop(bs);
     if (s->l2_table_cache) {
         ret = qcow2_cache_flush(bs, s->l2_table_cache);
         if (ret) {
@@ -655,8 +708,10 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
         }
     }
 
-    r->l2_table_cache = qcow2_cache_create(bs, l2_cache_size);
-    r->refcount_block_cache = qcow2_cache_create(bs, refcount_cache_size);
+    r->l2_table_cache = qcow2_cache_create(bs, l2_cache_size,
+                                           l2_cache_entry_size);
+    r->refcount_block_cache = qcow2_cache_create(bs, refcount_cache_size,
+                                                 s->cluster_size);
     if (r->l2_table_cache == NULL || r->refcount_block_cache == NULL) {
         error_setg(errp, "Could not allocate metadata caches");
         ret = -ENOMEM;
@@ -673,6 +728,17 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
         goto fail;
     }
 
+    /* Preallocation ahead of allocating writes, in whole clusters */
+    r->prealloc_size = qemu_opt_get_size(opts, QCOW2_OPT_PREALLOC_SIZE,
+                                         s->prealloc_size);
+    r->prealloc_size = ROUND_UP(r->prealloc_size, s->cluster_size);
+
+    r->warmup_file = g_strdup(qemu_opt_get(opts, QCOW2_OPT_CACHE_WARMUP_FILE)
+                              ?: s->warmup_file);
+
+    r->use_free_index = qemu_opt_get_bool(opts, QCOW2_OPT_FREE_EXTENT_INDEX,
+                                          s->free_index != NULL);
+
     /* lazy-refcounts; flush if going from enabled to disabled */
     r->use_lazy_refcounts = qemu_opt_get_bool(opts, QCOW2_OPT_LAZY_REFCOUNTS,
         (s->compatible_features & QCOW2_COMPAT_LAZY_REFCOUNTS));
@@ -763,6 +829,18 @@ static void qcow2_update_options_commit(BlockDriverState *bs,
     }
     s->l2_table_cache = r->l2_table_cache;
     s->refcount_block_cache = r->refcount_block_cache;
+    s->l2_slice_size = r->l2_slice_size;
+    s->prealloc_size = r->prealloc_size;
+
+    g_free(s->warmup_file);
+    s->warmup_file = r->warmup_file;
+    r->warmup_file = NULL;
+
+    if (r->use_free_index) {
+        qcow2_free_index_init(bs);
+    } else {
+        qcow2_free_index_destroy(bs);
+    }
 
     s->overlap_check = r->overlap_check;
     s->use_lazy_refcounts = r->use_lazy_refcounts;
@@ -787,6 +865,7 @@ static void qcow2_update_options_abort(BlockDriverState *bs,
     if (r->refcount_block_cache) {
         qcow2_cache_destroy(bs, r->refcount_block_cache);
     }
+    g_free(r->warmup_file);
 }
 
 static int qcow2_update_options(BlockDriverState *bs, QDict *options,
@@ -1077,15 +1156,6 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     }
 
     s->cluster_cache = g_malloc(s->cluster_size);
-    /* one more sector for decompressed data alignment */
-    s->cluster_data = qemu_try_blockalign(bs->file->bs, QCOW_MAX_CRYPT_CLUSTERS
-                                                    * s->cluster_size + 512);
-    if (s->cluster_data == NULL) {
-        error_setg(errp, "Could not allocate temporary cluster buffer");
-        ret = -ENOMEM;
-        goto fail;
-    }
-
     s->cluster_cache_offset = -1;
     s->flags = flags;
 
@@ -1166,6 +1236,11 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
         qcow2_check_refcounts(bs, &result, 0);
     }
 #endif
+
+    /* Refill the metadata caches from the previous run */
+    if (!(flags & (BDRV_O_CHECK | BDRV_O_INACTIVE))) {
+        qcow2_warmup_start(bs);
+    }
     return ret;
 
  fail:
@@ -1184,7 +1259,8 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
         qcow2_cache_destroy(bs, s->refcount_block_cache);
     }
     g_free(s->cluster_cache);
-    qemu_vfree(s->cluster_data);
+    g_free(s->warmup_file);
+    s->warmup_file = NULL;
     return ret;
 }
 
@@ -1446,15 +1522,13 @@ static coroutine_fn int qcow2_co_readv(BlockDriverState *bs, int64_t sector_num,
             break;
 
         case QCOW2_CLUSTER_COMPRESSED:
-            /* add AIO support for compressed blocks ? */
-            ret = qcow2_decompress_cluster(bs, cluster_offset);
+            /* drops s->lock while reading and decompressing the cluster */
+            ret = qcow2_decompress_cluster(bs, cluster_offset,
+                                           index_in_cluster * 512, &hd_qiov,
+                                           512 * cur_nr_sectors);
             if (ret < 0) {
                 goto fail;
             }
-
-            qemu_iovec_from_buf(&hd_qiov, 0,
-                s->cluster_cache + index_in_cluster * 512,
-                512 * cur_nr_sectors);
             break;
 
         case QCOW2_CLUSTER_NORMAL:
@@ -1553,7 +1627,7 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
 
     qemu_iovec_init(&hd_qiov, qiov->niov);
 
-    s->cluster_cache_offset = -1; /* disable compressed cache */
+    qcow2_cluster_cache_reset(s);
 
     qemu_co_mutex_lock(&s->lock);
 
@@ -1562,6 +1636,10 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
         l2meta = NULL;
 
         trace_qcow2_writev_start_part(qemu_coroutine_self());
+
+        /* Drops s->lock; nothing computed under the lock is live here */
+        qcow2_l2_prefetch(bs, sector_num << BDRV_SECTOR_BITS);
+
         index_in_cluster = sector_num & (s->cluster_sectors - 1);
         cur_nr_sectors = remaining_sectors;
         if (bs->encrypted &&
@@ -1579,6 +1657,10 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
 
         assert((cluster_offset & 511) == 0);
 
+        if (l2meta != NULL && s->prealloc_size) {
+            qcow2_prealloc_ahead(bs, l2meta);
+        }
+
         qemu_iovec_reset(&hd_qiov);
         qemu_iovec_concat(&hd_qiov, qiov, bytes_done,
             cur_nr_sectors * 512);
@@ -1613,23 +1695,33 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
                 cur_nr_sectors * 512);
         }
 
-        ret = qcow2_pre_write_overlap_check(bs, 0,
-                cluster_offset + index_in_cluster * BDRV_SECTOR_SIZE,
-                cur_nr_sectors * BDRV_SECTOR_SIZE);
-        if (ret < 0) {
-            goto fail;
-        }
+        /* If the request needs COW, qcow2_alloc_cluster_link_l2() writes the
+         * COW regions and the guest data at once rather than issuing separate
+         * requests for them */
+        if (qcow2_can_merge_cow(bs, l2meta, sector_num << BDRV_SECTOR_BITS,
+                                hd_qiov.size)) {
+            assert(start_of_cluster(s, cluster_offset) ==
+                   l2meta->alloc_offset);
+            l2meta->data_qiov = &hd_qiov;
+        } else {
+            ret = qcow2_pre_write_overlap_check(bs, 0,
+                    cluster_offset + index_in_cluster * BDRV_SECTOR_SIZE,
+                    cur_nr_sectors * BDRV_SECTOR_SIZE);
+            if (ret < 0) {
+                goto fail;
+            }
 
-        qemu_co_mutex_unlock(&s->lock);
-        BLKDBG_EVENT(bs->file, BLKDBG_WRITE_AIO);
-        trace_qcow2_writev_data(qemu_coroutine_self(),
-                                (cluster_offset >> 9) + index_in_cluster);
-        ret = bdrv_co_writev(bs->file->bs,
-                             (cluster_offset >> 9) + index_in_cluster,
-                             cur_nr_sectors, &hd_qiov);
-        qemu_co_mutex_lock(&s->lock);
-        if (ret < 0) {
-            goto fail;
+            qemu_co_mutex_unlock(&s->lock);
+            BLKDBG_EVENT(bs->file, BLKDBG_WRITE_AIO);
+            trace_qcow2_writev_data(qemu_coroutine_self(),
+                                    (cluster_offset >> 9) + index_in_cluster);
+            ret = bdrv_co_writev(bs->file->bs,
+                                 (cluster_offset >> 9) + index_in_cluster,
+                                 cur_nr_sectors, &hd_qiov);
+            qemu_co_mutex_lock(&s->lock);
+            if (ret < 0) {
+                goto fail;
+            }
         }
 
         while (l2meta != NULL) {
@@ -1687,6 +1779,10 @@ static int qcow2_inactivate(BlockDriverState *bs)
     BDRVQcow2State *s = bs->opaque;
     int ret, result = 0;
 
+    /* Let the migration destination start with the same hot tables */
+    qcow2_warmup_stop(bs);
+    qcow2_warmup_save(bs);
+
     ret = qcow2_cache_flush(bs, s->l2_table_cache);
     if (ret) {
         result = ret;
@@ -1711,6 +1807,12 @@ static int qcow2_inactivate(BlockDriverState *bs)
 static void qcow2_close(BlockDriverState *bs)
 {
     BDRVQcow2State *s = bs->opaque;
+
+    qcow2_warmup_stop(bs);
+    if (!(s->flags & BDRV_O_INACTIVE)) {
+        qcow2_warmup_save(bs);
+    }
+
     qemu_vfree(s->l1_table);
     /* else pre-write overlap checks in cache_destroy may crash */
     s->l1_table = NULL;
@@ -1733,7 +1835,8 @@ static void qcow2_close(BlockDriverState *bs)
     g_free(s->image_backing_format);
 
     g_free(s->cluster_cache);
-    qemu_vfree(s->cluster_data);
+    g_free(s->warmup_file);
+    s->warmup_file = NULL;
     qcow2_refcount_close(bs);
     qcow2_free_snapshots(bs);
 }
@@ -2487,13 +2590,16 @@ static int qcow2_truncate(BlockDriverState *bs, int64_t offset)
 
 /* XXX: put compressed sectors first, then all the cluster aligned
    tables to avoid losing bytes in alignment */
-static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
-                                  const uint8_t *buf, int nb_sectors)
+static coroutine_fn int
+qcow2_co_write_compressed(BlockDriverState *bs, int64_t sector_num,
+                          int nb_sectors, QEMUIOVector *qiov)
 {
     BDRVQcow2State *s = bs->opaque;
-    z_stream strm;
-    int ret, out_len;
-    uint8_t *out_buf;
+    QEMUIOVector hd_qiov;
+    struct iovec iov;
+    ssize_t ret;
+    size_t out_len;
+    uint8_t *buf, *out_buf;
     uint64_t cluster_offset;
 
     if (nb_sectors == 0) {
@@ -2504,77 +2610,77 @@ static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
     }
 
     if (nb_sectors != s->cluster_sectors) {
-        ret = -EINVAL;
-
-        /* Zero-pad last write if image size is not cluster aligned */
-        if (sector_num + nb_sectors == bs->total_sectors &&
-            nb_sectors < s->cluster_sectors) {
-            uint8_t *pad_buf = qemu_blockalign(bs, s->cluster_size);
-            memset(pad_buf, 0, s->cluster_size);
-            memcpy(pad_buf, buf, nb_sectors * BDRV_SECTOR_SIZE);
-            ret = qcow2_write_compressed(bs, sector_num,
-                                         pad_buf, s->cluster_sectors);
-            qemu_vfree(pad_buf);
+        /* Only the last cluster may be partial if the image size is not
+         * cluster aligned; it is zero-padded below */
+        if (sector_num + nb_sectors != bs->total_sectors ||
+            nb_sectors > s->cluster_sectors) {
+            return -EINVAL;
         }
-        return ret;
     }
 
-    out_buf = g_malloc(s->cluster_size + (s->cluster_size / 1000) + 128);
-
-    /* best compression, small window, no zlib header */
-    memset(&strm, 0, sizeof(strm));
-    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
-                       Z_DEFLATED, -12,
-                       9, Z_DEFAULT_STRATEGY);
-    if (ret != 0) {
-        ret = -EINVAL;
-        goto fail;
+    buf = qemu_blockalign(bs, s->cluster_size);
+    if (nb_sectors != s->cluster_sectors) {
+        memset(buf, 0, s->cluster_size);
     }
+    qemu_iovec_to_buf(qiov, 0, buf, nb_sectors * BDRV_SECTOR_SIZE);
 
-    strm.avail_in = s->cluster_size;
-    strm.next_in = (uint8_t *)buf;
-    strm.avail_out = s->cluster_size;
-    strm.next_out = out_buf;
+    out_buf = g_malloc(s->cluster_size);
 
-    ret = deflate(&strm, Z_FINISH);
-    if (ret != Z_STREAM_END && ret != Z_OK) {
-        deflateEnd(&strm);
+    /* The compression runs in a worker thread, so several clusters can be
+     * compressed in parallel by concurrent requests. Anything that doesn't
+     * shrink is stored uncompressed. */
+    ret = qcow2_co_compress(bs, out_buf, s->cluster_size - 1,
+                            buf, s->cluster_size);
+    if (ret == -ENOSPC) {
+        /* could not compress: write normal cluster */
+        iov = (struct iovec) {
+            .iov_base   = buf,
+            .iov_len    = nb_sectors * BDRV_SECTOR_SIZE,
+        };
+        qemu_iovec_init_external(&hd_qiov, &iov, 1);
+        ret = bdrv_co_writev(bs, sector_num, nb_sectors, &hd_qiov);
+        if (ret < 0) {
+            goto fail;
+        }
+        goto success;
+    } else if (ret < 0) {
         ret = -EINVAL;
         goto fail;
     }
-    out_len = strm.next_out - out_buf;
+    out_len = ret;
 
-    deflateEnd(&strm);
+    qemu_co_mutex_lock(&s->lock);
+    cluster_offset = qcow2_alloc_compressed_cluster_offset(bs,
+        sector_num << 9, out_len);
+    if (!cluster_offset) {
+        qemu_co_mutex_unlock(&s->lock);
+        ret = -EIO;
+        goto fail;
+    }
+    cluster_offset &= s->cluster_offset_mask;
 
-    if (ret != Z_STREAM_END || out_len >= s->cluster_size) {
-        /* could not compress: write normal cluster */
-        ret = bdrv_write(bs, sector_num, buf, s->cluster_sectors);
-        if (ret < 0) {
-            goto fail;
-        }
-    } else {
-        cluster_offset = qcow2_alloc_compressed_cluster_offset(bs,
-            sector_num << 9, out_len);
-        if (!cluster_offset) {
-            ret = -EIO;
-            goto fail;
-        }
-        cluster_offset &= s->cluster_offset_mask;
+    /* The new cluster may reuse the bytes of a freed compressed cluster.
+     * Reset the cache again once the data is written, in case a read
+     * picked up the old contents in the meantime. */
+    qcow2_cluster_cache_reset(s);
 
-        ret = qcow2_pre_write_overlap_check(bs, 0, cluster_offset, out_len);
-        if (ret < 0) {
-            goto fail;
-        }
+    ret = qcow2_pre_write_overlap_check(bs, 0, cluster_offset, out_len);
+    qemu_co_mutex_unlock(&s->lock);
+    if (ret < 0) {
+        goto fail;
+    }
 
-        BLKDBG_EVENT(bs->file, BLKDBG_WRITE_COMPRESSED);
-        ret = bdrv_pwrite(bs->file->bs, cluster_offset, out_buf, out_len);
-        if (ret < 0) {
-            goto fail;
-        }
+    BLKDBG_EVENT(bs->file, BLKDBG_WRITE_COMPRESSED);
+    ret = bdrv_pwrite(bs->file->bs, cluster_offset, out_buf, out_len);
+    qcow2_cluster_cache_reset(s);
+    if (ret < 0) {
+        goto fail;
     }
 
+success:
     ret = 0;
 fail:
+    qemu_vfree(buf);
     g_free(out_buf);
     return ret;
 }
@@ -2592,6 +2698,7 @@ static int make_completely_empty(BlockDriverState *bs)
         uint32_t reftable_clusters;
     } QEMU_PACKED l1_ofs_rt_ofs_cls;
 
+    qcow2_warmup_stop(bs);
     ret = qcow2_cache_empty(bs, s->l2_table_cache);
     if (ret < 0) {
         goto fail;
@@ -2689,6 +2796,7 @@ static int make_completely_empty(BlockDriverState *bs)
     s->refcount_table[0] = 2 * s->cluster_size;
 
     s->free_cluster_index = 0;
+    qcow2_free_index_reset(bs);
     assert(3 + l1_clusters <= s->refcount_block_size);
     offset = qcow2_alloc_clusters(bs, 3 * s->cluster_size + l1_size2);
     if (offset < 0) {
@@ -3336,7 +3444,7 @@ BlockDriver bdrv_qcow2 = {
     .bdrv_co_write_zeroes   = qcow2_co_write_zeroes,
     .bdrv_co_discard        = qcow2_co_discard,
     .bdrv_truncate          = qcow2_truncate,
-    .bdrv_write_compressed  = qcow2_write_compressed,
+    .bdrv_co_write_compressed = qcow2_co_write_compressed,
     .bdrv_make_empty        = qcow2_make_empty,
 
     .bdrv_snapshot_create   = qcow2_snapshot_create,
@@ -3359,6 +3467,7 @@ BlockDriver bdrv_qcow2 = {
 
     .create_opts         = &qcow2_create_opts,
     .bdrv_check          = qcow2_check,
+    .bdrv_check_parallel = qcow2_check_parallel,
     .bdrv_amend_options  = qcow2_amend_options,
 
     .bdrv_detach_aio_context  = qcow2_detach_aio_context,
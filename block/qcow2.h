@@ -63,7 +63,7 @@
 #define MAX_CLUSTER_BITS 21
 
 /* Must be at least 2 to cover COW */
-#define MIN_L2_CACHE_SIZE 2 /* clusters */
+#define MIN_L2_CACHE_SIZE 2 /* cache entries */
 
 /* Must be at least 4 to cover all cases of refcount table growth */
 #define MIN_REFCOUNT_CACHE_SIZE 4 /* clusters */
@@ -96,7 +96,11 @@
 #define QCOW2_OPT_CACHE_SIZE "cache-size"
 #define QCOW2_OPT_L2_CACHE_SIZE "l2-cache-size"
 #define QCOW2_OPT_REFCOUNT_CACHE_SIZE "refcount-cache-size"
+#define QCOW2_OPT_L2_CACHE_ENTRY_SIZE "l2-cache-entry-size"
 #define QCOW2_OPT_CACHE_CLEAN_INTERVAL "cache-clean-interval"
+#define QCOW2_OPT_PREALLOC_SIZE "prealloc-size"
+#define QCOW2_OPT_CACHE_WARMUP_FILE "cache-warmup-file"
+#define QCOW2_OPT_FREE_EXTENT_INDEX "free-extent-index"
 
 typedef struct QCowHeader {
     uint32_t magic;
@@ -163,6 +167,9 @@ typedef struct QCowSnapshot {
 struct Qcow2Cache;
 typedef struct Qcow2Cache Qcow2Cache;
 
+struct Qcow2FreeIndex;
+typedef struct Qcow2FreeIndex Qcow2FreeIndex;
+
 typedef struct Qcow2UnknownHeaderExtension {
     uint32_t magic;
     uint32_t len;
@@ -228,6 +235,7 @@ typedef struct BDRVQcow2State {
     int cluster_sectors;
     int l2_bits;
     int l2_size;
+    int l2_slice_size; /* L2 entries per L2 cache entry, a power of 2 */
     int l1_size;
     int l1_vm_state_index;
     int refcount_block_bits;
@@ -243,9 +251,19 @@ typedef struct BDRVQcow2State {
     QEMUTimer *cache_clean_timer;
     unsigned cache_clean_interval;
 
-    uint8_t *cluster_cache;
-    uint8_t *cluster_data;
+    /* Bytes to preallocate in the image file ahead of allocating writes */
+    uint64_t prealloc_size;
+
+    /* Metadata cache warmup, see qcow2-warmup.c */
+    char *warmup_file;
+    struct Qcow2WarmupEntry *warmup_entries;
+    int warmup_nb_entries;
+    bool warmup_cancel;
+    Coroutine *warmup_co;
+
+    uint8_t *cluster_cache; /* last decompressed cluster */
     uint64_t cluster_cache_offset;
+    uint64_t cluster_cache_gen; /* bumped by qcow2_cluster_cache_reset() */
     QLIST_HEAD(QCowClusterAlloc, QCowL2Meta) cluster_allocs;
 
     uint64_t *refcount_table;
@@ -253,6 +271,7 @@ typedef struct BDRVQcow2State {
     uint32_t refcount_table_size;
     uint64_t free_cluster_index;
     uint64_t free_byte_offset;
+    Qcow2FreeIndex *free_index; /* see qcow2-free-index.c */
 
     CoMutex lock;
 
@@ -304,6 +323,9 @@ typedef struct Qcow2COWRegion {
 
     /** Number of sectors to copy */
     int         nb_sectors;
+
+    /** Whether the region is known to read as zeroes (nothing to read) */
+    bool        is_zero;
 } Qcow2COWRegion;
 
 /**
@@ -345,6 +367,12 @@ typedef struct QCowL2Meta
      */
     Qcow2COWRegion cow_end;
 
+    /**
+     * The guest data of the write request. If non-NULL, it is written together
+     * with the COW regions in a single request when the L2 table is updated.
+     */
+    QEMUIOVector *data_qiov;
+
     /** Pointer to next L2Meta of the same write request */
     struct QCowL2Meta *next;
 
@@ -429,6 +457,19 @@ static inline int offset_to_l2_index(BDRVQcow2State *s, int64_t offset)
     return (offset >> s->cluster_bits) & (s->l2_size - 1);
 }
 
+/* Index of the L2 entry for @offset within its L2 slice */
+static inline int offset_to_l2_slice_index(BDRVQcow2State *s, int64_t offset)
+{
+    return (offset >> s->cluster_bits) & (s->l2_slice_size - 1);
+}
+
+/* Offset in the image file of the L2 slice containing entry @l2_index */
+static inline uint64_t l2_slice_offset(BDRVQcow2State *s, uint64_t l2_offset,
+                                       int l2_index)
+{
+    return l2_offset + (l2_index & ~(s->l2_slice_size - 1)) * sizeof(uint64_t);
+}
+
 static inline int64_t align_offset(int64_t offset, int n)
 {
     offset = (offset + n - 1) & ~(n - 1);
@@ -475,6 +516,15 @@ static inline uint64_t l2meta_cow_end(QCowL2Meta *m)
         + (m->cow_end.nb_sectors << BDRV_SECTOR_BITS);
 }
 
+/* Drops the last decompressed cluster.  Must be called whenever guest data
+ * is written, because the write may reuse the bytes of a freed compressed
+ * cluster; decompressions that were in flight then don't fill the cache. */
+static inline void qcow2_cluster_cache_reset(BDRVQcow2State *s)
+{
+    s->cluster_cache_offset = -1;
+    s->cluster_cache_gen++;
+}
+
 static inline uint64_t refcount_diff(uint64_t r1, uint64_t r2)
 {
     return r1 > r2 ? r1 - r2 : r2 - r1;
@@ -521,6 +571,10 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
 
 int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
                           BdrvCheckMode fix);
+int qcow2_check_refcounts_parallel(BlockDriverState *bs, BdrvCheckResult *res,
+                                   BdrvCheckMode fix, int num_workers,
+                                   BlockDriverCheckStatusCB *status_cb,
+                                   void *cb_opaque);
 
 void qcow2_process_discards(BlockDriverState *bs, int ret);
 
@@ -538,7 +592,11 @@ int qcow2_grow_l1_table(BlockDriverState *bs, uint64_t min_size,
                         bool exact_size);
 int qcow2_write_l1_entry(BlockDriverState *bs, int l1_index);
 void qcow2_l2_cache_reset(BlockDriverState *bs);
-int qcow2_decompress_cluster(BlockDriverState *bs, uint64_t cluster_offset);
+void coroutine_fn qcow2_l2_prefetch(BlockDriverState *bs, uint64_t offset);
+int coroutine_fn qcow2_decompress_cluster(BlockDriverState *bs,
+                                          uint64_t cluster_offset,
+                                          int offset_in_cluster,
+                                          QEMUIOVector *qiov, size_t bytes);
 int qcow2_encrypt_sectors(BDRVQcow2State *s, int64_t sector_num,
                           uint8_t *out_buf, const uint8_t *in_buf,
                           int nb_sectors, bool enc, Error **errp);
@@ -552,6 +610,9 @@ uint64_t qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
                                          int compressed_size);
 
 int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m);
+bool qcow2_can_merge_cow(BlockDriverState *bs, QCowL2Meta *m,
+                         uint64_t guest_offset, uint64_t bytes);
+void coroutine_fn qcow2_prealloc_ahead(BlockDriverState *bs, QCowL2Meta *m);
 int qcow2_discard_clusters(BlockDriverState *bs, uint64_t offset,
     int nb_sectors, enum qcow2_discard_type type, bool full_discard);
 int qcow2_zero_clusters(BlockDriverState *bs, uint64_t offset, int nb_sectors);
@@ -576,8 +637,17 @@ int qcow2_snapshot_load_tmp(BlockDriverState *bs,
 void qcow2_free_snapshots(BlockDriverState *bs);
 int qcow2_read_snapshots(BlockDriverState *bs);
 
+/* qcow2-compress.c functions */
+ssize_t coroutine_fn
+qcow2_co_compress(BlockDriverState *bs, void *dest, size_t dest_size,
+                  const void *src, size_t src_size);
+ssize_t coroutine_fn
+qcow2_co_decompress(BlockDriverState *bs, void *dest, size_t dest_size,
+                    const void *src, size_t src_size);
+
 /* qcow2-cache.c functions */
-Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables);
+Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
+                               int table_size);
 int qcow2_cache_destroy(BlockDriverState* bs, Qcow2Cache *c);
 
 void qcow2_cache_entry_mark_dirty(BlockDriverState *bs, Qcow2Cache *c,
@@ -592,8 +662,27 @@ int qcow2_cache_empty(BlockDriverState *bs, Qcow2Cache *c);
 
 int qcow2_cache_get(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     void **table);
+int qcow2_cache_get_unlocked(BlockDriverState *bs, Qcow2Cache *c,
+    uint64_t offset, void **table);
 int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     void **table);
 void qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table);
 
+int qcow2_cache_size(Qcow2Cache *c);
+int qcow2_cache_table_size(Qcow2Cache *c);
+int qcow2_cache_get_offsets(Qcow2Cache *c, uint64_t *offsets, int max);
+
+/* qcow2-free-index.c functions */
+void qcow2_free_index_init(BlockDriverState *bs);
+void qcow2_free_index_destroy(BlockDriverState *bs);
+void qcow2_free_index_reset(BlockDriverState *bs);
+void qcow2_free_index_mark_free(BlockDriverState *bs, int64_t cluster_index);
+void qcow2_free_index_mark_used(BlockDriverState *bs, int64_t cluster_index);
+int64_t qcow2_free_index_find(BlockDriverState *bs, int64_t nb_clusters);
+
+/* qcow2-warmup.c functions */
+void qcow2_warmup_save(BlockDriverState *bs);
+void qcow2_warmup_start(BlockDriverState *bs);
+void qcow2_warmup_stop(BlockDriverState *bs);
+
 #endif
@@ -0,0 +1,726 @@
+/*
+ * Shared read cache filter
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/*
+ * The read-cache driver caches the data read from the node below it in a
+ * cache file that is mapped into memory, and that can be shared by many
+ * nodes and QEMU processes.  It is meant for base images that are used
+ * through backing chains by many VMs on the same host: the first VM that
+ * reads a part of the image puts it into the cache, all others get it from
+ * there.  Put the cache file on a tmpfs for a RAM cache, or on a local SSD.
+ *
+ * The cache is split into entries of entry-size bytes.  Each entry is keyed
+ * by the identity of the cached image and its index in the image, and lives
+ * in the one slot that this key hashes to; a newer entry simply replaces an
+ * older one.  The identity covers the device, inode number, size,
+ * modification time and generation number of every file that the image is
+ * made of, and the cache-id option.  A modified image, or a new image under
+ * the old name, therefore never sees the entries of the old one.  Images that
+ * are not only made of local files need a cache-id.
+ *
+ * The node and the image below are read-only: nobody can write the image
+ * through the cache, so a fill never races with a write to the same data.
+ *
+ * Everybody who can write the cache file controls what its users read, so it
+ * must be a regular file that only the user running QEMU can access; share it
+ * between the processes of one user only.
+ *
+ * Slots are protected by a sequence counter in shared memory, which is odd
+ * while the slot is being written.  Readers retry with the node below when
+ * the counter changed while they copied the data.  Writers first claim the
+ * slot with a byte-range lock on it in the cache file and skip the update
+ * when somebody else holds it.  The kernel drops the lock of a writer that
+ * dies, so it doesn't leave the slot unusable, whatever PID namespace the
+ * processes sharing the file run in.
+ */
+
+#include "qemu/osdep.h"
+#include <sys/file.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+#include "qemu-common.h"
+#include "qapi/error.h"
+#include "qemu/atomic.h"
+#include "qemu/queue.h"
+#include "qemu/thread.h"
+#include "block/block_int.h"
+#include "qmp-commands.h"
+#include "trace.h"
+
+#define READ_CACHE_OPT_FILE         "cache-file"
+#define READ_CACHE_OPT_ID           "cache-id"
+#define READ_CACHE_OPT_SIZE         "size"
+#define READ_CACHE_OPT_ENTRY_SIZE   "entry-size"
+
+#define READ_CACHE_DEFAULT_SIZE         (1ULL << 30)
+#define READ_CACHE_DEFAULT_ENTRY_SIZE   (64 * 1024)
+
+#define READ_CACHE_MAGIC    0x51524541444341ULL /* "QREADCA" */
+#define READ_CACHE_VERSION  3
+
+/* Open file description locks conflict between the nodes of one process,
+ * which have their own descriptions.  Traditional locks belong to the
+ * process, so its writers are additionally serialised by a mutex. */
+#ifdef F_OFD_SETLK
+#define READ_CACHE_SETLK    F_OFD_SETLK
+#else
+#define READ_CACHE_SETLK    F_SETLK
+static QemuMutex read_cache_write_lock;
+#endif
+
+/* The cache file is only used on one host, so everything is in host order */
+typedef struct ReadCacheHeader {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t entry_size;
+    uint64_t nb_entries;
+
+    /* Totals over all users of the cache file */
+    uint64_t hits;
+    uint64_t misses;
+} ReadCacheHeader;
+
+typedef struct ReadCacheSlot {
+    uint32_t seq;           /* odd while the slot is being written */
+    uint32_t reserved;
+    uint64_t image_id;      /* 0 if the slot is empty */
+    uint64_t index;         /* entry index inside the image */
+} ReadCacheSlot;
+
+typedef struct BDRVReadCacheState {
+    BlockDriverState *bs;
+    char *path;
+    int fd;
+
+    void *map;
+    size_t map_size;
+    ReadCacheHeader *header;
+    ReadCacheSlot *slots;
+    uint8_t *data;
+
+    uint64_t nb_entries;
+    uint32_t entry_size;
+    uint64_t image_id;
+
+    /* Statistics of this node, in entries */
+    uint64_t hits;
+    uint64_t misses;
+
+    QLIST_ENTRY(BDRVReadCacheState) next;
+} BDRVReadCacheState;
+
+static QLIST_HEAD(, BDRVReadCacheState) read_caches =
+    QLIST_HEAD_INITIALIZER(read_caches);
+
+static QemuOptsList runtime_opts = {
+    .name = "read-cache",
+    .head = QTAILQ_HEAD_INITIALIZER(runtime_opts.head),
+    .desc = {
+        {
+            .name = READ_CACHE_OPT_FILE,
+            .type = QEMU_OPT_STRING,
+            .help = "File that holds the cache, shared by all its users",
+        },
+        {
+            .name = READ_CACHE_OPT_ID,
+            .type = QEMU_OPT_STRING,
+            .help = "Identifies the cached image in the cache, together "
+                    "with the files it is made of",
+        },
+        {
+            .name = READ_CACHE_OPT_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Size of the cached data in bytes",
+        },
+        {
+            .name = READ_CACHE_OPT_ENTRY_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Size of a cache entry in bytes",
+        },
+        { /* end of list */ }
+    },
+};
+
+#define READ_CACHE_HASH_INIT    0xcbf29ce484222325ULL
+
+/* FNV-1a */
+static uint64_t read_cache_hash(uint64_t h, const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+
+    while (len--) {
+        h ^= *p++;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static uint64_t read_cache_hash_u64(uint64_t h, uint64_t val)
+{
+    return read_cache_hash(h, &val, sizeof(val));
+}
+
+/*
+ * Adds the identity of every file that @bs is made of to @h.  Returns false
+ * if part of the image is not a local file, whose identity can't be checked.
+ */
+static bool read_cache_hash_files(BlockDriverState *bs, uint64_t *h)
+{
+    BdrvChild *child;
+    struct stat st;
+    bool local = true;
+
+    if (!QLIST_EMPTY(&bs->children)) {
+        QLIST_FOREACH(child, &bs->children, next) {
+            local &= read_cache_hash_files(child->bs, h);
+        }
+        return local;
+    }
+
+    if (!bs->drv || (strcmp(bs->drv->format_name, "file") &&
+                     strcmp(bs->drv->format_name, "host_device"))) {
+        return false;
+    }
+    if (stat(bs->filename, &st) < 0) {
+        return false;
+    }
+
+    *h = read_cache_hash_u64(*h, st.st_dev);
+    *h = read_cache_hash_u64(*h, st.st_ino);
+    *h = read_cache_hash_u64(*h, st.st_size);
+    *h = read_cache_hash_u64(*h, st.st_mtim.tv_sec);
+    *h = read_cache_hash_u64(*h, st.st_mtim.tv_nsec);
+
+#ifdef FS_IOC_GETVERSION
+    {
+        /* Tells apart a new file that reuses the inode number */
+        int fd = qemu_open(bs->filename, O_RDONLY);
+        int generation;
+
+        if (fd >= 0) {
+            if (ioctl(fd, FS_IOC_GETVERSION, &generation) == 0) {
+                *h = read_cache_hash_u64(*h, generation);
+            }
+            qemu_close(fd);
+        }
+    }
+#endif
+
+    return true;
+}
+
+static ReadCacheSlot *read_cache_slot(BDRVReadCacheState *s, uint64_t index,
+                                      uint8_t **data)
+{
+    uint64_t h = s->image_id ^ (index * 0x9e3779b97f4a7c15ULL);
+    uint64_t i;
+
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    i = h % s->nb_entries;
+
+    *data = s->data + i * s->entry_size;
+    return &s->slots[i];
+}
+
+static size_t read_cache_data_offset(uint64_t nb_entries)
+{
+    size_t slots_end = sizeof(ReadCacheHeader) +
+                       nb_entries * sizeof(ReadCacheSlot);
+
+    return ROUND_UP(slots_end, getpagesize());
+}
+
+/*
+ * Opens the cache file, creating and initialising it if it is new.  The file
+ * lock keeps a concurrent opener from seeing a half-initialised header.
+ */
+static int read_cache_map(BDRVReadCacheState *s, uint64_t nb_entries,
+                          uint32_t entry_size, Error **errp)
+{
+    struct stat st;
+    size_t size;
+    int ret;
+
+    size = read_cache_data_offset(nb_entries) + nb_entries * entry_size;
+
+    s->fd = qemu_open(s->path, O_RDWR | O_CREAT | O_NOFOLLOW, 0600);
+    if (s->fd < 0) {
+        error_setg_errno(errp, errno, "Could not open cache file '%s'",
+                         s->path);
+        return -errno;
+    }
+
+    if (flock(s->fd, LOCK_EX) < 0) {
+        ret = -errno;
+        error_setg_errno(errp, errno, "Could not lock cache file");
+        goto fail;
+    }
+
+    if (fstat(s->fd, &st) < 0) {
+        ret = -errno;
+        error_setg_errno(errp, errno, "Could not stat cache file");
+        goto fail;
+    }
+
+    if (!S_ISREG(st.st_mode) || st.st_uid != geteuid() ||
+        (st.st_mode & (S_IRWXG | S_IRWXO))) {
+        ret = -EPERM;
+        error_setg(errp, "Cache file '%s' must be a regular file that only "
+                   "its owner can access, and be owned by the current user",
+                   s->path);
+        goto fail;
+    }
+
+    if (st.st_size == 0 && ftruncate(s->fd, size) < 0) {
+        ret = -errno;
+        error_setg_errno(errp, errno, "Could not resize cache file");
+        goto fail;
+    } else if (st.st_size != 0 && st.st_size != size) {
+        ret = -EINVAL;
+        error_setg(errp, "Cache file '%s' was created with a different size "
+                   "or entry size", s->path);
+        goto fail;
+    }
+
+    s->map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, s->fd, 0);
+    if (s->map == MAP_FAILED) {
+        ret = -errno;
+        s->map = NULL;
+        error_setg_errno(errp, errno, "Could not map cache file");
+        goto fail;
+    }
+    s->map_size = size;
+
+    s->header = s->map;
+    s->slots = (ReadCacheSlot *)(s->header + 1);
+    s->data = (uint8_t *)s->map + read_cache_data_offset(nb_entries);
+
+    if (s->header->magic == 0) {
+        /* New file; ftruncate() has zeroed all slots */
+        s->header->version = READ_CACHE_VERSION;
+        s->header->entry_size = entry_size;
+        s->header->nb_entries = nb_entries;
+        smp_wmb();
+        s->header->magic = READ_CACHE_MAGIC;
+    } else if (s->header->magic != READ_CACHE_MAGIC ||
+               s->header->version != READ_CACHE_VERSION ||
+               s->header->entry_size != entry_size ||
+               s->header->nb_entries != nb_entries) {
+        ret = -EINVAL;
+        error_setg(errp, "Cache file '%s' is not compatible with the given "
+                   "options", s->path);
+        goto fail;
+    }
+
+    flock(s->fd, LOCK_UN);
+    s->nb_entries = nb_entries;
+    s->entry_size = entry_size;
+    return 0;
+
+fail:
+    if (s->map) {
+        munmap(s->map, s->map_size);
+        s->map = NULL;
+    }
+    qemu_close(s->fd);
+    s->fd = -1;
+    return ret;
+}
+
+static int read_cache_open(BlockDriverState *bs, QDict *options, int flags,
+                           Error **errp)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    QemuOpts *opts;
+    Error *local_err = NULL;
+    const char *id;
+    uint64_t size, entry_size;
+    int ret;
+
+    s->bs = bs;
+    s->fd = -1;
+
+    if (flags & BDRV_O_RDWR) {
+        error_setg(errp, "read-cache nodes must be opened read-only");
+        return -EINVAL;
+    }
+
+    opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
+    qemu_opts_absorb_qdict(opts, options, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    if (!qemu_opt_get(opts, READ_CACHE_OPT_FILE)) {
+        error_setg(errp, "A cache file must be given");
+        ret = -EINVAL;
+        goto out;
+    }
+    s->path = g_strdup(qemu_opt_get(opts, READ_CACHE_OPT_FILE));
+
+    entry_size = qemu_opt_get_size(opts, READ_CACHE_OPT_ENTRY_SIZE,
+                                   READ_CACHE_DEFAULT_ENTRY_SIZE);
+    if (entry_size < BDRV_SECTOR_SIZE || entry_size > (1 << 24) ||
+        !is_power_of_2(entry_size)) {
+        error_setg(errp, "Cache entry size must be a power of two between "
+                   "%d and %d", BDRV_SECTOR_SIZE, 1 << 24);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    size = qemu_opt_get_size(opts, READ_CACHE_OPT_SIZE,
+                             READ_CACHE_DEFAULT_SIZE);
+    if (size < entry_size || size > SIZE_MAX / 2) {
+        error_setg(errp, "Invalid cache size");
+        ret = -EINVAL;
+        goto out;
+    }
+
+    bs->file = bdrv_open_child(NULL, options, "image", bs, &child_file, false,
+                               &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    if (!bdrv_is_read_only(bs->file->bs)) {
+        error_setg(errp, "The image of a read-cache node must be read-only");
+        ret = -EINVAL;
+        goto fail_child;
+    }
+
+    id = qemu_opt_get(opts, READ_CACHE_OPT_ID) ?: "";
+    s->image_id = read_cache_hash(READ_CACHE_HASH_INIT, id, strlen(id) + 1);
+    if (!read_cache_hash_files(bs->file->bs, &s->image_id) && !*id) {
+        error_setg(errp, "A cache-id must be given for images that are not "
+                   "only made of local files");
+        ret = -EINVAL;
+        goto fail_child;
+    }
+    s->image_id = read_cache_hash_u64(s->image_id,
+                                      bdrv_getlength(bs->file->bs)) ?: 1;
+
+    ret = read_cache_map(s, size / entry_size, entry_size, errp);
+    if (ret < 0) {
+        goto fail_child;
+    }
+
+    QLIST_INSERT_HEAD(&read_caches, s, next);
+    ret = 0;
+    goto out;
+
+fail_child:
+    bdrv_unref_child(bs, bs->file);
+    bs->file = NULL;
+out:
+    if (ret < 0) {
+        g_free(s->path);
+        s->path = NULL;
+    }
+    qemu_opts_del(opts);
+    return ret;
+}
+
+static void read_cache_close(BlockDriverState *bs)
+{
+    BDRVReadCacheState *s = bs->opaque;
+
+    QLIST_REMOVE(s, next);
+    munmap(s->map, s->map_size);
+    qemu_close(s->fd);
+    g_free(s->path);
+}
+
+static int read_cache_reopen_prepare(BDRVReopenState *reopen_state,
+                                     BlockReopenQueue *queue, Error **errp)
+{
+    if (reopen_state->flags & BDRV_O_RDWR) {
+        error_setg(errp, "read-cache nodes must be read-only");
+        return -EINVAL;
+    }
+    return 0;
+}
+
+static int64_t read_cache_getlength(BlockDriverState *bs)
+{
+    return bdrv_getlength(bs->file->bs);
+}
+
+/*
+ * Copies @bytes bytes at @offset into entry @index from the cache into @qiov
+ * at @qiov_offset.  Returns false if the entry is not cached, in which case
+ * the contents of that part of @qiov are undefined.
+ */
+static bool read_cache_lookup(BDRVReadCacheState *s, uint64_t index,
+                              uint32_t offset, size_t bytes,
+                              QEMUIOVector *qiov, size_t qiov_offset)
+{
+    uint8_t *data;
+    ReadCacheSlot *slot = read_cache_slot(s, index, &data);
+    uint32_t seq;
+
+    seq = atomic_read(&slot->seq);
+    if (seq & 1) {
+        return false;
+    }
+    smp_rmb();
+
+    /* The key may be torn if it is being written, the check of the sequence
+     * counter below catches this */
+    if (slot->image_id != s->image_id || slot->index != index) {
+        return false;
+    }
+
+    qemu_iovec_from_buf(qiov, qiov_offset, data + offset, bytes);
+
+    /* The entry must not have been replaced while we copied it */
+    smp_rmb();
+    return atomic_read(&slot->seq) == seq;
+}
+
+/*
+ * Claims @slot for writing by locking its bytes in the cache file.  Returns
+ * false if another writer holds it.
+ */
+static bool read_cache_claim(BDRVReadCacheState *s, ReadCacheSlot *slot)
+{
+    struct flock fl = {
+        .l_type     = F_WRLCK,
+        .l_whence   = SEEK_SET,
+        .l_start    = (uint8_t *)slot - (uint8_t *)s->map,
+        .l_len      = sizeof(*slot),
+    };
+
+    return fcntl(s->fd, READ_CACHE_SETLK, &fl) == 0;
+}
+
+static void read_cache_release(BDRVReadCacheState *s, ReadCacheSlot *slot)
+{
+    struct flock fl = {
+        .l_type     = F_UNLCK,
+        .l_whence   = SEEK_SET,
+        .l_start    = (uint8_t *)slot - (uint8_t *)s->map,
+        .l_len      = sizeof(*slot),
+    };
+
+    fcntl(s->fd, READ_CACHE_SETLK, &fl);
+}
+
+static void read_cache_insert(BDRVReadCacheState *s, uint64_t index,
+                              const uint8_t *buf, size_t bytes)
+{
+    uint8_t *data;
+    ReadCacheSlot *slot = read_cache_slot(s, index, &data);
+    uint32_t seq;
+
+#ifndef F_OFD_SETLK
+    qemu_mutex_lock(&read_cache_write_lock);
+#endif
+    if (read_cache_claim(s, slot)) {
+        /* Already odd if the previous writer died half-way */
+        seq = atomic_read(&slot->seq) | 1;
+        atomic_set(&slot->seq, seq);
+        smp_wmb();
+
+        slot->image_id = s->image_id;
+        slot->index = index;
+        memcpy(data, buf, bytes);
+        memset(data + bytes, 0, s->entry_size - bytes);
+
+        smp_wmb();
+        atomic_set(&slot->seq, seq + 1);
+        read_cache_release(s, slot);
+    }
+#ifndef F_OFD_SETLK
+    qemu_mutex_unlock(&read_cache_write_lock);
+#endif
+}
+
+/*
+ * Reads [@start, @end) of the image from bs->file into @qiov, which starts at
+ * image offset @qiov_base.  Whole entries are read and added to the cache.
+ */
+static int coroutine_fn read_cache_fill(BlockDriverState *bs, uint64_t start,
+                                        uint64_t end, QEMUIOVector *qiov,
+                                        uint64_t qiov_base)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    uint64_t image_end = bs->total_sectors * BDRV_SECTOR_SIZE;
+    uint64_t read_start = QEMU_ALIGN_DOWN(start, s->entry_size);
+    uint64_t read_end = MIN(QEMU_ALIGN_UP(end, s->entry_size), image_end);
+    uint64_t pos;
+    QEMUIOVector local_qiov;
+    struct iovec iov;
+    uint8_t *buf;
+    int ret;
+
+    trace_read_cache_fill(bs, read_start, read_end - read_start);
+
+    buf = qemu_try_blockalign(bs->file->bs, read_end - read_start);
+    if (buf == NULL) {
+        return -ENOMEM;
+    }
+
+    iov = (struct iovec) {
+        .iov_base   = buf,
+        .iov_len    = read_end - read_start,
+    };
+    qemu_iovec_init_external(&local_qiov, &iov, 1);
+
+    ret = bdrv_co_readv(bs->file->bs, read_start >> BDRV_SECTOR_BITS,
+                        iov.iov_len >> BDRV_SECTOR_BITS, &local_qiov);
+    if (ret < 0) {
+        goto out;
+    }
+
+    qemu_iovec_from_buf(qiov, start - qiov_base, buf + (start - read_start),
+                        end - start);
+
+    for (pos = read_start; pos < read_end; pos += s->entry_size) {
+        read_cache_insert(s, pos / s->entry_size, buf + (pos - read_start),
+                          MIN(s->entry_size, read_end - pos));
+    }
+
+out:
+    qemu_vfree(buf);
+    return ret;
+}
+
+static int coroutine_fn read_cache_co_readv(BlockDriverState *bs,
+                                            int64_t sector_num, int nb_sectors,
+                                            QEMUIOVector *qiov)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    uint64_t offset = sector_num * BDRV_SECTOR_SIZE;
+    uint64_t end = offset + nb_sectors * BDRV_SECTOR_SIZE;
+    uint64_t pos, miss_start = end;
+    uint64_t hits = 0, misses = 0;
+    int ret = 0;
+
+    for (pos = offset; pos < end; ) {
+        uint64_t index = pos / s->entry_size;
+        uint64_t chunk_end = MIN((index + 1) * s->entry_size, end);
+
+        if (read_cache_lookup(s, index, pos - index * s->entry_size,
+                              chunk_end - pos, qiov, pos - offset)) {
+            hits++;
+            if (miss_start < pos) {
+                /* Read consecutive misses with a single request */
+                ret = read_cache_fill(bs, miss_start, pos, qiov, offset);
+                if (ret < 0) {
+                    goto out;
+                }
+            }
+            miss_start = end;
+        } else {
+            misses++;
+            miss_start = MIN(miss_start, pos);
+        }
+        pos = chunk_end;
+    }
+
+    if (miss_start < end) {
+        ret = read_cache_fill(bs, miss_start, end, qiov, offset);
+    }
+
+out:
+    s->hits += hits;
+    s->misses += misses;
+    atomic_add(&s->header->hits, hits);
+    atomic_add(&s->header->misses, misses);
+    return ret;
+}
+
+/* The block layer already refuses writes to read-only nodes */
+static int coroutine_fn read_cache_co_writev(BlockDriverState *bs,
+                                             int64_t sector_num,
+                                             int nb_sectors,
+                                             QEMUIOVector *qiov)
+{
+    return -EPERM;
+}
+
+static int64_t coroutine_fn
+read_cache_co_get_block_status(BlockDriverState *bs, int64_t sector_num,
+                               int nb_sectors, int *pnum,
+                               BlockDriverState **file)
+{
+    *pnum = nb_sectors;
+    *file = bs->file->bs;
+    return BDRV_BLOCK_RAW | BDRV_BLOCK_OFFSET_VALID | BDRV_BLOCK_DATA |
+           (sector_num << BDRV_SECTOR_BITS);
+}
+
+static bool read_cache_recurse_is_first_non_filter(BlockDriverState *bs,
+                                                   BlockDriverState *candidate)
+{
+    return bdrv_recurse_is_first_non_filter(bs->file->bs, candidate);
+}
+
+ReadCacheInfoList *qmp_query_read_cache(Error **errp)
+{
+    ReadCacheInfoList *head = NULL, **p_next = &head;
+    BDRVReadCacheState *s;
+
+    QLIST_FOREACH(s, &read_caches, next) {
+        ReadCacheInfoList *entry = g_new0(ReadCacheInfoList, 1);
+        ReadCacheInfo *info = g_new0(ReadCacheInfo, 1);
+
+        if (s->bs->node_name[0]) {
+            info->has_node_name = true;
+            info->node_name = g_strdup(s->bs->node_name);
+        }
+        info->cache_file = g_strdup(s->path);
+        info->size = s->nb_entries * s->entry_size;
+        info->entry_size = s->entry_size;
+        info->hits = s->hits;
+        info->misses = s->misses;
+        info->shared_hits = s->header->hits;
+        info->shared_misses = s->header->misses;
+
+        entry->value = info;
+        *p_next = entry;
+        p_next = &entry->next;
+    }
+
+    return head;
+}
+
+static BlockDriver bdrv_read_cache = {
+    .format_name            = "read-cache",
+    .protocol_name          = "read-cache",
+    .instance_size          = sizeof(BDRVReadCacheState),
+
+    .bdrv_file_open         = read_cache_open,
+    .bdrv_close             = read_cache_close,
+    .bdrv_reopen_prepare    = read_cache_reopen_prepare,
+    .bdrv_getlength         = read_cache_getlength,
+
+    .bdrv_co_readv          = read_cache_co_readv,
+    .bdrv_co_writev         = read_cache_co_writev,
+    .bdrv_co_get_block_status = read_cache_co_get_block_status,
+
+    .is_filter                        = true,
+    .bdrv_recurse_is_first_non_filter = read_cache_recurse_is_first_non_filter,
+};
+
+static void bdrv_read_cache_init(void)
+{
+#ifndef F_OFD_SETLK
+    qemu_mutex_init(&read_cache_write_lock);
+#endif
+    bdrv_register(&bdrv_read_cache);
+}
+
+block_init(bdrv_read_cache_init);
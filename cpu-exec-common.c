@@ -24,6 +24,8 @@
 
 bool exit_request;
 CPUState *tcg_current_cpu;
+bool mttcg_enabled;
+bool parallel_cpus;
 
 /* exit the current TB from a signal handler. The host registers are
    restored in a state compatible with the CPU emulator
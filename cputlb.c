@@ -58,6 +58,33 @@
 /* statistics */
 int tlb_flush_count;
 
+/* With multi-threaded TCG a vCPU keeps using its TLB while a device, the
+ * main loop or another vCPU asks for it to be flushed.  Such requests are
+ * deferred to an exclusive section that runs on the vCPU's own thread.
+ */
+static bool tlb_flush_is_remote(CPUState *cpu)
+{
+    return qemu_tcg_mttcg_enabled() && cpu->created && !qemu_cpu_is_self(cpu);
+}
+
+static void tlb_flush_safe_work(void *data)
+{
+    tlb_flush(data, 1);
+}
+
+typedef struct TLBFlushPageData {
+    CPUState *cpu;
+    target_ulong addr;
+} TLBFlushPageData;
+
+static void tlb_flush_page_safe_work(void *data)
+{
+    TLBFlushPageData *d = data;
+
+    tlb_flush_page(d->cpu, d->addr);
+    g_free(d);
+}
+
 /* NOTE:
  * If flush_global is true (the usual case), flush all tlb entries.
  * If flush_global is false, flush (at least) all tlb entries not
@@ -74,6 +101,11 @@ void tlb_flush(CPUState *cpu, int flush_global)
 {
     CPUArchState *env = cpu->env_ptr;
 
+    if (tlb_flush_is_remote(cpu)) {
+        async_safe_run_on_cpu(cpu, tlb_flush_safe_work, cpu);
+        return;
+    }
+
     tlb_debug("(%d)\n", flush_global);
 
     /* must reset current TB so that interrupts cannot modify the
@@ -141,6 +173,15 @@ void tlb_flush_page(CPUState *cpu, target_ulong addr)
     int i;
     int mmu_idx;
 
+    if (tlb_flush_is_remote(cpu)) {
+        TLBFlushPageData *d = g_new(TLBFlushPageData, 1);
+
+        d->cpu = cpu;
+        d->addr = addr;
+        async_safe_run_on_cpu(cpu, tlb_flush_page_safe_work, d);
+        return;
+    }
+
     tlb_debug("page :" TARGET_FMT_lx "\n", addr);
 
     /* Check if we need to flush due to large pages.  */
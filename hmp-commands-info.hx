@@ -572,6 +572,21 @@ STEXI
 @item info migrate_cache_size
 @findex migrate_cache_size
 Show current migration xbzrle cache size.
+ETEXI
+
+    {
+        .name       = "dirty_rate",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show the dirty page rate of the guest and its vcpus",
+        .mhandler.cmd = hmp_info_dirty_rate,
+    },
+
+STEXI
+@item info dirty_rate
+@findex dirty_rate
+Show the dirty page rate of the guest and of each vcpu, as measured by the
+last or current migration.
 ETEXI
 
     {
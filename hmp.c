@@ -205,6 +205,14 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->ram->normal_bytes >> 10);
         monitor_printf(mon, "dirty sync count: %" PRIu64 "\n",
                        info->ram->dirty_sync_count);
+        monitor_printf(mon, "dirty sync time: %" PRIu64 " us (last), %"
+                       PRIu64 " us (total)\n",
+                       info->ram->dirty_sync_time_last,
+                       info->ram->dirty_sync_time_total);
+        monitor_printf(mon, "zero scan time: %" PRIu64 " us\n",
+                       info->ram->zero_scan_time);
+        monitor_printf(mon, "send time: %" PRIu64 " us\n",
+                       info->ram->send_time);
         if (info->ram->dirty_pages_rate) {
             monitor_printf(mon, "dirty pages rate: %" PRIu64 " pages\n",
                            info->ram->dirty_pages_rate);
@@ -235,6 +243,17 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->xbzrle_cache->overflow);
     }
 
+    if (info->has_compression) {
+        CompressionCodecStatsList *codec;
+
+        for (codec = info->compression; codec; codec = codec->next) {
+            monitor_printf(mon, "%s compressed pages: %" PRIu64 " pages, "
+                           "ratio %0.2f, %0.1f MB/s per thread\n",
+                           codec->value->codec, codec->value->pages,
+                           codec->value->ratio, codec->value->throughput);
+        }
+    }
+
     if (info->has_x_cpu_throttle_percentage) {
         monitor_printf(mon, "cpu throttle percentage: %" PRIu64 "\n",
                        info->x_cpu_throttle_percentage);
@@ -286,6 +305,18 @@ void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, " %s: %" PRId64,
             MigrationParameter_lookup[MIGRATION_PARAMETER_X_CPU_THROTTLE_INCREMENT],
             params->x_cpu_throttle_increment);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_X_MULTIFD_CHANNELS],
+            params->x_multifd_channels);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_X_ZERO_SCAN_THREADS],
+            params->x_zero_scan_threads);
+        monitor_printf(mon, " %s: %s",
+            MigrationParameter_lookup[MIGRATION_PARAMETER_COMPRESS_ALGORITHM],
+            MigrationCompressAlgorithm_lookup[params->compress_algorithm]);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_X_XBZRLE_THREADS],
+            params->x_xbzrle_threads);
         monitor_printf(mon, "\n");
     }
 
@@ -298,6 +329,34 @@ void hmp_info_migrate_cache_size(Monitor *mon, const QDict *qdict)
                    qmp_query_migrate_cache_size(NULL) >> 10);
 }
 
+void hmp_info_dirty_rate(Monitor *mon, const QDict *qdict)
+{
+    DirtyRateInfo *info;
+    DirtyRateVcpuList *vcpu;
+    Error *err = NULL;
+
+    info = qmp_query_dirty_rate(&err);
+    if (err) {
+        hmp_handle_error(mon, &err);
+        return;
+    }
+
+    monitor_printf(mon, "dirty pages rate: %" PRId64 " pages/s%s\n",
+                   info->dirty_rate,
+                   info->estimated ? " (vcpus estimated by CPU time)" : "");
+    for (vcpu = info->vcpus; vcpu; vcpu = vcpu->next) {
+        monitor_printf(mon, "  vcpu %" PRId64 ": %" PRId64 " pages/s",
+                       vcpu->value->cpu_index, vcpu->value->dirty_rate);
+        if (vcpu->value->throttle_percentage) {
+            monitor_printf(mon, ", throttled %" PRId64 "%%",
+                           vcpu->value->throttle_percentage);
+        }
+        monitor_printf(mon, "\n");
+    }
+
+    qapi_free_DirtyRateInfo(info);
+}
+
 void hmp_info_cpus(Monitor *mon, const QDict *qdict)
 {
     CpuInfoList *cpu_list, *cpu;
@@ -1235,13 +1294,19 @@ void hmp_migrate_set_capability(Monitor *mon, const QDict *qdict)
 void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
 {
     const char *param = qdict_get_str(qdict, "parameter");
-    int value = qdict_get_int(qdict, "value");
+    const char *valuestr = qdict_get_str(qdict, "value");
+    int64_t value = 0;
+    int compress_algorithm = 0;
     Error *err = NULL;
     bool has_compress_level = false;
     bool has_compress_threads = false;
     bool has_decompress_threads = false;
     bool has_x_cpu_throttle_initial = false;
     bool has_x_cpu_throttle_increment = false;
+    bool has_x_multifd_channels = false;
+    bool has_x_zero_scan_threads = false;
+    bool has_compress_algorithm = false;
+    bool has_x_xbzrle_threads = false;
     int i;
 
     for (i = 0; i < MIGRATION_PARAMETER__MAX; i++) {
@@ -1262,12 +1327,43 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
             case MIGRATION_PARAMETER_X_CPU_THROTTLE_INCREMENT:
                 has_x_cpu_throttle_increment = true;
                 break;
+            case MIGRATION_PARAMETER_X_MULTIFD_CHANNELS:
+                has_x_multifd_channels = true;
+                break;
+            case MIGRATION_PARAMETER_X_ZERO_SCAN_THREADS:
+                has_x_zero_scan_threads = true;
+                break;
+            case MIGRATION_PARAMETER_COMPRESS_ALGORITHM:
+                has_compress_algorithm = true;
+                break;
+            case MIGRATION_PARAMETER_X_XBZRLE_THREADS:
+                has_x_xbzrle_threads = true;
+                break;
+            }
+
+            if (has_compress_algorithm) {
+                compress_algorithm = qapi_enum_parse(
+                    MigrationCompressAlgorithm_lookup, valuestr,
+                    MIGRATION_COMPRESS_ALGORITHM__MAX, -1, &err);
+                if (err) {
+                    break;
+                }
+            } else if (qemu_strtoll(valuestr, NULL, 0, &value) < 0) {
+                error_setg(&err, QERR_INVALID_PARAMETER_VALUE, param,
+                           "an integer");
+                break;
             }
+
             qmp_migrate_set_parameters(has_compress_level, value,
                                        has_compress_threads, value,
                                        has_decompress_threads, value,
                                        has_x_cpu_throttle_initial, value,
                                        has_x_cpu_throttle_increment, value,
+                                       has_x_multifd_channels, value,
+                                       has_x_zero_scan_threads, value,
+                                       has_compress_algorithm,
+                                       compress_algorithm,
+                                       has_x_xbzrle_threads, value,
                                        &err);
             break;
         }
@@ -2008,8 +2104,20 @@ void hmp_info_iothreads(Monitor *mon, const QDict *qdict)
     IOThreadInfoList *info;
 
     for (info = info_list; info; info = info->next) {
+        IOThreadInfo *value = info->value;
+
         monitor_printf(mon, "%s: thread_id=%" PRId64 "\n",
-                       info->value->id, info->value->thread_id);
+                       value->id, value->thread_id);
+        if (value->poll_max_ns) {
+            monitor_printf(mon, "    poll-max-ns=%" PRId64
+                           " poll-grow=%" PRId64 " poll-shrink=%" PRId64
+                           " poll-ns=%" PRId64 "\n",
+                           value->poll_max_ns, value->poll_grow,
+                           value->poll_shrink, value->poll_ns);
+            monitor_printf(mon, "    poll-hits=%" PRIu64
+                           " poll-misses=%" PRIu64 "\n",
+                           value->poll_hits, value->poll_misses);
+        }
     }
 
     qapi_free_IOThreadInfoList(info_list);
@@ -23,6 +23,8 @@
 #include "hw/virtio/virtio-blk.h"
 #include "virtio-blk.h"
 #include "block/aio.h"
+#include "exec/memory.h"
+#include "exec/address-spaces.h"
 #include "hw/virtio/virtio-bus.h"
 #include "qom/object_interfaces.h"
 
@@ -49,8 +51,18 @@ struct VirtIOBlockDataPlane {
 
     /* Operation blocker on BDS */
     Error *blocker;
+
+    /* Guest RAM registered with the BlockBackend, see x-register-ram */
+    MemoryListener ram_listener;
+    GArray *ram;
 };
 
+typedef struct DataPlaneRam {
+    void *host;
+    size_t size;
+    unsigned int refcnt;        /* aliases map the same RAM more than once */
+} DataPlaneRam;
+
 /* Raise an interrupt to signal guest, if necessary */
 void virtio_blk_data_plane_notify(VirtIOBlockDataPlane *s)
 {
@@ -195,6 +207,120 @@ static void virtio_blk_data_plane_handle_output(VirtIODevice *vdev,
     virtio_blk_handle_vq(s, vq);
 }
 
+static DataPlaneRam *data_plane_find_ram(VirtIOBlockDataPlane *s,
+                                         void *host, size_t size,
+                                         unsigned int *index)
+{
+    unsigned int i;
+
+    for (i = 0; i < s->ram->len; i++) {
+        DataPlaneRam *ram = &g_array_index(s->ram, DataPlaneRam, i);
+
+        if (ram->host == host && ram->size == size) {
+            *index = i;
+            return ram;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Let the host I/O engine pin guest RAM once instead of on every request.
+ * The listener follows hotplug and remapping, so that the engine never
+ * keeps using memory that has gone away.
+ */
+static void data_plane_ram_add(MemoryListener *listener,
+                               MemoryRegionSection *section)
+{
+    VirtIOBlockDataPlane *s = container_of(listener, VirtIOBlockDataPlane,
+                                           ram_listener);
+    DataPlaneRam *ram, new_ram;
+    unsigned int i;
+
+    if (!memory_region_is_ram(section->mr)) {
+        return;
+    }
+
+    new_ram.host = memory_region_get_ram_ptr(section->mr) +
+                   section->offset_within_region;
+    new_ram.size = int128_get64(section->size);
+    new_ram.refcnt = 1;
+
+    ram = data_plane_find_ram(s, new_ram.host, new_ram.size, &i);
+    if (ram) {
+        ram->refcnt++;
+        return;
+    }
+    g_array_append_val(s->ram, new_ram);
+
+    aio_context_acquire(s->ctx);
+    blk_register_buf(s->conf->conf.blk, new_ram.host, new_ram.size);
+    aio_context_release(s->ctx);
+}
+
+static void data_plane_ram_del(MemoryListener *listener,
+                               MemoryRegionSection *section)
+{
+    VirtIOBlockDataPlane *s = container_of(listener, VirtIOBlockDataPlane,
+                                           ram_listener);
+    DataPlaneRam *ram;
+    void *host;
+    size_t size;
+    unsigned int i;
+
+    if (!memory_region_is_ram(section->mr)) {
+        return;
+    }
+
+    host = memory_region_get_ram_ptr(section->mr) +
+           section->offset_within_region;
+    size = int128_get64(section->size);
+    ram = data_plane_find_ram(s, host, size, &i);
+    if (!ram || --ram->refcnt) {
+        return;
+    }
+    g_array_remove_index_fast(s->ram, i);
+
+    aio_context_acquire(s->ctx);
+    blk_unregister_buf(s->conf->conf.blk, host, size);
+    aio_context_release(s->ctx);
+}
+
+/* Context: QEMU global mutex held */
+static void data_plane_register_ram(VirtIOBlockDataPlane *s)
+{
+    if (!s->conf->register_ram) {
+        return;
+    }
+
+    s->ram = g_array_new(false, false, sizeof(DataPlaneRam));
+    s->ram_listener = (MemoryListener) {
+        .region_add = data_plane_ram_add,
+        .region_del = data_plane_ram_del,
+    };
+    /* Calls region_add for everything that is already mapped */
+    memory_listener_register(&s->ram_listener, &address_space_memory);
+}
+
+/* Context: QEMU global mutex held */
+static void data_plane_unregister_ram(VirtIOBlockDataPlane *s)
+{
+    unsigned int i;
+
+    if (!s->ram) {
+        return;
+    }
+
+    memory_listener_unregister(&s->ram_listener);
+    for (i = 0; i < s->ram->len; i++) {
+        DataPlaneRam *ram = &g_array_index(s->ram, DataPlaneRam, i);
+
+        blk_unregister_buf(s->conf->conf.blk, ram->host, ram->size);
+    }
+    g_array_free(s->ram, true);
+    s->ram = NULL;
+}
+
 /* Context: QEMU global mutex held */
 void virtio_blk_data_plane_start(VirtIOBlockDataPlane *s)
 {
@@ -232,6 +358,8 @@ void virtio_blk_data_plane_start(VirtIOBlockDataPlane *s)
 
     blk_set_aio_context(s->conf->conf.blk, s->ctx);
 
+    data_plane_register_ram(s);
+
     /* Kick right away to begin processing requests already in vring */
     event_notifier_set(virtio_queue_get_host_notifier(s->vq));
 
@@ -280,6 +408,9 @@ void virtio_blk_data_plane_stop(VirtIOBlockDataPlane *s)
 
     aio_context_release(s->ctx);
 
+    /* Nothing is in flight any more, so this takes effect immediately */
+    data_plane_unregister_ram(s);
+
     k->set_host_notifier(qbus->parent, 0, false);
 
     /* Clean up guest notifier (irq) */
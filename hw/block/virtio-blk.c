@@ -45,22 +45,40 @@ void virtio_blk_free_request(VirtIOBlockReq *req)
     }
 }
 
-static void virtio_blk_req_complete(VirtIOBlockReq *req, unsigned char status)
+static void virtio_blk_notify(VirtIOBlock *s)
 {
-    VirtIOBlock *s = req->dev;
-    VirtIODevice *vdev = VIRTIO_DEVICE(s);
+    if (s->dataplane_started && !s->dataplane_disabled) {
+        virtio_blk_data_plane_notify(s->dataplane);
+    } else {
+        virtio_notify(VIRTIO_DEVICE(s), s->vq);
+    }
+}
 
+/* Put @req in slot @idx of the used ring; see virtio_blk_complete_batch() */
+static void virtio_blk_req_fill(VirtIOBlockReq *req, unsigned char status,
+                                unsigned int idx)
+{
     trace_virtio_blk_req_complete(req, status);
 
     stb_p(&req->in->status, status);
-    virtqueue_push(s->vq, &req->elem, req->in_len);
-    if (s->dataplane_started && !s->dataplane_disabled) {
-        virtio_blk_data_plane_notify(s->dataplane);
-    } else {
-        virtio_notify(vdev, s->vq);
+    virtqueue_fill(req->dev->vq, &req->elem, req->in_len, idx);
+}
+
+/* Publish the @count requests filled so far and notify the guest once */
+static void virtio_blk_complete_batch(VirtIOBlock *s, unsigned int count)
+{
+    if (count) {
+        virtqueue_flush(s->vq, count);
+        virtio_blk_notify(s);
     }
 }
 
+static void virtio_blk_req_complete(VirtIOBlockReq *req, unsigned char status)
+{
+    virtio_blk_req_fill(req, status, 0);
+    virtio_blk_complete_batch(req->dev, 1);
+}
+
 static int virtio_blk_handle_rw_error(VirtIOBlockReq *req, int error,
     bool is_read)
 {
@@ -87,6 +105,8 @@ static int virtio_blk_handle_rw_error(VirtIOBlockReq *req, int error,
 static void virtio_blk_rw_complete(void *opaque, int ret)
 {
     VirtIOBlockReq *next = opaque;
+    VirtIOBlock *s = next->dev;
+    unsigned int done = 0;
 
     while (next) {
         VirtIOBlockReq *req = next;
@@ -110,16 +130,26 @@ static void virtio_blk_rw_complete(void *opaque, int ret)
              * it is acceptable because the device is free to write to
              * the memory until the request is completed (which will
              * happen on the other side of the migration).
+             *
+             * The error path may complete the request on its own, so
+             * publish what has been filled so far first.
              */
+            virtio_blk_complete_batch(s, done);
+            done = 0;
             if (virtio_blk_handle_rw_error(req, -ret, is_read)) {
                 continue;
             }
         }
 
-        virtio_blk_req_complete(req, VIRTIO_BLK_S_OK);
+        /* Merged requests all complete together: fill the used ring
+         * for each of them and flush it once at the end.
+         */
+        virtio_blk_req_fill(req, VIRTIO_BLK_S_OK, done++);
         block_acct_done(blk_get_stats(req->dev->blk), &req->acct);
         virtio_blk_free_request(req);
     }
+
+    virtio_blk_complete_batch(s, done);
 }
 
 static void virtio_blk_flush_complete(void *opaque, int ret)
@@ -187,16 +217,6 @@ out:
 
 #endif
 
-static VirtIOBlockReq *virtio_blk_get_request(VirtIOBlock *s)
-{
-    VirtIOBlockReq *req = virtqueue_pop(s->vq, sizeof(VirtIOBlockReq));
-
-    if (req) {
-        virtio_blk_init_request(s, req);
-    }
-    return req;
-}
-
 static int virtio_blk_handle_scsi_req(VirtIOBlockReq *req)
 {
     int status = VIRTIO_BLK_S_OK;
@@ -580,13 +600,18 @@ void virtio_blk_handle_request(VirtIOBlockReq *req, MultiReqBuffer *mrb)
 
 void virtio_blk_handle_vq(VirtIOBlock *s, VirtQueue *vq)
 {
-    VirtIOBlockReq *req;
+    VirtIOBlockReq *reqs[VIRTQUEUE_MAX_BATCH];
+    unsigned int i, num;
     MultiReqBuffer mrb = {};
 
     blk_io_plug(s->blk);
 
-    while ((req = virtio_blk_get_request(s))) {
-        virtio_blk_handle_request(req, &mrb);
+    while ((num = virtqueue_pop_batch(s->vq, sizeof(VirtIOBlockReq),
+                                      (void **)reqs, ARRAY_SIZE(reqs)))) {
+        for (i = 0; i < num; i++) {
+            virtio_blk_init_request(s, reqs[i]);
+            virtio_blk_handle_request(reqs[i], &mrb);
+        }
     }
 
     if (mrb.num_reqs) {
@@ -943,6 +968,8 @@ static Property virtio_blk_properties[] = {
 #endif
     DEFINE_PROP_BIT("request-merging", VirtIOBlock, conf.request_merging, 0,
                     true),
+    DEFINE_PROP_BIT("x-register-ram", VirtIOBlock, conf.register_ram, 0,
+                    false),
     DEFINE_PROP_END_OF_LIST(),
 };
 
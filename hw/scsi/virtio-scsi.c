@@ -181,6 +181,21 @@ static VirtIOSCSIReq *virtio_scsi_pop_req(VirtIOSCSI *s, VirtQueue *vq)
     return req;
 }
 
+static unsigned int virtio_scsi_pop_req_batch(VirtIOSCSI *s, VirtQueue *vq,
+                                              VirtIOSCSIReq **reqs,
+                                              unsigned int max)
+{
+    VirtIOSCSICommon *vs = (VirtIOSCSICommon *)s;
+    unsigned int i, num;
+
+    num = virtqueue_pop_batch(vq, sizeof(VirtIOSCSIReq) + vs->cdb_size,
+                              (void **)reqs, max);
+    for (i = 0; i < num; i++) {
+        virtio_scsi_init_req(s, vq, reqs[i]);
+    }
+    return num;
+}
+
 static void virtio_scsi_save_request(QEMUFile *f, SCSIRequest *sreq)
 {
     VirtIOSCSIReq *req = sreq->hba_private;
@@ -570,12 +585,17 @@ static void virtio_scsi_handle_cmd_req_submit(VirtIOSCSI *s, VirtIOSCSIReq *req)
 
 void virtio_scsi_handle_cmd_vq(VirtIOSCSI *s, VirtQueue *vq)
 {
-    VirtIOSCSIReq *req, *next;
+    VirtIOSCSIReq *req, *next, *batch[VIRTQUEUE_MAX_BATCH];
     QTAILQ_HEAD(, VirtIOSCSIReq) reqs = QTAILQ_HEAD_INITIALIZER(reqs);
-
-    while ((req = virtio_scsi_pop_req(s, vq))) {
-        if (virtio_scsi_handle_cmd_req_prepare(s, req)) {
-            QTAILQ_INSERT_TAIL(&reqs, req, next);
+    unsigned int i, num;
+
+    while ((num = virtio_scsi_pop_req_batch(s, vq, batch,
+                                            ARRAY_SIZE(batch)))) {
+        for (i = 0; i < num; i++) {
+            req = batch[i];
+            if (virtio_scsi_handle_cmd_req_prepare(s, req)) {
+                QTAILQ_INSERT_TAIL(&reqs, req, next);
+            }
         }
     }
 
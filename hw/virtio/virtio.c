@@ -23,6 +23,7 @@
 #include "hw/virtio/virtio-bus.h"
 #include "migration/migration.h"
 #include "hw/virtio/virtio-access.h"
+#include "hw/xen/xen.h"
 
 /*
  * The alignment to use between consumer and producer parts of vring.
@@ -101,13 +102,228 @@ struct VirtQueue
     EventNotifier guest_notifier;
     EventNotifier host_notifier;
     QLIST_ENTRY(VirtQueue) node;
+
+    /* Host addresses of the descriptor table and of the available ring,
+     * resolved against the GPA->HVA cache whose generation is ring_gen.
+     * NULL if the ring is not entirely inside one RAM section.
+     */
+    unsigned int ring_gen;
+    VRingDesc *desc_hva;
+    VRingAvail *avail_hva;
 };
 
+/*
+ * GPA->HVA cache for guest RAM.
+ *
+ * cpu_physical_memory_map() walks the dispatch tree of the address space
+ * for every descriptor, but virtio buffers are nearly always plain RAM.
+ * Keep a sorted table of the RAM sections of address_space_memory instead,
+ * rebuilt by a MemoryListener whenever the memory topology changes.  The
+ * table holds a reference to each MemoryRegion and is only freed after an
+ * RCU grace period, so host pointers taken from it are valid for as long
+ * as the RCU critical section they were looked up in.
+ */
+typedef struct VirtIOMemSection {
+    hwaddr gpa;
+    hwaddr size;
+    uint8_t *hva;
+    MemoryRegion *mr;
+} VirtIOMemSection;
+
+typedef struct VirtIOMemMap {
+    struct rcu_head rcu;
+    unsigned int generation;
+    unsigned int num;
+    VirtIOMemSection sections[];
+} VirtIOMemMap;
+
+static struct {
+    MemoryListener listener;
+    GArray *pending;
+    VirtIOMemMap *map;
+    unsigned int generation;
+} virtio_mem;
+
+static void virtio_mem_begin(MemoryListener *listener)
+{
+    g_array_set_size(virtio_mem.pending, 0);
+}
+
+static void virtio_mem_region_add(MemoryListener *listener,
+                                  MemoryRegionSection *section)
+{
+    MemoryRegion *mr = section->mr;
+    VirtIOMemSection s;
+
+    if (!memory_region_is_ram(mr) || memory_region_is_rom(mr) ||
+        section->readonly) {
+        return;
+    }
+
+    /* Sections are reported in address order, so the table stays sorted */
+    s.gpa = section->offset_within_address_space;
+    s.size = int128_get64(section->size);
+    s.hva = (uint8_t *)memory_region_get_ram_ptr(mr) +
+            section->offset_within_region;
+    s.mr = mr;
+    g_array_append_val(virtio_mem.pending, s);
+}
+
+static void virtio_mem_free(VirtIOMemMap *map)
+{
+    unsigned int i;
+
+    for (i = 0; i < map->num; i++) {
+        memory_region_unref(map->sections[i].mr);
+    }
+    g_free(map);
+}
+
+static void virtio_mem_commit(MemoryListener *listener)
+{
+    VirtIOMemMap *old = virtio_mem.map, *map;
+    GArray *pending = virtio_mem.pending;
+    size_t size = pending->len * sizeof(VirtIOMemSection);
+    unsigned int i;
+
+    /* Most transactions do not touch RAM; keep the rings' cached
+     * translations valid across those.
+     */
+    if (old && old->num == pending->len &&
+        !memcmp(old->sections, pending->data, size)) {
+        return;
+    }
+
+    map = g_malloc(sizeof(*map) + size);
+    /* Generation 0 means "not resolved" in VirtQueue */
+    if (!++virtio_mem.generation) {
+        virtio_mem.generation++;
+    }
+    map->generation = virtio_mem.generation;
+    map->num = pending->len;
+    memcpy(map->sections, pending->data, size);
+    for (i = 0; i < map->num; i++) {
+        memory_region_ref(map->sections[i].mr);
+    }
+
+    atomic_rcu_set(&virtio_mem.map, map);
+    if (old) {
+        call_rcu(old, virtio_mem_free, rcu);
+    }
+}
+
+static void virtio_mem_init(void)
+{
+    /* Xen maps guest memory on demand, always go through its map cache */
+    if (virtio_mem.pending || xen_enabled()) {
+        return;
+    }
+
+    virtio_mem.pending = g_array_new(false, false, sizeof(VirtIOMemSection));
+    virtio_mem.listener = (MemoryListener) {
+        .begin = virtio_mem_begin,
+        .commit = virtio_mem_commit,
+        .region_add = virtio_mem_region_add,
+        .region_nop = virtio_mem_region_add,
+        .priority = 10,
+    };
+    memory_listener_register(&virtio_mem.listener, &address_space_memory);
+}
+
+/* Must be called within an RCU critical section */
+static VirtIOMemSection *virtio_mem_find(VirtIOMemMap *map, hwaddr gpa)
+{
+    unsigned int lo = 0, hi = map ? map->num : 0;
+
+    while (lo < hi) {
+        unsigned int mid = lo + (hi - lo) / 2;
+        VirtIOMemSection *s = &map->sections[mid];
+
+        if (gpa < s->gpa) {
+            hi = mid;
+        } else if (gpa - s->gpa >= s->size) {
+            lo = mid + 1;
+        } else {
+            return s;
+        }
+    }
+    return NULL;
+}
+
+/* Host pointer to [gpa, gpa + len) if it lies in a single RAM section,
+ * NULL otherwise.  Must be called within an RCU critical section.
+ */
+static void *virtio_mem_lookup(VirtIOMemMap *map, hwaddr gpa, hwaddr len)
+{
+    VirtIOMemSection *s = virtio_mem_find(map, gpa);
+
+    if (!s || len > s->size - (gpa - s->gpa)) {
+        return NULL;
+    }
+    return s->hva + (gpa - s->gpa);
+}
+
+/* Like cpu_physical_memory_map(), and unmapped the same way, but served
+ * from the GPA->HVA cache when @gpa is in guest RAM.
+ */
+static void *virtio_mem_map(hwaddr gpa, hwaddr *plen, bool is_write)
+{
+    VirtIOMemSection *s;
+    void *ptr;
+
+    rcu_read_lock();
+    s = virtio_mem_find(atomic_rcu_read(&virtio_mem.map), gpa);
+    if (!s) {
+        rcu_read_unlock();
+        return cpu_physical_memory_map(gpa, plen, is_write);
+    }
+
+    *plen = MIN(*plen, s->size - (gpa - s->gpa));
+    ptr = s->hva + (gpa - s->gpa);
+    /* Dropped by address_space_unmap(), as for a regular mapping */
+    memory_region_ref(s->mr);
+    rcu_read_unlock();
+
+    return ptr;
+}
+
+/* Resolve the host addresses of the rings of @vq if the GPA->HVA cache
+ * changed since the last time.  Must be called within an RCU critical
+ * section, which also bounds the lifetime of the pointers.
+ */
+static void vring_cache_refresh(VirtQueue *vq)
+{
+    VirtIOMemMap *map = atomic_rcu_read(&virtio_mem.map);
+
+    if (!map) {
+        vq->desc_hva = NULL;
+        vq->avail_hva = NULL;
+        return;
+    }
+    if (vq->ring_gen == map->generation) {
+        return;
+    }
+
+    vq->desc_hva = virtio_mem_lookup(map, vq->vring.desc,
+                                     vq->vring.num * sizeof(VRingDesc));
+    /* Include used_event, which follows the ring */
+    vq->avail_hva = virtio_mem_lookup(map, vq->vring.avail,
+                                      offsetof(VRingAvail,
+                                               ring[vq->vring.num + 1]));
+    vq->ring_gen = map->generation;
+}
+
+static inline void vring_cache_invalidate(VirtQueue *vq)
+{
+    vq->ring_gen = 0;
+}
+
 /* virt queue functions */
 void virtio_queue_update_rings(VirtIODevice *vdev, int n)
 {
     VRing *vring = &vdev->vq[n].vring;
 
+    vring_cache_invalidate(&vdev->vq[n]);
     if (!vring->desc) {
         /* not yet setup -> nothing to do */
         return;
@@ -118,37 +334,68 @@ void virtio_queue_update_rings(VirtIODevice *vdev, int n)
                               vring->align);
 }
 
-static void vring_desc_read(VirtIODevice *vdev, VRingDesc *desc,
+static void vring_desc_read(VirtQueue *vq, VRingDesc *desc,
                             hwaddr desc_pa, int i)
 {
-    address_space_read(&address_space_memory, desc_pa + i * sizeof(VRingDesc),
-                       MEMTXATTRS_UNSPECIFIED, (void *)desc, sizeof(VRingDesc));
+    VirtIODevice *vdev = vq->vdev;
+    const VRingDesc *ptr;
+
+    rcu_read_lock();
+    if (desc_pa == vq->vring.desc) {
+        vring_cache_refresh(vq);
+        ptr = vq->desc_hva ? &vq->desc_hva[i] : NULL;
+    } else {
+        /* Indirect table */
+        ptr = virtio_mem_lookup(atomic_rcu_read(&virtio_mem.map),
+                                desc_pa + i * sizeof(VRingDesc),
+                                sizeof(VRingDesc));
+    }
+    if (ptr) {
+        memcpy(desc, ptr, sizeof(VRingDesc));
+    } else {
+        address_space_read(&address_space_memory,
+                           desc_pa + i * sizeof(VRingDesc),
+                           MEMTXATTRS_UNSPECIFIED, (void *)desc,
+                           sizeof(VRingDesc));
+    }
+    rcu_read_unlock();
+
     virtio_tswap64s(vdev, &desc->addr);
     virtio_tswap32s(vdev, &desc->len);
     virtio_tswap16s(vdev, &desc->flags);
     virtio_tswap16s(vdev, &desc->next);
 }
 
+static uint16_t vring_avail_read(VirtQueue *vq, hwaddr offset)
+{
+    uint16_t val;
+
+    rcu_read_lock();
+    vring_cache_refresh(vq);
+    if (vq->avail_hva) {
+        val = virtio_lduw_p(vq->vdev, (uint8_t *)vq->avail_hva + offset);
+    } else {
+        val = virtio_lduw_phys(vq->vdev, vq->vring.avail + offset);
+    }
+    rcu_read_unlock();
+
+    return val;
+}
+
 static inline uint16_t vring_avail_flags(VirtQueue *vq)
 {
-    hwaddr pa;
-    pa = vq->vring.avail + offsetof(VRingAvail, flags);
-    return virtio_lduw_phys(vq->vdev, pa);
+    return vring_avail_read(vq, offsetof(VRingAvail, flags));
 }
 
 static inline uint16_t vring_avail_idx(VirtQueue *vq)
 {
-    hwaddr pa;
-    pa = vq->vring.avail + offsetof(VRingAvail, idx);
-    vq->shadow_avail_idx = virtio_lduw_phys(vq->vdev, pa);
+    vq->shadow_avail_idx = vring_avail_read(vq, offsetof(VRingAvail, idx));
     return vq->shadow_avail_idx;
 }
 
 static inline uint16_t vring_avail_ring(VirtQueue *vq, int i)
 {
-    hwaddr pa;
-    pa = vq->vring.avail + offsetof(VRingAvail, ring[i]);
-    return virtio_lduw_phys(vq->vdev, pa);
+    return vring_avail_read(vq, offsetof(VRingAvail, ring[i]));
 }
 
 static inline uint16_t vring_get_used_event(VirtQueue *vq)
@@ -267,6 +514,7 @@ void virtqueue_discard(VirtQueue *vq, const VirtQueueElement *elem,
                        unsigned int len)
 {
     vq->last_avail_idx--;
+    vq->inuse--;
     virtqueue_unmap_sg(vq, elem, len);
 }
 
@@ -343,7 +591,7 @@ static unsigned int virtqueue_get_head(VirtQueue *vq, unsigned int idx)
     return head;
 }
 
-static unsigned virtqueue_read_next_desc(VirtIODevice *vdev, VRingDesc *desc,
+static unsigned virtqueue_read_next_desc(VirtQueue *vq, VRingDesc *desc,
                                          hwaddr desc_pa, unsigned int max)
 {
     unsigned int next;
@@ -363,7 +611,7 @@ static unsigned virtqueue_read_next_desc(VirtIODevice *vdev, VRingDesc *desc,
         exit(1);
     }
 
-    vring_desc_read(vdev, desc, desc_pa, next);
+    vring_desc_read(vq, desc, desc_pa, next);
     return next;
 }
 
@@ -378,7 +626,6 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
 
     total_bufs = in_total = out_total = 0;
     while (virtqueue_num_heads(vq, idx)) {
-        VirtIODevice *vdev = vq->vdev;
         unsigned int max, num_bufs, indirect = 0;
         VRingDesc desc;
         hwaddr desc_pa;
@@ -388,7 +635,7 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
         num_bufs = total_bufs;
         i = virtqueue_get_head(vq, idx++);
         desc_pa = vq->vring.desc;
-        vring_desc_read(vdev, &desc, desc_pa, i);
+        vring_desc_read(vq, &desc, desc_pa, i);
 
         if (desc.flags & VRING_DESC_F_INDIRECT) {
             if (desc.len % sizeof(VRingDesc)) {
@@ -407,7 +654,7 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
             max = desc.len / sizeof(VRingDesc);
             desc_pa = desc.addr;
             num_bufs = i = 0;
-            vring_desc_read(vdev, &desc, desc_pa, i);
+            vring_desc_read(vq, &desc, desc_pa, i);
         }
 
         do {
@@ -425,7 +672,7 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
             if (in_total >= max_in_bytes && out_total >= max_out_bytes) {
                 goto done;
             }
-        } while ((i = virtqueue_read_next_desc(vdev, &desc, desc_pa, max)) != max);
+        } while ((i = virtqueue_read_next_desc(vq, &desc, desc_pa, max)) != max);
 
         if (!indirect)
             total_bufs = num_bufs;
@@ -465,7 +712,7 @@ static void virtqueue_map_desc(unsigned int *p_num_sg, hwaddr *addr, struct iove
             exit(1);
         }
 
-        iov[num_sg].iov_base = cpu_physical_memory_map(pa, &len, is_write);
+        iov[num_sg].iov_base = virtio_mem_map(pa, &len, is_write);
         iov[num_sg].iov_len = len;
         addr[num_sg] = pa;
 
@@ -538,35 +785,23 @@ void *virtqueue_alloc_element(size_t sz, unsigned out_num, unsigned in_num)
     return elem;
 }
 
-void *virtqueue_pop(VirtQueue *vq, size_t sz)
+static void *virtqueue_map_chain(VirtQueue *vq, size_t sz, unsigned int head)
 {
-    unsigned int i, head, max;
+    unsigned int i, max;
     hwaddr desc_pa = vq->vring.desc;
-    VirtIODevice *vdev = vq->vdev;
     VirtQueueElement *elem;
     unsigned out_num, in_num;
     hwaddr addr[VIRTQUEUE_MAX_SIZE];
     struct iovec iov[VIRTQUEUE_MAX_SIZE];
     VRingDesc desc;
 
-    if (virtio_queue_empty(vq)) {
-        return NULL;
-    }
-    /* Needed after virtio_queue_empty(), see comment in
-     * virtqueue_num_heads(). */
-    smp_rmb();
-
     /* When we start there are none of either input nor output. */
     out_num = in_num = 0;
 
     max = vq->vring.num;
 
-    i = head = virtqueue_get_head(vq, vq->last_avail_idx++);
-    if (virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX)) {
-        vring_set_avail_event(vq, vq->last_avail_idx);
-    }
-
-    vring_desc_read(vdev, &desc, desc_pa, i);
+    i = head;
+    vring_desc_read(vq, &desc, desc_pa, i);
     if (desc.flags & VRING_DESC_F_INDIRECT) {
         if (desc.len % sizeof(VRingDesc)) {
             error_report("Invalid size for indirect buffer table");
@@ -577,7 +812,7 @@ void *virtqueue_pop(VirtQueue *vq, size_t sz)
         max = desc.len / sizeof(VRingDesc);
         desc_pa = desc.addr;
         i = 0;
-        vring_desc_read(vdev, &desc, desc_pa, i);
+        vring_desc_read(vq, &desc, desc_pa, i);
     }
 
     /* Collect all the descriptors */
@@ -599,7 +834,7 @@ void *virtqueue_pop(VirtQueue *vq, size_t sz)
             error_report("Looped descriptor");
             exit(1);
         }
-    } while ((i = virtqueue_read_next_desc(vdev, &desc, desc_pa, max)) != max);
+    } while ((i = virtqueue_read_next_desc(vq, &desc, desc_pa, max)) != max);
 
     /* Now copy what we have collected and mapped */
     elem = virtqueue_alloc_element(sz, out_num, in_num);
@@ -619,6 +854,63 @@ void *virtqueue_pop(VirtQueue *vq, size_t sz)
     return elem;
 }
 
+void *virtqueue_pop(VirtQueue *vq, size_t sz)
+{
+    unsigned int head;
+
+    if (virtio_queue_empty(vq)) {
+        return NULL;
+    }
+    /* Needed after virtio_queue_empty(), see comment in
+     * virtqueue_num_heads(). */
+    smp_rmb();
+
+    head = virtqueue_get_head(vq, vq->last_avail_idx++);
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
+        vring_set_avail_event(vq, vq->last_avail_idx);
+    }
+
+    return virtqueue_map_chain(vq, sz, head);
+}
+
+unsigned int virtqueue_pop_batch(VirtQueue *vq, size_t sz, void **elems,
+                                 unsigned int max)
+{
+    unsigned int i, num;
+
+    if (!max || virtio_queue_empty(vq)) {
+        return 0;
+    }
+
+    /* virtio_queue_empty() has just refreshed shadow_avail_idx, so every
+     * head up to it can be taken without going back to the guest memory.
+     */
+    num = (uint16_t)(vq->shadow_avail_idx - vq->last_avail_idx);
+    if (num > vq->vring.num) {
+        error_report("Guest moved used index from %u to %u",
+                     vq->last_avail_idx, vq->shadow_avail_idx);
+        exit(1);
+    }
+    num = MIN(num, max);
+
+    /* A single barrier covers all the heads, see comment in
+     * virtqueue_num_heads(). */
+    smp_rmb();
+
+    for (i = 0; i < num; i++) {
+        unsigned int head = virtqueue_get_head(vq, vq->last_avail_idx++);
+
+        elems[i] = virtqueue_map_chain(vq, sz, head);
+    }
+
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
+        vring_set_avail_event(vq, vq->last_avail_idx);
+    }
+
+    trace_virtqueue_pop_batch(vq, num);
+    return num;
+}
+
 /* Reading and writing a structure directly to QEMUFile is *awful*, but
  * it is what QEMU has always done by mistake.  We can change it sooner
  * or later by bumping the version number of the affected vm states.
@@ -810,6 +1102,7 @@ void virtio_reset(void *opaque)
         vdev->vq[i].signalled_used_valid = false;
         vdev->vq[i].notification = true;
         vdev->vq[i].vring.num = vdev->vq[i].vring.num_default;
+        vring_cache_invalidate(&vdev->vq[i]);
     }
 }
 
@@ -1019,6 +1312,7 @@ void virtio_queue_set_rings(VirtIODevice *vdev, int n, hwaddr desc,
     vdev->vq[n].vring.desc = desc;
     vdev->vq[n].vring.avail = avail;
     vdev->vq[n].vring.used = used;
+    vring_cache_invalidate(&vdev->vq[n]);
 }
 
 void virtio_queue_set_num(VirtIODevice *vdev, int n, int num)
@@ -1032,6 +1326,7 @@ void virtio_queue_set_num(VirtIODevice *vdev, int n, int num)
         return;
     }
     vdev->vq[n].vring.num = num;
+    vring_cache_invalidate(&vdev->vq[n]);
 }
 
 VirtQueue *virtio_vector_first_queue(VirtIODevice *vdev, uint16_t vector)
@@ -1595,6 +1890,8 @@ int virtio_load(VirtIODevice *vdev, QEMUFile *f, int version_id)
     }
 
     for (i = 0; i < num; i++) {
+        /* The subsections may have moved the rings */
+        vring_cache_invalidate(&vdev->vq[i]);
         if (vdev->vq[i].vring.desc) {
             uint16_t nheads;
             nheads = vring_avail_idx(&vdev->vq[i]) - vdev->vq[i].last_avail_idx;
@@ -1675,6 +1972,7 @@ void virtio_init(VirtIODevice *vdev, const char *name,
     vdev->config_vector = VIRTIO_NO_VECTOR;
     vdev->vq = g_malloc0(sizeof(VirtQueue) * VIRTIO_QUEUE_MAX);
     vdev->vm_running = runstate_is_running();
+    virtio_mem_init();
     for (i = 0; i < VIRTIO_QUEUE_MAX; i++) {
         vdev->vq[i].vector = VIRTIO_NO_VECTOR;
         vdev->vq[i].vdev = vdev;
@@ -1800,6 +2098,19 @@ static void virtio_queue_host_notifier_aio_read(EventNotifier *n)
     }
 }
 
+static bool virtio_queue_host_notifier_aio_poll(void *opaque)
+{
+    EventNotifier *n = opaque;
+    VirtQueue *vq = container_of(n, VirtQueue, host_notifier);
+
+    if (!vq->vring.desc || virtio_queue_empty(vq)) {
+        return false;
+    }
+
+    virtio_queue_notify_aio_vq(vq);
+    return true;
+}
+
 void virtio_queue_aio_set_host_notifier_handler(VirtQueue *vq, AioContext *ctx,
                                                 void (*handle_output)(VirtIODevice *,
                                                                       VirtQueue *))
@@ -1808,6 +2119,8 @@ void virtio_queue_aio_set_host_notifier_handler(VirtQueue *vq, AioContext *ctx,
         vq->handle_aio_output = handle_output;
         aio_set_event_notifier(ctx, &vq->host_notifier, true,
                                virtio_queue_host_notifier_aio_read);
+        aio_set_event_notifier_poll(ctx, &vq->host_notifier,
+                                    virtio_queue_host_notifier_aio_poll);
     } else {
         aio_set_event_notifier(ctx, &vq->host_notifier, true, NULL);
         /* Test and clear notifier before after disabling event,
@@ -46,6 +46,7 @@ void qemu_aio_ref(void *p);
 typedef struct AioHandler AioHandler;
 typedef void QEMUBHFunc(void *opaque);
 typedef void IOHandler(void *opaque);
+typedef bool AioPollFn(void *opaque);
 
 struct AioContext {
     GSource source;
@@ -128,6 +129,18 @@ struct AioContext {
     int epollfd;
     bool epoll_enabled;
     bool epoll_available;
+
+    /* Adaptive polling, see aio_poll() in aio-posix.c.  aio_poll() updates
+     * poll_ns and the counters with the AioContext acquired; other threads
+     * must acquire it too before reading them.
+     */
+    int poll_disable_cnt;   /* number of AioHandlers without ->io_poll() */
+    int64_t poll_ns;        /* current polling time in nanoseconds */
+    int64_t poll_max_ns;    /* maximum polling time in nanoseconds */
+    int64_t poll_grow;      /* polling time growth factor */
+    int64_t poll_shrink;    /* polling time shrink factor */
+    uint64_t poll_hits;     /* blocking aio_poll() calls served by polling */
+    uint64_t poll_misses;   /* ...and those that had to block afterwards */
 };
 
 /**
@@ -327,6 +340,23 @@ void aio_set_event_notifier(AioContext *ctx,
                             bool is_external,
                             EventNotifierHandler *io_read);
 
+/* Set a busy-polling callback for a file descriptor that was registered with
+ * aio_set_fd_handler().  @io_poll checks for activity without a system call,
+ * processes it, and returns true if progress was made.  It is removed along
+ * with the handler.
+ *
+ * Polling is only used while all handlers in the AioContext have an
+ * @io_poll callback, because the others would not be served during polling.
+ */
+void aio_set_fd_poll(AioContext *ctx, int fd, AioPollFn *io_poll);
+
+/* Same as aio_set_fd_poll() for an event notifier registered with
+ * aio_set_event_notifier().  @io_poll receives the notifier as its argument.
+ */
+void aio_set_event_notifier_poll(AioContext *ctx,
+                                 EventNotifier *notifier,
+                                 AioPollFn *io_poll);
+
 /* Return a GSource that lets the main loop poll the file descriptors attached
  * to this AioContext.
  */
@@ -441,4 +471,18 @@ static inline bool aio_node_check(AioContext *ctx, bool is_external)
  */
 void aio_context_setup(AioContext *ctx, Error **errp);
 
+/**
+ * aio_context_set_poll_params:
+ * @ctx: the aio context
+ * @max_ns: how long to busy poll for, in nanoseconds; 0 disables polling
+ * @grow: polling time growth factor; 0 selects the default
+ * @shrink: polling time shrink factor; 0 selects the default
+ *
+ * Blocking aio_poll() calls busy-wait on the handlers' ->io_poll() callbacks
+ * for up to @max_ns before going to sleep.  The polling time adapts between
+ * 0 and @max_ns depending on how long the event loop actually had to wait.
+ */
+void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
+                                 int64_t grow, int64_t shrink, Error **errp);
+
 #endif
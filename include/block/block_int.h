@@ -209,6 +209,9 @@ struct BlockDriver {
 
     int (*bdrv_write_compressed)(BlockDriverState *bs, int64_t sector_num,
                                  const uint8_t *buf, int nb_sectors);
+    /* Preferred over bdrv_write_compressed if both are set */
+    int coroutine_fn (*bdrv_co_write_compressed)(BlockDriverState *bs,
+        int64_t sector_num, int nb_sectors, QEMUIOVector *qiov);
 
     int (*bdrv_snapshot_create)(BlockDriverState *bs,
                                 QEMUSnapshotInfo *sn_info);
@@ -256,6 +259,15 @@ struct BlockDriver {
     int (*bdrv_check)(BlockDriverState* bs, BdrvCheckResult *result,
         BdrvCheckMode fix);
 
+    /*
+     * Like bdrv_check, but may use up to num_workers concurrent workers and
+     * reports its progress through status_cb (which may be NULL).
+     */
+    int (*bdrv_check_parallel)(BlockDriverState *bs, BdrvCheckResult *result,
+                               BdrvCheckMode fix, int num_workers,
+                               BlockDriverCheckStatusCB *status_cb,
+                               void *cb_opaque);
+
     int (*bdrv_amend_options)(BlockDriverState *bs, QemuOpts *opts,
                               BlockDriverAmendStatusCB *status_cb,
                               void *cb_opaque);
@@ -296,6 +308,14 @@ struct BlockDriver {
     void (*bdrv_io_unplug)(BlockDriverState *bs);
     void (*bdrv_flush_io_queue)(BlockDriverState *bs);
 
+    /* Tell the driver that a host memory area will be used for I/O buffers,
+     * e.g. so that it can be pinned and registered with the kernel once
+     * rather than mapped on every request.
+     */
+    void (*bdrv_register_buf)(BlockDriverState *bs, void *host, size_t size);
+    void (*bdrv_unregister_buf)(BlockDriverState *bs, void *host,
+                                size_t size);
+
     /**
      * Try to get @bs's logical and physical block size.
      * On success, store them in @bsz and return zero.
@@ -392,6 +412,14 @@ struct BlockDriverState {
     int sg;        /* if true, the device is a /dev/sg* */
     int copy_on_read; /* if true, copy read backing sectors into image
                          note this is a reference count */
+
+    /* Copy-on-read prefetching, see bdrv_cor_prefetch_update() */
+    uint64_t cor_prefetch_max;      /* 0 if disabled */
+    int64_t cor_prefetch_next;      /* offset of the next sequential read */
+    unsigned int cor_prefetch_seq;  /* number of sequential reads in a row */
+    int64_t cor_prefetch_end;       /* prefetch was started up to here */
+    Coroutine *cor_prefetch_co;
+    bool cor_prefetch_cancel;
     bool probed;
 
     BlockDriver *drv; /* NULL means no media */
@@ -211,8 +211,8 @@ static inline void tlb_flush_by_mmuidx(CPUState *cpu, ...)
 
 #define CODE_GEN_ALIGN           16 /* must be >= of the size of a icache line */
 
-#define CODE_GEN_PHYS_HASH_BITS     15
-#define CODE_GEN_PHYS_HASH_SIZE     (1 << CODE_GEN_PHYS_HASH_BITS)
+#define CODE_GEN_HTABLE_BITS     15
+#define CODE_GEN_HTABLE_SIZE     (1 << CODE_GEN_HTABLE_BITS)
 
 /* Estimated block size for TB allocation.  */
 /* ??? The following is based on a 2015 survey of x86_64 host output.
@@ -240,6 +240,7 @@ struct TranslationBlock {
                            size <= TARGET_PAGE_SIZE) */
     uint16_t icount;
     uint32_t cflags;    /* compile flags */
+    bool invalid;       /* set once the TB has been removed from the hash */
 #define CF_COUNT_MASK  0x7fff
 #define CF_LAST_IO     0x8000 /* Last insn may be an IO access.  */
 #define CF_NOCACHE     0x10000 /* To be freed after execution */
@@ -248,8 +249,6 @@ struct TranslationBlock {
 
     void *tc_ptr;    /* pointer to the translated code */
     uint8_t *tc_search;  /* pointer to search data */
-    /* next matching tb for physical address. */
-    struct TranslationBlock *phys_hash_next;
     /* original tb when cflags has CF_NOCACHE */
     struct TranslationBlock *orig_tb;
     /* first and second physical page containing code. The lower bit
@@ -274,13 +273,15 @@ struct TranslationBlock {
 };
 
 #include "qemu/thread.h"
+#include "qemu/qht.h"
 
 typedef struct TBContext TBContext;
 
 struct TBContext {
 
     TranslationBlock *tbs;
-    TranslationBlock *tb_phys_hash[CODE_GEN_PHYS_HASH_SIZE];
+    /* TBs indexed by tb_hash_func(); lookups are lock-free under RCU */
+    QHT htable;
     int nb_tbs;
     /* any access to the tbs or the page table must use this lock */
     QemuMutex tb_lock;
@@ -465,4 +466,22 @@ extern int singlestep;
 extern CPUState *tcg_current_cpu;
 extern bool exit_request;
 
+/* cpu-exec-common.c, set up by qemu_tcg_configure() and qemu_init_vcpu()
+ * before any vCPU runs.
+ *
+ * mttcg_enabled selects one host thread per vCPU instead of a single thread
+ * round-robining between all of them.  parallel_cpus tells the translators
+ * that other vCPUs may run concurrently; a target that cannot map a guest
+ * atomic operation onto host atomics should then end the TB with
+ * EXCP_ATOMIC, so that the instruction is replayed by cpu_exec_step_atomic()
+ * while all other vCPUs are stopped.
+ */
+extern bool mttcg_enabled;
+extern bool parallel_cpus;
+#define qemu_tcg_mttcg_enabled() (mttcg_enabled)
+
+#if !defined(CONFIG_USER_ONLY)
+void cpu_exec_step_atomic(CPUState *cpu);
+#endif
+
 #endif
@@ -21,6 +21,7 @@
 
 #ifndef CONFIG_USER_ONLY
 #include "hw/xen/xen.h"
+#include "qemu/cutils.h"
 
 struct RAMBlock {
     struct rcu_head rcu;
@@ -36,6 +37,15 @@ struct RAMBlock {
     /* RCU-enabled, writes protected by the ramlist lock */
     QLIST_ENTRY(RAMBlock) next;
     int fd;
+    /* Dirty bitmap used during migration, indexed by target page within
+     * the block; NULL when no migration is running.
+     */
+    unsigned long *bmap;
+    /* Bitmap of pages that haven't been sent even once; only maintained
+     * and used in postcopy, where it's used to send the dirtymap at the
+     * start of the postcopy phase.
+     */
+    unsigned long *unsentmap;
 };
 
 static inline bool offset_in_ramblock(RAMBlock *b, ram_addr_t offset)
@@ -75,6 +85,7 @@ static inline void *ramblock_ptr(RAMBlock *block, ram_addr_t offset)
  * pointed to from the new DirtyMemoryBlocks).
  */
 #define DIRTY_MEMORY_BLOCK_SIZE ((ram_addr_t)256 * 1024 * 8)
+#define DIRTY_MEMORY_BLOCK_ALIGN 64
 typedef struct {
     struct rcu_head rcu;
     unsigned long *blocks[];
@@ -395,56 +406,88 @@ static inline void cpu_physical_memory_clear_dirty_range(ram_addr_t start,
 }
 
 
+/* Number of words of the dirty log checked at once for clean stretches.
+ * With 64-bit words a stride is 512 bytes, a multiple of the unrolled
+ * length of every buffer_is_zero() vector path up to AVX-512; the log
+ * blocks are allocated with DIRTY_MEMORY_BLOCK_ALIGN to match.
+ */
+#define DIRTY_MEMORY_SYNC_STRIDE 64
+
+/*
+ * Move the DIRTY_MEMORY_MIGRATION bits of [start, start + length) within
+ * @rb into rb->bmap, and return how many pages were newly marked dirty.
+ * Concurrent callers must use ranges that do not share a word of rb->bmap.
+ */
 static inline
-uint64_t cpu_physical_memory_sync_dirty_bitmap(unsigned long *dest,
+uint64_t cpu_physical_memory_sync_dirty_bitmap(RAMBlock *rb,
                                                ram_addr_t start,
                                                ram_addr_t length)
 {
-    ram_addr_t addr;
-    unsigned long page = BIT_WORD(start >> TARGET_PAGE_BITS);
+    ram_addr_t addr = 0;
+    unsigned long *dest = rb->bmap;
+    unsigned long page = BIT_WORD((rb->offset + start) >> TARGET_PAGE_BITS);
     uint64_t num_dirty = 0;
 
-    /* start address is aligned at the start of a word? */
-    if (((page * BITS_PER_LONG) << TARGET_PAGE_BITS) == start) {
-        int k;
-        int nr = BITS_TO_LONGS(length >> TARGET_PAGE_BITS);
+    /* start address and destination are aligned at the start of a word? */
+    if (((page * BITS_PER_LONG) << TARGET_PAGE_BITS) == rb->offset + start &&
+        !((start >> TARGET_PAGE_BITS) % BITS_PER_LONG)) {
+        unsigned long k;
+        /* Only whole words: the last one may be shared with the next block */
+        unsigned long nr = (length >> TARGET_PAGE_BITS) / BITS_PER_LONG;
         unsigned long * const *src;
         unsigned long idx = (page * BITS_PER_LONG) / DIRTY_MEMORY_BLOCK_SIZE;
         unsigned long offset = BIT_WORD((page * BITS_PER_LONG) %
                                         DIRTY_MEMORY_BLOCK_SIZE);
+        unsigned long dest_page = BIT_WORD(start >> TARGET_PAGE_BITS);
 
         rcu_read_lock();
 
         src = atomic_rcu_read(
                 &ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION])->blocks;
 
-        for (k = page; k < page + nr; k++) {
-            if (src[idx][offset]) {
+        for (k = 0; k < nr; ) {
+            unsigned long n = 1;
+
+            /* Most of the log is clean between two syncs; skip it a
+             * stride at a time, buffer_is_zero() vectorizes the test.
+             */
+            if (!(offset % DIRTY_MEMORY_SYNC_STRIDE) &&
+                nr - k >= DIRTY_MEMORY_SYNC_STRIDE &&
+                buffer_is_zero(&src[idx][offset],
+                               DIRTY_MEMORY_SYNC_STRIDE *
+                               sizeof(unsigned long))) {
+                n = DIRTY_MEMORY_SYNC_STRIDE;
+            } else if (src[idx][offset]) {
                 unsigned long bits = atomic_xchg(&src[idx][offset], 0);
                 unsigned long new_dirty;
-                new_dirty = ~dest[k];
-                dest[k] |= bits;
+                new_dirty = ~dest[dest_page + k];
+                dest[dest_page + k] |= bits;
                 new_dirty &= bits;
                 num_dirty += ctpopl(new_dirty);
             }
 
-            if (++offset >= BITS_TO_LONGS(DIRTY_MEMORY_BLOCK_SIZE)) {
+            k += n;
+            offset += n;
+            if (offset >= BITS_TO_LONGS(DIRTY_MEMORY_BLOCK_SIZE)) {
                 offset = 0;
                 idx++;
             }
         }
 
         rcu_read_unlock();
-    } else {
-        for (addr = 0; addr < length; addr += TARGET_PAGE_SIZE) {
-            if (cpu_physical_memory_test_and_clear_dirty(
-                        start + addr,
-                        TARGET_PAGE_SIZE,
-                        DIRTY_MEMORY_MIGRATION)) {
-                long k = (start + addr) >> TARGET_PAGE_BITS;
-                if (!test_and_set_bit(k, dest)) {
-                    num_dirty++;
-                }
+
+        addr = ((ram_addr_t)nr * BITS_PER_LONG) << TARGET_PAGE_BITS;
+    }
+
+    /* Whatever is not word aligned is done a page at a time */
+    for (; addr < length; addr += TARGET_PAGE_SIZE) {
+        if (cpu_physical_memory_test_and_clear_dirty(
+                    rb->offset + start + addr,
+                    TARGET_PAGE_SIZE,
+                    DIRTY_MEMORY_MIGRATION)) {
+            long k = (start + addr) >> TARGET_PAGE_BITS;
+            if (!test_and_set_bit(k, dest)) {
+                num_dirty++;
             }
         }
     }
@@ -452,6 +495,6 @@ uint64_t cpu_physical_memory_sync_dirty_bitmap(unsigned long *dest,
     return num_dirty;
 }
 
-void migration_bitmap_extend(ram_addr_t old, ram_addr_t new);
+void migration_bitmap_add_block(RAMBlock *rb);
 #endif
 #endif
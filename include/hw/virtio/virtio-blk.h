@@ -38,6 +38,7 @@ struct VirtIOBlkConf
     uint32_t scsi;
     uint32_t config_wce;
     uint32_t request_merging;
+    uint32_t register_ram;
 };
 
 struct VirtIOBlockDataPlane;
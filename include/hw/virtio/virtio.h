@@ -41,6 +41,9 @@ typedef struct VirtQueue VirtQueue;
 
 #define VIRTQUEUE_MAX_SIZE 1024
 
+/* Upper bound on the elements devices pop with one virtqueue_pop_batch() */
+#define VIRTQUEUE_MAX_BATCH 64
+
 typedef struct VirtQueueElement
 {
     unsigned int index;
@@ -155,6 +158,14 @@ void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
 
 void virtqueue_map(VirtQueueElement *elem);
 void *virtqueue_pop(VirtQueue *vq, size_t sz);
+/*
+ * Pop up to @max elements of size @sz into @elems, reading the available
+ * ring index and issuing the read barrier only once for the whole batch.
+ * Returns the number of elements popped.  Elements that the caller does
+ * not consume can be given back with virtqueue_discard(), in reverse order.
+ */
+unsigned int virtqueue_pop_batch(VirtQueue *vq, size_t sz, void **elems,
+                                 unsigned int max);
 void *qemu_get_virtqueue_element(QEMUFile *f, size_t sz);
 void qemu_put_virtqueue_element(QEMUFile *f, VirtQueueElement *elem);
 int virtqueue_avail_bytes(VirtQueue *vq, unsigned int in_bytes,
@@ -0,0 +1,72 @@
+/*
+ * Page compression codecs for RAM migration
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#ifndef QEMU_MIGRATION_COMPRESS_H
+#define QEMU_MIGRATION_COMPRESS_H
+
+#include "qapi-types.h"
+
+/*
+ * The codec of a RAM_SAVE_FLAG_COMPRESS_PAGE is stored in the top byte of
+ * its 32-bit length, so that zlib pages look the same as they always did.
+ * The values are part of the migration stream.
+ */
+typedef enum MigrationCodec {
+    MIGRATION_CODEC_ZLIB = 0,
+    MIGRATION_CODEC_RAW = 1,
+    MIGRATION_CODEC_LZ4 = 2,
+    MIGRATION_CODEC_ZSTD = 3,
+    MIGRATION_CODEC__MAX,
+} MigrationCodec;
+
+#define MIGRATION_CODEC_SHIFT   24
+#define MIGRATION_CODEC_LEN_MASK ((1 << MIGRATION_CODEC_SHIFT) - 1)
+
+/* Per-thread state of the codecs, e.g. compression contexts */
+typedef struct MigrationCodecState MigrationCodecState;
+
+MigrationCodecState *migration_codec_state_new(void);
+void migration_codec_state_free(MigrationCodecState *state);
+
+bool migration_codec_available(MigrationCodec codec);
+const char *migration_codec_name(MigrationCodec codec);
+
+/* Maximum compressed size of @size bytes, for all codecs */
+size_t migration_codec_bound(size_t size);
+
+/*
+ * Compresses @size bytes from @src into @dest.  @level is the zlib level;
+ * the other codecs map it to a level of their own or ignore it.
+ * Returns the compressed size, or -1 if it doesn't fit into @dest_size.
+ */
+ssize_t migration_codec_compress(MigrationCodecState *state,
+                                 MigrationCodec codec, int level,
+                                 uint8_t *dest, size_t dest_size,
+                                 const uint8_t *src, size_t size);
+
+/*
+ * Decompresses @size bytes from @src into @dest, which must be filled
+ * completely.  Returns 0 on success, -1 on error.
+ */
+int migration_codec_decompress(MigrationCodecState *state,
+                               MigrationCodec codec,
+                               uint8_t *dest, size_t dest_size,
+                               const uint8_t *src, size_t size);
+
+/* The codec to use for @algorithm, or -1 to let the adaptive mode choose */
+int migration_codec_for_algorithm(MigrationCompressAlgorithm algorithm);
+
+/*
+ * Adaptive codec selection and statistics.  These are only called from the
+ * migration thread, except for migration_codec_query_stats().
+ */
+void migration_codec_stats_reset(void);
+void migration_codec_account(MigrationCodec codec, size_t in, size_t out,
+                             int64_t ns);
+MigrationCodec migration_codec_choose(int nthreads, int64_t link_bandwidth);
+CompressionCodecStatsList *migration_codec_query_stats(void);
+
+#endif
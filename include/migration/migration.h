@@ -157,6 +157,9 @@ struct MigrationState
     int64_t xbzrle_cache_size;
     int64_t setup_time;
     int64_t dirty_sync_count;
+    /* Duration of the last dirty bitmap sync, and of all of them (us) */
+    int64_t dirty_sync_time_last;
+    int64_t dirty_sync_time_total;
 
     /* Flag set once the migration has been asked to enter postcopy */
     bool start_postcopy;
@@ -171,6 +174,9 @@ struct MigrationState
     QSIMPLEQ_HEAD(src_page_requests, MigrationSrcPageRequest) src_page_requests;
     /* The RAMBlock used in the last src_page_request */
     RAMBlock *last_req_rb;
+
+    /* URI of the outgoing migration, used to open the multifd channels */
+    char *uri;
 };
 
 void migrate_set_state(int *state, int old_state, int new_state);
@@ -241,9 +247,12 @@ uint64_t xbzrle_mig_pages_transferred(void);
 uint64_t xbzrle_mig_pages_overflow(void);
 uint64_t xbzrle_mig_pages_cache_miss(void);
 double xbzrle_mig_cache_miss_rate(void);
+uint64_t ram_zero_scan_time(void);
+uint64_t ram_send_time(void);
 
 void ram_handle_compressed(void *host, uint8_t ch, uint64_t size);
-void ram_debug_dump_bitmap(unsigned long *todump, bool expected);
+void ram_debug_dump_bitmap(unsigned long *todump, bool expected,
+                           unsigned long pages);
 /* For outgoing discard bitmap */
 int ram_postcopy_send_discard_bitmap(MigrationState *ms);
 /* For incoming postcopy discard */
@@ -283,6 +292,12 @@ bool migrate_use_compression(void);
 int migrate_compress_level(void);
 int migrate_compress_threads(void);
 int migrate_decompress_threads(void);
+bool migrate_use_multifd(void);
+bool migrate_use_zero_copy(void);
+int migrate_multifd_channels(void);
+int migrate_zero_scan_threads(void);
+MigrationCompressAlgorithm migrate_compress_algorithm(void);
+int migrate_xbzrle_threads(void);
 bool migrate_use_events(void);
 
 /* Sending on the return path - generic and then for each message type */
@@ -0,0 +1,61 @@
+/*
+ * Multiple channel (multifd) RAM migration
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#ifndef QEMU_MIGRATION_MULTIFD_H
+#define QEMU_MIGRATION_MULTIFD_H
+
+#include "exec/cpu-common.h"
+
+/*
+ * Source side.  All of these are called from the migration thread, except
+ * multifd_save_shutdown() which may be called from any thread.
+ */
+
+/* Connect the multifd channels to the destination and start their threads */
+int multifd_save_setup(Error **errp);
+
+/* Stop the sender threads and close the channels */
+void multifd_save_cleanup(void);
+
+/* Kick any sender blocked on the network, e.g. when migration is cancelled */
+void multifd_save_shutdown(void);
+
+/*
+ * Queue the target page at @offset inside @block to be sent by one of the
+ * sender threads.  Pages are batched and handed over a packet at a time.
+ * Returns 0 on success, negative on error.
+ */
+int multifd_queue_page(RAMBlock *block, ram_addr_t offset);
+
+/*
+ * Flush the pending batch and wait until every channel has sent everything
+ * it was given.  Returns 1 if the destination must be told to synchronize
+ * too (i.e. pages were queued since the last call), 0 if there was nothing
+ * to synchronize, and negative on error.
+ */
+int multifd_send_sync_main(void);
+
+/*
+ * Destination side.
+ */
+
+/*
+ * Start accepting the multifd channels on @listen_fd, which was used to
+ * accept the main migration stream.  Ownership of @listen_fd is passed on.
+ */
+void multifd_load_start(int listen_fd);
+
+/* Stop the receiver threads and close the channels */
+void multifd_load_cleanup(void);
+
+/*
+ * Wait until every channel has loaded the pages that were sent before the
+ * synchronization point the source just put in the main stream.
+ * Returns 0 on success, negative on error.
+ */
+int multifd_recv_sync_main(void);
+
+#endif
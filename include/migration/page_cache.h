@@ -17,6 +17,7 @@
 
 /* Page cache for storing guest pages */
 typedef struct PageCache PageCache;
+typedef struct CacheItem CacheItem;
 
 /**
  * cache_init: Initialize the page cache
@@ -72,6 +73,32 @@ uint8_t *get_cached_data(const PageCache *cache, uint64_t addr);
 int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
                  uint64_t current_age);
 
+/**
+ * cache_pin: pin the cached page of an addr, so that its data can be used by
+ * another thread.  Pinned pages are neither replaced nor updated by
+ * cache_insert() until they are unpinned.
+ *
+ * Returns the pinned item or NULL if not cached
+ *
+ * @cache pointer to the PageCache struct
+ * @addr: page addr
+ */
+CacheItem *cache_pin(PageCache *cache, uint64_t addr);
+
+/**
+ * cache_item_data: Get the data of a pinned item
+ *
+ * @it: the item returned by cache_pin()
+ */
+uint8_t *cache_item_data(const CacheItem *it);
+
+/**
+ * cache_unpin: unpin an item.  Can be called from any thread.
+ *
+ * @it: the item returned by cache_pin()
+ */
+void cache_unpin(CacheItem *it);
+
 /**
  * cache_resize: resize the page cache. In case of size reduction the extra
  * pages will be freed
@@ -24,6 +24,7 @@
 #ifndef QEMU_FILE_H
 #define QEMU_FILE_H 1
 #include "exec/cpu-common.h"
+#include "migration/compress.h"
 
 
 /* This function writes a chunk of data to a file at the given position.
@@ -59,6 +60,21 @@ typedef int (QEMUFileGetFD)(void *opaque);
 typedef ssize_t (QEMUFileWritevBufferFunc)(void *opaque, struct iovec *iov,
                                            int iovcnt, int64_t pos);
 
+/*
+ * Same as QEMUFileWritevBufferFunc, but the iovecs for which @zerocopy is
+ * set may be sent without copying them.  The kernel then keeps reading
+ * them until the send completes, see QEMUFileZerocopyFunc.
+ */
+typedef ssize_t (QEMUFileWritevZerocopyFunc)(void *opaque, struct iovec *iov,
+                                             const bool *zerocopy, int iovcnt,
+                                             int64_t pos);
+
+/*
+ * Enables zero-copy sends, or waits for all of them to complete.
+ * Return negative error number on error, 0 on success.
+ */
+typedef int (QEMUFileZerocopyFunc)(void *opaque);
+
 /*
  * This function provides hooks around different
  * stages of RAM migration.
@@ -106,6 +122,9 @@ typedef struct QEMUFileOps {
     QEMUFileCloseFunc *close;
     QEMUFileGetFD *get_fd;
     QEMUFileWritevBufferFunc *writev_buffer;
+    QEMUFileWritevZerocopyFunc *writev_zerocopy;
+    QEMUFileZerocopyFunc *enable_zerocopy;
+    QEMUFileZerocopyFunc *flush_zerocopy;
     QEMURamHookFunc *before_ram_iterate;
     QEMURamHookFunc *after_ram_iterate;
     QEMURamHookFunc *hook_ram_load;
@@ -136,6 +155,9 @@ void qemu_put_byte(QEMUFile *f, int v);
 /*
  * put_buffer without copying the buffer.
  * The buffer should be available till it is sent asynchronously.
+ * If zero-copy sends are enabled, it must stay available until
+ * qemu_file_flush_zerocopy() and it may be sent with contents written after
+ * the call.
  */
 void qemu_put_buffer_async(QEMUFile *f, const uint8_t *buf, size_t size);
 bool qemu_file_mode_is_not_valid(const char *mode);
@@ -170,7 +192,8 @@ size_t qemu_peek_buffer(QEMUFile *f, uint8_t **buf, size_t size, size_t offset);
 size_t qemu_get_buffer(QEMUFile *f, uint8_t *buf, size_t size);
 size_t qemu_get_buffer_in_place(QEMUFile *f, uint8_t **buf, size_t size);
 ssize_t qemu_put_compression_data(QEMUFile *f, const uint8_t *p, size_t size,
-                                  int level);
+                                  MigrationCodecState *state,
+                                  MigrationCodec codec, int level);
 int qemu_put_qemu_file(QEMUFile *f_des, QEMUFile *f_src);
 
 /*
@@ -196,6 +219,9 @@ uint64_t qemu_get_be64(QEMUFile *f);
 
 int qemu_file_rate_limit(QEMUFile *f);
 void qemu_file_reset_rate_limit(QEMUFile *f);
+void qemu_file_update_transfer(QEMUFile *f, int64_t len);
+int qemu_file_enable_zerocopy(QEMUFile *f);
+void qemu_file_flush_zerocopy(QEMUFile *f);
 void qemu_file_set_rate_limit(QEMUFile *f, int64_t new_rate);
 int64_t qemu_file_get_rate_limit(QEMUFile *f);
 int qemu_file_get_error(QEMUFile *f);
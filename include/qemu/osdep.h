@@ -339,7 +339,22 @@ unsigned long qemu_getauxval(unsigned long type);
 
 void qemu_set_tty_echo(int fd, bool echo);
 
-void os_mem_prealloc(int fd, char *area, size_t sz);
+/**
+ * os_mem_prealloc:
+ * @fd: file descriptor backing @area, or -1 for anonymous memory
+ * @area: start of the memory to preallocate
+ * @sz: size of @area in bytes
+ * @max_threads: maximum number of threads touching @area in parallel
+ * @host_nodes: bitmap of the host NUMA nodes @area is bound to, or NULL
+ * @maxnode: number of bits in @host_nodes
+ *
+ * Fault in every page of @area, exiting if the host runs out of memory.
+ * @area is split in consecutive ranges, each touched by its own thread;
+ * when @host_nodes is not empty, the threads are spread over those nodes
+ * and run on their CPUs.
+ */
+void os_mem_prealloc(int fd, char *area, size_t sz, int max_threads,
+                     const unsigned long *host_nodes, unsigned long maxnode);
 
 int qemu_read_password(char *buf, int buf_size);
 
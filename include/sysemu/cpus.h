@@ -14,6 +14,13 @@ void cpu_synchronize_all_post_init(void);
 
 void qtest_clock_warp(int64_t dest);
 
+/* Exclusive sections for multi-threaded TCG.  start_exclusive() returns once
+ * no other vCPU is executing guest code, and must be called by a thread that
+ * is not itself between cpu_exec_start() and cpu_exec_end().
+ */
+void start_exclusive(void);
+void end_exclusive(void);
+
 #ifndef CONFIG_USER_ONLY
 /* vl.c */
 extern int smp_cores;
@@ -0,0 +1,408 @@
+/*
+ * Page compression codecs for RAM migration
+ *
+ * Besides zlib, which has always been used for compressed pages, pages can
+ * be compressed with the much faster lz4 and zstd if QEMU is built with them.
+ * The destination learns the codec of each page from the page itself.
+ *
+ * In the adaptive mode, the source picks a codec for each page: no
+ * compression at all, a fast codec or zlib, whichever moves the most guest
+ * memory per second.  This is estimated from the moving averages of the
+ * compression ratio and of the speed of each codec, the number of compression
+ * threads and the bandwidth of the link (the migration speed limit).  Every
+ * ADAPTIVE_PROBE_INTERVAL pages, one of the codecs that are not chosen is
+ * used anyway, so that their averages follow the guest's data.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <zlib.h>
+#ifdef CONFIG_LZ4
+#include <lz4.h>
+#endif
+#ifdef CONFIG_ZSTD
+#include <zstd.h>
+#endif
+#include "qemu-common.h"
+#include "qemu/timer.h"
+#include "migration/compress.h"
+
+#define ADAPTIVE_PROBE_INTERVAL 64
+/* Weight of a new page in the moving averages */
+#define ADAPTIVE_WEIGHT         0.02
+
+struct MigrationCodecState {
+    z_stream deflate;
+    int deflate_level;
+    bool deflate_init;
+    z_stream inflate;
+    bool inflate_init;
+#ifdef CONFIG_ZSTD
+    ZSTD_CCtx *zstd_cctx;
+    ZSTD_DCtx *zstd_dctx;
+#endif
+};
+
+static const char *const codec_names[MIGRATION_CODEC__MAX] = {
+    [MIGRATION_CODEC_ZLIB]  = "zlib",
+    [MIGRATION_CODEC_RAW]   = "raw",
+    [MIGRATION_CODEC_LZ4]   = "lz4",
+    [MIGRATION_CODEC_ZSTD]  = "zstd",
+};
+
+MigrationCodecState *migration_codec_state_new(void)
+{
+    return g_new0(MigrationCodecState, 1);
+}
+
+void migration_codec_state_free(MigrationCodecState *state)
+{
+    if (!state) {
+        return;
+    }
+    if (state->deflate_init) {
+        deflateEnd(&state->deflate);
+    }
+    if (state->inflate_init) {
+        inflateEnd(&state->inflate);
+    }
+#ifdef CONFIG_ZSTD
+    ZSTD_freeCCtx(state->zstd_cctx);
+    ZSTD_freeDCtx(state->zstd_dctx);
+#endif
+    g_free(state);
+}
+
+bool migration_codec_available(MigrationCodec codec)
+{
+    switch (codec) {
+    case MIGRATION_CODEC_ZLIB:
+    case MIGRATION_CODEC_RAW:
+        return true;
+#ifdef CONFIG_LZ4
+    case MIGRATION_CODEC_LZ4:
+        return true;
+#endif
+#ifdef CONFIG_ZSTD
+    case MIGRATION_CODEC_ZSTD:
+        return true;
+#endif
+    default:
+        return false;
+    }
+}
+
+const char *migration_codec_name(MigrationCodec codec)
+{
+    assert(codec < MIGRATION_CODEC__MAX);
+    return codec_names[codec];
+}
+
+size_t migration_codec_bound(size_t size)
+{
+    size_t bound = MAX(size, compressBound(size));
+
+#ifdef CONFIG_LZ4
+    bound = MAX(bound, LZ4_compressBound(size));
+#endif
+#ifdef CONFIG_ZSTD
+    bound = MAX(bound, ZSTD_compressBound(size));
+#endif
+    return bound;
+}
+
+static ssize_t zlib_compress(MigrationCodecState *state, int level,
+                             uint8_t *dest, size_t dest_size,
+                             const uint8_t *src, size_t size)
+{
+    z_stream *strm = &state->deflate;
+    int ret;
+
+    /* Same output as compress2(), without setting up a stream every time */
+    if (state->deflate_init && state->deflate_level != level) {
+        deflateEnd(strm);
+        state->deflate_init = false;
+    }
+    if (!state->deflate_init) {
+        memset(strm, 0, sizeof(*strm));
+        if (deflateInit(strm, level) != Z_OK) {
+            return -1;
+        }
+        state->deflate_init = true;
+        state->deflate_level = level;
+    } else if (deflateReset(strm) != Z_OK) {
+        return -1;
+    }
+
+    strm->next_in = (Bytef *)src;
+    strm->avail_in = size;
+    strm->next_out = dest;
+    strm->avail_out = dest_size;
+
+    ret = deflate(strm, Z_FINISH);
+    if (ret != Z_STREAM_END) {
+        return -1;
+    }
+    return dest_size - strm->avail_out;
+}
+
+static int zlib_decompress(MigrationCodecState *state,
+                           uint8_t *dest, size_t dest_size,
+                           const uint8_t *src, size_t size)
+{
+    z_stream *strm = &state->inflate;
+    int ret;
+
+    if (!state->inflate_init) {
+        memset(strm, 0, sizeof(*strm));
+        if (inflateInit(strm) != Z_OK) {
+            return -1;
+        }
+        state->inflate_init = true;
+    } else if (inflateReset(strm) != Z_OK) {
+        return -1;
+    }
+
+    strm->next_in = (Bytef *)src;
+    strm->avail_in = size;
+    strm->next_out = dest;
+    strm->avail_out = dest_size;
+
+    ret = inflate(strm, Z_FINISH);
+    if (ret != Z_STREAM_END || strm->avail_out != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+ssize_t migration_codec_compress(MigrationCodecState *state,
+                                 MigrationCodec codec, int level,
+                                 uint8_t *dest, size_t dest_size,
+                                 const uint8_t *src, size_t size)
+{
+    switch (codec) {
+    case MIGRATION_CODEC_ZLIB:
+        return zlib_compress(state, level, dest, dest_size, src, size);
+    case MIGRATION_CODEC_RAW:
+        if (dest_size < size) {
+            return -1;
+        }
+        memcpy(dest, src, size);
+        return size;
+#ifdef CONFIG_LZ4
+    case MIGRATION_CODEC_LZ4: {
+        int ret = LZ4_compress_default((const char *)src, (char *)dest,
+                                       size, dest_size);
+        return ret > 0 ? ret : -1;
+    }
+#endif
+#ifdef CONFIG_ZSTD
+    case MIGRATION_CODEC_ZSTD: {
+        size_t ret;
+
+        if (!state->zstd_cctx) {
+            state->zstd_cctx = ZSTD_createCCtx();
+            if (!state->zstd_cctx) {
+                return -1;
+            }
+        }
+        /* zlib level 0 stores the data uncompressed, zstd has no such level */
+        ret = ZSTD_compressCCtx(state->zstd_cctx, dest, dest_size, src, size,
+                                MAX(level, 1));
+        return ZSTD_isError(ret) ? -1 : ret;
+    }
+#endif
+    default:
+        return -1;
+    }
+}
+
+int migration_codec_decompress(MigrationCodecState *state,
+                               MigrationCodec codec,
+                               uint8_t *dest, size_t dest_size,
+                               const uint8_t *src, size_t size)
+{
+    switch (codec) {
+    case MIGRATION_CODEC_ZLIB:
+        return zlib_decompress(state, dest, dest_size, src, size);
+    case MIGRATION_CODEC_RAW:
+        if (size != dest_size) {
+            return -1;
+        }
+        memcpy(dest, src, size);
+        return 0;
+#ifdef CONFIG_LZ4
+    case MIGRATION_CODEC_LZ4:
+        return LZ4_decompress_safe((const char *)src, (char *)dest,
+                                   size, dest_size) == dest_size ? 0 : -1;
+#endif
+#ifdef CONFIG_ZSTD
+    case MIGRATION_CODEC_ZSTD: {
+        size_t ret;
+
+        if (!state->zstd_dctx) {
+            state->zstd_dctx = ZSTD_createDCtx();
+            if (!state->zstd_dctx) {
+                return -1;
+            }
+        }
+        ret = ZSTD_decompressDCtx(state->zstd_dctx, dest, dest_size,
+                                  src, size);
+        return !ZSTD_isError(ret) && ret == dest_size ? 0 : -1;
+    }
+#endif
+    default:
+        return -1;
+    }
+}
+
+int migration_codec_for_algorithm(MigrationCompressAlgorithm algorithm)
+{
+    switch (algorithm) {
+    case MIGRATION_COMPRESS_ALGORITHM_ZLIB:
+        return MIGRATION_CODEC_ZLIB;
+    case MIGRATION_COMPRESS_ALGORITHM_LZ4:
+        return MIGRATION_CODEC_LZ4;
+    case MIGRATION_COMPRESS_ALGORITHM_ZSTD:
+        return MIGRATION_CODEC_ZSTD;
+    default:
+        return -1;
+    }
+}
+
+typedef struct CodecStats {
+    uint64_t pages;
+    uint64_t in_bytes;
+    uint64_t out_bytes;
+    uint64_t ns;
+    /* Moving averages: compressed size / size, input bytes per second */
+    double ratio;
+    double speed;
+} CodecStats;
+
+static CodecStats codec_stats[MIGRATION_CODEC__MAX];
+static unsigned int adaptive_pages;
+
+void migration_codec_stats_reset(void)
+{
+    memset(codec_stats, 0, sizeof(codec_stats));
+    adaptive_pages = 0;
+}
+
+void migration_codec_account(MigrationCodec codec, size_t in, size_t out,
+                             int64_t ns)
+{
+    CodecStats *stats = &codec_stats[codec];
+    double ratio, speed;
+
+    if (!in) {
+        return;
+    }
+
+    ratio = (double)out / in;
+    speed = ns > 0 ? (double)in * NANOSECONDS_PER_SECOND / ns : 0;
+    if (stats->pages == 0) {
+        stats->ratio = ratio;
+        stats->speed = speed;
+    } else {
+        stats->ratio += (ratio - stats->ratio) * ADAPTIVE_WEIGHT;
+        stats->speed += (speed - stats->speed) * ADAPTIVE_WEIGHT;
+    }
+
+    stats->pages++;
+    stats->in_bytes += in;
+    stats->out_bytes += out;
+    stats->ns += ns;
+}
+
+/* The fast codec of the adaptive mode, or -1 if there is none */
+static int adaptive_fast_codec(void)
+{
+    if (migration_codec_available(MIGRATION_CODEC_LZ4)) {
+        return MIGRATION_CODEC_LZ4;
+    }
+    if (migration_codec_available(MIGRATION_CODEC_ZSTD)) {
+        return MIGRATION_CODEC_ZSTD;
+    }
+    return -1;
+}
+
+/*
+ * Picks the codec for the next page in the adaptive mode.  @link_bandwidth
+ * is in bytes per second.  MIGRATION_CODEC_RAW means that the page should be
+ * sent as a normal page.
+ */
+MigrationCodec migration_codec_choose(int nthreads, int64_t link_bandwidth)
+{
+    int candidates[2];
+    int i, n = 0, fast;
+    MigrationCodec best = MIGRATION_CODEC_RAW;
+    double best_rate = link_bandwidth;
+
+    fast = adaptive_fast_codec();
+    if (fast >= 0) {
+        candidates[n++] = fast;
+    }
+    candidates[n++] = MIGRATION_CODEC_ZLIB;
+
+    /* Measure every codec first, and keep probing them once in a while */
+    for (i = 0; i < n; i++) {
+        if (!codec_stats[candidates[i]].pages) {
+            return candidates[i];
+        }
+    }
+    if (++adaptive_pages % ADAPTIVE_PROBE_INTERVAL == 0) {
+        return candidates[(adaptive_pages / ADAPTIVE_PROBE_INTERVAL) % n];
+    }
+
+    /* Guest memory per second: the threads or the link are the limit */
+    for (i = 0; i < n; i++) {
+        CodecStats *stats = &codec_stats[candidates[i]];
+        double rate = nthreads * stats->speed;
+
+        if (stats->ratio > 0) {
+            rate = MIN(rate, link_bandwidth / stats->ratio);
+        }
+        if (rate > best_rate) {
+            best = candidates[i];
+            best_rate = rate;
+        }
+    }
+
+    return best;
+}
+
+CompressionCodecStatsList *migration_codec_query_stats(void)
+{
+    CompressionCodecStatsList *head = NULL, **tail = &head;
+    int i;
+
+    for (i = 0; i < MIGRATION_CODEC__MAX; i++) {
+        CodecStats *stats = &codec_stats[i];
+        CompressionCodecStatsList *entry;
+        CompressionCodecStats *info;
+
+        if (!stats->pages) {
+            continue;
+        }
+
+        info = g_new0(CompressionCodecStats, 1);
+        info->codec = g_strdup(codec_names[i]);
+        info->pages = stats->pages;
+        info->input_bytes = stats->in_bytes;
+        info->output_bytes = stats->out_bytes;
+        info->ratio = (double)stats->out_bytes / stats->in_bytes;
+        if (stats->ns) {
+            info->throughput = (double)stats->in_bytes * 1000 / stats->ns;
+        }
+
+        entry = g_new0(CompressionCodecStatsList, 1);
+        entry->value = info;
+        *tail = entry;
+        tail = &entry->next;
+    }
+
+    return head;
+}
@@ -19,6 +19,7 @@
 #include "qemu/main-loop.h"
 #include "migration/migration.h"
 #include "migration/qemu-file.h"
+#include "migration/compress.h"
 #include "sysemu/sysemu.h"
 #include "block/block.h"
 #include "qapi/qmp/qerror.h"
@@ -27,6 +28,7 @@
 #include "qemu/rcu.h"
 #include "migration/block.h"
 #include "migration/postcopy-ram.h"
+#include "migration/multifd.h"
 #include "qemu/thread.h"
 #include "qmp-commands.h"
 #include "trace.h"
@@ -52,6 +54,14 @@
 /* Define default autoconverge cpu throttle migration parameters */
 #define DEFAULT_MIGRATE_X_CPU_THROTTLE_INITIAL 20
 #define DEFAULT_MIGRATE_X_CPU_THROTTLE_INCREMENT 10
+/* Default number of parallel connections for multifd migration */
+#define DEFAULT_MIGRATE_MULTIFD_CHANNELS 2
+/* Zero pages are checked by the migration thread by default */
+#define DEFAULT_MIGRATE_ZERO_SCAN_THREADS 0
+/* zlib is the only codec that older destinations understand */
+#define DEFAULT_MIGRATE_COMPRESS_ALGORITHM MIGRATION_COMPRESS_ALGORITHM_ZLIB
+/* XBZRLE pages are encoded by the migration thread by default */
+#define DEFAULT_MIGRATE_XBZRLE_THREADS 0
 
 /* Migration XBZRLE default cache size */
 #define DEFAULT_MIGRATE_CACHE_SIZE (64 * 1024 * 1024)
@@ -91,6 +101,14 @@ MigrationState *migrate_get_current(void)
                 DEFAULT_MIGRATE_X_CPU_THROTTLE_INITIAL,
         .parameters[MIGRATION_PARAMETER_X_CPU_THROTTLE_INCREMENT] =
                 DEFAULT_MIGRATE_X_CPU_THROTTLE_INCREMENT,
+        .parameters[MIGRATION_PARAMETER_X_MULTIFD_CHANNELS] =
+                DEFAULT_MIGRATE_MULTIFD_CHANNELS,
+        .parameters[MIGRATION_PARAMETER_X_ZERO_SCAN_THREADS] =
+                DEFAULT_MIGRATE_ZERO_SCAN_THREADS,
+        .parameters[MIGRATION_PARAMETER_COMPRESS_ALGORITHM] =
+                DEFAULT_MIGRATE_COMPRESS_ALGORITHM,
+        .parameters[MIGRATION_PARAMETER_X_XBZRLE_THREADS] =
+                DEFAULT_MIGRATE_XBZRLE_THREADS,
     };
 
     if (!once) {
@@ -382,6 +400,7 @@ static void process_incoming_migration_co(void *opaque)
     migrate_set_state(&mis->state, MIGRATION_STATUS_NONE,
                       MIGRATION_STATUS_ACTIVE);
     ret = qemu_loadvm_state(f);
+    multifd_load_cleanup();
 
     ps = postcopy_state_get();
     trace_process_incoming_migration_co_end(ret, ps);
@@ -525,6 +544,14 @@ MigrationParameters *qmp_query_migrate_parameters(Error **errp)
             s->parameters[MIGRATION_PARAMETER_X_CPU_THROTTLE_INITIAL];
     params->x_cpu_throttle_increment =
             s->parameters[MIGRATION_PARAMETER_X_CPU_THROTTLE_INCREMENT];
+    params->x_multifd_channels =
+            s->parameters[MIGRATION_PARAMETER_X_MULTIFD_CHANNELS];
+    params->x_zero_scan_threads =
+            s->parameters[MIGRATION_PARAMETER_X_ZERO_SCAN_THREADS];
+    params->compress_algorithm =
+            s->parameters[MIGRATION_PARAMETER_COMPRESS_ALGORITHM];
+    params->x_xbzrle_threads =
+            s->parameters[MIGRATION_PARAMETER_X_XBZRLE_THREADS];
 
     return params;
 }
@@ -561,6 +588,14 @@ static void get_xbzrle_cache_stats(MigrationInfo *info)
     }
 }
 
+static void get_compression_stats(MigrationInfo *info)
+{
+    if (migrate_use_compression()) {
+        info->compression = migration_codec_query_stats();
+        info->has_compression = info->compression != NULL;
+    }
+}
+
 MigrationInfo *qmp_query_migrate(Error **errp)
 {
     MigrationInfo *info = g_malloc0(sizeof(*info));
@@ -597,6 +632,10 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         info->ram->dirty_pages_rate = s->dirty_pages_rate;
         info->ram->mbps = s->mbps;
         info->ram->dirty_sync_count = s->dirty_sync_count;
+        info->ram->dirty_sync_time_last = s->dirty_sync_time_last;
+        info->ram->dirty_sync_time_total = s->dirty_sync_time_total;
+        info->ram->zero_scan_time = ram_zero_scan_time();
+        info->ram->send_time = ram_send_time();
 
         if (blk_mig_active()) {
             info->has_disk = true;
@@ -612,6 +651,7 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         }
 
         get_xbzrle_cache_stats(info);
+        get_compression_stats(info);
         break;
     case MIGRATION_STATUS_POSTCOPY_ACTIVE:
         /* Mostly the same as active; TODO add some postcopy stats */
@@ -636,6 +676,10 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         info->ram->dirty_pages_rate = s->dirty_pages_rate;
         info->ram->mbps = s->mbps;
         info->ram->dirty_sync_count = s->dirty_sync_count;
+        info->ram->dirty_sync_time_last = s->dirty_sync_time_last;
+        info->ram->dirty_sync_time_total = s->dirty_sync_time_total;
+        info->ram->zero_scan_time = ram_zero_scan_time();
+        info->ram->send_time = ram_send_time();
 
         if (blk_mig_active()) {
             info->has_disk = true;
@@ -646,9 +690,11 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         }
 
         get_xbzrle_cache_stats(info);
+        get_compression_stats(info);
         break;
     case MIGRATION_STATUS_COMPLETED:
         get_xbzrle_cache_stats(info);
+        get_compression_stats(info);
 
         info->has_status = true;
         info->has_total_time = true;
@@ -669,6 +715,10 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         info->ram->normal_bytes = norm_mig_bytes_transferred();
         info->ram->mbps = s->mbps;
         info->ram->dirty_sync_count = s->dirty_sync_count;
+        info->ram->dirty_sync_time_last = s->dirty_sync_time_last;
+        info->ram->dirty_sync_time_total = s->dirty_sync_time_total;
+        info->ram->zero_scan_time = ram_zero_scan_time();
+        info->ram->send_time = ram_send_time();
         break;
     case MIGRATION_STATUS_FAILED:
         info->has_status = true;
@@ -710,6 +760,18 @@ void qmp_migrate_set_capabilities(MigrationCapabilityStatusList *params,
                 false;
         }
     }
+
+    if (migrate_use_multifd()) {
+        if (migrate_use_xbzrle() || migrate_use_compression() ||
+            migrate_postcopy_ram()) {
+            /* Pages sent over the multifd channels are always sent raw,
+             * and postcopy needs the pages to arrive in stream order.
+             */
+            error_report("Multifd is not currently compatible with "
+                         "xbzrle, compression or postcopy");
+            s->enabled_capabilities[MIGRATION_CAPABILITY_X_MULTIFD] = false;
+        }
+    }
 }
 
 void qmp_migrate_set_parameters(bool has_compress_level,
@@ -721,7 +783,15 @@ void qmp_migrate_set_parameters(bool has_compress_level,
                                 bool has_x_cpu_throttle_initial,
                                 int64_t x_cpu_throttle_initial,
                                 bool has_x_cpu_throttle_increment,
-                                int64_t x_cpu_throttle_increment, Error **errp)
+                                int64_t x_cpu_throttle_increment,
+                                bool has_x_multifd_channels,
+                                int64_t x_multifd_channels,
+                                bool has_x_zero_scan_threads,
+                                int64_t x_zero_scan_threads,
+                                bool has_compress_algorithm,
+                                MigrationCompressAlgorithm compress_algorithm,
+                                bool has_x_xbzrle_threads,
+                                int64_t x_xbzrle_threads, Error **errp)
 {
     MigrationState *s = migrate_get_current();
 
@@ -756,6 +826,36 @@ void qmp_migrate_set_parameters(bool has_compress_level,
                    "x_cpu_throttle_increment",
                    "an integer in the range of 1 to 99");
     }
+    if (has_x_multifd_channels &&
+            (x_multifd_channels < 1 || x_multifd_channels > 255)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "x_multifd_channels",
+                   "is invalid, it should be in the range of 1 to 255");
+        return;
+    }
+    if (has_x_zero_scan_threads &&
+            (x_zero_scan_threads < 0 || x_zero_scan_threads > 64)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "x_zero_scan_threads",
+                   "is invalid, it should be in the range of 0 to 64");
+        return;
+    }
+    if (has_compress_algorithm) {
+        int codec = migration_codec_for_algorithm(compress_algorithm);
+
+        if (codec >= 0 && !migration_codec_available(codec)) {
+            error_setg(errp, "QEMU was built without support for %s",
+                       MigrationCompressAlgorithm_lookup[compress_algorithm]);
+            return;
+        }
+    }
+    if (has_x_xbzrle_threads &&
+            (x_xbzrle_threads < 0 || x_xbzrle_threads > 64)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "x_xbzrle_threads",
+                   "is invalid, it should be in the range of 0 to 64");
+        return;
+    }
 
     if (has_compress_level) {
         s->parameters[MIGRATION_PARAMETER_COMPRESS_LEVEL] = compress_level;
@@ -776,6 +876,22 @@ void qmp_migrate_set_parameters(bool has_compress_level,
         s->parameters[MIGRATION_PARAMETER_X_CPU_THROTTLE_INCREMENT] =
                                                     x_cpu_throttle_increment;
     }
+    if (has_x_multifd_channels) {
+        s->parameters[MIGRATION_PARAMETER_X_MULTIFD_CHANNELS] =
+                                                    x_multifd_channels;
+    }
+    if (has_x_zero_scan_threads) {
+        s->parameters[MIGRATION_PARAMETER_X_ZERO_SCAN_THREADS] =
+                                                    x_zero_scan_threads;
+    }
+    if (has_compress_algorithm) {
+        s->parameters[MIGRATION_PARAMETER_COMPRESS_ALGORITHM] =
+                                                    compress_algorithm;
+    }
+    if (has_x_xbzrle_threads) {
+        s->parameters[MIGRATION_PARAMETER_X_XBZRLE_THREADS] =
+                                                    x_xbzrle_threads;
+    }
 }
 
 void qmp_migrate_start_postcopy(Error **errp)
@@ -882,6 +998,9 @@ static void migrate_fd_cancel(MigrationState *s)
     if (s->state == MIGRATION_STATUS_CANCELLING && f) {
         qemu_file_shutdown(f);
     }
+    if (s->state == MIGRATION_STATUS_CANCELLING) {
+        multifd_save_shutdown();
+    }
 }
 
 void add_migration_state_change_notifier(Notifier *notify)
@@ -944,6 +1063,8 @@ MigrationState *migrate_init(const MigrationParams *params)
     s->dirty_bytes_rate = 0;
     s->setup_time = 0;
     s->dirty_sync_count = 0;
+    s->dirty_sync_time_last = 0;
+    s->dirty_sync_time_total = 0;
     s->start_postcopy = false;
     s->postcopy_after_devices = false;
     s->migration_thread_running = false;
@@ -1023,7 +1144,15 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         return;
     }
 
+    if (migrate_use_multifd() &&
+        !strstart(uri, "tcp:", NULL) && !strstart(uri, "unix:", NULL)) {
+        error_setg(errp, "Multifd migration requires a tcp: or unix: URI");
+        return;
+    }
+
     s = migrate_init(&params);
+    g_free(s->uri);
+    s->uri = g_strdup(uri);
 
     if (strstart(uri, "tcp:", &p)) {
         tcp_start_outgoing_migration(s, p, &local_err);
@@ -1182,6 +1311,60 @@ int migrate_decompress_threads(void)
     return s->parameters[MIGRATION_PARAMETER_DECOMPRESS_THREADS];
 }
 
+bool migrate_use_multifd(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_MULTIFD];
+}
+
+bool migrate_use_zero_copy(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_ZERO_COPY];
+}
+
+int migrate_multifd_channels(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters[MIGRATION_PARAMETER_X_MULTIFD_CHANNELS];
+}
+
+int migrate_zero_scan_threads(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters[MIGRATION_PARAMETER_X_ZERO_SCAN_THREADS];
+}
+
+MigrationCompressAlgorithm migrate_compress_algorithm(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters[MIGRATION_PARAMETER_COMPRESS_ALGORITHM];
+}
+
+int migrate_xbzrle_threads(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters[MIGRATION_PARAMETER_X_XBZRLE_THREADS];
+}
+
 bool migrate_use_events(void)
 {
     MigrationState *s;
@@ -0,0 +1,733 @@
+/*
+ * Multiple channel (multifd) RAM migration
+ *
+ * RAM pages are batched into packets and sent over several sockets, each
+ * one owned by its own thread, next to the main migration stream.  Packets
+ * carry the name of the RAMBlock and the offsets of the pages they contain,
+ * so they can be loaded by whichever receive thread gets them.
+ *
+ * Ordering against the main stream is kept with synchronization points:
+ * at the end of every RAM iteration the source waits for all its channels
+ * to send what they were given, sends a SYNC packet on each of them and puts
+ * RAM_SAVE_FLAG_MULTIFD_SYNC on the main stream.  The destination does not
+ * go past that flag until every channel has loaded everything before its
+ * SYNC packet, and the channels do not go past the SYNC packet until the
+ * main stream has reached the flag.  A page is sent at most once between
+ * two synchronization points, so it can never be overwritten by a stale copy.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu/cutils.h"
+#include "qemu/error-report.h"
+#include "qemu/iov.h"
+#include "qemu/rcu.h"
+#include "qemu/sockets.h"
+#include "qemu/thread.h"
+#include "migration/migration.h"
+#include "migration/multifd.h"
+#include "exec/ram_addr.h"
+#include "trace.h"
+
+#define MULTIFD_MAGIC 0x11223344U
+#define MULTIFD_VERSION 1
+
+/* Maximum number of pages in a packet */
+#define MULTIFD_PAGES_PER_PACKET 128
+
+#define MULTIFD_FLAG_SYNC (1 << 0)
+
+/* First thing sent on every channel */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t channels;
+    uint32_t page_size;
+} QEMU_PACKED MultiFDInit;
+
+/*
+ * Packet header, followed by @pages_used big endian 64-bit offsets and then
+ * by the contents of the pages themselves.
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t flags;
+    uint32_t pages_used;
+    uint64_t packet_num;
+    char ramblock[256];
+} QEMU_PACKED MultiFDPacket;
+
+typedef struct {
+    /* number of pages in the batch */
+    uint32_t used;
+    /* all the pages belong to this block */
+    RAMBlock *block;
+    ram_addr_t offset[MULTIFD_PAGES_PER_PACKET];
+    struct iovec iov[MULTIFD_PAGES_PER_PACKET];
+} MultiFDPages;
+
+typedef struct {
+    int id;
+    int fd;
+    QemuThread thread;
+    bool running;
+    /* posted when there is something to do */
+    QemuSemaphore sem;
+    /* protects everything below */
+    QemuMutex mutex;
+    bool quit;
+    /* @pages has been handed over and is not sent yet */
+    bool pending_job;
+    /* a SYNC packet has been requested */
+    bool pending_sync;
+    uint64_t packet_num;
+    MultiFDPages *pages;
+} MultiFDSendParams;
+
+static struct {
+    MultiFDSendParams *params;
+    int count;
+    /* batch being filled by the migration thread */
+    MultiFDPages *pages;
+    /* one post for every idle channel */
+    QemuSemaphore channels_ready;
+    /* one post for every channel that has sent its SYNC packet */
+    QemuSemaphore sem_sync;
+    /* next channel to look at when handing over a batch */
+    int next_channel;
+    uint64_t packet_num;
+    /* pages have been queued since the last synchronization */
+    bool dirty;
+    /* set by the sender threads on error */
+    bool error;
+} *multifd_send_state;
+
+static int multifd_send_all(int fd, struct iovec *iov, int iovcnt, size_t len)
+{
+    return iov_send(fd, iov, iovcnt, 0, len) == len ? 0 : -1;
+}
+
+static int multifd_recv_all(int fd, struct iovec *iov, int iovcnt, size_t len)
+{
+    return iov_recv(fd, iov, iovcnt, 0, len) == len ? 0 : -1;
+}
+
+/* Fail the migration thread's waits once a channel is unusable */
+static void multifd_send_terminate(void)
+{
+    int i;
+
+    atomic_set(&multifd_send_state->error, true);
+    for (i = 0; i < multifd_send_state->count; i++) {
+        qemu_sem_post(&multifd_send_state->channels_ready);
+        qemu_sem_post(&multifd_send_state->sem_sync);
+    }
+}
+
+static int multifd_send_packet(MultiFDSendParams *p, MultiFDPacket *packet,
+                               MultiFDPages *pages, uint32_t flags,
+                               uint64_t packet_num)
+{
+    uint64_t offset[MULTIFD_PAGES_PER_PACKET];
+    struct iovec iov[MULTIFD_PAGES_PER_PACKET + 2];
+    uint32_t used = pages ? pages->used : 0;
+    size_t len;
+    int i;
+
+    memset(packet, 0, sizeof(*packet));
+    packet->magic = cpu_to_be32(MULTIFD_MAGIC);
+    packet->version = cpu_to_be32(MULTIFD_VERSION);
+    packet->flags = cpu_to_be32(flags);
+    packet->pages_used = cpu_to_be32(used);
+    packet->packet_num = cpu_to_be64(packet_num);
+    if (used) {
+        pstrcpy(packet->ramblock, sizeof(packet->ramblock),
+                qemu_ram_get_idstr(pages->block));
+    }
+
+    iov[0].iov_base = packet;
+    iov[0].iov_len = sizeof(*packet);
+    len = sizeof(*packet);
+    if (used) {
+        for (i = 0; i < used; i++) {
+            offset[i] = cpu_to_be64(pages->offset[i]);
+        }
+        iov[1].iov_base = offset;
+        iov[1].iov_len = used * sizeof(offset[0]);
+        len += iov[1].iov_len;
+        memcpy(&iov[2], pages->iov, used * sizeof(struct iovec));
+        len += used * TARGET_PAGE_SIZE;
+    }
+
+    trace_multifd_send(p->id, packet_num, used, flags);
+    return multifd_send_all(p->fd, iov, used ? used + 2 : 1, len);
+}
+
+static void *multifd_send_thread(void *opaque)
+{
+    MultiFDSendParams *p = opaque;
+    MultiFDPacket packet;
+
+    /* We are idle until the migration thread hands us a batch */
+    qemu_sem_post(&multifd_send_state->channels_ready);
+
+    while (true) {
+        bool job, sync;
+        uint64_t packet_num;
+
+        qemu_sem_wait(&p->sem);
+        qemu_mutex_lock(&p->mutex);
+        if (p->quit) {
+            qemu_mutex_unlock(&p->mutex);
+            break;
+        }
+        job = p->pending_job;
+        sync = p->pending_sync;
+        p->pending_sync = false;
+        packet_num = p->packet_num;
+        qemu_mutex_unlock(&p->mutex);
+
+        if (!job && !sync) {
+            /* Both were handled by an earlier wakeup */
+            continue;
+        }
+
+        if (multifd_send_packet(p, &packet, job ? p->pages : NULL,
+                                sync ? MULTIFD_FLAG_SYNC : 0, packet_num)) {
+            if (!atomic_read(&p->quit)) {
+                error_report("multifd: failed to send on channel %d", p->id);
+            }
+            multifd_send_terminate();
+            break;
+        }
+
+        if (job) {
+            qemu_mutex_lock(&p->mutex);
+            p->pages->used = 0;
+            p->pages->block = NULL;
+            p->pending_job = false;
+            qemu_mutex_unlock(&p->mutex);
+            qemu_sem_post(&multifd_send_state->channels_ready);
+        }
+        if (sync) {
+            qemu_sem_post(&multifd_send_state->sem_sync);
+        }
+    }
+
+    return NULL;
+}
+
+static int multifd_channel_connect(const char *uri, Error **errp)
+{
+    const char *p;
+
+    if (strstart(uri, "tcp:", &p)) {
+        return inet_connect(p, errp);
+    } else if (strstart(uri, "unix:", &p)) {
+        return unix_connect(p, errp);
+    }
+    error_setg(errp, "multifd: unsupported migration protocol: %s", uri);
+    return -1;
+}
+
+int multifd_save_setup(Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+    MultiFDInit msg;
+    struct iovec iov = { .iov_base = &msg, .iov_len = sizeof(msg) };
+    int count = migrate_multifd_channels();
+    int i;
+
+    assert(!multifd_send_state);
+    multifd_send_state = g_malloc0(sizeof(*multifd_send_state));
+    multifd_send_state->params = g_new0(MultiFDSendParams, count);
+    multifd_send_state->count = count;
+    multifd_send_state->pages = g_new0(MultiFDPages, 1);
+    qemu_sem_init(&multifd_send_state->channels_ready, 0);
+    qemu_sem_init(&multifd_send_state->sem_sync, 0);
+    for (i = 0; i < count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        p->id = i;
+        p->fd = -1;
+        qemu_mutex_init(&p->mutex);
+        qemu_sem_init(&p->sem, 0);
+        p->pages = g_new0(MultiFDPages, 1);
+    }
+
+    msg.magic = cpu_to_be32(MULTIFD_MAGIC);
+    msg.version = cpu_to_be32(MULTIFD_VERSION);
+    msg.channels = cpu_to_be32(count);
+    msg.page_size = cpu_to_be32(TARGET_PAGE_SIZE);
+
+    for (i = 0; i < count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+        char name[16];
+
+        p->fd = multifd_channel_connect(s->uri, errp);
+        if (p->fd < 0) {
+            return -1;
+        }
+        socket_set_nodelay(p->fd);
+        if (multifd_send_all(p->fd, &iov, 1, sizeof(msg))) {
+            error_setg_errno(errp, errno,
+                             "multifd: could not initialize channel %d", i);
+            return -1;
+        }
+
+        snprintf(name, sizeof(name), "multifdsend_%d", i);
+        qemu_thread_create(&p->thread, name, multifd_send_thread, p,
+                           QEMU_THREAD_JOINABLE);
+        p->running = true;
+    }
+
+    return 0;
+}
+
+void multifd_save_shutdown(void)
+{
+    int i;
+
+    if (!multifd_send_state) {
+        return;
+    }
+    for (i = 0; i < multifd_send_state->count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        atomic_set(&p->quit, true);
+        if (p->fd >= 0) {
+            shutdown(p->fd, SHUT_RDWR);
+        }
+    }
+}
+
+void multifd_save_cleanup(void)
+{
+    int i;
+
+    if (!multifd_send_state) {
+        return;
+    }
+
+    for (i = 0; i < multifd_send_state->count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        qemu_mutex_lock(&p->mutex);
+        p->quit = true;
+        qemu_mutex_unlock(&p->mutex);
+        qemu_sem_post(&p->sem);
+    }
+
+    for (i = 0; i < multifd_send_state->count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        if (p->running) {
+            qemu_thread_join(&p->thread);
+        }
+        if (p->fd >= 0) {
+            closesocket(p->fd);
+        }
+        qemu_mutex_destroy(&p->mutex);
+        qemu_sem_destroy(&p->sem);
+        g_free(p->pages);
+    }
+
+    qemu_sem_destroy(&multifd_send_state->channels_ready);
+    qemu_sem_destroy(&multifd_send_state->sem_sync);
+    g_free(multifd_send_state->pages);
+    g_free(multifd_send_state->params);
+    g_free(multifd_send_state);
+    multifd_send_state = NULL;
+}
+
+/* Hand the current batch over to an idle channel */
+static int multifd_send_pages(void)
+{
+    MultiFDSendParams *p;
+    MultiFDPages *pages;
+    int i;
+
+    qemu_sem_wait(&multifd_send_state->channels_ready);
+    if (atomic_read(&multifd_send_state->error)) {
+        return -1;
+    }
+
+    /*
+     * The semaphore guarantees that one channel is idle, and only the
+     * migration thread ever makes channels busy.
+     */
+    for (i = multifd_send_state->next_channel;; i = (i + 1) %
+                                            multifd_send_state->count) {
+        p = &multifd_send_state->params[i];
+        qemu_mutex_lock(&p->mutex);
+        if (!p->pending_job) {
+            break;
+        }
+        qemu_mutex_unlock(&p->mutex);
+    }
+    multifd_send_state->next_channel = (i + 1) % multifd_send_state->count;
+
+    pages = p->pages;
+    p->pages = multifd_send_state->pages;
+    multifd_send_state->pages = pages;
+    p->packet_num = multifd_send_state->packet_num++;
+    p->pending_job = true;
+    qemu_mutex_unlock(&p->mutex);
+    qemu_sem_post(&p->sem);
+
+    return 0;
+}
+
+int multifd_queue_page(RAMBlock *block, ram_addr_t offset)
+{
+    MultiFDPages *pages = multifd_send_state->pages;
+
+    if (pages->block && pages->block != block) {
+        if (multifd_send_pages() < 0) {
+            return -1;
+        }
+        pages = multifd_send_state->pages;
+    }
+
+    pages->block = block;
+    pages->offset[pages->used] = offset;
+    pages->iov[pages->used].iov_base = block->host + offset;
+    pages->iov[pages->used].iov_len = TARGET_PAGE_SIZE;
+    pages->used++;
+    multifd_send_state->dirty = true;
+
+    if (pages->used == MULTIFD_PAGES_PER_PACKET) {
+        return multifd_send_pages();
+    }
+    return 0;
+}
+
+int multifd_send_sync_main(void)
+{
+    int i;
+
+    if (!multifd_send_state || !multifd_send_state->dirty) {
+        return 0;
+    }
+    if (multifd_send_state->pages->used && multifd_send_pages() < 0) {
+        return -1;
+    }
+
+    for (i = 0; i < multifd_send_state->count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        qemu_mutex_lock(&p->mutex);
+        if (!p->pending_job) {
+            p->packet_num = multifd_send_state->packet_num++;
+        }
+        p->pending_sync = true;
+        qemu_mutex_unlock(&p->mutex);
+        qemu_sem_post(&p->sem);
+    }
+    for (i = 0; i < multifd_send_state->count; i++) {
+        qemu_sem_wait(&multifd_send_state->sem_sync);
+    }
+    if (atomic_read(&multifd_send_state->error)) {
+        return -1;
+    }
+
+    multifd_send_state->dirty = false;
+    trace_multifd_send_sync_main(multifd_send_state->packet_num);
+    return 1;
+}
+
+typedef struct {
+    int id;
+    int fd;
+    QemuThread thread;
+    bool running;
+    /* posted by the main thread once it has reached the SYNC flag */
+    QemuSemaphore sem_sync;
+    uint64_t offset[MULTIFD_PAGES_PER_PACKET];
+    struct iovec iov[MULTIFD_PAGES_PER_PACKET];
+} MultiFDRecvParams;
+
+static struct {
+    MultiFDRecvParams *params;
+    int count;
+    int listen_fd;
+    QemuThread accept_thread;
+    /* protects the file descriptors against multifd_load_cleanup() */
+    QemuMutex mutex;
+    bool quit;
+    /* one post for every channel that has loaded its SYNC packet */
+    QemuSemaphore sem_sync;
+    /* set on error or once a channel is gone */
+    bool error;
+} *multifd_recv_state;
+
+/* Fail the main thread's waits once a channel is unusable */
+static void multifd_recv_terminate(void)
+{
+    int i;
+
+    atomic_set(&multifd_recv_state->error, true);
+    for (i = 0; i < multifd_recv_state->count; i++) {
+        qemu_sem_post(&multifd_recv_state->sem_sync);
+    }
+}
+
+static int multifd_recv_packet(MultiFDRecvParams *p, MultiFDPacket *packet)
+{
+    struct iovec iov = { .iov_base = packet, .iov_len = sizeof(*packet) };
+    RAMBlock *block;
+    uint32_t used;
+    int i, ret = 0;
+
+    if (multifd_recv_all(p->fd, &iov, 1, sizeof(*packet))) {
+        return -1;
+    }
+    packet->magic = be32_to_cpu(packet->magic);
+    packet->version = be32_to_cpu(packet->version);
+    packet->flags = be32_to_cpu(packet->flags);
+    packet->pages_used = be32_to_cpu(packet->pages_used);
+    packet->packet_num = be64_to_cpu(packet->packet_num);
+    packet->ramblock[sizeof(packet->ramblock) - 1] = 0;
+
+    if (packet->magic != MULTIFD_MAGIC ||
+        packet->version != MULTIFD_VERSION) {
+        error_report("multifd: bad packet header on channel %d", p->id);
+        return -1;
+    }
+    used = packet->pages_used;
+    if (used > MULTIFD_PAGES_PER_PACKET) {
+        error_report("multifd: packet with %u pages on channel %d, "
+                     "max is %d", used, p->id, MULTIFD_PAGES_PER_PACKET);
+        return -1;
+    }
+    trace_multifd_recv(p->id, packet->packet_num, used, packet->flags);
+    if (!used) {
+        return 0;
+    }
+
+    iov.iov_base = p->offset;
+    iov.iov_len = used * sizeof(p->offset[0]);
+    if (multifd_recv_all(p->fd, &iov, 1, iov.iov_len)) {
+        return -1;
+    }
+
+    rcu_read_lock();
+    block = qemu_ram_block_by_name(packet->ramblock);
+    if (!block) {
+        error_report("multifd: unknown ramblock \"%s\" on channel %d",
+                     packet->ramblock, p->id);
+        ret = -1;
+        goto out;
+    }
+    for (i = 0; i < used; i++) {
+        ram_addr_t offset = be64_to_cpu(p->offset[i]);
+
+        if ((offset & ~TARGET_PAGE_MASK) ||
+            !offset_in_ramblock(block, offset + TARGET_PAGE_SIZE - 1)) {
+            error_report("multifd: invalid page offset 0x" RAM_ADDR_FMT
+                         " for ramblock \"%s\"", offset, packet->ramblock);
+            ret = -1;
+            goto out;
+        }
+        p->iov[i].iov_base = block->host + offset;
+        p->iov[i].iov_len = TARGET_PAGE_SIZE;
+    }
+    ret = multifd_recv_all(p->fd, p->iov, used, used * TARGET_PAGE_SIZE);
+out:
+    rcu_read_unlock();
+    return ret;
+}
+
+static void *multifd_recv_thread(void *opaque)
+{
+    MultiFDRecvParams *p = opaque;
+    MultiFDPacket packet;
+
+    rcu_register_thread();
+
+    while (!atomic_read(&multifd_recv_state->quit)) {
+        if (multifd_recv_packet(p, &packet)) {
+            /*
+             * The source closes the channels once migration is over, so
+             * this is only an error if someone is still waiting for us.
+             */
+            multifd_recv_terminate();
+            break;
+        }
+        if (packet.flags & MULTIFD_FLAG_SYNC) {
+            qemu_sem_post(&multifd_recv_state->sem_sync);
+            qemu_sem_wait(&p->sem_sync);
+        }
+    }
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+static void *multifd_accept_thread(void *opaque)
+{
+    int count = multifd_recv_state->count;
+    int listen_fd = multifd_recv_state->listen_fd;
+    int i;
+
+    qemu_set_block(listen_fd);
+
+    for (i = 0; i < count; i++) {
+        MultiFDRecvParams *p = &multifd_recv_state->params[i];
+        MultiFDInit msg;
+        struct iovec iov = { .iov_base = &msg, .iov_len = sizeof(msg) };
+        char name[16];
+        int fd;
+
+        do {
+            fd = qemu_accept(listen_fd, NULL, NULL);
+        } while (fd < 0 && errno == EINTR);
+
+        qemu_mutex_lock(&multifd_recv_state->mutex);
+        if (fd >= 0 && multifd_recv_state->quit) {
+            closesocket(fd);
+            fd = -1;
+        }
+        p->fd = fd;
+        qemu_mutex_unlock(&multifd_recv_state->mutex);
+        if (fd < 0) {
+            if (!atomic_read(&multifd_recv_state->quit)) {
+                error_report("multifd: could not accept channel %d (%s)",
+                             i, strerror(errno));
+            }
+            goto err;
+        }
+
+        if (multifd_recv_all(fd, &iov, 1, sizeof(msg))) {
+            error_report("multifd: could not read header of channel %d", i);
+            goto err;
+        }
+        if (be32_to_cpu(msg.magic) != MULTIFD_MAGIC ||
+            be32_to_cpu(msg.version) != MULTIFD_VERSION) {
+            error_report("multifd: bad header on channel %d", i);
+            goto err;
+        }
+        if (be32_to_cpu(msg.channels) != count) {
+            error_report("multifd: source uses %u channels, we expect %d",
+                         be32_to_cpu(msg.channels), count);
+            goto err;
+        }
+        if (be32_to_cpu(msg.page_size) != TARGET_PAGE_SIZE) {
+            error_report("multifd: source uses a page size of %u bytes",
+                         be32_to_cpu(msg.page_size));
+            goto err;
+        }
+
+        p->id = i;
+        qemu_sem_init(&p->sem_sync, 0);
+        snprintf(name, sizeof(name), "multifdrecv_%d", i);
+        qemu_thread_create(&p->thread, name, multifd_recv_thread, p,
+                           QEMU_THREAD_JOINABLE);
+        p->running = true;
+    }
+
+    trace_multifd_load_channels_ready(count);
+    goto out;
+
+err:
+    multifd_recv_terminate();
+out:
+    qemu_mutex_lock(&multifd_recv_state->mutex);
+    closesocket(listen_fd);
+    multifd_recv_state->listen_fd = -1;
+    qemu_mutex_unlock(&multifd_recv_state->mutex);
+    return NULL;
+}
+
+void multifd_load_start(int listen_fd)
+{
+    int count = migrate_multifd_channels();
+    int i;
+
+    assert(!multifd_recv_state);
+    multifd_recv_state = g_malloc0(sizeof(*multifd_recv_state));
+    multifd_recv_state->params = g_new0(MultiFDRecvParams, count);
+    multifd_recv_state->count = count;
+    multifd_recv_state->listen_fd = listen_fd;
+    qemu_mutex_init(&multifd_recv_state->mutex);
+    qemu_sem_init(&multifd_recv_state->sem_sync, 0);
+    for (i = 0; i < count; i++) {
+        multifd_recv_state->params[i].fd = -1;
+    }
+
+    qemu_thread_create(&multifd_recv_state->accept_thread, "multifdaccept",
+                       multifd_accept_thread, NULL, QEMU_THREAD_JOINABLE);
+}
+
+void multifd_load_cleanup(void)
+{
+    int i;
+
+    if (!multifd_recv_state) {
+        return;
+    }
+
+    /* Kick every thread out of accept() and recv() */
+    qemu_mutex_lock(&multifd_recv_state->mutex);
+    atomic_set(&multifd_recv_state->quit, true);
+    if (multifd_recv_state->listen_fd >= 0) {
+        shutdown(multifd_recv_state->listen_fd, SHUT_RDWR);
+    }
+    for (i = 0; i < multifd_recv_state->count; i++) {
+        MultiFDRecvParams *p = &multifd_recv_state->params[i];
+
+        if (p->fd >= 0) {
+            shutdown(p->fd, SHUT_RDWR);
+        }
+    }
+    qemu_mutex_unlock(&multifd_recv_state->mutex);
+
+    qemu_thread_join(&multifd_recv_state->accept_thread);
+
+    for (i = 0; i < multifd_recv_state->count; i++) {
+        MultiFDRecvParams *p = &multifd_recv_state->params[i];
+
+        if (p->running) {
+            qemu_sem_post(&p->sem_sync);
+            qemu_thread_join(&p->thread);
+            qemu_sem_destroy(&p->sem_sync);
+        }
+        if (p->fd >= 0) {
+            closesocket(p->fd);
+        }
+    }
+
+    qemu_sem_destroy(&multifd_recv_state->sem_sync);
+    qemu_mutex_destroy(&multifd_recv_state->mutex);
+    g_free(multifd_recv_state->params);
+    g_free(multifd_recv_state);
+    multifd_recv_state = NULL;
+}
+
+int multifd_recv_sync_main(void)
+{
+    int i;
+
+    if (!multifd_recv_state) {
+        error_report("multifd: source uses multifd, enable the x-multifd "
+                     "capability on the destination too");
+        return -1;
+    }
+
+    for (i = 0; i < multifd_recv_state->count; i++) {
+        qemu_sem_wait(&multifd_recv_state->sem_sync);
+        if (atomic_read(&multifd_recv_state->error)) {
+            return -1;
+        }
+    }
+    for (i = 0; i < multifd_recv_state->count; i++) {
+        qemu_sem_post(&multifd_recv_state->params[i].sem_sync);
+    }
+
+    trace_multifd_recv_sync_main();
+    return 0;
+}
@@ -46,6 +46,9 @@ struct QEMUFile {
 
     struct iovec iov[MAX_IOV_SIZE];
     unsigned int iovcnt;
+    /* Which iovecs may be sent without copying, if zerocopy is set */
+    bool iov_zerocopy[MAX_IOV_SIZE];
+    bool zerocopy;
 
     int last_error;
 };
@@ -29,10 +29,19 @@
 #include "qemu/coroutine.h"
 #include "migration/qemu-file.h"
 #include "migration/qemu-file-internal.h"
+#include "trace.h"
+
+#ifdef CONFIG_MSG_ZEROCOPY
+#include <linux/errqueue.h>
+#endif
 
 typedef struct QEMUFileSocket {
     int fd;
     QEMUFile *file;
+    /* Zero-copy sends done and completed, and completions that copied */
+    uint32_t zerocopy_sent;
+    uint32_t zerocopy_done;
+    uint64_t zerocopy_copied;
 } QEMUFileSocket;
 
 static ssize_t socket_writev_buffer(void *opaque, struct iovec *iov, int iovcnt,
@@ -79,6 +88,197 @@ static ssize_t socket_writev_buffer(void *opaque, struct iovec *iov, int iovcnt,
     return offset;
 }
 
+#ifdef CONFIG_MSG_ZEROCOPY
+/*
+ * With MSG_ZEROCOPY, the kernel pins the pages of the buffer and transmits
+ * them as they are instead of copying them.  Each successful sendmsg() gets
+ * a sequence number, and the kernel reports on the error queue of the
+ * socket the ranges of sends that have completed.  Until then the pages
+ * stay pinned, which counts against RLIMIT_MEMLOCK; sendmsg() fails with
+ * ENOBUFS when too much is in flight.
+ */
+
+/* Collects the completions; if @wait, until all sends have completed */
+static int socket_zerocopy_reap(QEMUFileSocket *s, bool wait)
+{
+    char control[CMSG_SPACE(sizeof(struct sock_extended_err))];
+    struct sock_extended_err *serr;
+    struct cmsghdr *cm;
+    struct msghdr msg;
+    GPollFD pfd;
+    int err;
+
+    while (s->zerocopy_done != s->zerocopy_sent) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        /* This never blocks, the error queue is either empty or not */
+        if (recvmsg(s->fd, &msg, MSG_ERRQUEUE) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                return -errno;
+            }
+            if (!wait) {
+                return 0;
+            }
+
+            /* Queued errors are always reported by poll */
+            pfd.fd = s->fd;
+            pfd.events = G_IO_ERR;
+            pfd.revents = 0;
+            TFR(err = g_poll(&pfd, 1, -1 /* no timeout */));
+            continue;
+        }
+
+        cm = CMSG_FIRSTHDR(&msg);
+        if (!cm ||
+            !((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+              (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))) {
+            error_report("socket_zerocopy_reap: unexpected control message");
+            return -EIO;
+        }
+        serr = (struct sock_extended_err *)CMSG_DATA(cm);
+        if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY || serr->ee_errno) {
+            error_report("socket_zerocopy_reap: Got err=%d", serr->ee_errno);
+            return serr->ee_errno ? -serr->ee_errno : -EIO;
+        }
+
+        /* [ee_info, ee_data] is the range of sends that completed */
+        s->zerocopy_done += serr->ee_data - serr->ee_info + 1;
+        if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+            /* e.g. over loopback, or when the device can't gather */
+            s->zerocopy_copied++;
+        }
+    }
+
+    return 0;
+}
+
+static ssize_t socket_send_zerocopy(QEMUFileSocket *s, struct iovec *iov,
+                                    int iovcnt)
+{
+    struct msghdr msg;
+    ssize_t len, offset;
+    ssize_t size = iov_size(iov, iovcnt);
+    ssize_t total = 0;
+    int flags = MSG_ZEROCOPY;
+    int err, ret;
+
+    offset = 0;
+    while (size > 0) {
+        /* Skip what was sent already, as in unix_writev_buffer() */
+        while (offset >= iov[0].iov_len) {
+            offset -= iov[0].iov_len;
+            iov++, iovcnt--;
+        }
+        iov[0].iov_base += offset;
+        iov[0].iov_len -= offset;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+        len = sendmsg(s->fd, &msg, flags);
+
+        iov[0].iov_base -= offset;
+        iov[0].iov_len += offset;
+
+        if (len > 0) {
+            if (flags & MSG_ZEROCOPY) {
+                s->zerocopy_sent++;
+            }
+            offset += len;
+            total += len;
+            size -= len;
+            flags = MSG_ZEROCOPY;
+            continue;
+        }
+
+        if (errno == ENOBUFS && s->zerocopy_done != s->zerocopy_sent) {
+            /* Too much pinned, wait for what is in flight */
+            ret = socket_zerocopy_reap(s, true);
+            if (ret < 0) {
+                return ret;
+            }
+        } else if (errno == ENOBUFS) {
+            /* Nothing to wait for, so this one has to be copied */
+            flags = 0;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            GPollFD pfd;
+
+            pfd.fd = s->fd;
+            pfd.events = G_IO_OUT | G_IO_ERR;
+            pfd.revents = 0;
+            TFR(err = g_poll(&pfd, 1, -1 /* no timeout */));
+        } else if (errno != EINTR) {
+            error_report("socket_send_zerocopy: Got err=%d for (%zu/%zu)",
+                         errno, (size_t)size, (size_t)total);
+            return -errno;
+        }
+    }
+
+    return total;
+}
+
+static ssize_t socket_writev_zerocopy(void *opaque, struct iovec *iov,
+                                      const bool *zerocopy, int iovcnt,
+                                      int64_t pos)
+{
+    QEMUFileSocket *s = opaque;
+    ssize_t len, total = 0;
+    int i, n;
+    int ret;
+
+    /* The buffers that can't be sent without copying, like the QEMUFile's
+     * own buffer which is reused after this returns, are sent in between */
+    for (i = 0; i < iovcnt; i += n) {
+        for (n = 1; i + n < iovcnt && zerocopy[i + n] == zerocopy[i]; n++) {
+            /* nothing */
+        }
+        if (zerocopy[i]) {
+            len = socket_send_zerocopy(s, iov + i, n);
+        } else {
+            len = socket_writev_buffer(s, iov + i, n, pos + total);
+        }
+        if (len < 0) {
+            return len;
+        }
+        total += len;
+    }
+
+    /* Keep the error queue short */
+    ret = socket_zerocopy_reap(s, false);
+    if (ret < 0) {
+        return ret;
+    }
+
+    return total;
+}
+
+static int socket_enable_zerocopy(void *opaque)
+{
+    QEMUFileSocket *s = opaque;
+    int v = 1;
+
+    if (setsockopt(s->fd, SOL_SOCKET, SO_ZEROCOPY, &v, sizeof(v)) < 0) {
+        return -errno;
+    }
+    return 0;
+}
+
+static int socket_flush_zerocopy(void *opaque)
+{
+    QEMUFileSocket *s = opaque;
+    int ret;
+
+    ret = socket_zerocopy_reap(s, true);
+    trace_qemu_file_zerocopy_flush(s->zerocopy_sent, s->zerocopy_copied);
+    return ret;
+}
+#endif
+
 static int socket_get_fd(void *opaque)
 {
     QEMUFileSocket *s = opaque;
@@ -298,6 +498,11 @@ static const QEMUFileOps socket_read_ops = {
 static const QEMUFileOps socket_write_ops = {
     .get_fd          = socket_get_fd,
     .writev_buffer   = socket_writev_buffer,
+#ifdef CONFIG_MSG_ZEROCOPY
+    .writev_zerocopy = socket_writev_zerocopy,
+    .enable_zerocopy = socket_enable_zerocopy,
+    .flush_zerocopy  = socket_flush_zerocopy,
+#endif
     .close           = socket_close,
     .shut_down       = socket_shutdown,
     .get_return_path = socket_get_return_path
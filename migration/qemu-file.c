@@ -22,7 +22,6 @@
  * THE SOFTWARE.
  */
 #include "qemu/osdep.h"
-#include <zlib.h>
 #include "qemu-common.h"
 #include "qemu/error-report.h"
 #include "qemu/iov.h"
@@ -119,7 +118,10 @@ void qemu_fflush(QEMUFile *f)
     }
 
     if (f->ops->writev_buffer) {
-        if (f->iovcnt > 0) {
+        if (f->iovcnt > 0 && f->zerocopy) {
+            ret = f->ops->writev_zerocopy(f->opaque, f->iov, f->iov_zerocopy,
+                                          f->iovcnt, f->pos);
+        } else if (f->iovcnt > 0) {
             ret = f->ops->writev_buffer(f->opaque, f->iov, f->iovcnt, f->pos);
         }
     } else {
@@ -252,6 +254,57 @@ void qemu_update_position(QEMUFile *f, size_t size)
     f->pos += size;
 }
 
+/*
+ * Account for @len bytes that were sent on behalf of this stream over some
+ * other channel, so that they count against the rate limit.
+ */
+void qemu_file_update_transfer(QEMUFile *f, int64_t len)
+{
+    f->bytes_xfer += len;
+}
+
+/*
+ * Makes qemu_put_buffer_async() send the buffers without copying them, if
+ * the file supports it.  Returns negative error value if it doesn't.
+ */
+int qemu_file_enable_zerocopy(QEMUFile *f)
+{
+    int ret;
+
+    if (!f->ops->writev_zerocopy || !f->ops->enable_zerocopy) {
+        return -ENOTSUP;
+    }
+
+    ret = f->ops->enable_zerocopy(f->opaque);
+    if (ret == 0) {
+        f->zerocopy = true;
+    }
+    return ret;
+}
+
+/*
+ * Flushes the file and waits until the zero-copy sends have completed, so
+ * that none of the buffers passed to qemu_put_buffer_async() is still
+ * being read by the kernel.
+ */
+void qemu_file_flush_zerocopy(QEMUFile *f)
+{
+    int ret;
+
+    if (!f->zerocopy) {
+        return;
+    }
+
+    qemu_fflush(f);
+    if (f->last_error) {
+        return;
+    }
+    ret = f->ops->flush_zerocopy(f->opaque);
+    if (ret < 0) {
+        qemu_file_set_error(f, ret);
+    }
+}
+
 /** Closes the file
  *
  * Returns negative error value if any error happened on previous operations or
@@ -283,13 +336,16 @@ int qemu_fclose(QEMUFile *f)
     return ret;
 }
 
-static void add_to_iovec(QEMUFile *f, const uint8_t *buf, size_t size)
+static void add_to_iovec(QEMUFile *f, const uint8_t *buf, size_t size,
+                         bool zerocopy)
 {
     /* check for adjacent buffer and coalesce them */
     if (f->iovcnt > 0 && buf == f->iov[f->iovcnt - 1].iov_base +
-        f->iov[f->iovcnt - 1].iov_len) {
+        f->iov[f->iovcnt - 1].iov_len &&
+        zerocopy == f->iov_zerocopy[f->iovcnt - 1]) {
         f->iov[f->iovcnt - 1].iov_len += size;
     } else {
+        f->iov_zerocopy[f->iovcnt] = zerocopy;
         f->iov[f->iovcnt].iov_base = (uint8_t *)buf;
         f->iov[f->iovcnt++].iov_len = size;
     }
@@ -311,7 +367,7 @@ void qemu_put_buffer_async(QEMUFile *f, const uint8_t *buf, size_t size)
     }
 
     f->bytes_xfer += size;
-    add_to_iovec(f, buf, size);
+    add_to_iovec(f, buf, size, f->zerocopy);
 }
 
 void qemu_put_buffer(QEMUFile *f, const uint8_t *buf, size_t size)
@@ -330,7 +386,7 @@ void qemu_put_buffer(QEMUFile *f, const uint8_t *buf, size_t size)
         memcpy(f->buf + f->buf_index, buf, l);
         f->bytes_xfer += l;
         if (f->ops->writev_buffer) {
-            add_to_iovec(f, f->buf + f->buf_index, l);
+            add_to_iovec(f, f->buf + f->buf_index, l, false);
         }
         f->buf_index += l;
         if (f->buf_index == IO_BUF_SIZE) {
@@ -353,7 +409,7 @@ void qemu_put_byte(QEMUFile *f, int v)
     f->buf[f->buf_index] = v;
     f->bytes_xfer++;
     if (f->ops->writev_buffer) {
-        add_to_iovec(f, f->buf + f->buf_index, 1);
+        add_to_iovec(f, f->buf + f->buf_index, 1, false);
     }
     f->buf_index++;
     if (f->buf_index == IO_BUF_SIZE) {
@@ -607,24 +663,33 @@ uint64_t qemu_get_be64(QEMUFile *f)
     return v;
 }
 
-/* compress size bytes of data start at p with specific compression
- * level and store the compressed data to the buffer of f.
+/* compress size bytes of data start at p with the given codec and
+ * compression level and store the compressed data to the buffer of f.
+ * The length of the compressed data is stored together with the codec that
+ * was used; data that doesn't get smaller with lz4 or zstd is stored raw.
+ * Returns the number of bytes written, or 0 on error.
  */
-
 ssize_t qemu_put_compression_data(QEMUFile *f, const uint8_t *p, size_t size,
-                                  int level)
+                                  MigrationCodecState *state,
+                                  MigrationCodec codec, int level)
 {
     ssize_t blen = IO_BUF_SIZE - f->buf_index - sizeof(int32_t);
+    uint8_t *dest = f->buf + f->buf_index + sizeof(int32_t);
 
-    if (blen < compressBound(size)) {
+    if (blen < migration_codec_bound(size)) {
         return 0;
     }
-    if (compress2(f->buf + f->buf_index + sizeof(int32_t), (uLongf *)&blen,
-                  (Bytef *)p, size, level) != Z_OK) {
+    blen = migration_codec_compress(state, codec, level, dest, blen, p, size);
+    if (blen < 0) {
         error_report("Compress Failed!");
         return 0;
     }
-    qemu_put_be32(f, blen);
+    if (codec != MIGRATION_CODEC_ZLIB && blen >= size) {
+        codec = MIGRATION_CODEC_RAW;
+        memcpy(dest, p, size);
+        blen = size;
+    }
+    qemu_put_be32(f, blen | (codec << MIGRATION_CODEC_SHIFT));
     f->buf_index += blen;
     return blen + sizeof(int32_t);
 }
@@ -26,8 +26,8 @@
  * THE SOFTWARE.
  */
 #include "qemu/osdep.h"
-#include <zlib.h>
 #include "qapi-event.h"
+#include "qmp-commands.h"
 #include "qemu/cutils.h"
 #include "qemu/bitops.h"
 #include "qemu/bitmap.h"
@@ -35,12 +35,16 @@
 #include "qemu/main-loop.h"
 #include "migration/migration.h"
 #include "migration/postcopy-ram.h"
+#include "migration/multifd.h"
+#include "migration/compress.h"
 #include "exec/address-spaces.h"
 #include "migration/page_cache.h"
 #include "qemu/error-report.h"
 #include "trace.h"
 #include "exec/ram_addr.h"
 #include "qemu/rcu_queue.h"
+#include "qom/cpu.h"
+#include "sysemu/sysemu.h"
 
 #ifdef DEBUG_MIGRATION_RAM
 #define DPRINTF(fmt, ...) \
@@ -66,6 +70,7 @@ static uint64_t bitmap_sync_count;
 #define RAM_SAVE_FLAG_XBZRLE   0x40
 /* 0x80 is reserved in migration.h start with 0x100 next */
 #define RAM_SAVE_FLAG_COMPRESS_PAGE    0x100
+#define RAM_SAVE_FLAG_MULTIFD_SYNC     0x200
 
 static const uint8_t ZERO_TARGET_PAGE[TARGET_PAGE_SIZE];
 
@@ -83,9 +88,51 @@ static struct {
     uint8_t *current_buf;
     /* Cache for XBZRLE, Protected by lock. */
     PageCache *cache;
+    /* Caches replaced while the encoder threads may still use them */
+    GSList *retired_caches;
     QemuMutex lock;
 } XBZRLE;
 
+/*
+ * XBZRLE encoder threads.  The migration thread looks pages up in the cache
+ * and pins them; the threads encode them into their own QEMUFile, which the
+ * migration thread copies to the stream later.  The threads only get the
+ * pages of the block that was sent last, so that their output can always
+ * use RAM_SAVE_FLAG_CONTINUE; their output is flushed before anything else
+ * is sent for another block.
+ */
+struct XbzrleParam {
+    QemuThread thread;
+    QemuCond cond;
+    /* Set while the thread encodes a page */
+    bool busy;
+    /* Set while the output of the thread hasn't been collected */
+    bool pending;
+    QEMUFile *file;
+    RAMBlock *block;
+    /* offset of the page in the block, including flags */
+    ram_addr_t offset;
+    uint8_t *host;
+    bool last_stage;
+    CacheItem *item;
+    uint8_t *current_buf;
+    uint8_t *encoded_buf;
+    /* Same as the return value of save_xbzrle_page(), and bytes written */
+    int result;
+    size_t bytes;
+};
+typedef struct XbzrleParam XbzrleParam;
+
+static struct {
+    /* Set with XBZRLE.lock held, 0 if the pages are encoded synchronously */
+    int nthreads;
+    bool quit;
+    /* Protects the busy and pending flags */
+    QemuMutex lock;
+    QemuCond done_cond;
+    XbzrleParam *params;
+} xbzrle_enc;
+
 /* buffer used for XBZRLE decoding */
 static uint8_t *xbzrle_decoded_buf;
 
@@ -109,36 +156,50 @@ static void XBZRLE_cache_unlock(void)
  */
 int64_t xbzrle_cache_resize(int64_t new_size)
 {
-    PageCache *new_cache;
-    int64_t ret;
+    PageCache *new_cache, *old_cache = NULL;
+    bool active;
 
     if (new_size < TARGET_PAGE_SIZE) {
         return -1;
     }
 
     XBZRLE_cache_lock();
+    active = XBZRLE.cache != NULL;
+    XBZRLE_cache_unlock();
 
-    if (XBZRLE.cache != NULL) {
-        if (pow2floor(new_size) == migrate_xbzrle_cache_size()) {
-            goto out_new_size;
-        }
-        new_cache = cache_init(new_size / TARGET_PAGE_SIZE,
-                                        TARGET_PAGE_SIZE);
-        if (!new_cache) {
-            error_report("Error creating cache");
-            ret = -1;
-            goto out;
-        }
+    if (!active || pow2floor(new_size) == migrate_xbzrle_cache_size()) {
+        return pow2floor(new_size);
+    }
 
-        cache_fini(XBZRLE.cache);
-        XBZRLE.cache = new_cache;
+    /*
+     * The new cache starts out empty: allocating it, and freeing the old
+     * one, is done without the lock so that the migration thread keeps
+     * sending pages meanwhile.
+     */
+    new_cache = cache_init(new_size / TARGET_PAGE_SIZE, TARGET_PAGE_SIZE);
+    if (!new_cache) {
+        error_report("Error creating cache");
+        return -1;
     }
 
-out_new_size:
-    ret = pow2floor(new_size);
-out:
+    XBZRLE_cache_lock();
+    if (!XBZRLE.cache) {
+        /* The migration finished meanwhile */
+        old_cache = new_cache;
+    } else if (xbzrle_enc.nthreads) {
+        XBZRLE.retired_caches = g_slist_prepend(XBZRLE.retired_caches,
+                                                XBZRLE.cache);
+        XBZRLE.cache = new_cache;
+    } else {
+        old_cache = XBZRLE.cache;
+        XBZRLE.cache = new_cache;
+    }
     XBZRLE_cache_unlock();
-    return ret;
+
+    if (old_cache) {
+        cache_fini(old_cache);
+    }
+    return pow2floor(new_size);
 }
 
 /* accounting for migration statistics */
@@ -152,6 +213,9 @@ typedef struct AccountingInfo {
     uint64_t xbzrle_cache_miss;
     double xbzrle_cache_miss_rate;
     uint64_t xbzrle_overflows;
+    /* Time spent checking pages for zeroes, and saving them otherwise (ns) */
+    uint64_t zero_scan_time;
+    uint64_t send_time;
 } AccountingInfo;
 
 static AccountingInfo acct_info;
@@ -216,6 +280,16 @@ uint64_t xbzrle_mig_pages_overflow(void)
     return acct_info.xbzrle_overflows;
 }
 
+uint64_t ram_zero_scan_time(void)
+{
+    return acct_info.zero_scan_time / SCALE_US;
+}
+
+uint64_t ram_send_time(void)
+{
+    return acct_info.send_time / SCALE_US;
+}
+
 /* This is the last block that we have visited serching for dirty pages
  */
 static RAMBlock *last_seen_block;
@@ -224,6 +298,10 @@ static RAMBlock *last_sent_block;
 static ram_addr_t last_offset;
 static QemuMutex migration_bitmap_mutex;
 static uint64_t migration_dirty_pages;
+/* Set while the RAMBlocks have migration bitmaps */
+static bool migration_bitmap_active;
+/* A block was added after the bitmaps were set up, so it has no unsentmap */
+static bool migration_bitmap_resized;
 static uint32_t last_version;
 static bool ram_bulk_stage;
 
@@ -238,18 +316,6 @@ struct PageSearchStatus {
 };
 typedef struct PageSearchStatus PageSearchStatus;
 
-static struct BitmapRcu {
-    struct rcu_head rcu;
-    /* Main migration bitmap */
-    unsigned long *bmap;
-    /* bitmap of pages that haven't been sent even once
-     * only maintained and used in postcopy at the moment
-     * where it's used to send the dirtymap at the start
-     * of the postcopy phase
-     */
-    unsigned long *unsentmap;
-} *migration_bitmap_rcu;
-
 struct CompressParam {
     bool start;
     bool done;
@@ -258,6 +324,17 @@ struct CompressParam {
     QemuCond cond;
     RAMBlock *block;
     ram_addr_t offset;
+    MigrationCodec codec;
+    int level;
+    MigrationCodecState *codec_state;
+    /* The page is compressed from here if it must not be read from guest
+     * memory, e.g. because the XBZRLE cache has to match the destination */
+    uint8_t *page_copy;
+    bool use_copy;
+    /* Compressed size (0 if nothing was compressed) and compression time of
+     * the page, accounted by the migration thread */
+    size_t comp_len;
+    int64_t comp_ns;
 };
 typedef struct CompressParam CompressParam;
 
@@ -268,6 +345,8 @@ struct DecompressParam {
     void *des;
     uint8_t *compbuf;
     int len;
+    MigrationCodec codec;
+    MigrationCodecState *codec_state;
 };
 typedef struct DecompressParam DecompressParam;
 
@@ -287,6 +366,11 @@ static bool quit_comp_thread;
 static bool quit_decomp_thread;
 static DecompressParam *decomp_param;
 static QemuThread *decompress_threads;
+/* decomp_done_cond is signalled when a decompression thread has finished
+ * a page, so that ram_load() can wait for all of them.
+ */
+static QemuMutex decomp_done_lock;
+static QemuCond decomp_done_cond;
 
 static int do_compress_ram_page(CompressParam *param);
 
@@ -347,6 +431,8 @@ void migrate_compress_threads_join(void)
         qemu_fclose(comp_param[i].file);
         qemu_mutex_destroy(&comp_param[i].mutex);
         qemu_cond_destroy(&comp_param[i].cond);
+        migration_codec_state_free(comp_param[i].codec_state);
+        g_free(comp_param[i].page_copy);
     }
     qemu_mutex_destroy(comp_done_lock);
     qemu_cond_destroy(comp_done_cond);
@@ -382,6 +468,8 @@ void migrate_compress_threads_create(void)
          */
         comp_param[i].file = qemu_fopen_ops(NULL, &empty_ops);
         comp_param[i].done = true;
+        comp_param[i].codec_state = migration_codec_state_new();
+        comp_param[i].page_copy = g_malloc(TARGET_PAGE_SIZE);
         qemu_mutex_init(&comp_param[i].mutex);
         qemu_cond_init(&comp_param[i].cond);
         qemu_thread_create(compress_threads + i, "compress",
@@ -418,6 +506,148 @@ static size_t save_page_header(QEMUFile *f, RAMBlock *block, ram_addr_t offset)
     return size;
 }
 
+/*
+ * Per-vcpu dirty page rates, measured like the total one at every bitmap
+ * sync that ends a period of at least one second.
+ *
+ * TCG counts the pages that each vcpu was the first to dirty in
+ * CPUState::dirty_pages.  KVM only reports which pages are dirty, so there
+ * the pages dirtied in a period are split between the vcpus in proportion
+ * to the CPU time used by their threads: a halted vcpu dirties no memory.
+ * Protected by the iothread lock.
+ */
+typedef struct VcpuDirtyRate {
+    unsigned long dirty_pages_prev;
+    int64_t cpu_time_prev;
+    /* Pages and CPU time of the current period */
+    uint64_t period_pages;
+    int64_t period_cpu_time;
+    /* Pages per second */
+    int64_t dirty_pages_rate;
+} VcpuDirtyRate;
+
+static struct {
+    /* Indexed by cpu_index, NULL until the first migration */
+    VcpuDirtyRate *vcpus;
+    /* Whether the rates are split by CPU time */
+    bool estimated;
+} dirty_rate;
+
+static VcpuDirtyRate *vcpu_dirty_rate(CPUState *cpu)
+{
+    if (!dirty_rate.vcpus || cpu->cpu_index >= max_cpus) {
+        return NULL;
+    }
+    return &dirty_rate.vcpus[cpu->cpu_index];
+}
+
+static int64_t vcpu_cpu_time(CPUState *cpu)
+{
+    return cpu->thread ? qemu_thread_get_cpu_time_ns(cpu->thread) : -1;
+}
+
+static void dirty_rate_setup(void)
+{
+    CPUState *cpu;
+
+    g_free(dirty_rate.vcpus);
+    dirty_rate.vcpus = g_new0(VcpuDirtyRate, max_cpus);
+    dirty_rate.estimated = false;
+
+    CPU_FOREACH(cpu) {
+        VcpuDirtyRate *v = vcpu_dirty_rate(cpu);
+
+        if (v) {
+            v->dirty_pages_prev = atomic_read(&cpu->dirty_pages);
+            v->cpu_time_prev = vcpu_cpu_time(cpu);
+        }
+    }
+}
+
+/* Called at the end of a period of @period_ms, with @num_dirty_pages */
+static void dirty_rate_update(int64_t num_dirty_pages, int64_t period_ms)
+{
+    CPUState *cpu;
+    uint64_t counted = 0;
+    int64_t cpu_time = 0;
+
+    CPU_FOREACH(cpu) {
+        VcpuDirtyRate *v = vcpu_dirty_rate(cpu);
+        unsigned long pages = atomic_read(&cpu->dirty_pages);
+        int64_t now = vcpu_cpu_time(cpu);
+
+        if (!v) {
+            continue;
+        }
+        v->period_pages = pages - v->dirty_pages_prev;
+        v->dirty_pages_prev = pages;
+        v->period_cpu_time = 0;
+        if (now >= 0 && v->cpu_time_prev >= 0) {
+            v->period_cpu_time = now - v->cpu_time_prev;
+        }
+        v->cpu_time_prev = now;
+
+        counted += v->period_pages;
+        cpu_time += v->period_cpu_time;
+    }
+
+    dirty_rate.estimated = !counted;
+    CPU_FOREACH(cpu) {
+        VcpuDirtyRate *v = vcpu_dirty_rate(cpu);
+        double pages;
+
+        if (!v) {
+            continue;
+        }
+        if (counted) {
+            pages = v->period_pages;
+        } else if (cpu_time) {
+            pages = (double)num_dirty_pages * v->period_cpu_time / cpu_time;
+        } else {
+            pages = 0;
+        }
+        v->dirty_pages_rate = pages * 1000 / period_ms;
+    }
+}
+
+DirtyRateInfo *qmp_query_dirty_rate(Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+    DirtyRateInfo *info;
+    DirtyRateVcpuList *head = NULL, **tail = &head;
+    CPUState *cpu;
+
+    if (!dirty_rate.vcpus) {
+        error_setg(errp, "The dirty page rate is only measured "
+                   "during migration");
+        return NULL;
+    }
+
+    info = g_new0(DirtyRateInfo, 1);
+    info->dirty_rate = s->dirty_pages_rate;
+    info->estimated = dirty_rate.estimated;
+
+    CPU_FOREACH(cpu) {
+        VcpuDirtyRate *v = vcpu_dirty_rate(cpu);
+        DirtyRateVcpuList *entry;
+
+        if (!v) {
+            continue;
+        }
+        entry = g_new0(DirtyRateVcpuList, 1);
+        entry->value = g_new0(DirtyRateVcpu, 1);
+        entry->value->cpu_index = cpu->cpu_index;
+        entry->value->dirty_rate = v->dirty_pages_rate;
+        entry->value->throttle_percentage =
+            cpu_throttle_get_vcpu_percentage(cpu);
+        *tail = entry;
+        tail = &entry->next;
+    }
+    info->vcpus = head;
+
+    return info;
+}
+
 /* Reduce amount of guest cpu execution to hopefully slow down memory writes.
  * If guest dirty memory rate is reduced below the rate at which we can
  * transfer pages to the destination then we should be able to complete
@@ -431,13 +661,50 @@ static void mig_throttle_guest_down(void)
             s->parameters[MIGRATION_PARAMETER_X_CPU_THROTTLE_INITIAL];
     uint64_t pct_icrement =
             s->parameters[MIGRATION_PARAMETER_X_CPU_THROTTLE_INCREMENT];
+    CPUState *cpu;
+    int64_t total_rate = 0;
+    int nvcpus = 0;
 
-    /* We have not started throttling yet. Let's start it. */
-    if (!cpu_throttle_active()) {
-        cpu_throttle_set(pct_initial);
-    } else {
-        /* Throttling already on, just increase the rate */
-        cpu_throttle_set(cpu_throttle_get_percentage() + pct_icrement);
+    CPU_FOREACH(cpu) {
+        VcpuDirtyRate *v = vcpu_dirty_rate(cpu);
+
+        total_rate += v ? v->dirty_pages_rate : 0;
+        nvcpus++;
+    }
+
+    if (!total_rate || dirty_rate.estimated) {
+        /*
+         * No idea who dirties memory, throttle all vcpus alike.  Rates
+         * estimated from the CPU time would throttle vcpus that are busy
+         * but don't write to memory, and spare the ones that do.
+         */
+        if (!cpu_throttle_active()) {
+            /* We have not started throttling yet. Let's start it. */
+            cpu_throttle_set(pct_initial);
+        } else {
+            /* Throttling already on, just increase the rate */
+            cpu_throttle_set(cpu_throttle_get_percentage() + pct_icrement);
+        }
+        return;
+    }
+
+    /*
+     * Only throttle the vcpus that dirty at least half of their fair share
+     * of the pages.  If all vcpus dirty memory alike, all of them are
+     * throttled, as above.
+     */
+    CPU_FOREACH(cpu) {
+        VcpuDirtyRate *v = vcpu_dirty_rate(cpu);
+        int pct;
+
+        if (!v || v->dirty_pages_rate * nvcpus * 2 < total_rate) {
+            continue;
+        }
+        pct = cpu_throttle_get_vcpu_percentage(cpu);
+        pct = pct ? pct + pct_icrement : pct_initial;
+        trace_migration_throttle_vcpu(cpu->cpu_index, v->dirty_pages_rate,
+                                      pct);
+        cpu_throttle_set_vcpu(cpu, pct);
     }
 }
 
@@ -540,45 +807,257 @@ static int save_xbzrle_page(QEMUFile *f, uint8_t **current_data,
     return 1;
 }
 
-/* Called with rcu_read_lock() to protect migration_bitmap
+/* Same as save_xbzrle_page() for a cached page, in an encoder thread */
+static void xbzrle_encode_page(XbzrleParam *param)
+{
+    QEMUFile *f = param->file;
+    uint8_t *prev_cached_page = cache_item_data(param->item);
+    int encoded_len;
+
+    memcpy(param->current_buf, param->host, TARGET_PAGE_SIZE);
+    encoded_len = xbzrle_encode_buffer(prev_cached_page, param->current_buf,
+                                       TARGET_PAGE_SIZE, param->encoded_buf,
+                                       TARGET_PAGE_SIZE);
+    if (encoded_len != 0 && !param->last_stage) {
+        memcpy(prev_cached_page, param->current_buf, TARGET_PAGE_SIZE);
+    }
+
+    if (encoded_len == 0) {
+        param->bytes = 0;
+        param->result = 0;
+    } else if (encoded_len == -1) {
+        /* Send the copy, which is what the cache now holds */
+        param->bytes = save_page_header(f, param->block,
+                                        param->offset | RAM_SAVE_FLAG_PAGE);
+        qemu_put_buffer(f, param->current_buf, TARGET_PAGE_SIZE);
+        param->bytes += TARGET_PAGE_SIZE;
+        param->result = -1;
+    } else {
+        param->bytes = save_page_header(f, param->block,
+                                        param->offset | RAM_SAVE_FLAG_XBZRLE);
+        qemu_put_byte(f, ENCODING_FLAG_XBZRLE);
+        qemu_put_be16(f, encoded_len);
+        qemu_put_buffer(f, param->encoded_buf, encoded_len);
+        param->bytes += encoded_len + 1 + 2;
+        param->result = 1;
+    }
+
+    cache_unpin(param->item);
+    param->item = NULL;
+}
+
+static void *xbzrle_encode_thread(void *opaque)
+{
+    XbzrleParam *param = opaque;
+
+    qemu_mutex_lock(&xbzrle_enc.lock);
+    while (true) {
+        /* A page that was handed over is encoded even when quitting, so
+         * that it gets unpinned */
+        if (param->busy) {
+            qemu_mutex_unlock(&xbzrle_enc.lock);
+            xbzrle_encode_page(param);
+            qemu_mutex_lock(&xbzrle_enc.lock);
+            param->busy = false;
+            param->pending = true;
+            qemu_cond_broadcast(&xbzrle_enc.done_cond);
+        } else if (xbzrle_enc.quit) {
+            break;
+        } else {
+            qemu_cond_wait(&param->cond, &xbzrle_enc.lock);
+        }
+    }
+    qemu_mutex_unlock(&xbzrle_enc.lock);
+
+    return NULL;
+}
+
+/* Called with xbzrle_enc.lock held, for a thread that isn't busy */
+static void xbzrle_enc_collect(QEMUFile *f, XbzrleParam *param,
+                               uint64_t *bytes_transferred)
+{
+    if (!param->pending) {
+        return;
+    }
+    param->pending = false;
+
+    if (param->result == 0) {
+        DPRINTF("Skipping unmodified page\n");
+        return;
+    }
+    qemu_put_qemu_file(f, param->file);
+    *bytes_transferred += param->bytes;
+    if (param->result == 1) {
+        acct_info.xbzrle_pages++;
+        acct_info.xbzrle_bytes += param->bytes;
+    } else {
+        DPRINTF("Overflow\n");
+        acct_info.xbzrle_overflows++;
+        acct_info.norm_pages++;
+    }
+}
+
+/*
+ * xbzrle_enc_queue_page: hand a page over to an encoder thread
+ *
+ * Returns: true if the page was handed over
+ *          false if it isn't cached, and must be saved by save_xbzrle_page()
+ *
+ * Called with the XBZRLE cache lock held.  @offset must include
+ * RAM_SAVE_FLAG_CONTINUE, see xbzrle_enc.
+ */
+static bool xbzrle_enc_queue_page(QEMUFile *f, RAMBlock *block,
+                                  ram_addr_t offset, uint8_t *p,
+                                  ram_addr_t current_addr, bool last_stage,
+                                  uint64_t *bytes_transferred)
+{
+    XbzrleParam *param = NULL;
+    int i;
+
+    if (!cache_is_cached(XBZRLE.cache, current_addr, bitmap_sync_count)) {
+        return false;
+    }
+
+    qemu_mutex_lock(&xbzrle_enc.lock);
+    while (true) {
+        for (i = 0; i < xbzrle_enc.nthreads; i++) {
+            if (!xbzrle_enc.params[i].busy) {
+                param = &xbzrle_enc.params[i];
+                break;
+            }
+        }
+        if (param) {
+            break;
+        }
+        qemu_cond_wait(&xbzrle_enc.done_cond, &xbzrle_enc.lock);
+    }
+
+    xbzrle_enc_collect(f, param, bytes_transferred);
+
+    param->item = cache_pin(XBZRLE.cache, current_addr);
+    param->block = block;
+    param->offset = offset;
+    param->host = p;
+    param->last_stage = last_stage;
+    param->busy = true;
+    qemu_cond_signal(&param->cond);
+    qemu_mutex_unlock(&xbzrle_enc.lock);
+
+    return true;
+}
+
+/* Waits for the encoder threads and writes out what they have encoded */
+static void xbzrle_enc_flush(QEMUFile *f, uint64_t *bytes_transferred)
+{
+    int i;
+
+    if (!xbzrle_enc.nthreads) {
+        return;
+    }
+
+    qemu_mutex_lock(&xbzrle_enc.lock);
+    for (i = 0; i < xbzrle_enc.nthreads; i++) {
+        XbzrleParam *param = &xbzrle_enc.params[i];
+
+        while (param->busy) {
+            qemu_cond_wait(&xbzrle_enc.done_cond, &xbzrle_enc.lock);
+        }
+        xbzrle_enc_collect(f, param, bytes_transferred);
+    }
+    qemu_mutex_unlock(&xbzrle_enc.lock);
+}
+
+/* Called with the XBZRLE cache lock held */
+static void xbzrle_enc_setup(void)
+{
+    int i;
+
+    xbzrle_enc.nthreads = migrate_xbzrle_threads();
+    if (!xbzrle_enc.nthreads) {
+        return;
+    }
+
+    qemu_mutex_init(&xbzrle_enc.lock);
+    qemu_cond_init(&xbzrle_enc.done_cond);
+    xbzrle_enc.quit = false;
+    xbzrle_enc.params = g_new0(XbzrleParam, xbzrle_enc.nthreads);
+    for (i = 0; i < xbzrle_enc.nthreads; i++) {
+        XbzrleParam *param = &xbzrle_enc.params[i];
+
+        /* Used as a buffer only, like the files of CompressParam */
+        param->file = qemu_fopen_ops(NULL, &empty_ops);
+        param->current_buf = g_malloc(TARGET_PAGE_SIZE);
+        param->encoded_buf = g_malloc(TARGET_PAGE_SIZE);
+        qemu_cond_init(&param->cond);
+        qemu_thread_create(&param->thread, "xbzrle-enc",
+                           xbzrle_encode_thread, param, QEMU_THREAD_JOINABLE);
+    }
+}
+
+/* Called with the XBZRLE cache lock held */
+static void xbzrle_enc_cleanup(void)
+{
+    int i;
+
+    if (!xbzrle_enc.nthreads) {
+        return;
+    }
+
+    qemu_mutex_lock(&xbzrle_enc.lock);
+    xbzrle_enc.quit = true;
+    for (i = 0; i < xbzrle_enc.nthreads; i++) {
+        qemu_cond_signal(&xbzrle_enc.params[i].cond);
+    }
+    qemu_mutex_unlock(&xbzrle_enc.lock);
+
+    for (i = 0; i < xbzrle_enc.nthreads; i++) {
+        XbzrleParam *param = &xbzrle_enc.params[i];
+
+        qemu_thread_join(&param->thread);
+        qemu_fclose(param->file);
+        qemu_cond_destroy(&param->cond);
+        g_free(param->current_buf);
+        g_free(param->encoded_buf);
+    }
+    g_free(xbzrle_enc.params);
+    xbzrle_enc.params = NULL;
+    xbzrle_enc.nthreads = 0;
+
+    qemu_cond_destroy(&xbzrle_enc.done_cond);
+    qemu_mutex_destroy(&xbzrle_enc.lock);
+
+    g_slist_free_full(XBZRLE.retired_caches, (GDestroyNotify)cache_fini);
+    XBZRLE.retired_caches = NULL;
+}
+
+/* Called with rcu_read_lock() to protect the RAMBlock list
  * rb: The RAMBlock  to search for dirty pages in
  * start: Start address (typically so we can continue from previous page)
- * ram_addr_abs: Pointer into which to store the address of the dirty page
- *               within the global ram_addr space
  *
  * Returns: byte offset within memory region of the start of a dirty page
  */
 static inline
-ram_addr_t migration_bitmap_find_dirty(RAMBlock *rb,
-                                       ram_addr_t start,
-                                       ram_addr_t *ram_addr_abs)
+ram_addr_t migration_bitmap_find_dirty(RAMBlock *rb, ram_addr_t start)
 {
-    unsigned long base = rb->offset >> TARGET_PAGE_BITS;
-    unsigned long nr = base + (start >> TARGET_PAGE_BITS);
-    uint64_t rb_size = rb->used_length;
-    unsigned long size = base + (rb_size >> TARGET_PAGE_BITS);
-    unsigned long *bitmap;
-
+    unsigned long nr = start >> TARGET_PAGE_BITS;
+    unsigned long size = rb->used_length >> TARGET_PAGE_BITS;
     unsigned long next;
 
-    bitmap = atomic_rcu_read(&migration_bitmap_rcu)->bmap;
-    if (ram_bulk_stage && nr > base) {
+    if (ram_bulk_stage && nr > 0) {
         next = nr + 1;
     } else {
-        next = find_next_bit(bitmap, size, nr);
+        next = find_next_bit(rb->bmap, size, nr);
     }
 
-    *ram_addr_abs = next << TARGET_PAGE_BITS;
-    return (next - base) << TARGET_PAGE_BITS;
+    return next << TARGET_PAGE_BITS;
 }
 
-static inline bool migration_bitmap_clear_dirty(ram_addr_t addr)
+static inline bool migration_bitmap_clear_dirty(RAMBlock *rb,
+                                                ram_addr_t offset)
 {
     bool ret;
-    int nr = addr >> TARGET_PAGE_BITS;
-    unsigned long *bitmap = atomic_rcu_read(&migration_bitmap_rcu)->bmap;
 
-    ret = test_and_clear_bit(nr, bitmap);
+    ret = test_and_clear_bit(offset >> TARGET_PAGE_BITS, rb->bmap);
 
     if (ret) {
         migration_dirty_pages--;
@@ -586,12 +1065,198 @@ static inline bool migration_bitmap_clear_dirty(ram_addr_t addr)
     return ret;
 }
 
-static void migration_bitmap_sync_range(ram_addr_t start, ram_addr_t length)
+/*
+ * The dirty log is moved into the RAMBlock bitmaps in chunks of this size,
+ * which worker threads pick up one at a time so that the sync of large
+ * guests does not run on a single CPU.
+ */
+#define MIGRATION_SYNC_CHUNK        (1ULL << 30)
+#define MIGRATION_SYNC_THREADS_MAX  8
+
+typedef struct MigrationSyncRange {
+    RAMBlock *block;
+    ram_addr_t start;
+    ram_addr_t length;
+} MigrationSyncRange;
+
+static struct {
+    MigrationSyncRange *ranges;
+    unsigned int size;
+    unsigned int num;
+    unsigned int next;
+    uint64_t num_dirty;
+} sync_work;
+
+/*
+ * Worker threads live from ram_save_setup() to ram_migration_cleanup();
+ * each sync bumps the generation to wake them and waits until none is
+ * still running.
+ */
+static struct {
+    QemuThread *threads;
+    unsigned int nthreads;
+    QemuMutex lock;
+    QemuCond work_cond;
+    QemuCond done_cond;
+    unsigned int generation;
+    unsigned int running;
+    bool quit;
+} sync_workers;
+
+static void migration_bitmap_sync_ranges(void)
+{
+    uint64_t num_dirty = 0;
+    unsigned int i;
+
+    while ((i = atomic_fetch_inc(&sync_work.next)) < sync_work.num) {
+        MigrationSyncRange *range = &sync_work.ranges[i];
+
+        num_dirty += cpu_physical_memory_sync_dirty_bitmap(range->block,
+                                                           range->start,
+                                                           range->length);
+    }
+    atomic_add(&sync_work.num_dirty, num_dirty);
+}
+
+static void *migration_bitmap_sync_thread(void *opaque)
+{
+    unsigned int generation = 0;
+
+    rcu_register_thread();
+    qemu_mutex_lock(&sync_workers.lock);
+    while (!sync_workers.quit) {
+        if (sync_workers.generation == generation) {
+            qemu_cond_wait(&sync_workers.work_cond, &sync_workers.lock);
+            continue;
+        }
+        generation = sync_workers.generation;
+        qemu_mutex_unlock(&sync_workers.lock);
+
+        migration_bitmap_sync_ranges();
+
+        qemu_mutex_lock(&sync_workers.lock);
+        if (--sync_workers.running == 0) {
+            qemu_cond_signal(&sync_workers.done_cond);
+        }
+    }
+    qemu_mutex_unlock(&sync_workers.lock);
+    rcu_unregister_thread();
+
+    return NULL;
+}
+
+/* Called with rcu_read_lock() and migration_bitmap_mutex held; the
+ * workers rely on the former to keep the RAMBlocks alive.
+ * Returns the number of pages newly marked dirty.
+ */
+static uint64_t migration_bitmap_sync_blocks(void)
+{
+    RAMBlock *block;
+
+    sync_work.num = 0;
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        ram_addr_t start;
+
+        for (start = 0; start < block->used_length;
+             start += MIGRATION_SYNC_CHUNK) {
+            MigrationSyncRange *range;
+
+            if (sync_work.num == sync_work.size) {
+                sync_work.size = MAX(sync_work.size * 2, 16);
+                sync_work.ranges = g_renew(MigrationSyncRange,
+                                           sync_work.ranges, sync_work.size);
+            }
+            range = &sync_work.ranges[sync_work.num++];
+            range->block = block;
+            range->start = start;
+            range->length = MIN(MIGRATION_SYNC_CHUNK,
+                                block->used_length - start);
+        }
+    }
+    sync_work.next = 0;
+    sync_work.num_dirty = 0;
+
+    /* A single range is not worth a round trip through the workers */
+    if (sync_workers.nthreads && sync_work.num > 1) {
+        qemu_mutex_lock(&sync_workers.lock);
+        sync_workers.generation++;
+        sync_workers.running = sync_workers.nthreads;
+        qemu_cond_broadcast(&sync_workers.work_cond);
+        qemu_mutex_unlock(&sync_workers.lock);
+
+        migration_bitmap_sync_ranges();
+
+        qemu_mutex_lock(&sync_workers.lock);
+        while (sync_workers.running) {
+            qemu_cond_wait(&sync_workers.done_cond, &sync_workers.lock);
+        }
+        qemu_mutex_unlock(&sync_workers.lock);
+    } else {
+        migration_bitmap_sync_ranges();
+    }
+
+    return sync_work.num_dirty;
+}
+
+static unsigned int migration_bitmap_sync_threads(void)
+{
+#ifdef _SC_NPROCESSORS_ONLN
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (cpus > 1) {
+        return MIN(cpus, MIGRATION_SYNC_THREADS_MAX);
+    }
+#endif
+    return 1;
+}
+
+static void migration_bitmap_sync_setup(void)
+{
+    unsigned int i;
+
+    /* The migration thread takes part in every sync */
+    sync_workers.nthreads = migration_bitmap_sync_threads() - 1;
+    if (!sync_workers.nthreads) {
+        return;
+    }
+
+    qemu_mutex_init(&sync_workers.lock);
+    qemu_cond_init(&sync_workers.work_cond);
+    qemu_cond_init(&sync_workers.done_cond);
+    sync_workers.generation = 0;
+    sync_workers.running = 0;
+    sync_workers.quit = false;
+    sync_workers.threads = g_new0(QemuThread, sync_workers.nthreads);
+    for (i = 0; i < sync_workers.nthreads; i++) {
+        qemu_thread_create(&sync_workers.threads[i], "migration-sync",
+                           migration_bitmap_sync_thread, NULL,
+                           QEMU_THREAD_JOINABLE);
+    }
+}
+
+static void migration_bitmap_sync_cleanup(void)
 {
-    unsigned long *bitmap;
-    bitmap = atomic_rcu_read(&migration_bitmap_rcu)->bmap;
-    migration_dirty_pages +=
-        cpu_physical_memory_sync_dirty_bitmap(bitmap, start, length);
+    unsigned int i;
+
+    if (!sync_workers.nthreads) {
+        return;
+    }
+
+    qemu_mutex_lock(&sync_workers.lock);
+    sync_workers.quit = true;
+    qemu_cond_broadcast(&sync_workers.work_cond);
+    qemu_mutex_unlock(&sync_workers.lock);
+
+    for (i = 0; i < sync_workers.nthreads; i++) {
+        qemu_thread_join(&sync_workers.threads[i]);
+    }
+    g_free(sync_workers.threads);
+    sync_workers.threads = NULL;
+    sync_workers.nthreads = 0;
+
+    qemu_cond_destroy(&sync_workers.done_cond);
+    qemu_cond_destroy(&sync_workers.work_cond);
+    qemu_mutex_destroy(&sync_workers.lock);
 }
 
 /* Fix me: there are too many global variables used in migration process. */
@@ -603,88 +1268,424 @@ static uint64_t iterations_prev;
 
 static void migration_bitmap_sync_init(void)
 {
-    start_time = 0;
-    bytes_xfer_prev = 0;
-    num_dirty_pages_period = 0;
-    xbzrle_cache_miss_prev = 0;
-    iterations_prev = 0;
+    start_time = 0;
+    bytes_xfer_prev = 0;
+    num_dirty_pages_period = 0;
+    xbzrle_cache_miss_prev = 0;
+    iterations_prev = 0;
+}
+
+static void migration_bitmap_sync(void)
+{
+    uint64_t num_dirty_pages_init = migration_dirty_pages;
+    MigrationState *s = migrate_get_current();
+    int64_t end_time;
+    int64_t bytes_xfer_now;
+    int64_t sync_start, sync_time;
+
+    bitmap_sync_count++;
+
+    if (!bytes_xfer_prev) {
+        bytes_xfer_prev = ram_bytes_transferred();
+    }
+
+    if (!start_time) {
+        start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    }
+
+    trace_migration_bitmap_sync_start();
+    sync_start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+    address_space_sync_dirty_bitmap(&address_space_memory);
+
+    qemu_mutex_lock(&migration_bitmap_mutex);
+    rcu_read_lock();
+    migration_dirty_pages += migration_bitmap_sync_blocks();
+    rcu_read_unlock();
+    qemu_mutex_unlock(&migration_bitmap_mutex);
+
+    sync_time = qemu_clock_get_us(QEMU_CLOCK_REALTIME) - sync_start;
+    s->dirty_sync_time_last = sync_time;
+    s->dirty_sync_time_total += sync_time;
+    trace_migration_bitmap_sync_end(migration_dirty_pages
+                                    - num_dirty_pages_init, sync_time);
+    num_dirty_pages_period += migration_dirty_pages - num_dirty_pages_init;
+    end_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+
+    /* more than 1 second = 1000 millisecons */
+    if (end_time > start_time + 1000) {
+        dirty_rate_update(num_dirty_pages_period, end_time - start_time);
+
+        if (migrate_auto_converge()) {
+            /* The following detection logic can be refined later. For now:
+               Check to see if the dirtied bytes is 50% more than the approx.
+               amount of bytes that just got transferred since the last time we
+               were in this routine. If that happens twice, start or increase
+               throttling */
+            bytes_xfer_now = ram_bytes_transferred();
+
+            if (s->dirty_pages_rate &&
+               (num_dirty_pages_period * TARGET_PAGE_SIZE >
+                   (bytes_xfer_now - bytes_xfer_prev)/2) &&
+               (dirty_rate_high_cnt++ >= 2)) {
+                    trace_migration_throttle();
+                    dirty_rate_high_cnt = 0;
+                    mig_throttle_guest_down();
+             }
+             bytes_xfer_prev = bytes_xfer_now;
+        }
+
+        if (migrate_use_xbzrle()) {
+            if (iterations_prev != acct_info.iterations) {
+                acct_info.xbzrle_cache_miss_rate =
+                   (double)(acct_info.xbzrle_cache_miss -
+                            xbzrle_cache_miss_prev) /
+                   (acct_info.iterations - iterations_prev);
+            }
+            iterations_prev = acct_info.iterations;
+            xbzrle_cache_miss_prev = acct_info.xbzrle_cache_miss;
+        }
+        s->dirty_pages_rate = num_dirty_pages_period * 1000
+            / (end_time - start_time);
+        s->dirty_bytes_rate = s->dirty_pages_rate * TARGET_PAGE_SIZE;
+        start_time = end_time;
+        num_dirty_pages_period = 0;
+    }
+    s->dirty_sync_count = bitmap_sync_count;
+    if (migrate_use_events()) {
+        qapi_event_send_migration_pass(bitmap_sync_count, NULL);
+    }
+}
+
+/*
+ * Zero page scanning
+ *
+ * With x-zero-scan-threads > 0, helper threads check the dirty pages in a
+ * window ahead of the migration thread for zeroes, so that save_zero_page()
+ * usually only has to look up the result.  The window is a ring of chunks in
+ * the order in which find_dirty_block() visits the pages; it moves along as
+ * the migration thread looks up pages, and starts over wherever the migration
+ * thread jumps to a page outside of it.
+ *
+ * The results are only valid until the next bitmap sync, and the helpers
+ * rely on the RCU critical section of the migration thread to keep the
+ * RAMBlocks alive, so the window is emptied by zero_scan_flush() at the end
+ * of ram_save_iterate() and ram_save_complete().  A page that the guest
+ * writes after it was found to be zero is dirty again after the next sync and
+ * sent again, just like a page that the guest writes while it is being sent.
+ */
+#define ZERO_SCAN_CHUNK_PAGES   256
+#define ZERO_SCAN_WINDOW        64
+
+enum {
+    ZERO_SCAN_QUEUED,
+    ZERO_SCAN_BUSY,
+    ZERO_SCAN_DONE,
+};
+
+typedef struct ZeroScanChunk {
+    RAMBlock *block;
+    unsigned long start;
+    unsigned long npages;
+    int state;
+    /* The dirty pages that were checked, and which of them are zero */
+    unsigned long scanned[BITS_TO_LONGS(ZERO_SCAN_CHUNK_PAGES)];
+    unsigned long zero[BITS_TO_LONGS(ZERO_SCAN_CHUNK_PAGES)];
+} ZeroScanChunk;
+
+static struct {
+    QemuThread *threads;
+    int nthreads;
+    /* Protects everything below, except for cur */
+    QemuMutex lock;
+    QemuCond work_cond;
+    QemuCond done_cond;
+    bool quit;
+    /* The window, starting at chunks[head] */
+    ZeroScanChunk chunks[ZERO_SCAN_WINDOW];
+    unsigned int head;
+    unsigned int count;
+    /* First page after the window */
+    RAMBlock *next_block;
+    unsigned long next_page;
+    /* Time spent by the helpers since the last flush (ns) */
+    uint64_t helper_time;
+    /* Chunk of the last lookup, only used by the migration thread */
+    ZeroScanChunk *cur;
+} zero_scan;
+
+/* Ticks spent checking pages in the migration thread, see ram_send_timer */
+static int64_t zero_scan_ticks;
+
+static ZeroScanChunk *zero_scan_chunk(unsigned int n)
+{
+    return &zero_scan.chunks[(zero_scan.head + n) % ZERO_SCAN_WINDOW];
+}
+
+static void zero_scan_do_chunk(ZeroScanChunk *c)
+{
+    unsigned long end = c->start + c->npages;
+    unsigned long page;
+
+    for (page = find_next_bit(c->block->bmap, end, c->start); page < end;
+         page = find_next_bit(c->block->bmap, end, page + 1)) {
+        set_bit(page - c->start, c->scanned);
+        if (is_zero_range(c->block->host + (page << TARGET_PAGE_BITS),
+                          TARGET_PAGE_SIZE)) {
+            set_bit(page - c->start, c->zero);
+        }
+    }
+}
+
+static void *zero_scan_thread(void *opaque)
+{
+    qemu_mutex_lock(&zero_scan.lock);
+    while (!zero_scan.quit) {
+        ZeroScanChunk *c = NULL;
+        int64_t t0;
+        unsigned int n;
+
+        /* The chunks closest to the migration thread go first */
+        for (n = 0; n < zero_scan.count; n++) {
+            if (zero_scan_chunk(n)->state == ZERO_SCAN_QUEUED) {
+                c = zero_scan_chunk(n);
+                break;
+            }
+        }
+        if (!c) {
+            qemu_cond_wait(&zero_scan.work_cond, &zero_scan.lock);
+            continue;
+        }
+
+        c->state = ZERO_SCAN_BUSY;
+        qemu_mutex_unlock(&zero_scan.lock);
+
+        t0 = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+        zero_scan_do_chunk(c);
+
+        qemu_mutex_lock(&zero_scan.lock);
+        zero_scan.helper_time += qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - t0;
+        atomic_mb_set(&c->state, ZERO_SCAN_DONE);
+        qemu_cond_broadcast(&zero_scan.done_cond);
+    }
+    qemu_mutex_unlock(&zero_scan.lock);
+
+    return NULL;
+}
+
+/* Called with zero_scan.lock held */
+static void zero_scan_wait_chunk(ZeroScanChunk *c)
+{
+    while (c->state == ZERO_SCAN_BUSY) {
+        qemu_cond_wait(&zero_scan.done_cond, &zero_scan.lock);
+    }
+}
+
+/* Called with zero_scan.lock held and within an RCU critical section */
+static void zero_scan_fill(void)
+{
+    unsigned int added = 0;
+
+    while (zero_scan.count < ZERO_SCAN_WINDOW && zero_scan.next_block) {
+        RAMBlock *block = zero_scan.next_block;
+        unsigned long pages = block->used_length >> TARGET_PAGE_BITS;
+        unsigned long start = zero_scan.next_page;
+        unsigned long npages;
+        ZeroScanChunk *c;
+
+        if (!ram_bulk_stage) {
+            /* Don't bother the helpers with clean chunks */
+            start = find_next_bit(block->bmap, pages, start);
+        }
+        if (start >= pages) {
+            zero_scan.next_block = QLIST_NEXT_RCU(block, next);
+            zero_scan.next_page = 0;
+            continue;
+        }
+
+        npages = MIN(ZERO_SCAN_CHUNK_PAGES, pages - start);
+        c = zero_scan_chunk(zero_scan.count++);
+        c->block = block;
+        c->start = start;
+        c->npages = npages;
+        c->state = ZERO_SCAN_QUEUED;
+        bitmap_zero(c->scanned, ZERO_SCAN_CHUNK_PAGES);
+        bitmap_zero(c->zero, ZERO_SCAN_CHUNK_PAGES);
+        zero_scan.next_page = start + npages;
+        added++;
+    }
+
+    if (added) {
+        qemu_cond_broadcast(&zero_scan.work_cond);
+    }
+}
+
+/*
+ * Moves the window so that it starts with the chunk that contains @page,
+ * or right after @page if no chunk does.  Returns the chunk or NULL.
+ */
+static ZeroScanChunk *zero_scan_advance(RAMBlock *block, unsigned long page)
+{
+    ZeroScanChunk *c = NULL;
+    unsigned int n;
+
+    qemu_mutex_lock(&zero_scan.lock);
+    for (n = 0; n < zero_scan.count; n++) {
+        ZeroScanChunk *tmp = zero_scan_chunk(n);
+
+        if (tmp->block == block && page >= tmp->start &&
+            page < tmp->start + tmp->npages) {
+            c = tmp;
+            break;
+        }
+    }
+
+    /* Drop everything before the chunk, or everything if there is none */
+    while (zero_scan.count && zero_scan_chunk(0) != c) {
+        zero_scan_wait_chunk(zero_scan_chunk(0));
+        zero_scan.head = (zero_scan.head + 1) % ZERO_SCAN_WINDOW;
+        zero_scan.count--;
+    }
+    if (!c) {
+        zero_scan.next_block = block;
+        zero_scan.next_page = page + 1;
+    }
+
+    zero_scan_fill();
+    qemu_mutex_unlock(&zero_scan.lock);
+
+    return c;
+}
+
+/*
+ * Returns 1 if the page at @offset in @block was found to be zero by the
+ * zero scan threads, 0 if it was found not to be zero, and -1 if it has not
+ * been checked.
+ */
+static int zero_scan_lookup(RAMBlock *block, ram_addr_t offset)
+{
+    unsigned long page = offset >> TARGET_PAGE_BITS;
+    ZeroScanChunk *c = zero_scan.cur;
+
+    if (!zero_scan.nthreads) {
+        return -1;
+    }
+
+    if (!c || c->block != block || page < c->start ||
+        page >= c->start + c->npages) {
+        c = zero_scan.cur = zero_scan_advance(block, page);
+    }
+    if (!c || atomic_mb_read(&c->state) != ZERO_SCAN_DONE ||
+        !test_bit(page - c->start, c->scanned)) {
+        return -1;
+    }
+
+    return test_bit(page - c->start, c->zero);
+}
+
+/*
+ * Empties the window and waits for the helpers to become idle.  Must be
+ * called before the RCU critical section in which the window was filled
+ * ends.
+ */
+static void zero_scan_flush(void)
+{
+    if (!zero_scan.nthreads) {
+        return;
+    }
+
+    qemu_mutex_lock(&zero_scan.lock);
+    while (zero_scan.count) {
+        zero_scan_wait_chunk(zero_scan_chunk(--zero_scan.count));
+    }
+    zero_scan.next_block = NULL;
+    zero_scan.cur = NULL;
+
+    trace_ram_zero_scan_flush(zero_scan.helper_time);
+    acct_info.zero_scan_time += zero_scan.helper_time;
+    zero_scan.helper_time = 0;
+    qemu_mutex_unlock(&zero_scan.lock);
 }
 
-static void migration_bitmap_sync(void)
+static void zero_scan_setup(void)
 {
-    RAMBlock *block;
-    uint64_t num_dirty_pages_init = migration_dirty_pages;
-    MigrationState *s = migrate_get_current();
-    int64_t end_time;
-    int64_t bytes_xfer_now;
+    int i;
 
-    bitmap_sync_count++;
+    zero_scan.nthreads = migrate_zero_scan_threads();
+    if (!zero_scan.nthreads) {
+        return;
+    }
 
-    if (!bytes_xfer_prev) {
-        bytes_xfer_prev = ram_bytes_transferred();
+    qemu_mutex_init(&zero_scan.lock);
+    qemu_cond_init(&zero_scan.work_cond);
+    qemu_cond_init(&zero_scan.done_cond);
+    zero_scan.quit = false;
+    zero_scan.head = 0;
+    zero_scan.count = 0;
+    zero_scan.next_block = NULL;
+    zero_scan.cur = NULL;
+    zero_scan.helper_time = 0;
+
+    zero_scan.threads = g_new(QemuThread, zero_scan.nthreads);
+    for (i = 0; i < zero_scan.nthreads; i++) {
+        qemu_thread_create(&zero_scan.threads[i], "zero-scan",
+                           zero_scan_thread, NULL, QEMU_THREAD_JOINABLE);
     }
+}
 
-    if (!start_time) {
-        start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+static void zero_scan_cleanup(void)
+{
+    int i;
+
+    if (!zero_scan.nthreads) {
+        return;
     }
 
-    trace_migration_bitmap_sync_start();
-    address_space_sync_dirty_bitmap(&address_space_memory);
+    qemu_mutex_lock(&zero_scan.lock);
+    zero_scan.quit = true;
+    qemu_cond_broadcast(&zero_scan.work_cond);
+    qemu_mutex_unlock(&zero_scan.lock);
 
-    qemu_mutex_lock(&migration_bitmap_mutex);
-    rcu_read_lock();
-    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
-        migration_bitmap_sync_range(block->offset, block->used_length);
+    for (i = 0; i < zero_scan.nthreads; i++) {
+        qemu_thread_join(&zero_scan.threads[i]);
     }
-    rcu_read_unlock();
-    qemu_mutex_unlock(&migration_bitmap_mutex);
+    g_free(zero_scan.threads);
+    zero_scan.threads = NULL;
+    zero_scan.nthreads = 0;
 
-    trace_migration_bitmap_sync_end(migration_dirty_pages
-                                    - num_dirty_pages_init);
-    num_dirty_pages_period += migration_dirty_pages - num_dirty_pages_init;
-    end_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    qemu_cond_destroy(&zero_scan.done_cond);
+    qemu_cond_destroy(&zero_scan.work_cond);
+    qemu_mutex_destroy(&zero_scan.lock);
+}
 
-    /* more than 1 second = 1000 millisecons */
-    if (end_time > start_time + 1000) {
-        if (migrate_auto_converge()) {
-            /* The following detection logic can be refined later. For now:
-               Check to see if the dirtied bytes is 50% more than the approx.
-               amount of bytes that just got transferred since the last time we
-               were in this routine. If that happens twice, start or increase
-               throttling */
-            bytes_xfer_now = ram_bytes_transferred();
+/*
+ * Accounts the time that the migration thread spends in the loops that save
+ * pages to acct_info.send_time and acct_info.zero_scan_time.  The checks for
+ * zeroes are timed with the cheaper host ticks, which are then converted with
+ * the ratio of ticks to nanoseconds over the whole loop.
+ */
+typedef struct RAMSendTimer {
+    int64_t start_ns;
+    int64_t start_ticks;
+} RAMSendTimer;
 
-            if (s->dirty_pages_rate &&
-               (num_dirty_pages_period * TARGET_PAGE_SIZE >
-                   (bytes_xfer_now - bytes_xfer_prev)/2) &&
-               (dirty_rate_high_cnt++ >= 2)) {
-                    trace_migration_throttle();
-                    dirty_rate_high_cnt = 0;
-                    mig_throttle_guest_down();
-             }
-             bytes_xfer_prev = bytes_xfer_now;
-        }
+static void ram_send_timer_start(RAMSendTimer *timer)
+{
+    zero_scan_ticks = 0;
+    timer->start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    timer->start_ticks = cpu_get_host_ticks();
+}
 
-        if (migrate_use_xbzrle()) {
-            if (iterations_prev != acct_info.iterations) {
-                acct_info.xbzrle_cache_miss_rate =
-                   (double)(acct_info.xbzrle_cache_miss -
-                            xbzrle_cache_miss_prev) /
-                   (acct_info.iterations - iterations_prev);
-            }
-            iterations_prev = acct_info.iterations;
-            xbzrle_cache_miss_prev = acct_info.xbzrle_cache_miss;
-        }
-        s->dirty_pages_rate = num_dirty_pages_period * 1000
-            / (end_time - start_time);
-        s->dirty_bytes_rate = s->dirty_pages_rate * TARGET_PAGE_SIZE;
-        start_time = end_time;
-        num_dirty_pages_period = 0;
-    }
-    s->dirty_sync_count = bitmap_sync_count;
-    if (migrate_use_events()) {
-        qapi_event_send_migration_pass(bitmap_sync_count, NULL);
+static void ram_send_timer_stop(RAMSendTimer *timer)
+{
+    int64_t ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - timer->start_ns;
+    int64_t ticks = cpu_get_host_ticks() - timer->start_ticks;
+    int64_t scan_ns = 0;
+
+    if (ticks > 0 && ns > 0) {
+        scan_ns = MIN(ns, (double)zero_scan_ticks * ns / ticks);
     }
+    acct_info.zero_scan_time += scan_ns;
+    acct_info.send_time += ns - scan_ns;
 }
 
 /**
@@ -702,8 +1703,17 @@ static int save_zero_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset,
                           uint8_t *p, uint64_t *bytes_transferred)
 {
     int pages = -1;
+    int zero;
+
+    zero = zero_scan_lookup(block, offset & TARGET_PAGE_MASK);
+    if (zero < 0) {
+        int64_t t0 = cpu_get_host_ticks();
+
+        zero = is_zero_range(p, TARGET_PAGE_SIZE);
+        zero_scan_ticks += cpu_get_host_ticks() - t0;
+    }
 
-    if (is_zero_range(p, TARGET_PAGE_SIZE)) {
+    if (zero) {
         acct_info.dup_pages++;
         *bytes_transferred += save_page_header(f, block,
                                                offset | RAM_SAVE_FLAG_COMPRESS);
@@ -743,6 +1753,11 @@ static int ram_save_page(QEMUFile *f, PageSearchStatus *pss,
 
     p = block->host + offset;
 
+    /* The encoder threads' output uses RAM_SAVE_FLAG_CONTINUE */
+    if (block != last_sent_block) {
+        xbzrle_enc_flush(f, bytes_transferred);
+    }
+
     /* In doubt sent page as normal */
     bytes_xmit = 0;
     ret = ram_control_save_page(f, block->offset,
@@ -774,6 +1789,11 @@ static int ram_save_page(QEMUFile *f, PageSearchStatus *pss,
              * page would be stale
              */
             xbzrle_cache_zero_page(current_addr);
+        } else if (!ram_bulk_stage && migrate_use_xbzrle() &&
+                   xbzrle_enc.nthreads && block == last_sent_block &&
+                   xbzrle_enc_queue_page(f, block, offset, p, current_addr,
+                                         last_stage, bytes_transferred)) {
+            pages = 1;
         } else if (!ram_bulk_stage && migrate_use_xbzrle()) {
             pages = save_xbzrle_page(f, &p, current_addr, block,
                                      offset, last_stage, bytes_transferred);
@@ -805,24 +1825,87 @@ static int ram_save_page(QEMUFile *f, PageSearchStatus *pss,
     return pages;
 }
 
+/**
+ * ram_save_multifd_page: Send the given page over the multifd channels
+ *
+ * Zero pages are still sent on the main stream, where they only take a few
+ * bytes; all the other pages are queued for the multifd sender threads.
+ *
+ * Returns: Number of pages written.
+ *          < 0 - error
+ *
+ * @f: QEMUFile where to send the data
+ * @pss: data about the page we want to send
+ * @bytes_transferred: increase it with the number of transferred bytes
+ */
+static int ram_save_multifd_page(QEMUFile *f, PageSearchStatus *pss,
+                                 uint64_t *bytes_transferred)
+{
+    RAMBlock *block = pss->block;
+    ram_addr_t offset = pss->offset;
+    int pages;
+    int ret;
+
+    pages = save_zero_page(f, block, block == last_sent_block ?
+                           offset | RAM_SAVE_FLAG_CONTINUE : offset,
+                           block->host + offset, bytes_transferred);
+    if (pages > 0) {
+        last_sent_block = block;
+        return pages;
+    }
+
+    ret = multifd_queue_page(block, offset);
+    if (ret < 0) {
+        qemu_file_set_error(f, -EIO);
+        return -EIO;
+    }
+
+    /* The page bypasses f, but must still count against its rate limit */
+    qemu_update_position(f, TARGET_PAGE_SIZE);
+    qemu_file_update_transfer(f, TARGET_PAGE_SIZE);
+    *bytes_transferred += TARGET_PAGE_SIZE;
+    acct_info.norm_pages++;
+
+    return 1;
+}
+
 static int do_compress_ram_page(CompressParam *param)
 {
     int bytes_sent, blen;
     uint8_t *p;
     RAMBlock *block = param->block;
     ram_addr_t offset = param->offset;
+    int64_t start;
 
-    p = block->host + (offset & TARGET_PAGE_MASK);
+    if (param->use_copy) {
+        p = param->page_copy;
+    } else {
+        p = block->host + (offset & TARGET_PAGE_MASK);
+    }
 
     bytes_sent = save_page_header(param->file, block, offset |
                                   RAM_SAVE_FLAG_COMPRESS_PAGE);
+    start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     blen = qemu_put_compression_data(param->file, p, TARGET_PAGE_SIZE,
-                                     migrate_compress_level());
+                                     param->codec_state, param->codec,
+                                     param->level);
+    param->comp_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start;
+    param->comp_len = blen > 0 ? blen - sizeof(int32_t) : 0;
     bytes_sent += blen;
 
     return bytes_sent;
 }
 
+/* Called by the migration thread when it takes the output of @param */
+static void account_compressed_page(CompressParam *param)
+{
+    if (param->comp_len) {
+        migration_codec_account(param->codec, TARGET_PAGE_SIZE,
+                                param->comp_len, param->comp_ns);
+        param->comp_len = 0;
+    }
+}
+
 static inline void start_compression(CompressParam *param)
 {
     param->done = false;
@@ -861,19 +1944,47 @@ static void flush_compressed_data(QEMUFile *f)
         if (!quit_comp_thread) {
             len = qemu_put_qemu_file(f, comp_param[idx].file);
             bytes_transferred += len;
+            account_compressed_page(&comp_param[idx]);
         }
     }
 }
 
+static void flush_xbzrle_data(QEMUFile *f)
+{
+    GSList *retired;
+
+    if (!migrate_use_xbzrle()) {
+        return;
+    }
+
+    XBZRLE_cache_lock();
+    xbzrle_enc_flush(f, &bytes_transferred);
+    retired = XBZRLE.retired_caches;
+    XBZRLE.retired_caches = NULL;
+    XBZRLE_cache_unlock();
+
+    g_slist_free_full(retired, (GDestroyNotify)cache_fini);
+}
+
+/* @copy is the data of the page if it must not be read from guest memory */
 static inline void set_compress_params(CompressParam *param, RAMBlock *block,
-                                       ram_addr_t offset)
+                                       ram_addr_t offset, MigrationCodec codec,
+                                       int level, const uint8_t *copy)
 {
     param->block = block;
     param->offset = offset;
+    param->codec = codec;
+    param->level = level;
+    param->use_copy = copy != NULL;
+    if (copy) {
+        memcpy(param->page_copy, copy, TARGET_PAGE_SIZE);
+    }
 }
 
 static int compress_page_with_multi_thread(QEMUFile *f, RAMBlock *block,
                                            ram_addr_t offset,
+                                           MigrationCodec codec, int level,
+                                           const uint8_t *copy,
                                            uint64_t *bytes_transferred)
 {
     int idx, thread_count, bytes_xmit = -1, pages = -1;
@@ -884,7 +1995,9 @@ static int compress_page_with_multi_thread(QEMUFile *f, RAMBlock *block,
         for (idx = 0; idx < thread_count; idx++) {
             if (comp_param[idx].done) {
                 bytes_xmit = qemu_put_qemu_file(f, comp_param[idx].file);
-                set_compress_params(&comp_param[idx], block, offset);
+                account_compressed_page(&comp_param[idx]);
+                set_compress_params(&comp_param[idx], block, offset, codec,
+                                    level, copy);
                 start_compression(&comp_param[idx]);
                 pages = 1;
                 acct_info.norm_pages++;
@@ -903,6 +2016,84 @@ static int compress_page_with_multi_thread(QEMUFile *f, RAMBlock *block,
     return pages;
 }
 
+/**
+ * ram_save_codec_page: send a page that isn't zero in the compressed mode
+ *
+ * With the adaptive algorithm, pages that hit the XBZRLE cache are sent as
+ * XBZRLE if they encode well, the others uncompressed or with the codec that
+ * moves the most guest memory per second.
+ *
+ * Returns: Number of pages written.
+ *
+ * @f: QEMUFile where to send the data
+ * @block: block that contains the page we want to send
+ * @offset: offset inside the block for the page, including the flags
+ * @last_stage: if we are at the completion stage
+ * @sync: compress on the migration thread rather than a compression thread
+ * @bytes_transferred: increase it with the number of transferred bytes
+ */
+static int ram_save_codec_page(QEMUFile *f, RAMBlock *block,
+                               ram_addr_t offset, bool last_stage, bool sync,
+                               uint64_t *bytes_transferred)
+{
+    ram_addr_t current_addr = block->offset + (offset & TARGET_PAGE_MASK);
+    uint8_t *p = block->host + (offset & TARGET_PAGE_MASK);
+    const uint8_t *copy = NULL;
+    int codec, level = migrate_compress_level();
+    int pages = -1;
+    uint64_t bytes_xmit;
+
+    XBZRLE_cache_lock();
+
+    codec = migration_codec_for_algorithm(migrate_compress_algorithm());
+    if (codec < 0) {
+        if (!ram_bulk_stage && migrate_use_xbzrle()) {
+            pages = save_xbzrle_page(f, &p, current_addr, block, offset,
+                                     last_stage, bytes_transferred);
+            if (pages >= 0) {
+                goto out;
+            }
+            if (!last_stage) {
+                /* p is in the cache now, which can change before the page
+                 * is compressed */
+                copy = p;
+            }
+        }
+        codec = migration_codec_choose(migrate_compress_threads(),
+                                       migrate_get_current()->bandwidth_limit);
+        if (codec != MIGRATION_CODEC_ZLIB) {
+            level = 1;
+        }
+    }
+
+    if (codec == MIGRATION_CODEC_RAW) {
+        *bytes_transferred += save_page_header(f, block,
+                                               offset | RAM_SAVE_FLAG_PAGE);
+        qemu_put_buffer(f, p, TARGET_PAGE_SIZE);
+        *bytes_transferred += TARGET_PAGE_SIZE;
+        acct_info.norm_pages++;
+        migration_codec_account(MIGRATION_CODEC_RAW, TARGET_PAGE_SIZE,
+                                TARGET_PAGE_SIZE, 0);
+        pages = 1;
+    } else if (sync) {
+        set_compress_params(&comp_param[0], block, offset, codec, level,
+                            copy);
+        bytes_xmit = do_compress_ram_page(&comp_param[0]);
+        acct_info.norm_pages++;
+        qemu_put_qemu_file(f, comp_param[0].file);
+        account_compressed_page(&comp_param[0]);
+        *bytes_transferred += bytes_xmit;
+        pages = 1;
+    } else {
+        pages = compress_page_with_multi_thread(f, block, offset, codec, level,
+                                                copy, bytes_transferred);
+    }
+
+out:
+    XBZRLE_cache_unlock();
+    return pages;
+}
+
 /**
  * ram_save_compressed_page: compress the given page and send it to the stream
  *
@@ -954,24 +2145,20 @@ static int ram_save_compressed_page(QEMUFile *f, PageSearchStatus *pss,
          */
         if (block != last_sent_block) {
             flush_compressed_data(f);
-            pages = save_zero_page(f, block, offset, p, bytes_transferred);
-            if (pages == -1) {
-                set_compress_params(&comp_param[0], block, offset);
-                /* Use the qemu thread to compress the data to make sure the
-                 * first page is sent out before other pages
-                 */
-                bytes_xmit = do_compress_ram_page(&comp_param[0]);
-                acct_info.norm_pages++;
-                qemu_put_qemu_file(f, comp_param[0].file);
-                *bytes_transferred += bytes_xmit;
-                pages = 1;
-            }
+        }
+        pages = save_zero_page(f, block, offset, p, bytes_transferred);
+        if (pages > 0) {
+            /* Only matters in the adaptive mode, which keeps XBZRLE in use */
+            XBZRLE_cache_lock();
+            xbzrle_cache_zero_page(block->offset + pss->offset);
+            XBZRLE_cache_unlock();
         } else {
-            pages = save_zero_page(f, block, offset, p, bytes_transferred);
-            if (pages == -1) {
-                pages = compress_page_with_multi_thread(f, block, offset,
-                                                        bytes_transferred);
-            }
+            /* Use the qemu thread to compress the first page of a block,
+             * to make sure it is sent out before other pages
+             */
+            pages = ram_save_codec_page(f, block, offset, last_stage,
+                                        block != last_sent_block,
+                                        bytes_transferred);
         }
     }
 
@@ -987,14 +2174,11 @@ static int ram_save_compressed_page(QEMUFile *f, PageSearchStatus *pss,
  * @f: Current migration stream.
  * @pss: Data about the state of the current dirty page scan.
  * @*again: Set to false if the search has scanned the whole of RAM
- * *ram_addr_abs: Pointer into which to store the address of the dirty page
- *               within the global ram_addr space
  */
 static bool find_dirty_block(QEMUFile *f, PageSearchStatus *pss,
-                             bool *again, ram_addr_t *ram_addr_abs)
+                             bool *again)
 {
-    pss->offset = migration_bitmap_find_dirty(pss->block, pss->offset,
-                                              ram_addr_abs);
+    pss->offset = migration_bitmap_find_dirty(pss->block, pss->offset);
     if (pss->complete_round && pss->block == last_seen_block &&
         pss->offset >= last_offset) {
         /*
@@ -1014,9 +2198,11 @@ static bool find_dirty_block(QEMUFile *f, PageSearchStatus *pss,
             /* Flag that we've looped */
             pss->complete_round = true;
             ram_bulk_stage = false;
-            if (migrate_use_xbzrle()) {
+            if (migrate_use_xbzrle() && migrate_compress_algorithm() !=
+                                        MIGRATION_COMPRESS_ALGORITHM_ADAPTIVE) {
                 /* If xbzrle is on, stop using the data compression at this
                  * point. In theory, xbzrle can do better than compression.
+                 * The adaptive mode chooses between them for each page.
                  */
                 flush_compressed_data(f);
                 compression_switch = false;
@@ -1037,12 +2223,10 @@ static bool find_dirty_block(QEMUFile *f, PageSearchStatus *pss,
  * Helper for 'get_queued_page' - gets a page off the queue
  *      ms:      MigrationState in
  * *offset:      Used to return the offset within the RAMBlock
- * ram_addr_abs: global offset in the dirty/sent bitmaps
  *
  * Returns:      block (or NULL if none available)
  */
-static RAMBlock *unqueue_page(MigrationState *ms, ram_addr_t *offset,
-                              ram_addr_t *ram_addr_abs)
+static RAMBlock *unqueue_page(MigrationState *ms, ram_addr_t *offset)
 {
     RAMBlock *block = NULL;
 
@@ -1051,9 +2235,7 @@ static RAMBlock *unqueue_page(MigrationState *ms, ram_addr_t *offset,
         struct MigrationSrcPageRequest *entry =
                                 QSIMPLEQ_FIRST(&ms->src_page_requests);
         block = entry->rb;
-        *offset = entry->offset;
-        *ram_addr_abs = (entry->offset + entry->rb->offset) &
-                        TARGET_PAGE_MASK;
+        *offset = entry->offset & TARGET_PAGE_MASK;
 
         if (entry->len > TARGET_PAGE_SIZE) {
             entry->len -= TARGET_PAGE_SIZE;
@@ -1075,19 +2257,17 @@ static RAMBlock *unqueue_page(MigrationState *ms, ram_addr_t *offset,
  *
  *      ms:      MigrationState in
  *     pss:      PageSearchStatus structure updated with found block/offset
- * ram_addr_abs: global offset in the dirty/sent bitmaps
  *
  * Returns:      true if a queued page is found
  */
-static bool get_queued_page(MigrationState *ms, PageSearchStatus *pss,
-                            ram_addr_t *ram_addr_abs)
+static bool get_queued_page(MigrationState *ms, PageSearchStatus *pss)
 {
     RAMBlock  *block;
     ram_addr_t offset;
     bool dirty;
 
     do {
-        block = unqueue_page(ms, &offset, ram_addr_abs);
+        block = unqueue_page(ms, &offset);
         /*
          * We're sending this page, and since it's postcopy nothing else
          * will dirty it, and we must make sure it doesn't get sent again
@@ -1095,19 +2275,18 @@ static bool get_queued_page(MigrationState *ms, PageSearchStatus *pss,
          * search already sent it.
          */
         if (block) {
-            unsigned long *bitmap;
-            bitmap = atomic_rcu_read(&migration_bitmap_rcu)->bmap;
-            dirty = test_bit(*ram_addr_abs >> TARGET_PAGE_BITS, bitmap);
+            unsigned long page = offset >> TARGET_PAGE_BITS;
+
+            dirty = test_bit(page, block->bmap);
             if (!dirty) {
                 trace_get_queued_page_not_dirty(
                     block->idstr, (uint64_t)offset,
-                    (uint64_t)*ram_addr_abs,
-                    test_bit(*ram_addr_abs >> TARGET_PAGE_BITS,
-                         atomic_rcu_read(&migration_bitmap_rcu)->unsentmap));
+                    (uint64_t)(block->offset + offset),
+                    block->unsentmap ? test_bit(page, block->unsentmap) : 0);
             } else {
                 trace_get_queued_page(block->idstr,
                                       (uint64_t)offset,
-                                      (uint64_t)*ram_addr_abs);
+                                      (uint64_t)(block->offset + offset));
             }
         }
 
@@ -1228,25 +2407,24 @@ err:
  * @offset: offset inside the block for the page;
  * @last_stage: if we are at the completion stage
  * @bytes_transferred: increase it with the number of transferred bytes
- * @dirty_ram_abs: Address of the start of the dirty page in ram_addr_t space
  *
  * Returns: Number of pages written.
  */
 static int ram_save_target_page(MigrationState *ms, QEMUFile *f,
                                 PageSearchStatus *pss,
                                 bool last_stage,
-                                uint64_t *bytes_transferred,
-                                ram_addr_t dirty_ram_abs)
+                                uint64_t *bytes_transferred)
 {
     int res = 0;
 
     /* Check the pages is dirty and if it is send it */
-    if (migration_bitmap_clear_dirty(dirty_ram_abs)) {
-        unsigned long *unsentmap;
+    if (migration_bitmap_clear_dirty(pss->block, pss->offset)) {
         if (compression_switch && migrate_use_compression()) {
             res = ram_save_compressed_page(f, pss,
                                            last_stage,
                                            bytes_transferred);
+        } else if (migrate_use_multifd()) {
+            res = ram_save_multifd_page(f, pss, bytes_transferred);
         } else {
             res = ram_save_page(f, pss, last_stage,
                                 bytes_transferred);
@@ -1255,15 +2433,15 @@ static int ram_save_target_page(MigrationState *ms, QEMUFile *f,
         if (res < 0) {
             return res;
         }
-        unsentmap = atomic_rcu_read(&migration_bitmap_rcu)->unsentmap;
-        if (unsentmap) {
-            clear_bit(dirty_ram_abs >> TARGET_PAGE_BITS, unsentmap);
+        if (pss->block->unsentmap) {
+            clear_bit(pss->offset >> TARGET_PAGE_BITS, pss->block->unsentmap);
         }
         /* Only update last_sent_block if a block was actually sent; xbzrle
          * might have decided the page was identical so didn't bother writing
-         * to the stream.
+         * to the stream.  Pages sent over multifd never touch the stream,
+         * so ram_save_multifd_page() updates it by itself.
          */
-        if (res > 0) {
+        if (res > 0 && !migrate_use_multifd()) {
             last_sent_block = pss->block;
         }
     }
@@ -1286,25 +2464,22 @@ static int ram_save_target_page(MigrationState *ms, QEMUFile *f,
  *          sent
  * @last_stage: if we are at the completion stage
  * @bytes_transferred: increase it with the number of transferred bytes
- * @dirty_ram_abs: Address of the start of the dirty page in ram_addr_t space
  */
 static int ram_save_host_page(MigrationState *ms, QEMUFile *f,
                               PageSearchStatus *pss,
                               bool last_stage,
-                              uint64_t *bytes_transferred,
-                              ram_addr_t dirty_ram_abs)
+                              uint64_t *bytes_transferred)
 {
     int tmppages, pages = 0;
     do {
         tmppages = ram_save_target_page(ms, f, pss, last_stage,
-                                        bytes_transferred, dirty_ram_abs);
+                                        bytes_transferred);
         if (tmppages < 0) {
             return tmppages;
         }
 
         pages += tmppages;
         pss->offset += TARGET_PAGE_SIZE;
-        dirty_ram_abs += TARGET_PAGE_SIZE;
     } while (pss->offset & (qemu_host_page_size - 1));
 
     /* The offset we leave with is the last one we looked at */
@@ -1335,8 +2510,6 @@ static int ram_find_and_save_block(QEMUFile *f, bool last_stage,
     MigrationState *ms = migrate_get_current();
     int pages = 0;
     bool again, found;
-    ram_addr_t dirty_ram_abs; /* Address of the start of the dirty page in
-                                 ram_addr_t space */
 
     pss.block = last_seen_block;
     pss.offset = last_offset;
@@ -1348,17 +2521,16 @@ static int ram_find_and_save_block(QEMUFile *f, bool last_stage,
 
     do {
         again = true;
-        found = get_queued_page(ms, &pss, &dirty_ram_abs);
+        found = get_queued_page(ms, &pss);
 
         if (!found) {
             /* priority queue empty, so just search for something dirty */
-            found = find_dirty_block(f, &pss, &again, &dirty_ram_abs);
+            found = find_dirty_block(f, &pss, &again);
         }
 
         if (found) {
             pages = ram_save_host_page(ms, f, &pss,
-                                       last_stage, bytes_transferred,
-                                       dirty_ram_abs);
+                                       last_stage, bytes_transferred);
         }
     } while (!pages && again);
 
@@ -1413,27 +2585,33 @@ void free_xbzrle_decoded_buf(void)
     xbzrle_decoded_buf = NULL;
 }
 
-static void migration_bitmap_free(struct BitmapRcu *bmap)
-{
-    g_free(bmap->bmap);
-    g_free(bmap->unsentmap);
-    g_free(bmap);
-}
-
 static void ram_migration_cleanup(void *opaque)
 {
+    RAMBlock *block;
+
     /* caller have hold iothread lock or is in a bh, so there is
-     * no writing race against this migration_bitmap
+     * no writing race against the migration bitmaps
      */
-    struct BitmapRcu *bitmap = migration_bitmap_rcu;
-    atomic_rcu_set(&migration_bitmap_rcu, NULL);
-    if (bitmap) {
+    if (migration_bitmap_active) {
         memory_global_dirty_log_stop();
-        call_rcu(bitmap, migration_bitmap_free, rcu);
+        rcu_read_lock();
+        QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+            g_free(block->bmap);
+            block->bmap = NULL;
+            g_free(block->unsentmap);
+            block->unsentmap = NULL;
+        }
+        rcu_read_unlock();
+        migration_bitmap_active = false;
     }
+    migration_bitmap_sync_cleanup();
+    g_free(sync_work.ranges);
+    sync_work.ranges = NULL;
+    sync_work.size = 0;
 
     XBZRLE_cache_lock();
     if (XBZRLE.cache) {
+        xbzrle_enc_cleanup();
         cache_fini(XBZRLE.cache);
         g_free(XBZRLE.encoded_buf);
         g_free(XBZRLE.current_buf);
@@ -1442,6 +2620,9 @@ static void ram_migration_cleanup(void *opaque)
         XBZRLE.current_buf = NULL;
     }
     XBZRLE_cache_unlock();
+
+    multifd_save_cleanup();
+    zero_scan_cleanup();
 }
 
 static void reset_ram_globals(void)
@@ -1455,55 +2636,45 @@ static void reset_ram_globals(void)
 
 #define MAX_WAIT 50 /* ms, half buffered_file limit */
 
-void migration_bitmap_extend(ram_addr_t old, ram_addr_t new)
+/*
+ * Called from ram_block_add() in the main thread, before @rb is visible
+ * in the RAMBlock list.  A block added while migrating starts out all
+ * dirty.
+ */
+void migration_bitmap_add_block(RAMBlock *rb)
 {
-    /* called in qemu main thread, so there is
-     * no writing race against this migration_bitmap
-     */
-    if (migration_bitmap_rcu) {
-        struct BitmapRcu *old_bitmap = migration_bitmap_rcu, *bitmap;
-        bitmap = g_new(struct BitmapRcu, 1);
-        bitmap->bmap = bitmap_new(new);
-
-        /* prevent migration_bitmap content from being set bit
-         * by migration_bitmap_sync_range() at the same time.
-         * it is safe to migration if migration_bitmap is cleared bit
-         * at the same time.
-         */
-        qemu_mutex_lock(&migration_bitmap_mutex);
-        bitmap_copy(bitmap->bmap, old_bitmap->bmap, old);
-        bitmap_set(bitmap->bmap, old, new - old);
-
-        /* We don't have a way to safely extend the sentmap
-         * with RCU; so mark it as missing, entry to postcopy
-         * will fail.
-         */
-        bitmap->unsentmap = NULL;
+    unsigned long pages = rb->used_length >> TARGET_PAGE_BITS;
 
-        atomic_rcu_set(&migration_bitmap_rcu, bitmap);
-        qemu_mutex_unlock(&migration_bitmap_mutex);
-        migration_dirty_pages += new - old;
-        call_rcu(old_bitmap, migration_bitmap_free, rcu);
+    if (!migration_bitmap_active) {
+        return;
     }
+
+    rb->bmap = bitmap_new(rb->max_length >> TARGET_PAGE_BITS);
+    bitmap_set(rb->bmap, 0, pages);
+
+    qemu_mutex_lock(&migration_bitmap_mutex);
+    migration_dirty_pages += pages;
+    /* We don't have the unsent pages of this block; entry to postcopy
+     * will fail.
+     */
+    migration_bitmap_resized = true;
+    qemu_mutex_unlock(&migration_bitmap_mutex);
 }
 
 /*
  * 'expected' is the value you expect the bitmap mostly to be full
  * of; it won't bother printing lines that are all this value.
- * If 'todump' is null the migration bitmap is dumped.
+ * 'pages' is the number of bits in 'todump'.
  */
-void ram_debug_dump_bitmap(unsigned long *todump, bool expected)
+void ram_debug_dump_bitmap(unsigned long *todump, bool expected,
+                           unsigned long pages)
 {
-    int64_t ram_pages = last_ram_offset() >> TARGET_PAGE_BITS;
+    int64_t ram_pages = pages;
 
     int64_t cur;
     int64_t linelen = 128;
     char linebuf[129];
 
-    if (!todump) {
-        todump = atomic_rcu_read(&migration_bitmap_rcu)->bmap;
-    }
-
     for (cur = 0; cur < ram_pages; cur += linelen) {
         int64_t curb;
         bool found = false;
@@ -1532,20 +2703,16 @@ void ram_debug_dump_bitmap(unsigned long *todump, bool expected)
  * Callback from postcopy_each_ram_send_discard for each RAMBlock
  * Note: At this point the 'unsentmap' is the processed bitmap combined
  *       with the dirtymap; so a '1' means it's either dirty or unsent.
- * start,length: Indexes into the bitmap for the first bit
- *            representing the named block and length in target-pages
  */
 static int postcopy_send_discard_bm_ram(MigrationState *ms,
                                         PostcopyDiscardState *pds,
-                                        unsigned long start,
-                                        unsigned long length)
+                                        RAMBlock *block)
 {
-    unsigned long end = start + length; /* one after the end */
+    unsigned long end = block->used_length >> TARGET_PAGE_BITS;
     unsigned long current;
-    unsigned long *unsentmap;
+    unsigned long *unsentmap = block->unsentmap;
 
-    unsentmap = atomic_rcu_read(&migration_bitmap_rcu)->unsentmap;
-    for (current = start; current < end; ) {
+    for (current = 0; current < end; ) {
         unsigned long one = find_next_bit(unsentmap, end, current);
 
         if (one <= end) {
@@ -1581,9 +2748,7 @@ static int postcopy_each_ram_send_discard(MigrationState *ms)
     int ret;
 
     QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
-        unsigned long first = block->offset >> TARGET_PAGE_BITS;
-        PostcopyDiscardState *pds = postcopy_discard_send_init(ms,
-                                                               first,
+        PostcopyDiscardState *pds = postcopy_discard_send_init(ms, 0,
                                                                block->idstr);
 
         /*
@@ -1591,8 +2756,7 @@ static int postcopy_each_ram_send_discard(MigrationState *ms)
          * just needs indexes at this point, avoids it having
          * target page specific code.
          */
-        ret = postcopy_send_discard_bm_ram(ms, pds, first,
-                                    block->used_length >> TARGET_PAGE_BITS);
+        ret = postcopy_send_discard_bm_ram(ms, pds, block);
         postcopy_discard_send_finish(ms, pds);
         if (ret) {
             return ret;
@@ -1618,23 +2782,19 @@ static void postcopy_chunk_hostpages_pass(MigrationState *ms, bool unsent_pass,
                                           RAMBlock *block,
                                           PostcopyDiscardState *pds)
 {
-    unsigned long *bitmap;
-    unsigned long *unsentmap;
+    unsigned long *bitmap = block->bmap;
+    unsigned long *unsentmap = block->unsentmap;
     unsigned int host_ratio = qemu_host_page_size / TARGET_PAGE_SIZE;
-    unsigned long first = block->offset >> TARGET_PAGE_BITS;
     unsigned long len = block->used_length >> TARGET_PAGE_BITS;
-    unsigned long last = first + (len - 1);
+    unsigned long last = len - 1;
     unsigned long run_start;
 
-    bitmap = atomic_rcu_read(&migration_bitmap_rcu)->bmap;
-    unsentmap = atomic_rcu_read(&migration_bitmap_rcu)->unsentmap;
-
     if (unsent_pass) {
         /* Find a sent page */
-        run_start = find_next_zero_bit(unsentmap, last + 1, first);
+        run_start = find_next_zero_bit(unsentmap, last + 1, 0);
     } else {
         /* Find a dirty page */
-        run_start = find_next_bit(bitmap, last + 1, first);
+        run_start = find_next_bit(bitmap, last + 1, 0);
     }
 
     while (run_start <= last) {
@@ -1748,10 +2908,8 @@ static int postcopy_chunk_hostpages(MigrationState *ms)
     last_offset     = 0;
 
     QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
-        unsigned long first = block->offset >> TARGET_PAGE_BITS;
-
         PostcopyDiscardState *pds =
-                         postcopy_discard_send_init(ms, first, block->idstr);
+                         postcopy_discard_send_init(ms, 0, block->idstr);
 
         /* First pass: Discard all partially sent host pages */
         postcopy_chunk_hostpages_pass(ms, true, block, pds);
@@ -1779,19 +2937,15 @@ static int postcopy_chunk_hostpages(MigrationState *ms)
 int ram_postcopy_send_discard_bitmap(MigrationState *ms)
 {
     int ret;
-    unsigned long *bitmap, *unsentmap;
+    RAMBlock *block;
 
     rcu_read_lock();
 
     /* This should be our last sync, the src is now paused */
     migration_bitmap_sync();
 
-    unsentmap = atomic_rcu_read(&migration_bitmap_rcu)->unsentmap;
-    if (!unsentmap) {
-        /* We don't have a safe way to resize the sentmap, so
-         * if the bitmap was resized it will be NULL at this
-         * point.
-         */
+    if (migration_bitmap_resized) {
+        /* Blocks added during precopy have no unsentmap */
         error_report("migration ram resized during precopy phase");
         rcu_read_unlock();
         return -EINVAL;
@@ -1807,15 +2961,16 @@ int ram_postcopy_send_discard_bitmap(MigrationState *ms)
     /*
      * Update the unsentmap to be unsentmap = unsentmap | dirty
      */
-    bitmap = atomic_rcu_read(&migration_bitmap_rcu)->bmap;
-    bitmap_or(unsentmap, unsentmap, bitmap,
-               last_ram_offset() >> TARGET_PAGE_BITS);
-
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        unsigned long pages = block->used_length >> TARGET_PAGE_BITS;
 
-    trace_ram_postcopy_send_discard_bitmap();
+        bitmap_or(block->unsentmap, block->unsentmap, block->bmap, pages);
 #ifdef DEBUG_POSTCOPY
-    ram_debug_dump_bitmap(unsentmap, true);
+        ram_debug_dump_bitmap(block->unsentmap, true, pages);
 #endif
+    }
+
+    trace_ram_postcopy_send_discard_bitmap();
 
     ret = postcopy_each_ram_send_discard(ms);
     rcu_read_unlock();
@@ -1874,6 +3029,22 @@ err:
     return ret;
 }
 
+/*
+ * Make sure every page queued on the multifd channels is loaded on the
+ * destination before anything that follows on the main stream.
+ */
+static void ram_multifd_sync(QEMUFile *f)
+{
+    int ret = multifd_send_sync_main();
+
+    if (ret < 0) {
+        qemu_file_set_error(f, -EIO);
+    } else if (ret > 0) {
+        qemu_put_be64(f, RAM_SAVE_FLAG_MULTIFD_SYNC);
+        bytes_transferred += 8;
+    }
+}
+
 
 /* Each of ram_save_setup, ram_save_iterate and ram_save_complete has
  * long-running RCU critical section.  When rcu-reclaims in the code
@@ -1884,13 +3055,21 @@ err:
 static int ram_save_setup(QEMUFile *f, void *opaque)
 {
     RAMBlock *block;
-    int64_t ram_bitmap_pages; /* Size of bitmap in pages, including gaps */
 
     dirty_rate_high_cnt = 0;
     bitmap_sync_count = 0;
     migration_bitmap_sync_init();
     qemu_mutex_init(&migration_bitmap_mutex);
 
+    if (migrate_use_multifd()) {
+        Error *local_err = NULL;
+
+        if (multifd_save_setup(&local_err) < 0) {
+            error_report_err(local_err);
+            return -1;
+        }
+    }
+
     if (migrate_use_xbzrle()) {
         XBZRLE_cache_lock();
         XBZRLE.cache = cache_init(migrate_xbzrle_cache_size() /
@@ -1918,26 +3097,44 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
             return -1;
         }
 
+        XBZRLE_cache_lock();
+        xbzrle_enc_setup();
+        XBZRLE_cache_unlock();
+
         acct_clear();
     }
+    acct_info.zero_scan_time = 0;
+    acct_info.send_time = 0;
+    zero_scan_setup();
+    if (migrate_use_zero_copy() && qemu_file_enable_zerocopy(f) < 0) {
+        error_report("Zero-copy is not supported by the migration channel, "
+                     "RAM pages will be copied");
+    }
+    migration_codec_stats_reset();
 
     /* For memory_global_dirty_log_start below.  */
     qemu_mutex_lock_iothread();
+    dirty_rate_setup();
 
     qemu_mutex_lock_ramlist();
     rcu_read_lock();
     bytes_transferred = 0;
     reset_ram_globals();
 
-    ram_bitmap_pages = last_ram_offset() >> TARGET_PAGE_BITS;
-    migration_bitmap_rcu = g_new0(struct BitmapRcu, 1);
-    migration_bitmap_rcu->bmap = bitmap_new(ram_bitmap_pages);
-    bitmap_set(migration_bitmap_rcu->bmap, 0, ram_bitmap_pages);
-
-    if (migrate_postcopy_ram()) {
-        migration_bitmap_rcu->unsentmap = bitmap_new(ram_bitmap_pages);
-        bitmap_set(migration_bitmap_rcu->unsentmap, 0, ram_bitmap_pages);
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        /* Sized for the whole block so that resizing needs no care */
+        unsigned long pages = block->max_length >> TARGET_PAGE_BITS;
+
+        block->bmap = bitmap_new(pages);
+        bitmap_set(block->bmap, 0, block->used_length >> TARGET_PAGE_BITS);
+        if (migrate_postcopy_ram()) {
+            block->unsentmap = bitmap_new(pages);
+            bitmap_set(block->unsentmap, 0, pages);
+        }
     }
+    migration_bitmap_active = true;
+    migration_bitmap_resized = false;
+    migration_bitmap_sync_setup();
 
     /*
      * Count the total number of pages used by ram blocks not including any
@@ -1974,6 +3171,7 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
     int i;
     int64_t t0;
     int pages_sent = 0;
+    RAMSendTimer timer;
 
     rcu_read_lock();
     if (ram_list.version != last_version) {
@@ -1986,6 +3184,7 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
     ram_control_before_iterate(f, RAM_CONTROL_ROUND);
 
     t0 = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    ram_send_timer_start(&timer);
     i = 0;
     while ((ret = qemu_file_rate_limit(f)) == 0) {
         int pages;
@@ -2013,7 +3212,11 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
         }
         i++;
     }
+    ram_send_timer_stop(&timer);
+    zero_scan_flush();
     flush_compressed_data(f);
+    flush_xbzrle_data(f);
+    ram_multifd_sync(f);
     rcu_read_unlock();
 
     /*
@@ -2036,6 +3239,8 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
 /* Called with iothread lock */
 static int ram_save_complete(QEMUFile *f, void *opaque)
 {
+    RAMSendTimer timer;
+
     rcu_read_lock();
 
     if (!migration_in_postcopy(migrate_get_current())) {
@@ -2047,6 +3252,7 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
     /* try transferring iterative blocks of memory */
 
     /* flush all remaining blocks regardless of rate limiting */
+    ram_send_timer_start(&timer);
     while (true) {
         int pages;
 
@@ -2056,8 +3262,12 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
             break;
         }
     }
+    ram_send_timer_stop(&timer);
+    zero_scan_flush();
 
     flush_compressed_data(f);
+    flush_xbzrle_data(f);
+    ram_multifd_sync(f);
     ram_control_after_iterate(f, RAM_CONTROL_FINISH);
 
     rcu_read_unlock();
@@ -2077,6 +3287,9 @@ static void ram_save_pending(QEMUFile *f, void *opaque, uint64_t max_size,
 
     if (!migration_in_postcopy(migrate_get_current()) &&
         remaining_size < max_size) {
+        /* Let the pages sent in this round leave before the next one, and
+         * don't wait for them with the iothread lock held */
+        qemu_file_flush_zerocopy(f);
         qemu_mutex_lock_iothread();
         rcu_read_lock();
         migration_bitmap_sync();
@@ -2195,15 +3408,19 @@ static void *do_data_decompress(void *opaque)
             qemu_cond_wait(&param->cond, &param->mutex);
             pagesize = TARGET_PAGE_SIZE;
             if (!quit_decomp_thread) {
-                /* uncompress() will return failed in some case, especially
-                 * when the page is dirted when doing the compression, it's
-                 * not a problem because the dirty page will be retransferred
-                 * and uncompress() won't break the data in other pages.
+                /* Decompression will fail in some case, especially when the
+                 * page is dirtied when doing the compression, it's not a
+                 * problem because the dirty page will be retransferred and
+                 * the codecs won't break the data in other pages.
                  */
-                uncompress((Bytef *)param->des, &pagesize,
-                           (const Bytef *)param->compbuf, param->len);
+                migration_codec_decompress(param->codec_state, param->codec,
+                                           param->des, pagesize,
+                                           param->compbuf, param->len);
             }
+            qemu_mutex_lock(&decomp_done_lock);
             param->start = false;
+            qemu_cond_signal(&decomp_done_cond);
+            qemu_mutex_unlock(&decomp_done_lock);
         }
         qemu_mutex_unlock(&param->mutex);
     }
@@ -2219,10 +3436,14 @@ void migrate_decompress_threads_create(void)
     decompress_threads = g_new0(QemuThread, thread_count);
     decomp_param = g_new0(DecompressParam, thread_count);
     quit_decomp_thread = false;
+    qemu_mutex_init(&decomp_done_lock);
+    qemu_cond_init(&decomp_done_cond);
     for (i = 0; i < thread_count; i++) {
         qemu_mutex_init(&decomp_param[i].mutex);
         qemu_cond_init(&decomp_param[i].cond);
-        decomp_param[i].compbuf = g_malloc0(compressBound(TARGET_PAGE_SIZE));
+        decomp_param[i].compbuf =
+            g_malloc0(migration_codec_bound(TARGET_PAGE_SIZE));
+        decomp_param[i].codec_state = migration_codec_state_new();
         qemu_thread_create(decompress_threads + i, "decompress",
                            do_data_decompress, decomp_param + i,
                            QEMU_THREAD_JOINABLE);
@@ -2245,15 +3466,19 @@ void migrate_decompress_threads_join(void)
         qemu_mutex_destroy(&decomp_param[i].mutex);
         qemu_cond_destroy(&decomp_param[i].cond);
         g_free(decomp_param[i].compbuf);
+        migration_codec_state_free(decomp_param[i].codec_state);
     }
     g_free(decompress_threads);
     g_free(decomp_param);
     decompress_threads = NULL;
     decomp_param = NULL;
+    qemu_mutex_destroy(&decomp_done_lock);
+    qemu_cond_destroy(&decomp_done_cond);
 }
 
 static void decompress_data_with_multi_threads(QEMUFile *f,
-                                               void *host, int len)
+                                               void *host, int len,
+                                               MigrationCodec codec)
 {
     int idx, thread_count;
 
@@ -2264,6 +3489,7 @@ static void decompress_data_with_multi_threads(QEMUFile *f,
                 qemu_get_buffer(f, decomp_param[idx].compbuf, len);
                 decomp_param[idx].des = host;
                 decomp_param[idx].len = len;
+                decomp_param[idx].codec = codec;
                 start_decompression(&decomp_param[idx]);
                 break;
             }
@@ -2274,6 +3500,31 @@ static void decompress_data_with_multi_threads(QEMUFile *f,
     }
 }
 
+/*
+ * Waits until the decompression threads have written all the pages they
+ * were given.  A page can only be sent again after the end of the section
+ * that carried it, so doing this at the end of each section keeps a page
+ * that is still being decompressed from overwriting a newer version, or
+ * from changing under the XBZRLE page that follows it in the adaptive mode.
+ */
+static void wait_for_decompress_done(void)
+{
+    int idx, thread_count;
+
+    if (!decomp_param) {
+        return;
+    }
+
+    thread_count = migrate_decompress_threads();
+    qemu_mutex_lock(&decomp_done_lock);
+    for (idx = 0; idx < thread_count; idx++) {
+        while (decomp_param[idx].start) {
+            qemu_cond_wait(&decomp_done_cond, &decomp_done_lock);
+        }
+    }
+    qemu_mutex_unlock(&decomp_done_lock);
+}
+
 /*
  * Allocate data structures etc needed by incoming migration with postcopy-ram
  * postcopy-ram's similarly names postcopy_ram_incoming_init does the work
@@ -2413,6 +3664,7 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
     int flags = 0, ret = 0;
     static uint64_t seq_iter;
     int len = 0;
+    unsigned int codec;
     /*
      * If system is running in postcopy mode, page inserts to host memory must
      * be atomic
@@ -2505,12 +3757,20 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
 
         case RAM_SAVE_FLAG_COMPRESS_PAGE:
             len = qemu_get_be32(f);
-            if (len < 0 || len > compressBound(TARGET_PAGE_SIZE)) {
+            codec = (uint32_t)len >> MIGRATION_CODEC_SHIFT;
+            len &= MIGRATION_CODEC_LEN_MASK;
+            if (codec >= MIGRATION_CODEC__MAX ||
+                !migration_codec_available(codec)) {
+                error_report("Unsupported compression codec: %u", codec);
+                ret = -EINVAL;
+                break;
+            }
+            if (len > migration_codec_bound(TARGET_PAGE_SIZE)) {
                 error_report("Invalid compressed data length: %d", len);
                 ret = -EINVAL;
                 break;
             }
-            decompress_data_with_multi_threads(f, host, len);
+            decompress_data_with_multi_threads(f, host, len, codec);
             break;
 
         case RAM_SAVE_FLAG_XBZRLE:
@@ -2521,8 +3781,14 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                 break;
             }
             break;
+        case RAM_SAVE_FLAG_MULTIFD_SYNC:
+            if (multifd_recv_sync_main() < 0) {
+                ret = -EINVAL;
+            }
+            break;
         case RAM_SAVE_FLAG_EOS:
             /* normal exit */
+            wait_for_decompress_done();
             break;
         default:
             if (flags & RAM_SAVE_FLAG_HOOK) {
@@ -20,6 +20,7 @@
 #include "qemu/sockets.h"
 #include "migration/migration.h"
 #include "migration/qemu-file.h"
+#include "migration/multifd.h"
 #include "block/block.h"
 #include "qemu/main-loop.h"
 
@@ -65,7 +66,9 @@ static void tcp_accept_incoming_migration(void *opaque)
         c = qemu_accept(s, (struct sockaddr *)&addr, &addrlen);
     } while (c < 0 && errno == EINTR);
     qemu_set_fd_handler(s, NULL, NULL, NULL);
-    closesocket(s);
+    if (c < 0 || !migrate_use_multifd()) {
+        closesocket(s);
+    }
 
     DPRINTF("accepted migration\n");
 
@@ -78,9 +81,16 @@ static void tcp_accept_incoming_migration(void *opaque)
     f = qemu_fopen_socket(c, "rb");
     if (f == NULL) {
         error_report("could not qemu_fopen socket");
+        if (migrate_use_multifd()) {
+            closesocket(s);
+        }
         goto out;
     }
 
+    if (migrate_use_multifd()) {
+        /* The multifd channels connect to the same socket */
+        multifd_load_start(s);
+    }
     process_incoming_migration(f);
     return;
 
@@ -21,6 +21,7 @@
 #include "qemu/main-loop.h"
 #include "migration/migration.h"
 #include "migration/qemu-file.h"
+#include "migration/multifd.h"
 #include "block/block.h"
 
 //#define DEBUG_MIGRATION_UNIX
@@ -66,7 +67,9 @@ static void unix_accept_incoming_migration(void *opaque)
         err = errno;
     } while (c < 0 && err == EINTR);
     qemu_set_fd_handler(s, NULL, NULL, NULL);
-    close(s);
+    if (c < 0 || !migrate_use_multifd()) {
+        close(s);
+    }
 
     DPRINTF("accepted migration\n");
 
@@ -79,9 +82,16 @@ static void unix_accept_incoming_migration(void *opaque)
     f = qemu_fopen_socket(c, "rb");
     if (f == NULL) {
         error_report("could not qemu_fopen socket");
+        if (migrate_use_multifd()) {
+            close(s);
+        }
         goto out;
     }
 
+    if (migrate_use_multifd()) {
+        /* The multifd channels connect to the same socket */
+        multifd_load_start(s);
+    }
     process_incoming_migration(f);
     return;
 
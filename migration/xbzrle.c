@@ -12,8 +12,121 @@
  */
 #include "qemu/osdep.h"
 #include "qemu/cutils.h"
+#include "qemu/host-utils.h"
 #include "include/migration/migration.h"
 
+/*
+ * Returns the length of the run of bytes at the start of @old and @new that
+ * are equal (@equal) resp. that differ (!@equal), at most @len.  @old and @new
+ * must have the same alignment.
+ */
+#ifdef __SSE2__
+#include <emmintrin.h>
+
+static size_t xbzrle_run_len_inner(const uint8_t *old, const uint8_t *new,
+                                   size_t len, bool equal)
+{
+    unsigned int flip = equal ? 0xffff : 0;
+    size_t i;
+
+    for (i = 0; i + sizeof(__m128i) <= len; i += sizeof(__m128i)) {
+        __m128i o = _mm_loadu_si128((const __m128i *)(old + i));
+        __m128i n = _mm_loadu_si128((const __m128i *)(new + i));
+        /* one bit per byte that doesn't belong to the run */
+        unsigned int end = _mm_movemask_epi8(_mm_cmpeq_epi8(o, n)) ^ flip;
+
+        if (end) {
+            return i + ctz32(end);
+        }
+    }
+
+    while (i < len && (old[i] == new[i]) == equal) {
+        i++;
+    }
+    return i;
+}
+#else
+static size_t xbzrle_run_len_inner(const uint8_t *old, const uint8_t *new,
+                                   size_t len, bool equal)
+{
+    /* truncation to 32-bit long okay */
+    unsigned long mask = (unsigned long)0x0101010101010101ULL;
+    size_t i = 0;
+
+    /* not aligned to sizeof(long) */
+    while (i < len && ((uintptr_t)(old + i) % sizeof(long))) {
+        if ((old[i] == new[i]) != equal) {
+            return i;
+        }
+        i++;
+    }
+
+    /* word at a time for speed */
+    while (i + sizeof(long) <= len) {
+        unsigned long xor = *(unsigned long *)(old + i)
+                          ^ *(unsigned long *)(new + i);
+        if (equal ? xor != 0 : ((xor - mask) & ~xor & (mask << 7)) != 0) {
+            /* the run ends within the current long */
+            break;
+        }
+        i += sizeof(long);
+    }
+
+    /* go over the rest */
+    while (i < len && (old[i] == new[i]) == equal) {
+        i++;
+    }
+    return i;
+}
+#endif
+
+/*
+ * GCC before version 4.9 has a bug which will cause the target
+ * attribute work incorrectly and failed to compile in some case,
+ * restrict the gcc version to 4.9+ to prevent the failure.
+ */
+#if defined CONFIG_AVX2_OPT && QEMU_GNUC_PREREQ(4, 9)
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+static size_t xbzrle_run_len_avx2(const uint8_t *old, const uint8_t *new,
+                                  size_t len, bool equal)
+{
+    uint32_t flip = equal ? 0xffffffff : 0;
+    size_t i;
+
+    for (i = 0; i + sizeof(__m256i) <= len; i += sizeof(__m256i)) {
+        __m256i o = _mm256_loadu_si256((const __m256i *)(old + i));
+        __m256i n = _mm256_loadu_si256((const __m256i *)(new + i));
+        uint32_t end = _mm256_movemask_epi8(_mm256_cmpeq_epi8(o, n)) ^ flip;
+
+        if (end) {
+            return i + ctz32(end);
+        }
+    }
+
+    while (i < len && (old[i] == new[i]) == equal) {
+        i++;
+    }
+    return i;
+}
+#pragma GCC pop_options
+#endif
+
+static size_t (*xbzrle_run_len)(const uint8_t *old, const uint8_t *new,
+                                size_t len, bool equal) = xbzrle_run_len_inner;
+
+#if defined CONFIG_AVX2_OPT && QEMU_GNUC_PREREQ(4, 9)
+static void __attribute__((constructor)) xbzrle_init(void)
+{
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        xbzrle_run_len = xbzrle_run_len_avx2;
+    }
+}
+#endif
+
 /*
   page = zrun nzrun
        | zrun nzrun page
@@ -29,8 +142,6 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
 {
     uint32_t zrun_len = 0, nzrun_len = 0;
     int d = 0, i = 0;
-    long res;
-    uint8_t *nzrun_start = NULL;
 
     g_assert(!(((uintptr_t)old_buf | (uintptr_t)new_buf | slen) %
                sizeof(long)));
@@ -41,28 +152,8 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
             return -1;
         }
 
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] == new_buf[i]) {
-            zrun_len++;
-            i++;
-            res--;
-        }
-
-        /* word at a time for speed */
-        if (!res) {
-            while (i < slen &&
-                   (*(long *)(old_buf + i)) == (*(long *)(new_buf + i))) {
-                i += sizeof(long);
-                zrun_len += sizeof(long);
-            }
-
-            /* go over the rest */
-            while (i < slen && old_buf[i] == new_buf[i]) {
-                zrun_len++;
-                i++;
-            }
-        }
+        zrun_len = xbzrle_run_len(old_buf + i, new_buf + i, slen - i, true);
+        i += zrun_len;
 
         /* buffer unchanged */
         if (zrun_len == slen) {
@@ -76,51 +167,23 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
 
         d += uleb128_encode_small(dst + d, zrun_len);
 
-        zrun_len = 0;
-        nzrun_start = new_buf + i;
-
         /* overflow */
         if (d + 2 > dlen) {
             return -1;
         }
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] != new_buf[i]) {
-            i++;
-            nzrun_len++;
-            res--;
-        }
 
-        /* word at a time for speed, use of 32-bit long okay */
-        if (!res) {
-            /* truncation to 32-bit long okay */
-            unsigned long mask = (unsigned long)0x0101010101010101ULL;
-            while (i < slen) {
-                unsigned long xor;
-                xor = *(unsigned long *)(old_buf + i)
-                    ^ *(unsigned long *)(new_buf + i);
-                if ((xor - mask) & ~xor & (mask << 7)) {
-                    /* found the end of an nzrun within the current long */
-                    while (old_buf[i] != new_buf[i]) {
-                        nzrun_len++;
-                        i++;
-                    }
-                    break;
-                } else {
-                    i += sizeof(long);
-                    nzrun_len += sizeof(long);
-                }
-            }
-        }
+        /* a run longer than the space that is left overflows anyway */
+        nzrun_len = xbzrle_run_len(old_buf + i, new_buf + i,
+                                   MIN(slen - i, dlen - d), false);
 
         d += uleb128_encode_small(dst + d, nzrun_len);
         /* overflow */
         if (d + nzrun_len > dlen) {
             return -1;
         }
-        memcpy(dst + d, nzrun_start, nzrun_len);
+        memcpy(dst + d, new_buf + i, nzrun_len);
         d += nzrun_len;
-        nzrun_len = 0;
+        i += nzrun_len;
     }
 
     return d;
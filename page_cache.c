@@ -16,6 +16,7 @@
 #include <glib.h>
 
 #include "qemu-common.h"
+#include "qemu/atomic.h"
 #include "migration/page_cache.h"
 
 #ifdef DEBUG_CACHE
@@ -29,20 +30,36 @@
 /* the page in cache will not be replaced in two cycles */
 #define CACHED_PAGE_LIFETIME 2
 
+/* Number of pages that an address can be cached in */
+#define CACHE_WAYS 8
+
 typedef struct CacheItem CacheItem;
 
 struct CacheItem {
     uint64_t it_addr;
     uint64_t it_age;
     uint8_t *it_data;
+    /* Set while another thread uses it_data, see cache_pin() */
+    int it_pinned;
 };
 
+/*
+ * The cache is set associative: an address maps to a set of CACHE_WAYS
+ * items, and is cached in any of them.  Unlike a direct mapped cache, two
+ * hot pages that map to the same set don't keep evicting each other.
+ *
+ * The cache isn't locked.  Its items are only looked up and changed by one
+ * thread, the one that inserts pages; other threads only get to use the
+ * data of pinned items, which cache_insert() leaves alone.
+ */
 struct PageCache {
     CacheItem *page_cache;
     unsigned int page_size;
     int64_t max_num_items;
     uint64_t max_item_age;
     int64_t num_items;
+    unsigned int ways;
+    int64_t num_sets;
 };
 
 PageCache *cache_init(int64_t num_pages, unsigned int page_size)
@@ -71,6 +88,8 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
     cache->num_items = 0;
     cache->max_item_age = 0;
     cache->max_num_items = num_pages;
+    cache->ways = MIN(num_pages, CACHE_WAYS);
+    cache->num_sets = num_pages / cache->ways;
 
     DPRINTF("Setting cache buckets to %" PRId64 "\n", cache->max_num_items);
 
@@ -87,6 +106,7 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
         cache->page_cache[i].it_data = NULL;
         cache->page_cache[i].it_age = 0;
         cache->page_cache[i].it_addr = -1;
+        cache->page_cache[i].it_pinned = 0;
     }
 
     return cache;
@@ -100,6 +120,7 @@ void cache_fini(PageCache *cache)
     g_assert(cache->page_cache);
 
     for (i = 0; i < cache->max_num_items; i++) {
+        g_assert(!cache->page_cache[i].it_pinned);
         g_free(cache->page_cache[i].it_data);
     }
 
@@ -108,31 +129,39 @@ void cache_fini(PageCache *cache)
     g_free(cache);
 }
 
-static size_t cache_get_cache_pos(const PageCache *cache,
-                                  uint64_t address)
+/* Returns the first item of the set that @address maps to */
+static CacheItem *cache_get_set(const PageCache *cache, uint64_t address)
 {
     size_t pos;
 
-    g_assert(cache->max_num_items);
-    pos = (address / cache->page_size) & (cache->max_num_items - 1);
-    return pos;
+    g_assert(cache->num_sets);
+    pos = (address / cache->page_size) & (cache->num_sets - 1);
+    return &cache->page_cache[pos * cache->ways];
 }
 
 static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
 {
-    size_t pos;
+    CacheItem *set;
+    unsigned int i;
 
     g_assert(cache);
     g_assert(cache->page_cache);
 
-    pos = cache_get_cache_pos(cache, addr);
+    set = cache_get_set(cache, addr);
+    for (i = 0; i < cache->ways; i++) {
+        if (set[i].it_addr == addr) {
+            return &set[i];
+        }
+    }
 
-    return &cache->page_cache[pos];
+    return NULL;
 }
 
 uint8_t *get_cached_data(const PageCache *cache, uint64_t addr)
 {
-    return cache_get_by_addr(cache, addr)->it_data;
+    CacheItem *it = cache_get_by_addr(cache, addr);
+
+    return it ? it->it_data : NULL;
 }
 
 bool cache_is_cached(const PageCache *cache, uint64_t addr,
@@ -142,7 +171,7 @@ bool cache_is_cached(const PageCache *cache, uint64_t addr,
 
     it = cache_get_by_addr(cache, addr);
 
-    if (it->it_addr == addr) {
+    if (it) {
         /* update the it_age when the cache hit */
         it->it_age = current_age;
         return true;
@@ -150,6 +179,34 @@ bool cache_is_cached(const PageCache *cache, uint64_t addr,
     return false;
 }
 
+/*
+ * Returns the item to store @addr in: the one that caches it already, or
+ * else an empty one, or else the least recently used one that isn't pinned.
+ */
+static CacheItem *cache_get_lru(const PageCache *cache, uint64_t addr)
+{
+    CacheItem *set = cache_get_set(cache, addr);
+    CacheItem *lru = NULL;
+    unsigned int i;
+
+    for (i = 0; i < cache->ways; i++) {
+        CacheItem *it = &set[i];
+
+        if (it->it_addr == addr) {
+            return it;
+        }
+        if (atomic_read(&it->it_pinned)) {
+            continue;
+        }
+        if (!lru || (lru->it_data &&
+                     (!it->it_data || it->it_age < lru->it_age))) {
+            lru = it;
+        }
+    }
+
+    return lru;
+}
+
 int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
                  uint64_t current_age)
 {
@@ -157,13 +214,16 @@ int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
     CacheItem *it;
 
     /* actual update of entry */
-    it = cache_get_by_addr(cache, addr);
-
+    it = cache_get_lru(cache, addr);
+    if (!it || atomic_read(&it->it_pinned)) {
+        return -1;
+    }
     if (it->it_data && it->it_addr != addr &&
         it->it_age + CACHED_PAGE_LIFETIME > current_age) {
         /* the cache page is fresh, don't replace it */
         return -1;
     }
+
     /* allocate page */
     if (!it->it_data) {
         it->it_data = g_try_malloc(cache->page_size);
@@ -182,6 +242,26 @@ int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
     return 0;
 }
 
+CacheItem *cache_pin(PageCache *cache, uint64_t addr)
+{
+    CacheItem *it = cache_get_by_addr(cache, addr);
+
+    if (it) {
+        atomic_inc(&it->it_pinned);
+    }
+    return it;
+}
+
+uint8_t *cache_item_data(const CacheItem *it)
+{
+    return it->it_data;
+}
+
+void cache_unpin(CacheItem *it)
+{
+    atomic_dec(&it->it_pinned);
+}
+
 int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
 {
     PageCache *new_cache;
@@ -207,12 +287,12 @@ int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
         return -1;
     }
 
-    /* move all data from old cache */
+    /* move all data from old cache, keeping the MRU pages of each set */
     for (i = 0; i < cache->max_num_items; i++) {
         old_it = &cache->page_cache[i];
+        g_assert(!old_it->it_pinned);
         if (old_it->it_addr != -1) {
-            /* check for collision, if there is, keep MRU page */
-            new_it = cache_get_by_addr(new_cache, old_it->it_addr);
+            new_it = cache_get_lru(new_cache, old_it->it_addr);
             if (new_it->it_data && new_it->it_age >= old_it->it_age) {
                 /* keep the MRU page */
                 g_free(old_it->it_data);
@@ -232,6 +312,8 @@ int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
     cache->page_cache = new_cache->page_cache;
     cache->max_num_items = new_cache->max_num_items;
     cache->num_items = new_cache->num_items;
+    cache->ways = new_cache->ways;
+    cache->num_sets = new_cache->num_sets;
 
     g_free(new_cache);
 
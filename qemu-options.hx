@@ -91,6 +91,26 @@ ETEXI
 HXCOMM Deprecated by -machine
 DEF("M", HAS_ARG, QEMU_OPTION_M, "", QEMU_ARCH_ALL)
 
+DEF("accel", HAS_ARG, QEMU_OPTION_accel,
+    "-accel [accel=]accelerator[,thread=single|multi]\n"
+    "                select accelerator ('-accel help' for list)\n"
+    "                thread=single|multi (enable multi-threaded TCG)\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -accel @var{name}[,prop=@var{value}[,...]]
+@findex -accel
+This is used to enable an accelerator. Depending on the target architecture,
+kvm, xen, or tcg can be available. By default, tcg is used.
+@table @option
+@item thread=single|multi
+Controls the number of TCG threads. When the TCG is multi-threaded there will
+be one thread per vCPU, therefore taking advantage of additional host cores.
+The default is single; multi is not compatible with -icount or record/replay,
+and is only accepted for guests that have been converted to multi-threaded TCG
+(currently x86).
+@end table
+ETEXI
+
 DEF("cpu", HAS_ARG, QEMU_OPTION_cpu,
     "-cpu cpu        select CPU ('-cpu help' for list)\n", QEMU_ARCH_ALL)
 STEXI
@@ -521,8 +541,9 @@ DEF("drive", HAS_ARG, QEMU_OPTION_drive,
     "       [,cyls=c,heads=h,secs=s[,trans=t]][,snapshot=on|off]\n"
     "       [,cache=writethrough|writeback|none|directsync|unsafe][,format=f]\n"
     "       [,serial=s][,addr=A][,rerror=ignore|stop|report]\n"
-    "       [,werror=ignore|stop|report|enospc][,id=name][,aio=threads|native]\n"
+    "       [,werror=ignore|stop|report|enospc][,id=name][,aio=threads|native|io_uring]\n"
     "       [,readonly=on|off][,copy-on-read=on|off]\n"
+    "       [,copy-on-read-prefetch=size]\n"
     "       [,discard=ignore|unmap][,detect-zeroes=on|off|unmap]\n"
     "       [[,bps=b]|[[,bps_rd=r][,bps_wr=w]]]\n"
     "       [[,iops=i]|[[,iops_rd=r][,iops_wr=w]]]\n"
@@ -564,7 +585,7 @@ These options have the same definition as they have in @option{-hdachs}.
 @item cache=@var{cache}
 @var{cache} is "none", "writeback", "unsafe", "directsync" or "writethrough" and controls how the host cache is used to access block data.
 @item aio=@var{aio}
-@var{aio} is "threads", or "native" and selects between pthread based disk I/O and native Linux AIO.
+@var{aio} is "threads", "native" or "io_uring" and selects between pthread based disk I/O, native Linux AIO and Linux io_uring.  Unlike native Linux AIO, io_uring does not require @option{cache=none}.
 @item discard=@var{discard}
 @var{discard} is one of "ignore" (or "off") or "unmap" (or "on") and controls whether @dfn{discard} (also known as @dfn{trim} or @dfn{unmap}) requests are ignored or passed to the filesystem.  Some machine types may not support discard requests.
 @item format=@var{format}
@@ -586,6 +607,10 @@ Open drive @option{file} as read-only. Guest write attempts will fail.
 @item copy-on-read=@var{copy-on-read}
 @var{copy-on-read} is "on" or "off" and enables whether to copy read backing
 file sectors into the image file.
+@item copy-on-read-prefetch=@var{size}
+With @option{copy-on-read}, copy up to @var{size} bytes ahead of sequential
+reads from the backing file into the image file in the background.  The
+default of 0 disables prefetching.
 @item detect-zeroes=@var{detect-zeroes}
 @var{detect-zeroes} is "off", "on" or "unmap" and enables the automatic
 conversion of plain zero writes by the OS to driver specific optimized
@@ -624,7 +649,9 @@ the @option{-snapshot} option, unsafe caching is always used.
 
 Copy-on-read avoids accessing the same backing file sectors repeatedly and is
 useful when the backing file is over a slow network.  By default copy-on-read
-is off.
+is off.  With @option{copy-on-read-prefetch}, sequential reads like a guest
+booting or copying files also pull in the data that follows them, so that the
+latency of the backing file is hidden from the guest.
 
 Instead of @option{-cdrom} you can use:
 @example
@@ -3769,6 +3796,10 @@ the path to either a shared memory or huge page filesystem mount.
 The @option{share} boolean option determines whether the memory
 region is marked as private to QEMU, or shared. The latter allows
 a co-operating external process to access the QEMU memory region.
+The @option{prealloc-threads} option sets how many threads fault in
+the memory region when the @option{prealloc} option is on; it defaults
+to the number of vCPUs. If @option{host-nodes} is set, the threads run
+on the CPUs of those host NUMA nodes.
 
 @item -object rng-random,id=@var{id},filename=@var{/dev/random}
 
@@ -2902,6 +2902,13 @@ Return a json-array. Each iothread is represented by a json-object, which contai
 
 - "id": name of iothread (json-str)
 - "thread-id": ID of the underlying host thread (json-int)
+- "poll-max-ns": maximum polling time in ns, 0 if disabled (json-int)
+- "poll-grow": polling time growth factor, 0 for the default of 2 (json-int)
+- "poll-shrink": polling time shrink divisor, 0 for the default of resetting
+  the polling time to 0 (json-int)
+- "poll-ns": current polling time in ns (json-int)
+- "poll-hits": number of times work was found while polling (json-int)
+- "poll-misses": number of times the thread blocked after polling (json-int)
 
 Example:
 
@@ -2910,11 +2917,23 @@ Example:
       "return":[
          {
             "id":"iothread0",
-            "thread-id":3134
+            "thread-id":3134,
+            "poll-max-ns":0,
+            "poll-grow":0,
+            "poll-shrink":0,
+            "poll-ns":0,
+            "poll-hits":0,
+            "poll-misses":0
          },
          {
             "id":"iothread1",
-            "thread-id":3135
+            "thread-id":3135,
+            "poll-max-ns":32768,
+            "poll-grow":0,
+            "poll-shrink":0,
+            "poll-ns":8000,
+            "poll-hits":10321,
+            "poll-misses":312
          }
       ]
    }
@@ -3537,6 +3556,14 @@ The main json-object contains the following:
             but this way upper levels don't need to care about page
             size (json-int)
          - "dirty-sync-count": times that dirty ram was synchronized (json-int)
+         - "dirty-sync-time-last": duration of the last dirty ram
+            synchronization in microseconds (json-int)
+         - "dirty-sync-time-total": duration of all dirty ram
+            synchronizations in microseconds (json-int)
+         - "zero-scan-time": time spent checking pages for zeroes in
+            microseconds (json-int)
+         - "send-time": time spent saving pages, without the zero checks,
+            in microseconds (json-int)
 - "disk": only present if "status" is "active" and it is a block migration,
   it is a json-object with the following disk information:
          - "transferred": amount transferred in bytes (json-int)
@@ -3553,6 +3580,17 @@ The main json-object contains the following:
            that the XBZRLE encoding was bigger than just sent the
            whole page, and then we sent the whole page instead (as as
            normal page).
+- "compression": only present if the compress capability is on.
+  It is a json-array with one json-object per codec that was used for
+  compressed pages:
+         - "codec": name of the codec, "raw" for pages that were sent
+           uncompressed (json-string)
+         - "pages": number of pages (json-int)
+         - "input-bytes": amount of bytes before compression (json-int)
+         - "output-bytes": amount of bytes after compression (json-int)
+         - "ratio": output-bytes divided by input-bytes (json-number)
+         - "throughput": compression speed of a single thread in MB/s
+           (json-number)
 
 Examples:
 
@@ -3671,6 +3709,48 @@ EQMP
         .mhandler.cmd_new = qmp_marshal_query_migrate,
     },
 
+SQMP
+query-dirty-rate
+----------------
+
+Dirty page rate of the guest and of each vcpu, as measured by the last or
+current migration.
+
+Return a json-object with the following information:
+
+- "dirty-rate": pages dirtied per second by the guest (json-int)
+- "estimated": true if the rate of each vcpu is estimated from the CPU time
+               it used, because the accelerator can't tell which vcpu dirtied
+               a page (json-bool)
+- "vcpus": a json-array of json-objects, one per vcpu:
+         - "cpu-index": index of the vcpu (json-int)
+         - "dirty-rate": pages dirtied per second by the vcpu (json-int)
+         - "throttle-percentage": auto-converge throttle percentage of the
+                                  vcpu, 0 if it isn't throttled (json-int)
+
+Arguments: None.
+
+Example:
+
+-> { "execute": "query-dirty-rate" }
+<- { "return": {
+        "dirty-rate": 41200,
+        "estimated": false,
+        "vcpus": [
+           { "cpu-index": 0, "dirty-rate": 40800, "throttle-percentage": 30 },
+           { "cpu-index": 1, "dirty-rate": 400, "throttle-percentage": 0 }
+        ]
+     }
+   }
+
+EQMP
+
+    {
+        .name       = "query-dirty-rate",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_query_dirty_rate,
+    },
+
 SQMP
 migrate-set-capabilities
 ------------------------
@@ -3684,6 +3764,8 @@ Enable/Disable migration capabilities
 - "compress": use multiple compression threads to accelerate live migration
 - "events": generate events for each migration state change
 - "postcopy-ram": postcopy mode for live migration
+- "x-multifd": send RAM pages over several parallel connections
+- "x-zero-copy": send RAM pages without copying them into the kernel
 
 Arguments:
 
@@ -3714,6 +3796,8 @@ Query current migration capabilities
          - "compress": Multiple compression threads state (json-bool)
          - "events": Migration state change event state (json-bool)
          - "postcopy-ram": postcopy ram state (json-bool)
+         - "x-multifd": multiple channel RAM migration state (json-bool)
+         - "x-zero-copy": zero-copy RAM migration state (json-bool)
 
 Arguments:
 
@@ -3727,7 +3811,9 @@ Example:
      {"state": false, "capability": "zero-blocks"},
      {"state": false, "capability": "compress"},
      {"state": true, "capability": "events"},
-     {"state": false, "capability": "postcopy-ram"}
+     {"state": false, "capability": "postcopy-ram"},
+     {"state": false, "capability": "x-multifd"},
+     {"state": false, "capability": "x-zero-copy"}
    ]}
 
 EQMP
@@ -3751,6 +3837,14 @@ Set migration parameters
                            throttled for auto-converge (json-int)
 - "x-cpu-throttle-increment": set throttle increasing percentage for
                              auto-converge (json-int)
+- "x-multifd-channels": set the number of parallel connections used by
+                        x-multifd (json-int)
+- "x-zero-scan-threads": set the number of threads that check pages for
+                         zeroes ahead of the migration thread (json-int)
+- "compress-algorithm": set the codec for compressed pages, one of "zlib",
+                        "lz4", "zstd" and "adaptive" (json-string)
+- "x-xbzrle-threads": set the number of threads that encode XBZRLE pages
+                      (json-int)
 
 Arguments:
 
@@ -3764,7 +3858,7 @@ EQMP
     {
         .name       = "migrate-set-parameters",
         .args_type  =
-            "compress-level:i?,compress-threads:i?,decompress-threads:i?,x-cpu-throttle-initial:i?,x-cpu-throttle-increment:i?",
+            "compress-level:i?,compress-threads:i?,decompress-threads:i?,x-cpu-throttle-initial:i?,x-cpu-throttle-increment:i?,x-multifd-channels:i?,x-zero-scan-threads:i?,compress-algorithm:s?,x-xbzrle-threads:i?",
         .mhandler.cmd_new = qmp_marshal_migrate_set_parameters,
     },
 SQMP
@@ -3781,6 +3875,12 @@ Query current migration parameters
                                       throttled (json-int)
          - "x-cpu-throttle-increment" : throttle increasing percentage for
                                         auto-converge (json-int)
+         - "x-multifd-channels" : number of parallel multifd connections
+                                  (json-int)
+         - "x-zero-scan-threads" : number of zero page scan threads
+                                   (json-int)
+         - "compress-algorithm" : codec for compressed pages (json-string)
+         - "x-xbzrle-threads" : number of XBZRLE encoder threads (json-int)
 
 Arguments:
 
@@ -3793,7 +3893,11 @@ Example:
          "x-cpu-throttle-increment": 10,
          "compress-threads": 8,
          "compress-level": 1,
-         "x-cpu-throttle-initial": 20
+         "x-cpu-throttle-initial": 20,
+         "x-multifd-channels": 2,
+         "x-zero-scan-threads": 0,
+         "compress-algorithm": "zlib",
+         "x-xbzrle-threads": 0
       }
    }
 
@@ -4457,6 +4561,43 @@ Example:
                       }
                    } } ] }
 
+EQMP
+
+    {
+        .name       = "query-read-cache",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_query_read_cache,
+    },
+
+SQMP
+@query-read-cache
+-----------------
+
+Return the statistics of all read-cache filter nodes.
+
+Each entry contains:
+
+- "node-name": node name of the filter (json-string, optional)
+- "cache-file": the cache file (json-string)
+- "size": size of the cached data in bytes (json-int)
+- "entry-size": size of a cache entry in bytes (json-int)
+- "hits": entries this node read from the cache (json-int)
+- "misses": entries this node read from its image (json-int)
+- "shared-hits": cache hits of all users of the cache file (json-int)
+- "shared-misses": cache misses of all users of the cache file (json-int)
+
+Example:
+
+-> { "execute": "query-read-cache" }
+<- { "return": [ { "node-name": "base-cache",
+                   "cache-file": "/dev/shm/base.cache",
+                   "size": 1073741824,
+                   "entry-size": 65536,
+                   "hits": 12034,
+                   "misses": 211,
+                   "shared-hits": 1542713,
+                   "shared-misses": 17384 } ] }
+
 EQMP
 
     {
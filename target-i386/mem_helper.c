@@ -55,6 +55,16 @@ void helper_lock_init(void)
 }
 #endif
 
+/* Leave the TB so that the current instruction is replayed by
+   cpu_exec_step_atomic() while no other vCPU is running.  */
+void helper_exit_atomic(CPUX86State *env)
+{
+    CPUState *cs = CPU(x86_env_get_cpu(env));
+
+    cs->exception_index = EXCP_ATOMIC;
+    cpu_loop_exit(cs);
+}
+
 void helper_cmpxchg8b(CPUX86State *env, target_ulong a0)
 {
     uint64_t d;
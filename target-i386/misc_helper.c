@@ -22,6 +22,7 @@
 #include "exec/helper-proto.h"
 #include "exec/cpu_ldst.h"
 #include "exec/address-spaces.h"
+#include "qemu/main-loop.h"
 
 void helper_outb(CPUX86State *env, uint32_t port, uint32_t data)
 {
@@ -120,6 +121,24 @@ void helper_write_crN(CPUX86State *env, int reg, target_ulong t0)
 {
 }
 #else
+/* The local APIC is device state protected by the BQL, which a
+   multi-threaded TCG vCPU does not hold while executing guest code.  */
+static bool apic_lock_iothread(void)
+{
+    if (qemu_mutex_iothread_locked()) {
+        return false;
+    }
+    qemu_mutex_lock_iothread();
+    return true;
+}
+
+static void apic_unlock_iothread(bool locked)
+{
+    if (locked) {
+        qemu_mutex_unlock_iothread();
+    }
+}
+
 target_ulong helper_read_crN(CPUX86State *env, int reg)
 {
     target_ulong val;
@@ -131,7 +150,10 @@ target_ulong helper_read_crN(CPUX86State *env, int reg)
         break;
     case 8:
         if (!(env->hflags2 & HF2_VINTR_MASK)) {
+            bool locked = apic_lock_iothread();
+
             val = cpu_get_apic_tpr(x86_env_get_cpu(env)->apic_state);
+            apic_unlock_iothread(locked);
         } else {
             val = env->v_tpr;
         }
@@ -155,7 +177,10 @@ void helper_write_crN(CPUX86State *env, int reg, target_ulong t0)
         break;
     case 8:
         if (!(env->hflags2 & HF2_VINTR_MASK)) {
+            bool locked = apic_lock_iothread();
+
             cpu_set_apic_tpr(x86_env_get_cpu(env)->apic_state, t0);
+            apic_unlock_iothread(locked);
         }
         env->v_tpr = t0 & 0x0f;
         break;
@@ -243,7 +268,12 @@ void helper_wrmsr(CPUX86State *env)
         env->sysenter_eip = val;
         break;
     case MSR_IA32_APICBASE:
-        cpu_set_apic_base(x86_env_get_cpu(env)->apic_state, val);
+        {
+            bool locked = apic_lock_iothread();
+
+            cpu_set_apic_base(x86_env_get_cpu(env)->apic_state, val);
+            apic_unlock_iothread(locked);
+        }
         break;
     case MSR_EFER:
         {
@@ -400,7 +430,12 @@ void helper_rdmsr(CPUX86State *env)
         val = env->sysenter_eip;
         break;
     case MSR_IA32_APICBASE:
-        val = cpu_get_apic_base(x86_env_get_cpu(env)->apic_state);
+        {
+            bool locked = apic_lock_iothread();
+
+            val = cpu_get_apic_base(x86_env_get_cpu(env)->apic_state);
+            apic_unlock_iothread(locked);
+        }
         break;
     case MSR_EFER:
         val = env->efer;
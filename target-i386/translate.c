@@ -2369,6 +2369,16 @@ static void gen_exception(DisasContext *s, int trapno, target_ulong cur_eip)
     s->is_jmp = DISAS_TB_JUMP;
 }
 
+/* End the TB before the current instruction and execute it again, on its
+   own, while all other vCPUs are stopped (see cpu_exec_step_atomic).  */
+static void gen_exit_atomic(DisasContext *s, target_ulong cur_eip)
+{
+    gen_update_cc_op(s);
+    gen_jmp_im(cur_eip);
+    gen_helper_exit_atomic(cpu_env);
+    s->is_jmp = DISAS_TB_JUMP;
+}
+
 /* Generate #UD for the current instruction.  The assumption here is that
    the instruction is known, but it isn't allowed in the current cpu mode.  */
 static void gen_illegal_opcode(DisasContext *s)
@@ -4489,6 +4499,14 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
     s->aflag = aflag;
     s->dflag = dflag;
 
+    /* With multi-threaded TCG the lock helpers only serialize against
+       other locked instructions, not against plain stores from other
+       vCPUs.  Replay the instruction with all other vCPUs stopped.  */
+    if ((prefixes & PREFIX_LOCK) && parallel_cpus) {
+        gen_exit_atomic(s, pc_start - s->cs_base);
+        return s->pc;
+    }
+
     /* lock generation */
     if (prefixes & PREFIX_LOCK)
         gen_helper_lock();
@@ -5455,9 +5473,13 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
             gen_op_mov_reg_v(ot, rm, cpu_T0);
             gen_op_mov_reg_v(ot, reg, cpu_T1);
         } else {
+            /* for xchg, lock is implicit */
+            if (parallel_cpus) {
+                gen_exit_atomic(s, pc_start - s->cs_base);
+                break;
+            }
             gen_lea_modrm(env, s, modrm);
             gen_op_mov_v_reg(ot, cpu_T0, reg);
-            /* for xchg, lock is implicit */
             if (!(prefixes & PREFIX_LOCK))
                 gen_helper_lock();
             gen_op_ld_v(s, ot, cpu_T1, cpu_A0);
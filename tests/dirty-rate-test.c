@@ -0,0 +1,100 @@
+/*
+ * QTest testcase for query-dirty-rate
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <glib.h>
+#include "libqtest.h"
+
+/* Sends a QMP command and returns its response, skipping events */
+static QDict *qmp_command(const char *cmd)
+{
+    QDict *response = qmp(cmd);
+
+    while (qdict_haskey(response, "event")) {
+        QDECREF(response);
+        response = qmp_receive();
+    }
+    return response;
+}
+
+static void test_before_migration(void)
+{
+    QDict *response, *error;
+
+    response = qmp_command("{ 'execute': 'query-dirty-rate' }");
+    g_assert(!qdict_haskey(response, "return"));
+    error = qdict_get_qdict(response, "error");
+    g_assert_cmpstr(qdict_get_str(error, "class"), ==, "GenericError");
+    QDECREF(response);
+}
+
+static void wait_for_migration(void)
+{
+    QDict *response, *ret;
+    const char *status;
+
+    for (;;) {
+        response = qmp_command("{ 'execute': 'query-migrate' }");
+        ret = qdict_get_qdict(response, "return");
+        status = qdict_get_str(ret, "status");
+        g_assert_cmpstr(status, !=, "failed");
+        if (!strcmp(status, "completed")) {
+            QDECREF(response);
+            return;
+        }
+        QDECREF(response);
+        g_usleep(10 * 1000);
+    }
+}
+
+static void test_after_migration(void)
+{
+    QDict *response, *ret, *vcpu;
+    QList *vcpus;
+    QListEntry *entry;
+    int64_t cpu_index = 0;
+
+    response = qmp_command("{ 'execute': 'migrate',"
+                           "  'arguments': { 'uri': 'exec:cat >/dev/null' } }");
+    g_assert(qdict_haskey(response, "return"));
+    QDECREF(response);
+    wait_for_migration();
+
+    response = qmp_command("{ 'execute': 'query-dirty-rate' }");
+    ret = qdict_get_qdict(response, "return");
+    g_assert(ret);
+    g_assert_cmpint(qdict_get_int(ret, "dirty-rate"), >=, 0);
+    g_assert(qdict_haskey(ret, "estimated"));
+
+    /* One entry per vcpu, none of which was throttled */
+    vcpus = qdict_get_qlist(ret, "vcpus");
+    QLIST_FOREACH_ENTRY(vcpus, entry) {
+        vcpu = qobject_to_qdict(qlist_entry_obj(entry));
+        g_assert_cmpint(qdict_get_int(vcpu, "cpu-index"), ==, cpu_index);
+        g_assert_cmpint(qdict_get_int(vcpu, "dirty-rate"), >=, 0);
+        g_assert_cmpint(qdict_get_int(vcpu, "throttle-percentage"), ==, 0);
+        cpu_index++;
+    }
+    g_assert_cmpint(cpu_index, ==, 2);
+    QDECREF(response);
+}
+
+int main(int argc, char **argv)
+{
+    int ret;
+
+    g_test_init(&argc, &argv, NULL);
+    qtest_add_func("/dirty-rate/before-migration", test_before_migration);
+    qtest_add_func("/dirty-rate/after-migration", test_after_migration);
+
+    qtest_start("-smp 2 -m 32");
+    ret = g_test_run();
+
+    qtest_end();
+
+    return ret;
+}
@@ -0,0 +1,78 @@
+/*
+ * QTest testcase for multi-threaded TCG
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <glib.h>
+#include "qemu-common.h"
+#include "libqtest.h"
+#include "boot-sector.h"
+
+static const char *disk = "tests/mttcg-test-disk.raw";
+
+/* Sends a QMP command and returns its response, skipping events */
+static QDict *qmp_command(const char *cmd)
+{
+    QDict *response = qmp(cmd);
+
+    while (qdict_haskey(response, "event")) {
+        QDECREF(response);
+        response = qmp_receive();
+    }
+    return response;
+}
+
+/* The firmware brings up and counts the application processors with
+ * locked instructions, so getting to the boot sector exercises the
+ * exclusive replay of guest atomics.
+ */
+static void test_mttcg_boot_smp(void)
+{
+    QDict *response, *cpu;
+    QList *cpus;
+    QListEntry *entry;
+    int64_t thread_id[2];
+    int n = 0;
+    char *args;
+
+    args = g_strdup_printf("-accel tcg,thread=multi -smp 2 "
+                           "-drive file=%s,format=raw", disk);
+    qtest_start(args);
+    boot_sector_test();
+
+    /* One host thread per vCPU */
+    response = qmp_command("{ 'execute': 'query-cpus' }");
+    cpus = qdict_get_qlist(response, "return");
+    g_assert(cpus);
+    QLIST_FOREACH_ENTRY(cpus, entry) {
+        cpu = qobject_to_qdict(qlist_entry_obj(entry));
+        g_assert_cmpint(n, <, 2);
+        thread_id[n++] = qdict_get_int(cpu, "thread_id");
+    }
+    g_assert_cmpint(n, ==, 2);
+    g_assert_cmpint(thread_id[0], !=, thread_id[1]);
+    QDECREF(response);
+
+    qtest_quit(global_qtest);
+    g_free(args);
+}
+
+int main(int argc, char *argv[])
+{
+    int ret;
+
+    ret = boot_sector_init(disk);
+    if (ret) {
+        return ret;
+    }
+
+    g_test_init(&argc, &argv, NULL);
+    qtest_add_func("/mttcg/boot-smp", test_mttcg_boot_smp);
+    ret = g_test_run();
+
+    boot_sector_cleanup(disk);
+    return ret;
+}
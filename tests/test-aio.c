@@ -449,6 +449,49 @@ static void test_wait_event_notifier_noflush(void)
     event_notifier_cleanup(&data.e);
 }
 
+#ifndef _WIN32
+static int poll_count;
+static int poll_ready_at;
+
+static bool poll_ready_cb(void *opaque)
+{
+    return ++poll_count == poll_ready_at;
+}
+
+static void test_poll_mode(void)
+{
+    EventNotifierTestData data = { .n = 0, .active = 1 };
+    uint64_t hits = ctx->poll_hits;
+
+    event_notifier_init(&data.e, false);
+    set_event_notifier(ctx, &data.e, event_ready_cb);
+    aio_set_event_notifier_poll(ctx, &data.e, poll_ready_cb);
+    aio_context_set_poll_params(ctx, NANOSECONDS_PER_SECOND, 0, 0,
+                                &error_abort);
+    while (aio_poll(ctx, false));
+
+    /* No polling until an event arrives quickly enough to grow poll_ns */
+    g_assert_cmpint(ctx->poll_ns, ==, 0);
+    event_notifier_set(&data.e);
+    g_assert(aio_poll(ctx, true));
+    g_assert_cmpint(data.n, ==, 1);
+    g_assert_cmpint(ctx->poll_ns, >, 0);
+
+    /* Now a blocking aio_poll is served by ->io_poll() without the fd */
+    poll_count = 0;
+    poll_ready_at = 1;
+    g_assert(aio_poll(ctx, true));
+    g_assert_cmpint(poll_count, ==, 1);
+    g_assert_cmpint(data.n, ==, 1);
+    g_assert_cmpint(ctx->poll_hits, ==, hits + 1);
+
+    aio_context_set_poll_params(ctx, 0, 0, 0, &error_abort);
+    set_event_notifier(ctx, &data.e, NULL);
+    g_assert(!aio_poll(ctx, false));
+    event_notifier_cleanup(&data.e);
+}
+#endif
+
 static void test_timer_schedule(void)
 {
     TimerTestData data = { .n = 0, .ctx = ctx, .ns = SCALE_MS * 750LL,
@@ -858,6 +901,9 @@ int main(int argc, char **argv)
     g_test_add_func("/aio/event/flush",             test_flush_event_notifier);
     g_test_add_func("/aio/external-client",         test_aio_external_client);
     g_test_add_func("/aio/timer/schedule",          test_timer_schedule);
+#ifndef _WIN32
+    g_test_add_func("/aio/poll-mode",               test_poll_mode);
+#endif
 
     g_test_add_func("/aio-gsource/flush",                   test_source_flush);
     g_test_add_func("/aio-gsource/bh/schedule",             test_source_bh_schedule);
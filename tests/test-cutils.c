@@ -1430,6 +1430,28 @@ static void test_qemu_strtosz_suffix_unit(void)
     g_assert_cmpint(res, ==, 12345000);
 }
 
+static void test_buffer_find_nonzero_offset(void)
+{
+    static uint8_t buf[4096] QEMU_ALIGNED(64);
+    const size_t len = sizeof(buf);
+    size_t i, res;
+
+    memset(buf, 0, len);
+    g_assert(can_use_buffer_find_nonzero_offset(buf, len));
+    g_assert_cmpint(buffer_find_nonzero_offset(buf, len), ==, len);
+    g_assert(buffer_is_zero(buf, len));
+
+    /* The result is rounded down, but never past the non-zero byte */
+    for (i = 0; i < len; i++) {
+        buf[i] = 0x80;
+        res = buffer_find_nonzero_offset(buf, len);
+        g_assert_cmpint(res, <=, i);
+        g_assert_cmpint(res, >, (ssize_t)i - 1024);
+        g_assert(!buffer_is_zero(buf, len));
+        buf[i] = 0;
+    }
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -1591,5 +1613,8 @@ int main(int argc, char **argv)
     g_test_add_func("/cutils/strtosz/suffix-unit",
                     test_qemu_strtosz_suffix_unit);
 
+    g_test_add_func("/cutils/buffer_find_nonzero_offset",
+                    test_buffer_find_nonzero_offset);
+
     return g_test_run();
 }
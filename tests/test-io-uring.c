@@ -0,0 +1,186 @@
+/*
+ * io_uring fixed buffer tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <glib.h>
+#include "qemu-common.h"
+#include "block/aio.h"
+#include "block/block.h"
+#include "block/raw-aio.h"
+#include "qapi/error.h"
+#include "qemu/timer.h"
+#include "qemu/error-report.h"
+
+#define BUF_SIZE 4096
+
+static AioContext *ctx;
+static int fd = -1;
+
+typedef struct {
+    struct iovec iov;
+    QEMUIOVector qiov;
+    int ret;
+} ReadData;
+
+static void read_cb(void *opaque, int ret)
+{
+    ReadData *data = opaque;
+
+    g_assert_cmpint(data->ret, ==, -EINPROGRESS);
+    data->ret = ret;
+}
+
+static void submit_read(LuringState *s, ReadData *data, void *buf,
+                        int64_t offset)
+{
+    data->iov.iov_base = buf;
+    data->iov.iov_len = BUF_SIZE;
+    qemu_iovec_init_external(&data->qiov, &data->iov, 1);
+    data->ret = -EINPROGRESS;
+
+    luring_submit(NULL, s, fd, offset >> BDRV_SECTOR_BITS, &data->qiov,
+                  BUF_SIZE >> BDRV_SECTOR_BITS, read_cb, data, QEMU_AIO_READ);
+}
+
+static void wait_for(ReadData *data)
+{
+    while (data->ret == -EINPROGRESS) {
+        aio_poll(ctx, true);
+    }
+}
+
+static void check_buf(uint8_t *buf, uint8_t pattern)
+{
+    int i;
+
+    for (i = 0; i < BUF_SIZE; i++) {
+        g_assert_cmpint(buf[i], ==, pattern);
+    }
+}
+
+static LuringState *luring_new(void)
+{
+    LuringState *s = luring_init();
+
+    g_assert(s);
+    luring_attach_aio_context(s, ctx);
+    return s;
+}
+
+static void luring_free(LuringState *s)
+{
+    luring_detach_aio_context(s, ctx);
+    luring_cleanup(s);
+}
+
+/*
+ * Change the buffer table while one request is in flight and another one
+ * sits in the plugged queue with an index into the old table.  The table
+ * must not be updated when the first request completes, or the queued one
+ * would be submitted with a stale index.
+ */
+static void do_test_plugged(bool do_register)
+{
+    LuringState *s = luring_new();
+    uint8_t *buf = qemu_memalign(BUF_SIZE, 3 * BUF_SIZE);
+    uint8_t *a = buf, *b = buf + BUF_SIZE, *c = buf + 2 * BUF_SIZE;
+    ReadData first, queued;
+
+    memset(buf, 0, 3 * BUF_SIZE);
+
+    /*
+     * Registering: b starts at index 0 and moves to 1 when a is added.
+     * Unregistering: b starts at index 1 and moves to 0 when a goes away.
+     */
+    if (!do_register) {
+        luring_register_buf(s, a, BUF_SIZE);
+    }
+    luring_register_buf(s, b, BUF_SIZE);
+
+    submit_read(s, &first, c, 0);
+
+    luring_io_plug(NULL, s);
+    submit_read(s, &queued, b, BUF_SIZE);
+
+    if (do_register) {
+        luring_register_buf(s, a, BUF_SIZE);
+    } else {
+        luring_unregister_buf(s, a, BUF_SIZE);
+    }
+
+    wait_for(&first);
+    g_assert_cmpint(first.ret, ==, 0);
+    g_assert_cmpint(queued.ret, ==, -EINPROGRESS);
+
+    luring_io_unplug(NULL, s, true);
+    wait_for(&queued);
+    g_assert_cmpint(queued.ret, ==, 0);
+    check_buf(c, 0xaa);
+    check_buf(b, 0x55);
+
+    /* Once idle, the new table is used */
+    submit_read(s, &first, a, 0);
+    wait_for(&first);
+    g_assert_cmpint(first.ret, ==, 0);
+    check_buf(a, 0xaa);
+
+    luring_free(s);
+    qemu_vfree(buf);
+}
+
+static void test_register_plugged(void)
+{
+    do_test_plugged(true);
+}
+
+static void test_unregister_plugged(void)
+{
+    do_test_plugged(false);
+}
+
+int main(int argc, char **argv)
+{
+    LuringState *s;
+    Error *local_error = NULL;
+    uint8_t buf[2 * BUF_SIZE];
+    gchar *path;
+    int ret;
+
+    init_clocks();
+
+    ctx = aio_context_new(&local_error);
+    if (!ctx) {
+        error_reportf_err(local_error, "Failed to create AIO Context: ");
+        exit(1);
+    }
+
+    fd = g_file_open_tmp("qemu-test-io-uring-XXXXXX", &path, NULL);
+    g_assert(fd >= 0);
+    unlink(path);
+    g_free(path);
+
+    memset(buf, 0xaa, BUF_SIZE);
+    memset(buf + BUF_SIZE, 0x55, BUF_SIZE);
+    g_assert_cmpint(pwrite(fd, buf, sizeof(buf), 0), ==, sizeof(buf));
+
+    g_test_init(&argc, &argv, NULL);
+
+    /* The kernel may not support io_uring even if liburing is installed */
+    s = luring_init();
+    if (s) {
+        luring_cleanup(s);
+        g_test_add_func("/io-uring/register-plugged", test_register_plugged);
+        g_test_add_func("/io-uring/unregister-plugged",
+                        test_unregister_plugged);
+    }
+
+    ret = g_test_run();
+
+    close(fd);
+    aio_context_unref(ctx);
+    return ret;
+}
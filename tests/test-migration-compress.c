@@ -0,0 +1,234 @@
+/*
+ * Migration page compression codec unit tests.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "migration/migration.h"
+#include "migration/qemu-file.h"
+#include "migration/compress.h"
+
+#define PAGE_SIZE 4096
+
+static const QEMUFileOps empty_ops = { };
+
+static const MigrationCodec codecs[] = {
+    MIGRATION_CODEC_ZLIB,
+    MIGRATION_CODEC_RAW,
+    MIGRATION_CODEC_LZ4,
+    MIGRATION_CODEC_ZSTD,
+};
+
+/* A page that every codec can shrink */
+static uint8_t *compressible_page(void)
+{
+    uint8_t *page = g_malloc(PAGE_SIZE);
+    int i;
+
+    for (i = 0; i < PAGE_SIZE; i++) {
+        page[i] = (i / 64) & 0xf;
+    }
+    return page;
+}
+
+/* A page that no codec can shrink */
+static uint8_t *random_page(void)
+{
+    uint8_t *page = g_malloc(PAGE_SIZE);
+    int i;
+
+    for (i = 0; i < PAGE_SIZE; i++) {
+        page[i] = g_test_rand_int_range(0, 256);
+    }
+    return page;
+}
+
+static void roundtrip(MigrationCodecState *state, MigrationCodec codec,
+                      const uint8_t *page, bool shrinks)
+{
+    size_t bound = migration_codec_bound(PAGE_SIZE);
+    uint8_t *compressed = g_malloc(bound);
+    uint8_t *result = g_malloc(PAGE_SIZE);
+    ssize_t len;
+
+    len = migration_codec_compress(state, codec, 1, compressed, bound,
+                                   page, PAGE_SIZE);
+    g_assert_cmpint(len, >, 0);
+    g_assert_cmpint(len, <=, bound);
+    if (shrinks) {
+        g_assert_cmpint(len, <, PAGE_SIZE);
+    }
+
+    g_assert_cmpint(migration_codec_decompress(state, codec, result, PAGE_SIZE,
+                                               compressed, len), ==, 0);
+    g_assert(memcmp(page, result, PAGE_SIZE) == 0);
+
+    /* Truncated input must be rejected, not produce a partial page */
+    g_assert_cmpint(migration_codec_decompress(state, codec, result,
+                                               PAGE_SIZE, compressed, len - 1),
+                    ==, -1);
+
+    g_free(compressed);
+    g_free(result);
+}
+
+static void test_roundtrip(void)
+{
+    MigrationCodecState *state = migration_codec_state_new();
+    uint8_t *page = compressible_page();
+    uint8_t *rnd = random_page();
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(codecs); i++) {
+        MigrationCodec codec = codecs[i];
+
+        if (!migration_codec_available(codec)) {
+            continue;
+        }
+        roundtrip(state, codec, page, codec != MIGRATION_CODEC_RAW);
+        roundtrip(state, codec, rnd, false);
+        /* The state is reused from page to page */
+        roundtrip(state, codec, page, codec != MIGRATION_CODEC_RAW);
+    }
+
+    migration_codec_state_free(state);
+    g_free(page);
+    g_free(rnd);
+}
+
+static void test_unavailable(void)
+{
+    MigrationCodecState *state = migration_codec_state_new();
+    uint8_t *page = compressible_page();
+    size_t bound = migration_codec_bound(PAGE_SIZE);
+    uint8_t *compressed = g_malloc(bound);
+    int i;
+
+    g_assert(migration_codec_available(MIGRATION_CODEC_ZLIB));
+    g_assert(migration_codec_available(MIGRATION_CODEC_RAW));
+
+    for (i = 0; i < ARRAY_SIZE(codecs); i++) {
+        if (migration_codec_available(codecs[i])) {
+            continue;
+        }
+        g_assert_cmpint(migration_codec_compress(state, codecs[i], 1,
+                                                 compressed, bound,
+                                                 page, PAGE_SIZE), ==, -1);
+    }
+
+    migration_codec_state_free(state);
+    g_free(page);
+    g_free(compressed);
+}
+
+/*
+ * Sends @page the way the compression threads do and reads it back the way
+ * ram_load() does.  Returns the codec found in the length word.
+ */
+static MigrationCodec put_and_get_page(MigrationCodecState *state,
+                                       MigrationCodec codec,
+                                       const uint8_t *page)
+{
+    QEMUFile *thread_file = qemu_fopen_ops(NULL, &empty_ops);
+    QEMUFile *out = qemu_bufopen("w", NULL);
+    QEMUFile *in;
+    QEMUSizedBuffer *qsb;
+    uint8_t *stream, *compressed, *result;
+    size_t stream_len;
+    ssize_t written;
+    uint32_t word, len;
+    MigrationCodec tag;
+
+    written = qemu_put_compression_data(thread_file, page, PAGE_SIZE, state,
+                                        codec, 1);
+    g_assert_cmpint(written, >, sizeof(int32_t));
+    g_assert_cmpint(qemu_put_qemu_file(out, thread_file), ==, written);
+    qemu_fflush(out);
+
+    stream_len = qsb_get_length(qemu_buf_get(out));
+    g_assert_cmpint(stream_len, ==, written);
+    stream = g_malloc(stream_len);
+    g_assert_cmpint(qsb_get_buffer(qemu_buf_get(out), 0, stream_len, stream),
+                    ==, stream_len);
+    qemu_fclose(out);
+    qemu_fclose(thread_file);
+
+    qsb = qsb_create(stream, stream_len);
+    in = qemu_bufopen("r", qsb);
+
+    word = qemu_get_be32(in);
+    tag = word >> MIGRATION_CODEC_SHIFT;
+    len = word & MIGRATION_CODEC_LEN_MASK;
+    g_assert_cmpint(len, ==, written - sizeof(int32_t));
+    g_assert_cmpint(len, <=, migration_codec_bound(PAGE_SIZE));
+    g_assert_cmpint(tag, <, MIGRATION_CODEC__MAX);
+    g_assert(migration_codec_available(tag));
+
+    compressed = g_malloc(len);
+    result = g_malloc(PAGE_SIZE);
+    g_assert_cmpint(qemu_get_buffer(in, compressed, len), ==, len);
+    g_assert_cmpint(migration_codec_decompress(state, tag, result, PAGE_SIZE,
+                                               compressed, len), ==, 0);
+    g_assert(memcmp(page, result, PAGE_SIZE) == 0);
+
+    qemu_fclose(in);
+    qsb_free(qsb);
+    g_free(stream);
+    g_free(compressed);
+    g_free(result);
+    return tag;
+}
+
+static void test_codec_tag(void)
+{
+    MigrationCodecState *state = migration_codec_state_new();
+    uint8_t *page = compressible_page();
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(codecs); i++) {
+        if (!migration_codec_available(codecs[i])) {
+            continue;
+        }
+        g_assert_cmpint(put_and_get_page(state, codecs[i], page), ==,
+                        codecs[i]);
+    }
+
+    migration_codec_state_free(state);
+    g_free(page);
+}
+
+static void test_raw_fallback(void)
+{
+    MigrationCodecState *state = migration_codec_state_new();
+    uint8_t *rnd = random_page();
+    int i;
+
+    /* zlib output is sent as is, even when it grows */
+    g_assert_cmpint(put_and_get_page(state, MIGRATION_CODEC_ZLIB, rnd), ==,
+                    MIGRATION_CODEC_ZLIB);
+
+    for (i = 0; i < ARRAY_SIZE(codecs); i++) {
+        if (codecs[i] == MIGRATION_CODEC_ZLIB ||
+            !migration_codec_available(codecs[i])) {
+            continue;
+        }
+        g_assert_cmpint(put_and_get_page(state, codecs[i], rnd), ==,
+                        MIGRATION_CODEC_RAW);
+    }
+
+    migration_codec_state_free(state);
+    g_free(rnd);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/migration-compress/roundtrip", test_roundtrip);
+    g_test_add_func("/migration-compress/unavailable", test_unavailable);
+    g_test_add_func("/migration-compress/codec-tag", test_codec_tag);
+    g_test_add_func("/migration-compress/raw-fallback", test_raw_fallback);
+    return g_test_run();
+}
@@ -174,6 +174,52 @@ static void test_encode_decode(void)
     }
 }
 
+/* Short runs at any alignment, as seen by the word and vector loops */
+static void encode_decode_runs(void)
+{
+    uint8_t *buffer = g_malloc(PAGE_SIZE);
+    uint8_t *compressed = g_malloc(PAGE_SIZE);
+    uint8_t *test = g_malloc(PAGE_SIZE);
+    int i, j, len, dlen, rc;
+    bool changed = g_test_rand_bit();
+
+    for (i = 0; i < PAGE_SIZE; i++) {
+        buffer[i] = g_test_rand_int();
+    }
+    memcpy(test, buffer, PAGE_SIZE);
+
+    for (i = g_test_rand_int_range(0, 64); i < PAGE_SIZE; i += len) {
+        len = MIN(g_test_rand_int_range(1, 80), PAGE_SIZE - i);
+        if (changed) {
+            for (j = i; j < i + len; j++) {
+                buffer[j] = ~test[j];
+            }
+        }
+        changed = !changed;
+    }
+
+    dlen = xbzrle_encode_buffer(test, buffer, PAGE_SIZE, compressed,
+                                PAGE_SIZE);
+    if (dlen != -1) {
+        rc = xbzrle_decode_buffer(compressed, dlen, test, PAGE_SIZE);
+        g_assert(rc <= PAGE_SIZE);
+        g_assert(memcmp(test, buffer, PAGE_SIZE) == 0);
+    }
+
+    g_free(buffer);
+    g_free(compressed);
+    g_free(test);
+}
+
+static void test_encode_decode_runs(void)
+{
+    int i;
+
+    for (i = 0; i < 10000; i++) {
+        encode_decode_runs();
+    }
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -186,6 +232,7 @@ int main(int argc, char **argv)
     g_test_add_func("/xbzrle/encode_decode_overflow",
                     test_encode_decode_overflow);
     g_test_add_func("/xbzrle/encode_decode", test_encode_decode);
+    g_test_add_func("/xbzrle/encode_decode_runs", test_encode_decode_runs);
 
     return g_test_run();
 }
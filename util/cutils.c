@@ -263,9 +263,9 @@ static size_t buffer_find_nonzero_offset_inner(const void *buf, size_t len)
  */
 
 #if defined CONFIG_AVX2_OPT && QEMU_GNUC_PREREQ(4, 9)
+#include <cpuid.h>
 #pragma GCC push_options
 #pragma GCC target("avx2")
-#include <cpuid.h>
 #include <immintrin.h>
 
 #define AVX2_VECTYPE        __m256i
@@ -316,19 +316,106 @@ static size_t buffer_find_nonzero_offset_avx2(const void *buf, size_t len)
 
     return i * sizeof(AVX2_VECTYPE);
 }
+#pragma GCC pop_options
 
-static bool avx2_support(void)
+#ifdef CONFIG_AVX512F_OPT
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+
+#define AVX512_VECTYPE          __m512i
+#define AVX512_IS_ZERO(v)       (_mm512_test_epi64_mask(v, v) == 0)
+#define AVX512_VEC_OR(v1, v2)   (_mm512_or_si512(v1, v2))
+
+static bool
+can_use_buffer_find_nonzero_offset_avx512(const void *buf, size_t len)
+{
+    return (len % (BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR
+                   * sizeof(AVX512_VECTYPE)) == 0
+            && ((uintptr_t) buf) % sizeof(AVX512_VECTYPE) == 0);
+}
+
+static size_t buffer_find_nonzero_offset_avx512(const void *buf, size_t len)
+{
+    const AVX512_VECTYPE *p = buf;
+    size_t i;
+
+    assert(can_use_buffer_find_nonzero_offset_avx512(buf, len));
+
+    if (!len) {
+        return 0;
+    }
+
+    for (i = 0; i < BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR; i++) {
+        if (!AVX512_IS_ZERO(p[i])) {
+            return i * sizeof(AVX512_VECTYPE);
+        }
+    }
+
+    for (i = BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR;
+         i < len / sizeof(AVX512_VECTYPE);
+         i += BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR) {
+        AVX512_VECTYPE tmp0 = AVX512_VEC_OR(p[i + 0], p[i + 1]);
+        AVX512_VECTYPE tmp1 = AVX512_VEC_OR(p[i + 2], p[i + 3]);
+        AVX512_VECTYPE tmp2 = AVX512_VEC_OR(p[i + 4], p[i + 5]);
+        AVX512_VECTYPE tmp3 = AVX512_VEC_OR(p[i + 6], p[i + 7]);
+        AVX512_VECTYPE tmp01 = AVX512_VEC_OR(tmp0, tmp1);
+        AVX512_VECTYPE tmp23 = AVX512_VEC_OR(tmp2, tmp3);
+        if (!AVX512_IS_ZERO(AVX512_VEC_OR(tmp01, tmp23))) {
+            break;
+        }
+    }
+
+    return i * sizeof(AVX512_VECTYPE);
+}
+#pragma GCC pop_options
+#endif
+
+#ifndef bit_AVX512F
+#define bit_AVX512F (1 << 16)
+#endif
+
+/* XCR0 bits for the SSE, AVX and AVX-512 register state */
+#define XCR0_YMM_STATE      0x06
+#define XCR0_ZMM_STATE      0xe6
+
+/*
+ * Checks that the CPU supports a vector extension and that the OS saves
+ * the registers it uses.
+ */
+static bool vector_support(int ebx7_bit, uint64_t xcr0_mask)
 {
     int a, b, c, d;
+    uint32_t xcr0_lo, xcr0_hi;
 
     if (__get_cpuid_max(0, NULL) < 7) {
         return false;
     }
 
+    __cpuid(1, a, b, c, d);
+    if (!(c & bit_OSXSAVE)) {
+        return false;
+    }
+    asm("xgetbv" : "=a" (xcr0_lo), "=d" (xcr0_hi) : "c" (0));
+    if (((((uint64_t)xcr0_hi << 32) | xcr0_lo) & xcr0_mask) != xcr0_mask) {
+        return false;
+    }
+
     __cpuid_count(7, 0, a, b, c, d);
 
-    return b & bit_AVX2;
+    return b & ebx7_bit;
+}
+
+static bool avx2_support(void)
+{
+    return vector_support(bit_AVX2, XCR0_YMM_STATE);
+}
+
+#ifdef CONFIG_AVX512F_OPT
+static bool avx512f_support(void)
+{
+    return vector_support(bit_AVX512F, XCR0_ZMM_STATE);
 }
+#endif
 
 bool can_use_buffer_find_nonzero_offset(const void *buf, size_t len) \
          __attribute__ ((ifunc("can_use_buffer_find_nonzero_offset_ifunc")));
@@ -340,6 +427,11 @@ static void *buffer_find_nonzero_offset_ifunc(void)
     typeof(buffer_find_nonzero_offset) *func = (avx2_support()) ?
         buffer_find_nonzero_offset_avx2 : buffer_find_nonzero_offset_inner;
 
+#ifdef CONFIG_AVX512F_OPT
+    if (avx512f_support()) {
+        func = buffer_find_nonzero_offset_avx512;
+    }
+#endif
     return func;
 }
 
@@ -349,9 +441,13 @@ static void *can_use_buffer_find_nonzero_offset_ifunc(void)
         can_use_buffer_find_nonzero_offset_avx2 :
         can_use_buffer_find_nonzero_offset_inner;
 
+#ifdef CONFIG_AVX512F_OPT
+    if (avx512f_support()) {
+        func = can_use_buffer_find_nonzero_offset_avx512;
+    }
+#endif
     return func;
 }
-#pragma GCC pop_options
 #else
 bool can_use_buffer_find_nonzero_offset(const void *buf, size_t len)
 {
@@ -53,9 +53,12 @@
 #include <libgen.h>
 #include <sys/signal.h>
 #include "qemu/cutils.h"
+#include "qemu/bitops.h"
+#include "qemu/thread.h"
 
 #ifdef CONFIG_LINUX
 #include <sys/syscall.h>
+#include <sched.h>
 #endif
 
 #ifdef __FreeBSD__
@@ -323,18 +326,159 @@ char *qemu_get_exec_dir(void)
     return g_strdup(exec_dir);
 }
 
-static sigjmp_buf sigjump;
+#define MAX_MEM_PREALLOC_THREAD_COUNT 16
+
+typedef struct MemsetThread {
+    char *addr;
+    size_t numpages;
+    size_t hpagesize;
+    /* host NUMA node to run on, or -1 */
+    int node;
+    QemuThread pgthread;
+    sigjmp_buf env;
+} MemsetThread;
+
+static __thread MemsetThread *memset_thread;
+static bool memset_thread_failed;
 
 static void sigbus_handler(int signal)
 {
-    siglongjmp(sigjump, 1);
+    if (memset_thread) {
+        siglongjmp(memset_thread->env, 1);
+    }
+    abort();
 }
 
-void os_mem_prealloc(int fd, char *area, size_t memory)
+#ifdef CONFIG_LINUX
+/*
+ * Run the calling thread on the CPUs of host NUMA node @node, so that the
+ * pages it faults in are zeroed by a CPU local to the memory.  This is only
+ * an optimization, so failures are ignored.
+ */
+static void memset_thread_bind_node(int node)
+{
+    char *path, *contents, *p;
+    cpu_set_t cpus;
+
+    path = g_strdup_printf("/sys/devices/system/node/node%d/cpulist", node);
+    if (!g_file_get_contents(path, &contents, NULL, NULL)) {
+        g_free(path);
+        return;
+    }
+
+    /* The format is a list of ranges, e.g. "0-7,16-23" */
+    CPU_ZERO(&cpus);
+    p = contents;
+    while (*p && *p != '\n') {
+        unsigned long first, last;
+
+        first = last = strtoul(p, &p, 10);
+        if (*p == '-') {
+            last = strtoul(p + 1, &p, 10);
+        }
+        for (; first <= last && first < CPU_SETSIZE; first++) {
+            CPU_SET(first, &cpus);
+        }
+        if (*p != ',') {
+            break;
+        }
+        p++;
+    }
+
+    if (CPU_COUNT(&cpus)) {
+        sched_setaffinity(0, sizeof(cpus), &cpus);
+    }
+    g_free(contents);
+    g_free(path);
+}
+#endif
+
+static void *do_touch_pages(void *arg)
+{
+    MemsetThread *memset_args = arg;
+    sigset_t set;
+    size_t i;
+
+    memset_thread = memset_args;
+
+    /* qemu_thread_create() starts the thread with all signals blocked */
+    sigemptyset(&set);
+    sigaddset(&set, SIGBUS);
+    pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+
+#ifdef CONFIG_LINUX
+    if (memset_args->node >= 0) {
+        memset_thread_bind_node(memset_args->node);
+    }
+#endif
+
+    if (sigsetjmp(memset_args->env, 1)) {
+        atomic_set(&memset_thread_failed, true);
+    } else {
+        /* MAP_POPULATE silently ignores failures */
+        for (i = 0; i < memset_args->numpages; i++) {
+            memset(memset_args->addr + i * memset_args->hpagesize, 0, 1);
+        }
+    }
+
+    memset_thread = NULL;
+    return NULL;
+}
+
+static void touch_all_pages(char *area, size_t hpagesize, size_t numpages,
+                            int max_threads, const unsigned long *host_nodes,
+                            unsigned long maxnode)
+{
+    MemsetThread *memset_threads;
+    int nodes[MAX_MEM_PREALLOC_THREAD_COUNT];
+    int num_nodes = 0;
+    int num_threads;
+    size_t numpages_per_thread, leftover;
+    char *addr = area;
+    unsigned long node;
+    int i;
+
+    num_threads = MIN(max_threads, MAX_MEM_PREALLOC_THREAD_COUNT);
+    num_threads = MIN(num_threads, sysconf(_SC_NPROCESSORS_ONLN));
+    num_threads = MIN(num_threads, numpages);
+    num_threads = MAX(num_threads, 1);
+
+    if (host_nodes) {
+        for (node = find_first_bit(host_nodes, maxnode);
+             node < maxnode && num_nodes < ARRAY_SIZE(nodes);
+             node = find_next_bit(host_nodes, maxnode, node + 1)) {
+            nodes[num_nodes++] = node;
+        }
+    }
+
+    memset_threads = g_new0(MemsetThread, num_threads);
+    numpages_per_thread = numpages / num_threads;
+    leftover = numpages % num_threads;
+    for (i = 0; i < num_threads; i++) {
+        memset_threads[i].addr = addr;
+        memset_threads[i].numpages = numpages_per_thread + (i < leftover);
+        memset_threads[i].hpagesize = hpagesize;
+        /* Spread the nodes evenly over consecutive ranges of the area */
+        memset_threads[i].node =
+            num_nodes ? nodes[i * num_nodes / num_threads] : -1;
+        qemu_thread_create(&memset_threads[i].pgthread, "touch_pages",
+                           do_touch_pages, &memset_threads[i],
+                           QEMU_THREAD_JOINABLE);
+        addr += memset_threads[i].numpages * hpagesize;
+    }
+    for (i = 0; i < num_threads; i++) {
+        qemu_thread_join(&memset_threads[i].pgthread);
+    }
+    g_free(memset_threads);
+}
+
+void os_mem_prealloc(int fd, char *area, size_t memory, int max_threads,
+                     const unsigned long *host_nodes, unsigned long maxnode)
 {
     int ret;
     struct sigaction act, oldact;
-    sigset_t set, oldset;
+    size_t hpagesize = qemu_fd_getpagesize(fd);
+    size_t numpages = DIV_ROUND_UP(memory, hpagesize);
 
     memset(&act, 0, sizeof(act));
     act.sa_handler = &sigbus_handler;
@@ -346,32 +490,19 @@ void os_mem_prealloc(int fd, char *area, size_t memory)
         exit(1);
     }
 
-    /* unblock SIGBUS */
-    sigemptyset(&set);
-    sigaddset(&set, SIGBUS);
-    pthread_sigmask(SIG_UNBLOCK, &set, &oldset);
-
-    if (sigsetjmp(sigjump, 1)) {
+    memset_thread_failed = false;
+    touch_all_pages(area, hpagesize, numpages, max_threads,
+                    host_nodes, maxnode);
+    if (memset_thread_failed) {
         fprintf(stderr, "os_mem_prealloc: Insufficient free host memory "
                         "pages available to allocate guest RAM\n");
         exit(1);
-    } else {
-        int i;
-        size_t hpagesize = qemu_fd_getpagesize(fd);
-        size_t numpages = DIV_ROUND_UP(memory, hpagesize);
-
-        /* MAP_POPULATE silently ignores failures */
-        for (i = 0; i < numpages; i++) {
-            memset(area + (hpagesize * i), 0, 1);
-        }
-
-        ret = sigaction(SIGBUS, &oldact, NULL);
-        if (ret) {
-            perror("os_mem_prealloc: failed to reinstall signal handler");
-            exit(1);
-        }
+    }
 
-        pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+    ret = sigaction(SIGBUS, &oldact, NULL);
+    if (ret) {
+        perror("os_mem_prealloc: failed to reinstall signal handler");
+        exit(1);
     }
 }
 
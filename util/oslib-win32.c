@@ -540,7 +540,8 @@ int getpagesize(void)
     return system_info.dwPageSize;
 }
 
-void os_mem_prealloc(int fd, char *area, size_t memory)
+void os_mem_prealloc(int fd, char *area, size_t memory, int max_threads,
+                     const unsigned long *host_nodes, unsigned long maxnode)
 {
     int i;
     size_t pagesize = getpagesize();